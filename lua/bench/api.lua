@@ -0,0 +1,159 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- API benchmark: a forked client logs in and sends a lot of small tagged
+-- prints (a query that picks one item out of a small table) on one
+-- session, all at once and then one at a time waiting for each !done, over
+-- the unix socket and over TCP on localhost.
+--
+-- Run from the lua directory: ../support/bin/lua bench/api.lua [count]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local COUNT = tonumber(arg and arg[1]) or 20000
+local ITEMS = 10
+local SOCK = "/tmp/opentik-bench-api.sock"
+local PORT = 18728
+
+lib.cf.register("/bench", {
+	["fields"] = {
+		["name"] = { default = "", uniq = true },
+		["mtu"] = { default = 1500 },
+		["comment"] = { default = "" },
+	},
+	["options"] = { ["field-order"] = { "name", "mtu", "comment" } },
+})
+for i = 1, ITEMS do lib.cf.set("/bench", nil, { name = "item" .. i, mtu = 1400 + i }) end
+
+local function connect(tcp)
+	local S = posix.sys.socket
+	local fd
+
+	if tcp then
+		fd = S.socket(S.AF_INET, S.SOCK_STREAM, 0)
+		assert(S.connect(fd, { family = S.AF_INET, addr = "127.0.0.1", port = PORT }) == 0)
+		S.setsockopt(fd, S.IPPROTO_TCP, S.TCP_NODELAY, 1)
+	else
+		fd = S.socket(S.AF_UNIX, S.SOCK_STREAM, 0)
+		assert(S.connect(fd, { family = S.AF_UNIX, path = SOCK }) == 0)
+	end
+	return fd
+end
+
+--
+-- The client counts the !done replies (the word after an empty one)
+--
+local function client(tcp, pipelined)
+	local fd = connect(tcp)
+	local reader = c.frame.reader()
+	local dones = 0
+	local first = true
+
+	local function wait_for(n)
+		while dones < n do
+			local word = reader:next()
+			if word then
+				if first and word == "!done" then dones = dones + 1 end
+				first = word == ""
+			else
+				assert(reader:fill(fd) > 0, "server went away")
+			end
+		end
+	end
+
+	--
+	-- Writing everything before reading anything would leave us both stuck
+	-- once the socket buffers are full, so we read whatever has come back
+	-- while we write
+	--
+	local function send_all(data)
+		local fl = posix.fcntl.fcntl(fd, posix.fcntl.F_GETFL)
+		posix.fcntl.fcntl(fd, posix.fcntl.F_SETFL, fl | posix.fcntl.O_NONBLOCK)
+		while #data > 0 do
+			posix.poll.poll({ [fd] = { events = { IN = true, OUT = true } } }, -1)
+			local n = posix.unistd.write(fd, data)
+			if n then data = data:sub(n + 1) end
+			if reader:fill(fd) then
+				while dones < COUNT + 1 do
+					local word = reader:next()
+					if not word then break end
+					if first and word == "!done" then dones = dones + 1 end
+					first = word == ""
+				end
+			end
+		end
+		posix.fcntl.fcntl(fd, posix.fcntl.F_SETFL, fl)
+	end
+
+	local function request(i)
+		return lib.api.sentence({ "/bench/print", "=.proplist=.id,mtu",
+							"?name=item" .. (i % ITEMS + 1), ".tag=" .. i })
+	end
+
+	posix.unistd.write(fd, lib.api.sentence({ "/login", "=name=admin", "=password=" }))
+	wait_for(1)
+
+	if pipelined then
+		local buf = {}
+		for i = 1, COUNT do buf[i] = request(i) end
+		send_all(table.concat(buf))
+		wait_for(COUNT + 1)
+	else
+		for i = 1, COUNT do
+			posix.unistd.write(fd, request(i))
+			wait_for(i + 1)
+		end
+	end
+	posix.unistd._exit(0)
+end
+
+--
+-- We know the client has finished when the server drops its connection
+--
+local finished = false
+local remove_fd = lib.event.remove_fd
+lib.event.remove_fd = function(fd)
+	finished = true
+	remove_fd(fd)
+end
+
+lib.api.configure({ path = SOCK, port = PORT, users = { ["admin"] = "" } })
+lib.api.init()
+
+local function run(what, tcp, pipelined)
+	local start = now()
+
+	finished = false
+	local pid = posix.unistd.fork()
+	if pid == 0 then client(tcp, pipelined) end
+
+	repeat lib.event.poll() until finished
+	posix.sys.wait.wait(pid)
+	local took = now() - start
+	output(string.format("%-34s %6.2fs, %7.0f requests/s", what, took, COUNT / took))
+end
+
+run(COUNT .. " prints, unix, pipelined", false, true)
+run(COUNT .. " prints, unix, one at a time", false, false)
+run(COUNT .. " prints, tcp, pipelined", true, true)
+run(COUNT .. " prints, tcp, one at a time", true, false)
+
+posix.unistd.unlink(SOCK)
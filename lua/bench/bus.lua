@@ -0,0 +1,66 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Event bus benchmark: helper processes each send a stream of events (the
+-- size of a dhcp lease) with lib.event.send and we time how long it takes
+-- the event loop to receive and dispatch them all, with one sender and
+-- with several at once.
+--
+-- Run from the lua directory: ../support/bin/lua bench/bus.lua [count] [senders]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local COUNT = tonumber(arg and arg[1]) or 200000
+local SENDERS = tonumber(arg and arg[2]) or 4
+local SOCK = "/tmp/opentik-bench-bus.sock"
+
+local EVENT = {
+	path = "/bench", event = "lease", action = "bound", interface = "ether1",
+	ip = "192.168.1.100", mask = "24", router = { "192.168.1.1" },
+	dns = { "192.168.1.1", "8.8.8.8" }, lease = "86400", serverid = "192.168.1.1",
+}
+
+local got = 0
+_ = lib.cf							-- for CONFIG
+CONFIG["/bench"] = { events = { lease = function(ev) got = got + 1 end } }
+lib.event.init(SOCK)
+
+local function run(senders)
+	local each = COUNT // senders
+	local start = now()
+
+	got = 0
+	for _ = 1, senders do
+		if posix.unistd.fork() == 0 then
+			for _ = 1, each do assert(lib.event.send(EVENT)) end
+			posix.unistd._exit(0)
+		end
+	end
+	while got < each * senders do lib.event.poll() end
+	for _ = 1, senders do posix.sys.wait.wait(-1) end
+
+	local took = now() - start
+	output(string.format("%d sender(s): %7d events in %5.2fs, %8.0f events/s", senders, got, took, got / took))
+end
+
+run(1)
+run(SENDERS)
+posix.unistd.unlink(SOCK)
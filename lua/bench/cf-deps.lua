@@ -0,0 +1,78 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Dependency graph benchmark: hang an increasing number of dependents off a
+-- single parent and time how long it takes to re-add one of them. The cost
+-- should stay flat as the number of dependents grows.
+--
+-- Run from the lua directory: ../support/bin/lua bench/cf-deps.lua
+--
+local bench = dofile("bench/harness.lua")
+local output = bench.output
+
+lib.cf.register("/bench/parent", {
+	["fields"] = {
+		["name"] = { uniq = true, default = "" },
+		["disabled"] = { default = false },
+	},
+	["options"] = {},
+})
+
+lib.cf.register("/bench/child", {
+	["fields"] = {
+		["address"] = { default = "" },
+		["interface"] = { default = "" },
+		["disabled"] = { default = false },
+		["uniq"] = {
+			uniq = function(_, ci) return string.format("%s@%s", ci.address, ci.interface) end,
+		},
+	},
+	["dependencies"] = {
+		["interface"] = { path = "/bench/parent", needrunning = false },
+	},
+	["options"] = {},
+})
+
+lib.cf.set("/bench/parent", nil, { name = "p1" })
+
+local ROUNDS = 2000
+local count = 0
+
+for _, target in ipairs({ 1000, 10000, 100000 }) do
+	while count < target do
+		count = count + 1
+		lib.cf.set("/bench/child", nil, { address = "10.0.0." .. count, interface = "p1" })
+	end
+
+	--
+	-- Remove and re-add the same dependent repeatedly
+	--
+	local start = os.clock()
+	for _ = 1, ROUNDS do
+		lib.cf.set("/bench/child", "10.0.0.1@p1", nil)
+		lib.cf.set("/bench/child", nil, { address = "10.0.0.1", interface = "p1" })
+	end
+	local elapsed = os.clock() - start
+
+	local n = 0
+	for _ in lib.cf.dependents("/bench/parent", "p1") do n = n + 1 end
+
+	output(string.format("dependents=%-7d re-add=%.2fus", n, elapsed / ROUNDS * 1e6))
+end
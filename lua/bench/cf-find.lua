@@ -0,0 +1,95 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Secondary index benchmark: spread a number of addresses over 1000
+-- interfaces and time finding all the addresses on one interface, using
+-- an indexed field and then the same values in a field without an index.
+--
+-- Run from the lua directory: ../support/bin/lua bench/cf-find.lua [count]
+--
+local bench = dofile("bench/harness.lua")
+local output = bench.output
+
+local COUNT = tonumber(arg and arg[1]) or 100000
+local INTERFACES = 1000
+local ROUNDS = 1000
+
+lib.cf.register("/bench/interface", {
+	["fields"] = {
+		["name"] = { uniq = true, default = "" },
+		["disabled"] = { default = false },
+	},
+	["options"] = {},
+})
+
+lib.cf.register("/bench/address", {
+	["fields"] = {
+		["address"] = { default = "" },
+		["interface"] = { default = "", index = true },
+		["label"] = { default = "" },
+		["disabled"] = { default = false },
+		["uniq"] = {
+			uniq = function(_, ci) return string.format("%s@%s", ci.address, ci.interface) end,
+		},
+	},
+	["dependencies"] = {
+		["interface"] = { path = "/bench/interface", needrunning = false },
+	},
+	["options"] = {},
+})
+
+lib.cf.begin()
+for i = 1, INTERFACES do
+	lib.cf.set("/bench/interface", nil, { name = "if" .. i })
+end
+for i = 1, COUNT do
+	local ifname = "if" .. ((i % INTERFACES) + 1)
+
+	lib.cf.set("/bench/address", nil, {
+		address = string.format("10.%d.%d.%d/32", (i >> 16) & 255, (i >> 8) & 255, i & 255),
+		interface = ifname,
+		label = ifname,
+	})
+end
+lib.cf.commit()
+
+local function time(field, rounds)
+	local n = 0
+	local start = os.clock()
+
+	for r = 1, rounds do
+		for _ in lib.cf.each_where("/bench/address", field, "if" .. ((r % INTERFACES) + 1)) do n = n + 1 end
+	end
+	return (os.clock() - start) / rounds, n / rounds
+end
+
+local took, found = time("interface", ROUNDS)
+output(string.format("items=%d indexed: %.1fus for %d matches", COUNT, took * 1e6, found))
+
+took, found = time("label", 10)
+output(string.format("items=%d scan:    %.1fus for %d matches", COUNT, took * 1e6, found))
+
+--
+-- Moving an item between interfaces keeps the index in step
+--
+local uniq = lib.cf.find("/bench/address", "interface", "if1")
+local newuniq = lib.cf.set("/bench/address", uniq, { interface = "if2" })
+assert(lib.cf.find("/bench/address", "interface", "if2") and CONFIG["/bench/address"].index.interface.if2[newuniq])
+assert(not CONFIG["/bench/address"].index.interface.if1[uniq])
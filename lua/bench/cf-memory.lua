@@ -0,0 +1,101 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Config memory benchmark: load a large number of routes, report the memory
+-- used per item, then time taking a snapshot, making changes on top of it
+-- and restoring it.
+--
+-- Run from the lua directory: ../support/bin/lua bench/cf-memory.lua [count]
+--
+local bench = dofile("bench/harness.lua")
+local output = bench.output
+
+local COUNT = tonumber(arg and arg[1]) or 100000
+local CHANGES = 1000
+
+lib.cf.register("/bench/route", {
+	["fields"] = {
+		["dst-address"] = { default = "" },
+		["gateway"] = { default = "" },
+		["distance"] = { default = 1 },
+		["comment"] = { default = "" },
+		["disabled"] = { default = false },
+		["uniq"] = {
+			uniq = function(_, ci) return ci["dst-address"] end,
+		},
+	},
+	["options"] = {},
+})
+
+local function kbytes()
+	collectgarbage()
+	collectgarbage()
+	return collectgarbage("count")
+end
+
+local function route(i)
+	return string.format("10.%d.%d.%d/32", (i >> 16) & 255, (i >> 8) & 255, i & 255)
+end
+
+local before = kbytes()
+local start = os.clock()
+
+lib.cf.begin()
+for i = 1, COUNT do
+	lib.cf.set("/bench/route", nil, { ["dst-address"] = route(i), gateway = "192.168.1.1" })
+end
+lib.cf.commit()
+
+local load = os.clock() - start
+local used = kbytes() - before
+
+output(string.format("items=%d load=%.2fs memory=%.1fMB (%.0f bytes/item)",
+			COUNT, load, used / 1024, used * 1024 / COUNT))
+
+--
+-- Snapshot, change a few items on top of it and restore, the collector is
+-- stopped while we time things so we only see the cost of the work itself
+--
+collectgarbage("stop")
+for _ = 1, 100 do lib.cf.release(lib.cf.snapshot()) end
+start = os.clock()
+for _ = 1, 100 do lib.cf.release(lib.cf.snapshot()) end
+local took = (os.clock() - start) / 100
+local snap = lib.cf.snapshot()
+
+before = kbytes()
+start = os.clock()
+for i = 1, CHANGES do
+	lib.cf.set("/bench/route", route(i), { comment = "changed" })
+end
+local change = os.clock() - start
+local extra = kbytes() - before
+collectgarbage("stop")
+
+start = os.clock()
+lib.cf.restore(snap)
+local restore = os.clock() - start
+lib.cf.release(snap)
+collectgarbage("restart")
+
+assert(CONFIG["/bench/route"].cf[route(1)].comment == "")
+
+output(string.format("snapshot+release=%.1fus changes=%d (%.1fus each, %.0f bytes each) restore=%.2fms",
+			took * 1e6, CHANGES, change / CHANGES * 1e6, extra * 1024 / CHANGES, restore * 1e3))
@@ -0,0 +1,142 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Dependency propagation benchmark: a trunk port carrying a number of vlans,
+-- each with an address and a route that depends on both the address and
+-- the vlan (so every route is reached two ways). We flap the port and
+-- change its comment and report how many items each commit visited and
+-- evaluated, then do the same down a long chain of items.
+--
+-- Run from the lua directory: ../support/bin/lua bench/cf-propagate.lua [vlans] [chain]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local VLANS = tonumber(arg and arg[1]) or 4000
+local CHAIN = tonumber(arg and arg[2]) or 100000
+
+local calls = 0
+local options = {
+	["start"] = function() calls = calls + 1 end,
+	["stop"] = function() calls = calls + 1 end,
+}
+
+lib.cf.register("/bench/port", {
+	["fields"] = {
+		["name"] = { uniq = true, default = "" },
+		["disabled"] = { default = false },
+		["comment"] = { default = "" },
+	},
+	["options"] = {
+		["start"] = options.start,
+		["stop"] = options.stop,
+		["update"] = function() calls = calls + 1 end,
+	},
+})
+
+lib.cf.register("/bench/vlan", {
+	["fields"] = {
+		["name"] = { uniq = true, default = "" },
+		["interface"] = { default = "" },
+		["disabled"] = { default = false },
+	},
+	["dependencies"] = {
+		["interface"] = { path = "/bench/port" },
+	},
+	["options"] = options,
+})
+
+lib.cf.register("/bench/address", {
+	["fields"] = {
+		["address"] = { uniq = true, default = "" },
+		["interface"] = { default = "" },
+		["disabled"] = { default = false },
+	},
+	["dependencies"] = {
+		["interface"] = { path = "/bench/vlan" },
+	},
+	["options"] = options,
+})
+
+lib.cf.register("/bench/route", {
+	["fields"] = {
+		["dst-address"] = { uniq = true, default = "" },
+		["gateway"] = { default = "" },
+		["interface"] = { default = "" },
+		["disabled"] = { default = false },
+	},
+	["dependencies"] = {
+		["gateway"] = { path = "/bench/address" },
+		["interface"] = { path = "/bench/vlan" },
+	},
+	["options"] = options,
+})
+
+lib.cf.register("/bench/chain", {
+	["fields"] = {
+		["name"] = { uniq = true, default = "" },
+		["parent"] = { default = "" },
+		["disabled"] = { default = false },
+	},
+	["dependencies"] = function(_, ci)
+		if ci.parent == "" then return {} end
+		return { ["parent"] = { path = "/bench/chain", uniq = ci.parent } }
+	end,
+	["options"] = options,
+})
+
+local function timed(what, path, uniq, items)
+	calls = 0
+	local start = now()
+	lib.cf.set(path, uniq, items)
+	local took = now() - start
+	local last = lib.cf.stats().last
+
+	output(string.format("%-28s %8.1fms  visited=%-7d evaluated=%-7d backend calls=%d",
+								what, took * 1000, last.visited, last.evaluated, calls))
+end
+
+lib.cf.begin()
+lib.cf.set("/bench/port", nil, { name = "trunk" })
+for i = 1, VLANS do
+	local vlan = "vlan" .. i
+	local address = string.format("10.%d.%d.1/24", i >> 8, i & 255)
+
+	lib.cf.set("/bench/vlan", nil, { name = vlan, interface = "trunk" })
+	lib.cf.set("/bench/address", nil, { address = address, interface = vlan })
+	lib.cf.set("/bench/route", nil, { ["dst-address"] = "route" .. i, gateway = address, interface = vlan })
+end
+lib.cf.commit()
+
+output(string.format("trunk with %d vlans (%d items)", VLANS, 1 + VLANS * 3))
+timed("port down", "/bench/port", "trunk", { disabled = true })
+timed("port up", "/bench/port", "trunk", { disabled = false })
+timed("port comment", "/bench/port", "trunk", { comment = "uplink" })
+
+lib.cf.begin()
+lib.cf.set("/bench/chain", nil, { name = "c1" })
+for i = 2, CHAIN do
+	lib.cf.set("/bench/chain", nil, { name = "c" .. i, parent = "c" .. (i - 1) })
+end
+lib.cf.commit()
+
+output(string.format("chain of %d items", CHAIN))
+timed("head down", "/bench/chain", "c1", { disabled = true })
+timed("head up", "/bench/chain", "c1", { disabled = false })
@@ -0,0 +1,106 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Per-item schema overhead benchmark: memory and time for configured items
+-- (lib.cf.set) and dynamic items (lib.cf.live), then the cost of reading a
+-- field that is set and one that comes from the defaults.
+--
+-- Run from the lua directory: ../support/bin/lua bench/cf-schema.lua [count]
+--
+local bench = dofile("bench/harness.lua")
+local output = bench.output
+
+local COUNT = tonumber(arg and arg[1]) or 100000
+local READS = 1000000
+
+local function schema()
+	return {
+		["fields"] = {
+			["dst-address"] = { default = "" },
+			["gateway"] = { default = "" },
+			["scope"] = { default = 30 },
+			["type"] = { default = "unicast" },
+			["distance"] = { default = 1 },
+			["disabled"] = { default = false },
+			["uniq"] = {
+				uniq = function(_, ci) return ci["dst-address"] end,
+			},
+		},
+		["options"] = {},
+	}
+end
+
+lib.cf.register("/bench/static", schema())
+lib.cf.register("/bench/dynamic", schema())
+
+local function kbytes()
+	collectgarbage()
+	collectgarbage()
+	return collectgarbage("count")
+end
+
+local function route(i)
+	return string.format("10.%d.%d.%d/32", (i >> 16) & 255, (i >> 8) & 255, i & 255)
+end
+
+local function report(what, used, took)
+	output(string.format("%-8s items=%d memory=%.1fMB (%.0f bytes/item) %.2fus/item",
+				what, COUNT, used / 1024, used * 1024 / COUNT, took / COUNT * 1e6))
+end
+
+--
+-- Configured items, each has a config item and a live item
+--
+local before = kbytes()
+local start = os.clock()
+
+lib.cf.begin()
+for i = 1, COUNT do
+	lib.cf.set("/bench/static", nil, { ["dst-address"] = route(i), gateway = "192.168.1.1" })
+end
+lib.cf.commit()
+report("static", kbytes() - before, os.clock() - start)
+
+--
+-- Dynamic items, just a live item
+--
+before = kbytes()
+start = os.clock()
+for i = 1, COUNT do
+	lib.cf.live("/bench/dynamic", nil, { ["dst-address"] = route(i), gateway = "192.168.1.1" })
+end
+report("dynamic", kbytes() - before, os.clock() - start)
+
+--
+-- Field reads through the live items
+--
+local live = CONFIG["/bench/static"].live
+local items = {}
+for i = 1, 1000 do items[i] = live[route(i)] end
+
+for _, field in ipairs({ "gateway", "distance" }) do
+	local n = 0
+
+	start = os.clock()
+	for i = 1, READS do
+		if items[(i % 1000) + 1][field] then n = n + 1 end
+	end
+	output(string.format("read %-8s %.3fus/read", field, (os.clock() - start) / READS * 1e6))
+end
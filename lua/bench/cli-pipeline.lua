@@ -0,0 +1,137 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Scripted cli benchmark: a forked client sends a lot of small commands
+-- over the cli socket, all at once (pipelined) and then one at a time
+-- waiting for each reply, and we time how long it takes to get all the
+-- replies back. For comparison we time the command handler on its own.
+--
+-- Run from the lua directory: ../support/bin/lua bench/cli-pipeline.lua [count]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local COUNT = tonumber(arg and arg[1]) or 10000
+local SOCK = "/tmp/opentik-bench-cli.sock"
+
+--
+-- A section with a command that gives a one line answer
+--
+local function ping(path, args)
+	local done = false
+
+	return function()
+		if done then return nil end
+		done = true
+		return "pong " .. (args[1] or "")
+	end
+end
+
+lib.cf.register("/bench", {
+	["fields"] = {},
+	["options"] = { ["commands"] = { ["ping"] = ping } },
+})
+
+--
+-- The client, it reads replies a big piece at a time and counts the end
+-- markers (an empty reply after each command's output)
+--
+local function client(pipelined)
+	local cli = posix.sys.socket.socket(posix.sys.socket.AF_UNIX, posix.sys.socket.SOCK_STREAM, 0)
+	assert(posix.sys.socket.connect(cli, { family = posix.sys.socket.AF_UNIX, path = SOCK }) == 0)
+
+	local reader = c.frame.reader()
+	local ends = 0
+
+	local function wait_for(n)
+		while ends < n do
+			local frame = reader:next()
+			if frame then
+				if #frame == 0 then ends = ends + 1 end
+			else
+				assert(reader:fill(cli) > 0, "server went away")
+			end
+		end
+	end
+
+	local function command(i)
+		local cmd = "/bench ping " .. i
+		return lib.cli.size_encode(#cmd) .. cmd
+	end
+
+	if pipelined then
+		local buf = {}
+		for i = 1, COUNT do buf[i] = command(i) end
+		local data = table.concat(buf)
+		while #data > 0 do
+			local n = assert(posix.unistd.write(cli, data))
+			data = data:sub(n + 1)
+		end
+		wait_for(COUNT)
+	else
+		for i = 1, COUNT do
+			posix.unistd.write(cli, command(i))
+			wait_for(i)
+		end
+	end
+	posix.unistd._exit(0)
+end
+
+--
+-- We know the client has finished when the server drops its connection
+--
+local finished = false
+local remove_fd = lib.event.remove_fd
+lib.event.remove_fd = function(fd)
+	finished = true
+	remove_fd(fd)
+end
+
+lib.cli.configure({ path = SOCK })
+lib.cli.init()
+
+local function run(what, pipelined)
+	local start = now()
+
+	finished = false
+	local pid = posix.unistd.fork()
+	if pid == 0 then client(pipelined) end
+
+	repeat lib.event.poll() until finished
+	posix.sys.wait.wait(pid)
+	local took = now() - start
+	output(string.format("%-28s %6.2fs, %7.0f commands/s", what, took, COUNT / took))
+end
+
+run(COUNT .. " commands, pipelined", true)
+run(COUNT .. " commands, one at a time", false)
+
+--
+-- Just the handler, the same work without the socket
+--
+local start = now()
+for i = 1, COUNT do
+	local lines = ping("/bench", { tostring(i) })
+	while lines() do end
+end
+local took = now() - start
+output(string.format("%-28s %6.2fs, %7.0f commands/s", "ping handler alone", took, COUNT / took))
+
+posix.unistd.unlink(SOCK)
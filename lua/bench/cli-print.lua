@@ -0,0 +1,146 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Streaming print benchmark: fill a table with routes, then have a forked
+-- client ask for print and export over the cli socket (reading slowly for
+-- the first part) while we watch how much memory the server side uses.
+--
+-- Run from the lua directory: ../support/bin/lua bench/cli-print.lua [count]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local COUNT = tonumber(arg and arg[1]) or 500000
+
+lib.cf.register("/bench/route", {
+	["fields"] = {
+		["dst-address"] = { default = "" },
+		["gateway"] = { default = "" },
+		["distance"] = { default = 1 },
+		["comment"] = { default = "" },
+		["disabled"] = { default = false },
+		["uniq"] = { uniq = function(_, ci) return ci["dst-address"] end },
+	},
+	["flags"] = {
+		{ name = "disabled", field = "disabled", flag = "X", pos = 1 },
+	},
+	["options"] = {},
+})
+
+lib.cf.begin()
+for i = 1, COUNT do
+	lib.cf.set("/bench/route", nil, {
+		["dst-address"] = string.format("10.%d.%d.%d/32", (i >> 16) & 255, (i >> 8) & 255, i & 255),
+		["gateway"] = "192.168.0." .. (i % 250 + 1),
+		["distance"] = i % 5 + 1,
+		["comment"] = (i % 10 == 0) and "route number " .. i or nil,
+	})
+end
+lib.cf.commit()
+
+--
+-- The client: send the command and read replies until the empty one,
+-- sleeping every so often at the start so the server has to wait for us
+--
+local function client(command)
+	local cli = posix.sys.socket.socket(posix.sys.socket.AF_UNIX, posix.sys.socket.SOCK_STREAM, 0)
+	assert(posix.sys.socket.connect(cli, { family = posix.sys.socket.AF_UNIX, path = "/tmp/opentik.cli" }) == 0)
+	posix.unistd.write(cli, lib.cli.size_encode(#command) .. command)
+
+	local function readn(n)
+		local buf = {}
+		while n > 0 do
+			local data = assert(posix.unistd.read(cli, n))
+			assert(#data > 0, "server went away")
+			buf[#buf+1] = data
+			n = n - #data
+		end
+		return table.concat(buf)
+	end
+
+	local frames = 0
+	while true do
+		local more, byte, template = lib.cli.size_decode(readn(1))
+		local size = string.unpack(template, string.char(byte) .. readn(more))
+
+		if size == 0 then break end
+		readn(size)
+		frames = frames + 1
+		if frames <= 20 then posix.time.nanosleep({ tv_sec = 0, tv_nsec = 20000000 }) end
+	end
+	posix.unistd._exit(0)
+end
+
+--
+-- We know the client has finished when the server drops its connection
+--
+local finished = false
+local remove_fd = lib.event.remove_fd
+lib.event.remove_fd = function(fd)
+	finished = true
+	remove_fd(fd)
+end
+
+lib.cli.init()
+
+--
+-- The heap is sampled with a full collection every so often (we only want
+-- to see what's live), which adds a little to the time
+--
+local function run(command)
+	local every = math.max(1, COUNT // 2000)
+	local polls = 0
+
+	collectgarbage()
+	collectgarbage()
+	local base = collectgarbage("count")
+	local peak = base
+	local start = now()
+
+	finished = false
+	local pid = posix.unistd.fork()
+	if pid == 0 then client(command) end
+
+	repeat
+		lib.event.poll()
+		polls = polls + 1
+		if polls % every == 0 then
+			collectgarbage()
+			peak = math.max(peak, collectgarbage("count"))
+		end
+	until finished
+	posix.sys.wait.wait(pid)
+	output(string.format("items=%d %-20s %.2fs, live server heap grew by at most %.0fKB",
+								COUNT, command, now() - start, peak - base))
+end
+
+run("/bench route print")
+run("/bench/route export")
+
+--
+-- For comparison, building the whole print output in one go
+--
+collectgarbage()
+collectgarbage()
+local base = collectgarbage("count")
+local buf = {}
+for line in lib.cf.rows("/bench/route") do buf[#buf+1] = line end
+local all = table.concat(buf, "\n")
+output(string.format("items=%d whole print output held in memory: %.0fKB", COUNT, collectgarbage("count") - base))
@@ -0,0 +1,98 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Event loop overhead benchmark: a number of idle handles (dups of the read
+-- end of a pipe nobody writes to) registered alongside one busy pipe, and
+-- we time a trip round the loop for each byte written to the busy one. We
+-- do it with lib.event and with a poll() over the table of handles (which
+-- is how lib.event used to work) for comparison.
+--
+-- Run from the lua directory: ../support/bin/lua bench/event.lua [idle] [count]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local IDLE = tonumber(arg and arg[1]) or 10000
+local COUNT = tonumber(arg and arg[2]) or 1000
+
+local r = posix.sys.resource
+local limit = r.getrlimit(r.RLIMIT_NOFILE)
+r.setrlimit(r.RLIMIT_NOFILE, { rlim_cur = limit.rlim_max, rlim_max = limit.rlim_max })
+
+local quiet = posix.unistd.pipe()
+local rd, wr = posix.unistd.pipe()
+local seen = 0
+
+local function busy()
+	posix.unistd.read(rd, 1)
+	seen = seen + 1
+end
+
+--
+-- The old way, a poll() over everything and then a look through all of
+-- them for the ones that are ready
+--
+local fds = {}
+
+local function old_poll()
+	local rc = posix.poll.poll(fds, 0)
+
+	if rc > 0 then
+		for _,fd in pairs(fds) do
+			local rev = fd.revents
+			if rev and (rev.IN or rev.OUT or rev.HUP or rev.ERR) then fd.callback(fd) end
+		end
+	end
+end
+
+local function run(what, idle, poll)
+	seen = 0
+	local start = now()
+	for _ = 1, COUNT do
+		posix.unistd.write(wr, "x")
+		poll()
+	end
+	local took = now() - start
+	assert(seen == COUNT, "missed some events")
+	output(string.format("%-10s %6d idle handles: %8.2fus per wakeup", what, idle, took * 1e6 / COUNT))
+end
+
+local idle = {}
+
+local function add(fd, callback)
+	lib.event.add_fd(fd, callback)
+	fds[fd] = { fd = fd, events = { IN = true }, callback = callback }
+end
+
+add(rd, busy)
+run("lib.event", 0, lib.event.poll)
+run("poll()", 0, old_poll)
+
+for i = 1, IDLE do
+	idle[i] = assert(posix.unistd.dup(quiet), "out of file handles, try fewer")
+	add(idle[i], function() error("idle handle was ready") end)
+end
+run("lib.event", IDLE, lib.event.poll)
+run("poll()", IDLE, old_poll)
+
+for _,fd in ipairs(idle) do
+	lib.event.remove_fd(fd)
+	posix.unistd.close(fd)
+end
@@ -0,0 +1,55 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+--
+-- What every benchmark starts with: the library, quiet (the daemon prints
+-- as it goes, the benchmark only wants its own results) and a clock.
+--
+-- Run from the lua directory, a benchmark starts with:
+--
+--	local bench = dofile("bench/harness.lua")
+--	local output, now = bench.output, bench.now
+--
+dofile("lib/lib.lua")
+
+local output = print
+print = function() end
+
+--
+-- Monotonic time in seconds
+--
+local function now()
+	local t = posix.time.clock_gettime(posix.time.CLOCK_MONOTONIC)
+	return t.tv_sec + t.tv_nsec / 1e9
+end
+
+--
+-- A figure (in kB) from /proc/self/status: VmRSS for what we're using now,
+-- VmHWM for the most we've used
+--
+local function status(field)
+	for line in io.lines("/proc/self/status") do
+		local kb = line:match("^" .. field .. ":%s+(%d+)")
+		if kb then return tonumber(kb) end
+	end
+end
+
+return {
+	output = output,
+	now = now,
+	status = status,
+}
@@ -0,0 +1,90 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Address change benchmark: add and then remove a number of addresses on a
+-- veth, first by running /sbin/ip for each one, then through the long
+-- running "ip -batch" and then with rtnetlink through lib.ip. Then install and remove a big routing table with a
+-- lib.ip batch. This changes the network config so it needs root and is
+-- best run in its own namespace (unshare -n).
+--
+-- Run from the lua directory: ../support/bin/lua bench/ip.lua [count] [routes]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local COUNT = tonumber(arg and arg[1]) or 10000
+local ROUTES = tonumber(arg and arg[2]) or 1000000
+local DEV = "bench0"
+
+local function address(i)
+	return string.format("10.%d.%d.1/32", i >> 8, i & 255)
+end
+
+local function timed(what, fn)
+	local start = now()
+	local failed = 0
+
+	for i = 1, COUNT do
+		if not fn(address(i)) then failed = failed + 1 end
+	end
+	local took = now() - start
+	output(string.format("%-16s %d addresses in %.2fs (%.1fus each), %d failed",
+								what, COUNT, took, took * 1e6 / COUNT, failed))
+end
+
+assert(lib.run.execute("/sbin/ip", { "link", "add", DEV, "type", "veth", "peer", "name", DEV .. "p" }) == 0,
+								"can't create " .. DEV .. " (are we root?)")
+
+timed("exec add", function(a) return lib.run.execute("/sbin/ip", { "addr", "add", a, "dev", DEV }) == 0 end)
+timed("exec del", function(a) return lib.run.execute("/sbin/ip", { "addr", "del", a, "dev", DEV }) == 0 end)
+timed("ip -batch add", function(a) return lib.ip.command({ "addr", "add", a, "dev", DEV }) end)
+timed("ip -batch del", function(a) return lib.ip.command({ "addr", "del", a, "dev", DEV }) end)
+timed("netlink add", function(a) return lib.ip.addr.add(a, DEV) end)
+timed("netlink del", function(a) return lib.ip.addr.del(a, DEV) end)
+
+--
+-- Routes through a batch, every one has a function for its outcome as it
+-- would if it was for a config item
+--
+local function route(i)
+	return string.format("%d.%d.%d.0/24", 16 + (i >> 16), (i >> 8) & 255, i & 255)
+end
+
+local function batched(what, op)
+	local b = lib.ip.batch()
+	local ok = 0
+	local done = function(rc) if rc then ok = ok + 1 end end
+	local start = now()
+
+	for i = 1, ROUTES do b[op](b, route(i), { gateway = "10.255.255.2" }, done) end
+	local built = now()
+	local failed = b:send()
+	local took = now() - start
+
+	output(string.format("%-16s %d routes in %.2fs (%.2fs building, %.1fus each), %d ok, %d failed",
+								what, ROUTES, took, built - start, took * 1e6 / ROUTES, ok, failed))
+end
+
+lib.ip.link.set(DEV, "up")
+lib.ip.addr.add("10.255.255.1/24", DEV)
+batched("batch route add", "route_add")
+batched("batch route del", "route_del")
+
+lib.run.execute("/sbin/ip", { "link", "del", DEV })
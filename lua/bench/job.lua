@@ -0,0 +1,91 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Backend job benchmark: bring up a number of addresses whose start runs
+-- a command, first in the foreground (everything done before lib.cf.set
+-- returns) and then with the jobs run by the event loop, where we look at
+-- the longest the loop goes without getting back to the cli.
+--
+-- Run from the lua directory: ../support/bin/lua bench/job.lua [count]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local COUNT = tonumber(arg and arg[1]) or 3000
+
+local started = 0
+
+lib.cf.register("/bench/interface", {
+	["fields"] = {
+		["name"] = { uniq = true, default = "" },
+		["disabled"] = { default = false },
+	},
+	["options"] = {},
+})
+
+lib.cf.register("/bench/address", {
+	["fields"] = {
+		["address"] = { uniq = true, default = "" },
+		["interface"] = { default = "" },
+		["disabled"] = { default = false },
+	},
+	["dependencies"] = {
+		["interface"] = { path = "/bench/interface" },
+	},
+	["options"] = {
+		["start"] = function()
+			lib.run.execute("/bin/true")
+			started = started + 1
+		end,
+		["stop"] = function() end,
+	},
+})
+
+local function apply(name)
+	lib.cf.begin()
+	lib.cf.set("/bench/interface", nil, { name = name })
+	for i = 1, COUNT do
+		lib.cf.set("/bench/address", nil, {
+			address = string.format("%s-10.%d.%d.1/24", name, i >> 8, i & 255),
+			interface = name,
+		})
+	end
+	lib.cf.commit()
+end
+
+started = 0
+local start = now()
+apply("fg")
+output(string.format("foreground: %d starts, lib.cf.set blocked for %.2fs", started, now() - start))
+
+lib.job.configure({ background = true })
+started = 0
+start = now()
+apply("bg")
+local returned = now() - start
+local worst = 0
+
+while started < COUNT do
+	local t = now()
+	lib.event.poll()
+	worst = math.max(worst, now() - t)
+end
+output(string.format("background: %d starts in %.2fs, lib.cf.set returned after %.3fs, longest loop pass %.1fms",
+							started, now() - start, returned, worst * 1000))
@@ -0,0 +1,122 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Journal benchmark: write a config through the journal, then time how long
+-- a boot takes to get back to the configured state, first by replaying the
+-- journal and then from a compacted snapshot. Also times single commits
+-- with an fsync each.
+--
+-- Run from the lua directory: ../support/bin/lua bench/journal.lua [count] [dir]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local COUNT = tonumber(arg and arg[1]) or 100000
+local DIR = (arg and arg[2]) or "/tmp/opentik-journal-bench"
+local BATCH = 1000
+local SINGLES = 200
+
+local function register()
+	lib.cf.register("/bench/route", {
+		["fields"] = {
+			["dst-address"] = { default = "" },
+			["gateway"] = { default = "" },
+			["distance"] = { default = 1 },
+			["comment"] = { default = "" },
+			["disabled"] = { default = false },
+		},
+		["options"] = {},
+	})
+end
+
+local function route(i)
+	return string.format("10.%d.%d.%d/32", (i >> 16) & 255, (i >> 8) & 255, i & 255)
+end
+
+local function size(name)
+	local st = posix.sys.stat.stat(DIR .. "/" .. name)
+	return (st and st.st_size) or 0
+end
+
+os.execute("rm -rf " .. DIR)
+register()
+lib.journal.open(DIR, { limit = 1 << 40 })
+
+--
+-- Load the config in batches, then some single commits
+--
+local start = now()
+for i = 1, COUNT, BATCH do
+	lib.cf.begin()
+	for j = i, math.min(i + BATCH - 1, COUNT) do
+		lib.cf.set("/bench/route", nil, { ["dst-address"] = route(j), gateway = "192.168.1.1", distance = j % 10 + 1 })
+	end
+	lib.cf.commit()
+end
+local load = now() - start
+
+local uniqs = {}
+for uniq in pairs(CONFIG["/bench/route"].cf) do
+	table.insert(uniqs, uniq)
+	if #uniqs == SINGLES then break end
+end
+
+start = now()
+for _,uniq in ipairs(uniqs) do
+	lib.cf.set("/bench/route", uniq, { comment = "changed" })
+end
+local single = (now() - start) / SINGLES
+lib.journal.close()
+
+output(string.format("items=%d load=%.2fs (batches of %d) journal=%.1fMB single commit+fsync=%.0fus",
+			COUNT, load, BATCH, size("journal.0") / 1048576, single * 1e6))
+
+--
+-- Boot from the journal
+--
+local function boot(what)
+	register()
+	collectgarbage()
+
+	local start = now()
+	lib.journal.open(DIR)
+	local took = now() - start
+
+	local n = 0
+	for _ in pairs(CONFIG["/bench/route"].cf) do n = n + 1 end
+	assert(n == COUNT, "expected "..COUNT.." items, got "..n)
+	assert(CONFIG["/bench/route"].cf[uniqs[1]].comment == "changed")
+
+	output(string.format("boot from %-8s %.2fs (%.1fus/item)", what, took, took / COUNT * 1e6))
+end
+
+boot("journal")
+
+--
+-- Compact and boot from the snapshot
+--
+start = now()
+lib.journal.compact()
+local rotate = now() - start
+lib.journal.close()
+output(string.format("compaction: parent blocked %.1fms, snapshot=%.1fMB", rotate * 1e3, size("snapshot") / 1048576))
+
+boot("snapshot")
+lib.journal.close()
@@ -0,0 +1,117 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Gateway failover benchmark: a table of routes all through one recursive
+-- gateway (100.64.0.1) which has a primary route out of one interface and
+-- a backup at a higher distance out of the other. We time disabling and
+-- re-enabling the primary, with the routes on kernel nexthop objects and
+-- then with each route carrying its own gateway, and count what we sent
+-- the kernel for it.
+--
+-- It needs root and its own network namespace (unshare -n), the two
+-- interfaces are a veth pair called eth0 and eth1 so they match the
+-- interfaces the config knows about.
+--
+-- Run from the lua directory: ../support/bin/lua bench/nexthop.lua [routes]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local ROUTES = tonumber(arg and arg[1]) or 100000
+
+local function dst(i)
+	return string.format("%d.%d.%d.0/24", 16 + (i >> 16), (i >> 8) & 255, i & 255)
+end
+
+--
+-- Count what goes to the kernel, whichever way it goes
+--
+local sent = {}
+
+local function counted(op, fn)
+	return function(...)
+		sent[op] = (sent[op] or 0) + 1
+		return fn(...)
+	end
+end
+
+local function report(what, took)
+	output(string.format("  %-24s %7.3fs, kernel: %6d route %6d nexthop", what, took,
+							(sent.route_replace or 0) + (sent.route_del or 0),
+							(sent.nexthop_add or 0) + (sent.nexthop_replace or 0) + (sent.nexthop_del or 0)))
+	sent = {}
+end
+
+--
+-- Each way round runs in its own child, so each starts from nothing
+--
+local function run(nexthops)
+	local pid = posix.unistd.fork()
+
+	if pid ~= 0 then
+		posix.sys.wait.wait(pid)
+		return
+	end
+
+	core.route.configure({ nexthops = nexthops })
+	for _,op in ipairs({ "add", "replace", "del" }) do
+		lib.ip.route[op] = lib.ip.route[op] and counted("route_" .. op, lib.ip.route[op])
+		lib.ip.nexthop[op] = counted("nexthop_" .. op, lib.ip.nexthop[op])
+	end
+	lib.netlink.init()
+
+	output(nexthops and "with nexthop objects:" or "with a gateway per route:")
+
+	local start = now()
+	lib.cf.begin()
+	local primary = lib.cf.set("/ip/route", nil, { ["dst-address"] = "100.64.0.1/32", ["gateway"] = "3.0.0.254" })
+	lib.cf.set("/ip/route", nil, { ["dst-address"] = "100.64.0.1/32", ["gateway"] = "4.0.0.1", ["distance"] = 2 })
+	for i = 1, ROUTES do
+		lib.cf.set("/ip/route", nil, { ["dst-address"] = dst(i), ["gateway"] = "100.64.0.1", ["target-scope"] = 30 })
+	end
+	lib.cf.commit()
+	report("load " .. ROUTES .. " routes", now() - start)
+
+	start = now()
+	lib.cf.set("/ip/route", primary, { disabled = true })
+	report("fail over to backup", now() - start)
+
+	start = now()
+	lib.cf.set("/ip/route", primary, { disabled = false })
+	report("back to primary", now() - start)
+
+	lib.run.execute("/sbin/ip", { "route", "flush", "proto", "73" })
+	lib.run.execute("/sbin/ip", { "nexthop", "flush" })
+	posix.unistd._exit(0)
+end
+
+assert(lib.run.execute("/sbin/ip", { "link", "add", "eth0", "type", "veth", "peer", "name", "eth1" }) == 0,
+								"can't create eth0 and eth1 (are we root, in our own namespace?)")
+_ = core.interface
+_ = core.ethernet
+lib.ip.link.set("eth0", "up")
+lib.ip.link.set("eth1", "up")
+lib.ip.addr.add("3.0.0.1/24", "eth0")
+lib.ip.addr.add("4.0.0.2/24", "eth1")
+
+run(true)
+run(false)
+
+lib.run.execute("/sbin/ip", { "link", "del", "eth0" })
@@ -0,0 +1,151 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Restart benchmark: bring up a config of interfaces, addresses and a big
+-- table of routes from nothing, then "restart" (a new process replaying
+-- the journal against the kernel the last one left behind) and see how
+-- long it takes and what gets sent to the kernel. We restart with the
+-- config reconciled against the kernel, with a few routes changed while
+-- we were down, and the old way where everything is started again.
+--
+-- It needs root and its own network namespace (unshare -n), the
+-- interfaces are a veth pair called eth0 and eth1 so they match the
+-- interfaces the config knows about.
+--
+-- Run from the lua directory: ../support/bin/lua bench/restart.lua [routes] [dir]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local ROUTES = tonumber(arg and arg[1]) or 100000
+local DIR = (arg and arg[2]) or "/tmp/opentik-restart-bench"
+local CHANGED = 100
+
+local function dst(i)
+	return string.format("%d.%d.%d.0/24", 16 + (i >> 16), (i >> 8) & 255, i & 255)
+end
+
+--
+-- The config, half the routes out of each interface
+--
+local function configure()
+	lib.cf.set("/interface/ethernet", "ether2", { ["mtu"] = 1400 })
+	lib.cf.set("/ip/address", nil, { ["address"] = "3.0.0.1/24", ["interface"] = "ether1" })
+	lib.cf.set("/ip/address", nil, { ["address"] = "4.0.0.2/24", ["interface"] = "ether2" })
+	for i = 1, ROUTES do
+		lib.cf.set("/ip/route", nil, { ["dst-address"] = dst(i), ["gateway"] = (i & 1 == 0) and "3.0.0.254" or "4.0.0.1" })
+	end
+end
+
+--
+-- Each run is its own process, as a restart would be. We count what's
+-- sent to the kernel through lib.ip (leftovers cleared away at the end of
+-- a reconcile go in one batch and aren't counted).
+--
+local function run(what, fn)
+	local rd, wr = posix.unistd.pipe()
+	local pid = posix.unistd.fork()
+
+	if pid == 0 then
+		local sent = 0
+
+		for _,section in ipairs({ "addr", "link", "route", "nexthop" }) do
+			for op, f in pairs(lib.ip[section]) do
+				lib.ip[section][op] = function(...) sent = sent + 1 return f(...) end
+			end
+		end
+
+		local start = now()
+		fn()
+		local took = now() - start
+
+		posix.unistd.write(wr, string.format("%-28s %7.2fs, %7d kernel requests, %d routes installed",
+												what, took, sent, core.route.stats().installed))
+		posix.unistd._exit(0)
+	end
+	posix.unistd.close(wr)
+	output(posix.unistd.read(rd, 1024))
+	posix.unistd.close(rd)
+	posix.sys.wait.wait(pid)
+end
+
+--
+-- What go does: load the modules, catch up with the kernel and replay the
+-- journal, a new journal then gets the initial config from fn
+--
+local function boot(fn)
+	for _,m in ipairs({ "interface", "ethernet", "address", "route" }) do _ = core[m] end
+	lib.netlink.init()
+	if not lib.journal.open(DIR, { sync = false, limit = 1 << 40 }) and fn then fn() end
+end
+
+--
+-- Until the routes have all gone in, starting from nothing they have to
+-- wait for the kernel to tell us about the connected routes
+--
+local function settle()
+	for _ = 1, 10 do
+		if core.route.stats().installed >= ROUTES then break end
+		lib.event.poll()
+	end
+end
+
+assert(lib.run.execute("/sbin/ip", { "link", "add", "eth0", "type", "veth", "peer", "name", "eth1" }) == 0,
+								"can't create eth0 and eth1 (are we root, in our own namespace?)")
+os.execute("rm -rf " .. DIR)
+
+run("cold start " .. ROUTES .. " routes", function()
+	lib.cf.reconcile(function() boot(configure) end)
+	settle()
+end)
+run("restart", function()
+	lib.cf.reconcile(boot)
+	settle()
+end)
+
+--
+-- Change some routes to the other gateway as if it happened while we were
+-- down: it goes in the journal but the backends are never run
+--
+run("restart, journal " .. CHANGED .. " changes", function()
+	lib.cf.reconcile(boot)
+	lib.job.configure({ background = true })
+	lib.cf.begin()
+	local n = 0
+	for uniq, ci in pairs(CONFIG["/ip/route"].cf) do
+		n = n + 1
+		if n > CHANGED then break end
+		lib.cf.set("/ip/route", uniq, { ["gateway"] = (ci.gateway == "4.0.0.1") and "3.0.0.254" or "4.0.0.1" })
+	end
+	lib.cf.commit()
+end)
+run("restart after the changes", function()
+	lib.cf.reconcile(boot)
+	settle()
+end)
+run("restart, no reconcile", function()
+	lib.cf.begin()
+	boot()
+	lib.cf.commit()
+	settle()
+end)
+
+lib.run.execute("/sbin/ip", { "link", "del", "eth0" })
+os.execute("rm -rf " .. DIR)
@@ -0,0 +1,140 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Prefix lookup benchmark: fill a c.lpm table with a full table's worth
+-- of v4 and v6 prefixes (like a real table the /24s are the bulk and only
+-- one in a hundred is a /16 or shorter) and time lookups of random
+-- addresses, then take half of them out again. Last we do the same lookups through core.route.check with a
+-- smaller configured table (the kernel side is just counted). Each is
+-- timed one address a call and then as batches of the whole address list
+-- (lookup_many and check_many).
+--
+-- Run from the lua directory: ../support/bin/lua bench/route-check.lua [v4] [v6]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local V4 = tonumber(arg and arg[1]) or 900000
+local V6 = tonumber(arg and arg[2]) or 100000
+local LOOKUPS = 2000000
+
+local function v4(n)
+	return string.format("%d.%d.%d.%d", n >> 24, (n >> 16) & 255, (n >> 8) & 255, n & 255)
+end
+
+local function v4_prefix(n, len)
+	return v4(n & ((0xffffffff << (32 - len)) & 0xffffffff)) .. "/" .. len
+end
+
+math.randomseed(1)
+
+local prefixes = {}
+for i = 1, V4 do
+	local len = (i % 10 < 6 and 24) or (i % 100 == 99 and math.random(8, 16)) or math.random(17, 23)
+	prefixes[i] = v4_prefix(math.random(0x01000000, 0xdfffffff), len)
+end
+for i = 1, V6 do
+	prefixes[V4 + i] = string.format("2001:%x:%x::/48", math.random(0, 0xffff), math.random(0, 0xffff))
+end
+
+local addrs = {}
+for i = 1, 100000 do
+	addrs[i] = (i % 10 == 0 and string.format("2001:%x:%x::1", math.random(0, 0xffff), math.random(0, 0xffff)))
+					or v4(math.random(0x01000000, 0xdfffffff))
+end
+
+local function report(what, took, found)
+	output(string.format("%-30s %8d lookups in %5.2fs, %5.2fM/s, %d matched",
+							what, LOOKUPS, took, LOOKUPS / took / 1e6, found))
+end
+
+local function lookups(what, t)
+	local n = #addrs
+	local found = 0
+	local start = now()
+
+	for i = 1, LOOKUPS do
+		if t:lookup(addrs[i % n + 1]) then found = found + 1 end
+	end
+	report(what, now() - start, found)
+end
+
+local function lookups_many(what, t)
+	local n = #addrs
+	local out = {}
+	local found = 0
+	local start = now()
+
+	for _ = 1, LOOKUPS // n do
+		local _, m = t:lookup_many(addrs, out)
+		found = found + m
+	end
+	report(what, now() - start, found)
+end
+
+local before = bench.status("VmRSS") / 1024
+local t = c.lpm.new()
+local start = now()
+
+for i, p in ipairs(prefixes) do t:insert(p, i) end
+output(string.format("inserted %d prefixes (%d distinct) in %.2fs, +%.0fMB RSS",
+							#prefixes, t:count(), now() - start, bench.status("VmRSS") / 1024 - before))
+
+lookups("c.lpm lookup", t)
+lookups_many("c.lpm lookup_many", t)
+
+start = now()
+for i = 1, #prefixes, 2 do t:remove(prefixes[i]) end
+output(string.format("removed half in %.2fs, %d left", now() - start, t:count()))
+lookups("c.lpm lookup (half)", t)
+lookups_many("c.lpm lookup_many (half)", t)
+t = nil
+collectgarbage()
+
+--
+-- Through the route selection
+--
+lib.ip = {
+	route = { replace = function() return true end, del = function() return true end },
+	nexthop = { add = function() return true end, replace = function() return true end, del = function() return true end },
+}
+_ = core.route
+
+local COUNT = math.min(V4, 50000)
+lib.cf.begin()
+for i = 1, COUNT do
+	lib.cf.set("/ip/route", nil, { ["dst-address"] = prefixes[i], ["type"] = "blackhole" })
+end
+lib.cf.commit()
+local found = 0
+start = now()
+for i = 1, LOOKUPS do
+	if core.route.check(addrs[i % #addrs + 1]).route then found = found + 1 end
+end
+report("core.route.check (" .. COUNT .. ")", now() - start, found)
+
+found = 0
+start = now()
+for _ = 1, LOOKUPS // #addrs do
+	for _, rc in ipairs(core.route.check_many(addrs)) do
+		if rc.route then found = found + 1 end
+	end
+end
+report("core.route.check_many (" .. COUNT .. ")", now() - start, found)
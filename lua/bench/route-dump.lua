@@ -0,0 +1,116 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Route dump benchmark: install a full table's worth of v4 and v6 routes
+-- and then read them back, by parsing "ip route show" (the way the route
+-- list used to), by walking the netlink dump and by loading them all into
+-- the route selection (live entries and a candidate for each).
+-- Each runs in its own child so we can report its peak RSS. This changes
+-- the routing table so it needs root and is best run in its own namespace
+-- (unshare -n).
+--
+-- Run from the lua directory: ../support/bin/lua bench/route-dump.lua [v4] [v6]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local V4 = tonumber(arg and arg[1]) or 900000
+local V6 = tonumber(arg and arg[2]) or 100000
+local DEV = "bench0"
+
+--
+-- The text parse that the route list used before it had netlink
+--
+local function text_routes()
+	local st, routes = lib.run.execute("/sbin/ip", { "-4", "route", "show", "table", "all" })
+	local count = 0
+
+	for i,r in ipairs(routes) do
+		local entry = {}
+
+		r:gsub("default", "0.0.0.0/0"):gsub("^([%d%./]+)%s", "unicast %1 ")
+			:gsub("%s([%d%./]+)%s", " dst-address %1 ",1):gsub("^", "type ")
+			:gsub(" src ", " pref-src "):gsub(" table ", " routing-mark ")
+				:gsub("([^%s]+)%s+([^%s]+)", function(k,v) entry[k] = v end)
+		routes[i] = entry
+		count = count + 1
+	end
+	return count
+end
+
+local function netlink_walk()
+	local count = 0
+
+	for r in assert(c.nl.routes()) do count = count + 1 end
+	return count
+end
+
+local function route_load()
+	lib.netlink.init()
+	return core.route.stats().externals
+end
+
+local function measure(what, fn)
+	local rd, wr = posix.unistd.pipe()
+	local pid = posix.unistd.fork()
+
+	if pid == 0 then
+		local start = now()
+		local count = fn()
+		local took = now() - start
+
+		posix.unistd.write(wr, string.format("%-22s %8d routes in %6.2fs, peak RSS %7.1fMB",
+												what, count, took, bench.status("VmHWM") / 1024))
+		posix.unistd._exit(0)
+	end
+	posix.unistd.close(wr)
+	output(posix.unistd.read(rd, 1024))
+	posix.unistd.close(rd)
+	posix.sys.wait.wait(pid)
+end
+
+assert(lib.run.execute("/sbin/ip", { "link", "add", DEV, "type", "veth", "peer", "name", DEV .. "p" }) == 0,
+								"can't create " .. DEV .. " (are we root?)")
+lib.ip.link.set(DEV, "up")
+lib.ip.addr.add("10.255.255.1/24", DEV)
+lib.ip.addr.add("fd00::1/64", DEV)
+
+local b = lib.ip.batch()
+for i = 1, V4 do
+	b:route_add(string.format("%d.%d.%d.0/24", 16 + (i >> 16), (i >> 8) & 255, i & 255), { gateway = "10.255.255.2" })
+end
+for i = 1, V6 do
+	b:route_add(string.format("2001:db8:%x:%x::/64", i >> 16, i & 0xffff), { gateway = "fd00::2" })
+end
+local failed = b:send()
+assert(failed == 0, failed .. " routes failed to install")
+b = nil
+_ = core.interface
+_ = core.route
+collectgarbage()
+collectgarbage()
+
+output(string.format("installed %d v4 and %d v6 routes", V4, V6))
+measure("baseline", function() return 0 end)
+measure("ip route show (v4)", text_routes)
+measure("netlink walk (v4+v6)", netlink_walk)
+measure("route load (v4+v6)", route_load)
+
+lib.run.execute("/sbin/ip", { "link", "del", DEV })
@@ -0,0 +1,92 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Route selection benchmark: configure a table of routes, each destination
+-- with a few candidates at different distances (out of different
+-- interfaces, so there's no gateway to resolve), and then time disabling
+-- and enabling the best one for a sample of destinations. The kernel side
+-- is just counted (so no root needed), what we're after is that the cost
+-- of a change, and what we send the kernel for it, doesn't grow with the
+-- size of the table.
+--
+-- Run from the lua directory: ../support/bin/lua bench/route-select.lua [routes] [candidates]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local ROUTES = tonumber(arg and arg[1]) or 100000
+local CANDIDATES = tonumber(arg and arg[2]) or 3
+local SAMPLE = 1000
+
+local sent = {}
+
+lib.ip = {
+	route = {
+		replace = function() sent.replace = (sent.replace or 0) + 1 return true end,
+		del = function() sent.del = (sent.del or 0) + 1 return true end,
+	},
+	nexthop = {
+		add = function() sent.nexthop = (sent.nexthop or 0) + 1 return true end,
+		replace = function() sent.nexthop = (sent.nexthop or 0) + 1 return true end,
+		del = function() sent.nexthop = (sent.nexthop or 0) + 1 return true end,
+	},
+}
+_ = core.route
+
+local function dst(i)
+	return string.format("%d.%d.%d.0/24", 16 + (i >> 16), (i >> 8) & 255, i & 255)
+end
+
+local function report(what, count, took)
+	output(string.format("%-28s %8d changes in %6.2fs, %6.1fus each, kernel: %d replace %d del %d nexthop",
+							what, count, took, took / count * 1e6, sent.replace or 0, sent.del or 0, sent.nexthop or 0))
+	sent = {}
+end
+
+local start = now()
+local best = {}
+
+lib.cf.begin()
+for i = 1, ROUTES do
+	for d = 1, CANDIDATES do
+		local uniq = lib.cf.set("/ip/route", nil, {
+			["dst-address"] = dst(i),
+			["gateway"] = string.format("ether%d", d),
+			["distance"] = d,
+		})
+		if d == 1 then best[i] = uniq end
+	end
+end
+lib.cf.commit()
+report("load " .. ROUTES .. "x" .. CANDIDATES, ROUTES * CANDIDATES, now() - start)
+
+local step = math.max(1, ROUTES // SAMPLE)
+
+start = now()
+for i = 1, ROUTES, step do lib.cf.set("/ip/route", best[i], { disabled = true }) end
+report("disable best", ROUTES // step, now() - start)
+
+start = now()
+for i = 1, ROUTES, step do lib.cf.set("/ip/route", best[i], { disabled = false }) end
+report("enable best", ROUTES // step, now() - start)
+
+start = now()
+for i = 1, ROUTES, step do lib.cf.set("/ip/route", best[i], nil) end
+report("delete best", ROUTES // step, now() - start)
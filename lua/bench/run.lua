@@ -0,0 +1,60 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Command execution benchmark: run a burst of commands from backend jobs,
+-- first with the blocking lib.run.execute and then with lib.run.await, and
+-- report the total time and the longest the event loop went without a
+-- pass (which is how long the cli would have to wait).
+--
+-- Run from the lua directory: ../support/bin/lua bench/run.lua [count] [limit]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local COUNT = tonumber(arg and arg[1]) or 1000
+local LIMIT = tonumber(arg and arg[2]) or 16
+
+lib.job.configure({ background = true, limit = LIMIT })
+
+local function burst(name, run)
+	local finished = 0
+	local failed = 0
+	local worst = 0
+	local start = now()
+
+	for i = 1, COUNT do
+		lib.job.add(function()
+			local status, out = run("/bin/sh", { "-c", "sleep 0.005; echo " .. i })
+
+			if status ~= 0 or out[1] ~= tostring(i) then failed = failed + 1 end
+			finished = finished + 1
+		end)
+	end
+	while finished < COUNT do
+		local t = now()
+		lib.event.poll()
+		worst = math.max(worst, now() - t)
+	end
+	output(string.format("%-8s %d commands (limit %d) in %.2fs, longest loop pass %.1fms, %d bad",
+								name, COUNT, LIMIT, now() - start, worst * 1000, failed))
+end
+
+burst("execute", lib.run.execute)
+burst("await", lib.run.await)
@@ -0,0 +1,84 @@
+#!../support/bin/lua
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Timer benchmark: arm a lot of timers spread over the next day, see what
+-- they cost to set up and cancel and what they add to a trip round the
+-- event loop (a byte through a pipe) while none are due. Then arm the same
+-- number to go off over a second (starting a second from now, so we've
+-- finished setting them up) and count how many wakeups it takes to get
+-- through them and how late they were.
+--
+-- Run from the lua directory: ../support/bin/lua bench/timer.lua [timers] [count]
+--
+local bench = dofile("bench/harness.lua")
+local output, now = bench.output, bench.now
+
+local TIMERS = tonumber(arg and arg[1]) or 200000
+local COUNT = tonumber(arg and arg[2]) or 10000
+
+local rd, wr = posix.unistd.pipe()
+lib.event.add_fd(rd, function() posix.unistd.read(rd, 1) end)
+
+local function trip(what)
+	local start = now()
+	for _ = 1, COUNT do
+		posix.unistd.write(wr, "x")
+		lib.event.poll()
+	end
+	output(string.format("%-32s %8.2fus per wakeup", what, (now() - start) * 1e6 / COUNT))
+end
+
+local function never() error("timer went off early") end
+
+trip("loop, no timers")
+
+local timers = {}
+local start = now()
+for i = 1, TIMERS do
+	timers[i] = lib.event.after(60000 + (i * 7919) % 86400000, never)
+end
+output(string.format("%-32s %8.2fus per timer", "arm " .. TIMERS .. " timers", (now() - start) * 1e6 / TIMERS))
+
+trip("loop, " .. TIMERS .. " idle timers")
+
+start = now()
+for i = 1, TIMERS do lib.event.cancel(timers[i]) end
+output(string.format("%-32s %8.2fus per timer", "cancel them", (now() - start) * 1e6 / TIMERS))
+
+--
+-- All going off over a second, a second from now
+--
+local fired, late, polls = 0, 0, 0
+for i = 1, TIMERS do
+	local ms = 1000 + i * 1000 // TIMERS
+	local due = lib.event.now() + ms
+
+	lib.event.after(ms, function()
+		fired = fired + 1
+		late = math.max(late, lib.event.now() - due)
+	end)
+end
+local begin = now()
+while fired < TIMERS do
+	lib.event.poll()
+	polls = polls + 1
+end
+output(string.format("%-32s %8.2fs, %d wakeups, at most %dms late", TIMERS .. " timers over 1s",
+							now() - begin, polls, late))
@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+/*==============================================================================
+ * The event bus: helper scripts (dhcp and friends) send events, which are
+ * Lua tables of strings, numbers and booleans, to a datagram socket the
+ * daemon listens on.
+ *
+ * Events are encoded in a compact binary form, a version byte and then the
+ * value as a type byte followed by what it needs:
+ *
+ *		false, true			nothing
+ *		integer				zigzag varint
+ *		float				8 byte double (host order, it never leaves the box)
+ *		string				varint length and the bytes
+ *		table				varint count of pairs and then key, value for each
+ *
+ * Decoding only ever builds values, so whoever can reach the socket can't
+ * get us to run anything, and anything that doesn't make sense is dropped.
+ *
+ * Senders keep a connected socket and the receiver takes as many datagrams
+ * as are waiting in one recvmmsg.
+ *
+ * Errors come back as nil, message, errno (the same as luaposix).
+ *==============================================================================
+ */
+#define BUS_VERSION		1
+#define BUS_MAX			65536			// biggest event
+#define BUS_BATCH		32				// datagrams per recvmmsg
+#define BUS_DEPTH		32				// deepest nesting of tables
+#define BUS_RCVBUF		(1024 * 1024)
+
+enum { T_FALSE, T_TRUE, T_INT, T_FLOAT, T_STRING, T_TABLE };
+
+/*==============================================================================
+ * A growing buffer to encode into, it's kept between uses so a steady
+ * stream of events doesn't allocate anything
+ *==============================================================================
+ */
+#define BUF_INC		2048
+
+struct charbuf {
+	unsigned char	*p;
+	size_t			alloc;
+	size_t			len;
+};
+
+static struct charbuf	out;
+
+static void charbuf_make_space(lua_State *L, struct charbuf *b, size_t need) {
+	size_t			alloc = b->alloc;
+	unsigned char	*p;
+
+	if (b->len + need <= alloc) return;
+	while (alloc < b->len + need) alloc += BUF_INC;
+	if (!(p = realloc(b->p, alloc))) luaL_error(L, "out of memory");
+	b->p = p;
+	b->alloc = alloc;
+}
+
+static void charbuf_addbytes(lua_State *L, struct charbuf *b, const void *d, size_t len) {
+	charbuf_make_space(L, b, len);
+	memcpy(b->p + b->len, d, len);
+	b->len += len;
+}
+
+static void charbuf_addchar(lua_State *L, struct charbuf *b, unsigned char c) {
+	charbuf_make_space(L, b, 1);
+	b->p[b->len++] = c;
+}
+
+static void charbuf_addvarint(lua_State *L, struct charbuf *b, uint64_t v) {
+	charbuf_make_space(L, b, 10);
+	while (v >= 0x80) {
+		b->p[b->len++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	b->p[b->len++] = (unsigned char)v;
+}
+
+/*==============================================================================
+ * Encode the value at index into the buffer
+ *==============================================================================
+ */
+static void encode_value(lua_State *L, int index, struct charbuf *b, int depth) {
+	const char	*s;
+	size_t		len;
+	size_t		count, at;
+	int64_t		i;
+	double		d;
+
+	switch (lua_type(L, index)) {
+	case LUA_TBOOLEAN:
+		charbuf_addchar(L, b, lua_toboolean(L, index) ? T_TRUE : T_FALSE);
+		break;
+
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, index)) {
+			i = (int64_t)lua_tointeger(L, index);
+			charbuf_addchar(L, b, T_INT);
+			charbuf_addvarint(L, b, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+		} else {
+			d = (double)lua_tonumber(L, index);
+			charbuf_addchar(L, b, T_FLOAT);
+			charbuf_addbytes(L, b, &d, sizeof(d));
+		}
+		break;
+
+	case LUA_TSTRING:
+		s = lua_tolstring(L, index, &len);
+		charbuf_addchar(L, b, T_STRING);
+		charbuf_addvarint(L, b, len);
+		charbuf_addbytes(L, b, s, len);
+		break;
+
+	case LUA_TTABLE:
+		if (depth >= BUS_DEPTH) luaL_error(L, "event is nested too deeply");
+		luaL_checkstack(L, 3, "event is nested too deeply");
+		index = lua_absindex(L, index);
+
+		// the count goes first, so leave room for the biggest varint and
+		// close the gap once we know it
+		charbuf_addchar(L, b, T_TABLE);
+		charbuf_make_space(L, b, 10);
+		at = b->len;
+		b->len += 10;
+
+		count = 0;
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			encode_value(L, -2, b, depth + 1);
+			encode_value(L, -1, b, depth + 1);
+			lua_pop(L, 1);
+			count++;
+		}
+		{
+			size_t			end = b->len;
+			unsigned char	v[10];
+			size_t			n = 0;
+
+			while (count >= 0x80) { v[n++] = (unsigned char)(count | 0x80); count >>= 7; }
+			v[n++] = (unsigned char)count;
+			memcpy(b->p + at, v, n);
+			memmove(b->p + at + n, b->p + at + 10, end - at - 10);
+			b->len = end - (10 - n);
+		}
+		break;
+
+	default:
+		luaL_error(L, "can't send a %s in an event", luaL_typename(L, index));
+	}
+}
+
+static void encode(lua_State *L, int index) {
+	out.len = 0;
+	charbuf_addchar(L, &out, BUS_VERSION);
+	encode_value(L, index, &out, 0);
+}
+
+/*==============================================================================
+ * Decode a value from p (up to end) and push it, returns where it finished
+ * or NULL (with nothing pushed) if it's not right
+ *==============================================================================
+ */
+static const unsigned char *decode_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+	int		shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+static const unsigned char *decode_value(lua_State *L, const unsigned char *p, const unsigned char *end, int depth) {
+	uint64_t	v, n;
+	double		d;
+
+	if (p >= end) return NULL;
+	switch (*p++) {
+	case T_FALSE:
+	case T_TRUE:
+		lua_pushboolean(L, p[-1] == T_TRUE);
+		return p;
+
+	case T_INT:
+		if (!(p = decode_varint(p, end, &v))) return NULL;
+		lua_pushinteger(L, (lua_Integer)((v >> 1) ^ (~(v & 1) + 1)));
+		return p;
+
+	case T_FLOAT:
+		if ((size_t)(end - p) < sizeof(d)) return NULL;
+		memcpy(&d, p, sizeof(d));
+		lua_pushnumber(L, d);
+		return p + sizeof(d);
+
+	case T_STRING:
+		if (!(p = decode_varint(p, end, &v)) || v > (uint64_t)(end - p)) return NULL;
+		lua_pushlstring(L, (const char *)p, (size_t)v);
+		return p + v;
+
+	case T_TABLE:
+		// a NaN can't be a key, and each pair is at least two bytes
+		if (depth >= BUS_DEPTH || !lua_checkstack(L, 3)) return NULL;
+		if (!(p = decode_varint(p, end, &n)) || n > (uint64_t)(end - p) / 2) return NULL;
+		lua_createtable(L, 0, (int)n);
+		while (n--) {
+			if (!(p = decode_value(L, p, end, depth + 1))) goto bad;
+			if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1)) {
+				lua_pop(L, 1);
+				goto bad;
+			}
+			if (!(p = decode_value(L, p, end, depth + 1))) {
+				lua_pop(L, 1);
+				goto bad;
+			}
+			lua_rawset(L, -3);
+		}
+		return p;
+bad:
+		lua_pop(L, 1);
+		return NULL;
+	}
+	return NULL;
+}
+
+static int decode(lua_State *L, const unsigned char *p, size_t len) {
+	const unsigned char *end = p + len;
+
+	if (len < 1 || *p != BUS_VERSION) return 0;
+	if (!(p = decode_value(L, p + 1, end, 0))) return 0;
+	if (p != end) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	return 1;
+}
+
+static int push_error(lua_State *L, int err) {
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(err));
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+/*------------------------------------------------------------------------------
+ * bus.encode(value) and bus.decode(string), for when it's not going over
+ * the socket
+ *------------------------------------------------------------------------------
+ */
+static int bus_encode(lua_State *L) {
+	luaL_checkany(L, 1);
+	encode(L, 1);
+	lua_pushlstring(L, (const char *)out.p, out.len);
+	return 1;
+}
+
+static int bus_decode(lua_State *L) {
+	size_t		len;
+	const char	*s = luaL_checklstring(L, 1, &len);
+
+	if (!decode(L, (const unsigned char *)s, len)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "bad event");
+		return 2;
+	}
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * The socket we receive on: bus.listen(path), anything already there is
+ * removed first. It's non-blocking, and has room for a good burst.
+ *------------------------------------------------------------------------------
+ */
+static int addr(lua_State *L, int index, struct sockaddr_un *sa) {
+	size_t		len;
+	const char	*path = luaL_checklstring(L, index, &len);
+
+	if (len >= sizeof(sa->sun_path)) return luaL_argerror(L, index, "path too long");
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	memcpy(sa->sun_path, path, len);
+	return 0;
+}
+
+static int bus_listen(lua_State *L) {
+	struct sockaddr_un	sa;
+	int					fd, size = BUS_RCVBUF;
+
+	addr(L, 1, &sa);
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return push_error(L, errno);
+
+	unlink(sa.sun_path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		int err = errno;
+
+		close(fd);
+		return push_error(L, err);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	lua_pushinteger(L, fd);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * A sender's socket, connected so each send just goes: bus.connect(path)
+ *------------------------------------------------------------------------------
+ */
+static int bus_connect(lua_State *L) {
+	struct sockaddr_un	sa;
+	int					fd;
+
+	addr(L, 1, &sa);
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return push_error(L, errno);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		int err = errno;
+
+		close(fd);
+		return push_error(L, err);
+	}
+	lua_pushinteger(L, fd);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Encode and send an event: bus.send(fd, value), this blocks if the
+ * receiver is behind (which is what a helper script wants)
+ *------------------------------------------------------------------------------
+ */
+static int bus_send(lua_State *L) {
+	int		fd = (int)luaL_checkinteger(L, 1);
+
+	luaL_checkany(L, 2);
+	encode(L, 2);
+	if (out.len > BUS_MAX) return push_error(L, EMSGSIZE);
+	while (send(fd, out.p, out.len, MSG_NOSIGNAL) < 0) {
+		if (errno != EINTR) return push_error(L, errno);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Take what's waiting, a batch at a time until there's no more or we've had
+ * max: events, bad = bus.recv(fd, max). Events that don't decode (or didn't
+ * fit) are counted and dropped.
+ *------------------------------------------------------------------------------
+ */
+static unsigned char	*rxbuf = NULL;
+
+static int bus_recv(lua_State *L) {
+	int				fd = (int)luaL_checkinteger(L, 1);
+	int				max = (int)luaL_optinteger(L, 2, 1024);
+	struct mmsghdr	msgs[BUS_BATCH];
+	struct iovec	iov[BUS_BATCH];
+	int				i, n, count = 0, bad = 0;
+
+	if (!rxbuf && !(rxbuf = malloc(BUS_BATCH * BUS_MAX))) return luaL_error(L, "out of memory");
+
+	lua_newtable(L);
+	while (count < max) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < BUS_BATCH; i++) {
+			iov[i].iov_base = rxbuf + i * BUS_MAX;
+			iov[i].iov_len = BUS_MAX;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(fd, msgs, BUS_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return push_error(L, errno);
+		}
+		for (i = 0; i < n; i++) {
+			if (!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+					&& decode(L, iov[i].iov_base, msgs[i].msg_len)) {
+				lua_rawseti(L, -2, ++count);
+			} else {
+				bad++;
+			}
+		}
+		if (n < BUS_BATCH) break;
+	}
+	lua_pushinteger(L, bad);
+	return 2;
+}
+
+/*==============================================================================
+ * These are the functions we export to Lua...
+ *==============================================================================
+ */
+static const struct luaL_Reg lib[] = {
+	{"encode", bus_encode},
+	{"decode", bus_decode},
+	{"listen", bus_listen},
+	{"connect", bus_connect},
+	{"send", bus_send},
+	{"recv", bus_recv},
+	{NULL, NULL}
+};
+
+/*------------------------------------------------------------------------------
+ * Main Library Entry Point ... just intialise all the functions
+ *------------------------------------------------------------------------------
+ */
+int luaopen_bus(lua_State *L) {
+	luaL_newlib(L, lib);
+	return 1;
+}
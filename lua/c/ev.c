@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+/*==============================================================================
+ * The core of the event loop: an epoll set that the file handles stay
+ * registered in, so a wait costs the same however many handles we have and
+ * only tells us about the ones that are ready.
+ *
+ * It's level triggered, so it behaves like poll() did: a handle we don't
+ * read everything from will show up again next time round. The Lua side
+ * keeps the callbacks, we just deal in file handles and event masks.
+ *
+ * Errors come back as nil, message, errno (the same as luaposix).
+ *==============================================================================
+ */
+#define LOOP_META		"ev.loop"
+#define MAX_EVENTS		256				// most ready handles from one wait
+
+struct loop {
+	int					fd;				// the epoll handle, -1 once closed
+	struct epoll_event	ev[MAX_EVENTS];
+};
+
+static int push_error(lua_State *L, int err) {
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(err));
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+static struct loop *check_loop(lua_State *L) {
+	struct loop *l = (struct loop *)luaL_checkudata(L, 1, LOOP_META);
+
+	if (l->fd < 0) luaL_error(L, "event loop is closed");
+	return l;
+}
+
+/*------------------------------------------------------------------------------
+ * A new (empty) loop, it's not inherited by anything we exec
+ *------------------------------------------------------------------------------
+ */
+static int ev_new(lua_State *L) {
+	struct loop *l = (struct loop *)lua_newuserdata(L, sizeof(struct loop));
+
+	l->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->fd < 0) return push_error(L, errno);
+	luaL_setmetatable(L, LOOP_META);
+	return 1;
+}
+
+static int loop_close(lua_State *L) {
+	struct loop *l = (struct loop *)luaL_checkudata(L, 1, LOOP_META);
+
+	if (l->fd >= 0) close(l->fd);
+	l->fd = -1;
+	return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Register a handle, or change the events we want from it: loop:add(fd, mask)
+ * and loop:mod(fd, mask). A handle that was closed without being removed can
+ * still be in the set if something else has it open (a child we forked) so
+ * add falls back to a change.
+ *------------------------------------------------------------------------------
+ */
+static int ctl(lua_State *L, int op) {
+	struct loop			*l = check_loop(L);
+	int					fd = (int)luaL_checkinteger(L, 2);
+	struct epoll_event	ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (uint32_t)luaL_checkinteger(L, 3);
+	ev.data.fd = fd;
+
+	if (epoll_ctl(l->fd, op, fd, &ev) < 0) {
+		if (op != EPOLL_CTL_ADD || errno != EEXIST) return push_error(L, errno);
+		if (epoll_ctl(l->fd, EPOLL_CTL_MOD, fd, &ev) < 0) return push_error(L, errno);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int loop_add(lua_State *L) {
+	return ctl(L, EPOLL_CTL_ADD);
+}
+
+static int loop_mod(lua_State *L) {
+	return ctl(L, EPOLL_CTL_MOD);
+}
+
+//
+// Closing a handle takes it out of the set anyway, so a handle that's
+// already gone isn't an error
+//
+static int loop_del(lua_State *L) {
+	struct loop	*l = check_loop(L);
+	int			fd = (int)luaL_checkinteger(L, 2);
+
+	if (epoll_ctl(l->fd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF && errno != ENOENT)
+		return push_error(L, errno);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Wait for up to timeout milliseconds (-1 for ever) and fill in the ready
+ * table with fd, events pairs: n = loop:wait(timeout, ready). The table is
+ * the caller's so it can be used again each time round, anything past the
+ * n pairs is left over from before. A signal just means nothing is ready.
+ *------------------------------------------------------------------------------
+ */
+static int loop_wait(lua_State *L) {
+	struct loop	*l = check_loop(L);
+	int			timeout = (int)luaL_optinteger(L, 2, -1);
+	int			n, i;
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	n = epoll_wait(l->fd, l->ev, MAX_EVENTS, timeout);
+	if (n < 0) {
+		if (errno != EINTR) return push_error(L, errno);
+		n = 0;
+	}
+	for (i = 0; i < n; i++) {
+		lua_pushinteger(L, l->ev[i].data.fd);
+		lua_rawseti(L, 3, 2 * i + 1);
+		lua_pushinteger(L, l->ev[i].events);
+		lua_rawseti(L, 3, 2 * i + 2);
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static const struct luaL_Reg loop_methods[] = {
+	{"add", loop_add},
+	{"mod", loop_mod},
+	{"del", loop_del},
+	{"wait", loop_wait},
+	{"close", loop_close},
+	{"__gc", loop_close},
+	{NULL, NULL}
+};
+
+/*==============================================================================
+ * These are the functions we export to Lua...
+ *==============================================================================
+ */
+static const struct luaL_Reg lib[] = {
+	{"new", ev_new},
+	{NULL, NULL}
+};
+
+/*------------------------------------------------------------------------------
+ * Main Library Entry Point ... just intialise the metatable and functions,
+ * along with the event bits (the same as poll's)
+ *------------------------------------------------------------------------------
+ */
+int luaopen_ev(lua_State *L) {
+	luaL_newmetatable(L, LOOP_META);
+	luaL_setfuncs(L, loop_methods, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newlib(L, lib);
+	lua_pushinteger(L, EPOLLIN);
+	lua_setfield(L, -2, "IN");
+	lua_pushinteger(L, EPOLLPRI);
+	lua_setfield(L, -2, "PRI");
+	lua_pushinteger(L, EPOLLOUT);
+	lua_setfield(L, -2, "OUT");
+	lua_pushinteger(L, EPOLLERR);
+	lua_setfield(L, -2, "ERR");
+	lua_pushinteger(L, EPOLLHUP);
+	lua_setfield(L, -2, "HUP");
+	return 1;
+}
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+/*==============================================================================
+ * Buffered I/O for length prefixed frames on a stream socket (the cli, and
+ * the API which uses the same encoding). Each frame is a length and then
+ * that many bytes, the length takes one to five bytes:
+ *
+ *		0xxxxxxx							up to 0x7f
+ *		10xxxxxx xxxxxxxx					up to 0x3fff
+ *		110xxxxx xxxxxxxx xxxxxxxx			up to 0x1fffff
+ *		1110xxxx xxxxxxxx x 3				up to 0xfffffff
+ *		11110000 xxxxxxxx x 4				anything else
+ *
+ * A reader takes everything that's waiting on the socket in as few reads as
+ * it can and hands back complete frames one at a time, so a client can send
+ * lots of requests without waiting for each reply. Output is a Lua table of
+ * strings which we write with as few writevs as it takes.
+ *
+ * Errors come back as nil, message, errno (the same as luaposix).
+ *==============================================================================
+ */
+#define READER_META		"frame.reader"
+#define READ_MIN		16384			// space we want for each read
+#define READ_MAX		(1024 * 1024)	// most to take in one go
+#define FRAME_MAX		(16 * 1024 * 1024)
+#define FLUSH_IOV		64				// chunks per writev
+
+//
+// What's been read and not handed back yet is p[start..end), we only move
+// it down to the bottom when we need room at the top
+//
+struct reader {
+	char	*p;
+	size_t	alloc;
+	size_t	start;
+	size_t	end;
+	int		bad;						// we've had a frame we can't take
+};
+
+static int push_error(lua_State *L, int err) {
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(err));
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+static int reader_new(lua_State *L) {
+	struct reader *r = (struct reader *)lua_newuserdata(L, sizeof(struct reader));
+
+	memset(r, 0, sizeof(*r));
+	luaL_setmetatable(L, READER_META);
+	return 1;
+}
+
+static int reader_gc(lua_State *L) {
+	struct reader *r = (struct reader *)luaL_checkudata(L, 1, READER_META);
+
+	free(r->p);
+	r->p = NULL;
+	r->alloc = r->start = r->end = 0;
+	return 0;
+}
+
+//
+// Make sure there's room for need more bytes at the top
+//
+static int make_space(struct reader *r, size_t need) {
+	size_t	alloc;
+	char	*p;
+
+	if (r->alloc - r->end >= need) return 0;
+	if (r->start) {
+		memmove(r->p, r->p + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+		if (r->alloc - r->end >= need) return 0;
+	}
+	alloc = r->alloc ? r->alloc : READ_MIN;
+	while (alloc - r->end < need) alloc *= 2;
+	if (!(p = realloc(r->p, alloc))) return -1;
+	r->p = p;
+	r->alloc = alloc;
+	return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Read everything that's waiting (up to a limit, the rest can wait for the
+ * next time round): r:fill(fd) gives the number of bytes read, 0 at the
+ * end of the stream, or nil, err, errno (EAGAIN if there was nothing)
+ *------------------------------------------------------------------------------
+ */
+static int reader_fill(lua_State *L) {
+	struct reader	*r = (struct reader *)luaL_checkudata(L, 1, READER_META);
+	int				fd = (int)luaL_checkinteger(L, 2);
+	size_t			total = 0, room;
+	ssize_t			n;
+
+	while (total < READ_MAX) {
+		if (make_space(r, READ_MIN) < 0) return luaL_error(L, "out of memory");
+
+		room = r->alloc - r->end;
+		n = read(fd, r->p + r->end, room);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (total && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			return push_error(L, errno);
+		}
+		if (n == 0) break;
+		r->end += n;
+		total += n;
+		if ((size_t)n < room) break;			// that was all of it
+	}
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * The next complete frame, or nil if we haven't got all of one yet (or
+ * nil, message if the length is nonsense)
+ *------------------------------------------------------------------------------
+ */
+static int reader_next(lua_State *L) {
+	struct reader		*r = (struct reader *)luaL_checkudata(L, 1, READER_META);
+	const unsigned char	*p = (const unsigned char *)r->p + r->start;
+	size_t				have = r->end - r->start;
+	size_t				more, len, i;
+
+	if (r->bad || !have) goto none;
+
+	if (!(p[0] & 0x80)) more = 0, len = p[0] & 0x7f;
+	else if ((p[0] & 0xc0) == 0x80) more = 1, len = p[0] & 0x3f;
+	else if ((p[0] & 0xe0) == 0xc0) more = 2, len = p[0] & 0x1f;
+	else if ((p[0] & 0xf0) == 0xe0) more = 3, len = p[0] & 0x0f;
+	else if (p[0] == 0xf0) more = 4, len = 0;
+	else goto bad;
+
+	if (have < 1 + more) goto none;
+	for (i = 1; i <= more; i++) {
+		len = (len << 8) | p[i];
+		if (len > FRAME_MAX) goto bad;
+	}
+	if (have < 1 + more + len) goto none;
+
+	lua_pushlstring(L, (const char *)p + 1 + more, len);
+	r->start += 1 + more + len;
+	if (r->start == r->end) r->start = r->end = 0;
+	return 1;
+
+bad:
+	r->bad = 1;
+	lua_pushnil(L);
+	lua_pushstring(L, "bad frame length");
+	return 2;
+none:
+	lua_pushnil(L);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * The length prefix for a frame of len bytes: frame.size(len)
+ *------------------------------------------------------------------------------
+ */
+static int frame_size(lua_State *L) {
+	lua_Integer		len = luaL_checkinteger(L, 1);
+	unsigned char	b[5];
+	int				n, i;
+
+	luaL_argcheck(L, len >= 0 && len <= 0xffffffff, 1, "bad length");
+	if (len < 0x80) n = 1, b[0] = len;
+	else if (len < 0x4000) n = 2, b[0] = 0x80 | (len >> 8);
+	else if (len < 0x200000) n = 3, b[0] = 0xc0 | (len >> 16);
+	else if (len < 0x10000000) n = 4, b[0] = 0xe0 | (len >> 24);
+	else n = 5, b[0] = 0xf0;
+	for (i = 1; i < n; i++) b[i] = (len >> (8 * (n - 1 - i))) & 0xff;
+
+	lua_pushlstring(L, (const char *)b, n);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Write as much of the chunks table as the socket will take:
+ * frame.flush(fd, chunks). What's written is taken off the front of the
+ * table (a chunk we only wrote part of is left with the rest). Gives true
+ * if everything went, false if the socket is full, or nil, err, errno.
+ *
+ * A socket gets MSG_NOSIGNAL so a client that's gone is an EPIPE rather
+ * than a signal, anything else (a pipe) just gets writev.
+ *------------------------------------------------------------------------------
+ */
+static int frame_flush(lua_State *L) {
+	int				fd = (int)luaL_checkinteger(L, 1);
+	struct iovec	iov[FLUSH_IOV];
+	struct msghdr	msg;
+	int				count, n, i, j, done;
+	ssize_t			sent;
+	size_t			len;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	count = (int)lua_rawlen(L, 2);
+
+	done = 0;
+	while (done < count) {
+		n = count - done < FLUSH_IOV ? count - done : FLUSH_IOV;
+		for (i = 0; i < n; i++) {
+			lua_rawgeti(L, 2, done + i + 1);
+			iov[i].iov_base = (void *)luaL_checklstring(L, -1, &len);
+			iov[i].iov_len = len;
+			lua_pop(L, 1);				// the table keeps it alive
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0 && errno == ENOTSOCK) sent = writev(fd, iov, n);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return push_error(L, errno);
+		}
+
+		for (i = 0; i < n && (size_t)sent >= iov[i].iov_len; i++) sent -= iov[i].iov_len;
+		done += i;
+		if (i < n) {
+			// part of one went, keep the rest of it
+			lua_pushlstring(L, (const char *)iov[i].iov_base + sent, iov[i].iov_len - sent);
+			lua_rawseti(L, 2, done + 1);
+			break;
+		}
+	}
+
+	// move what's left down to the front
+	for (j = 1; done && j <= count - done; j++) {
+		lua_rawgeti(L, 2, done + j);
+		lua_rawseti(L, 2, j);
+	}
+	for (j = count - done + 1; done && j <= count; j++) {
+		lua_pushnil(L);
+		lua_rawseti(L, 2, j);
+	}
+	lua_pushboolean(L, done == count);
+	return 1;
+}
+
+static const struct luaL_Reg reader_methods[] = {
+	{"fill", reader_fill},
+	{"next", reader_next},
+	{"__gc", reader_gc},
+	{NULL, NULL}
+};
+
+/*==============================================================================
+ * These are the functions we export to Lua...
+ *==============================================================================
+ */
+static const struct luaL_Reg lib[] = {
+	{"reader", reader_new},
+	{"size", frame_size},
+	{"flush", frame_flush},
+	{NULL, NULL}
+};
+
+/*------------------------------------------------------------------------------
+ * Main Library Entry Point ... just intialise the metatable and functions
+ *------------------------------------------------------------------------------
+ */
+int luaopen_frame(lua_State *L) {
+	luaL_newmetatable(L, READER_META);
+	luaL_setfuncs(L, reader_methods, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newlib(L, lib);
+	return 1;
+}
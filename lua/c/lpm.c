@@ -0,0 +1,709 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+/*==============================================================================
+ * Longest prefix match tables for v4 and v6 prefixes, each prefix maps to a
+ * Lua value (a route, usually).
+ *
+ * It's a path compressed binary trie: a node only exists where there is a
+ * prefix or where two branches split, and it holds the bits leading to it so
+ * a lookup only looks at the nodes on the way down and never backtracks.
+ * Changes only touch the nodes along one path so it can be kept up to date
+ * one prefix at a time, which the fancier fixed stride tables can't do
+ * cheaply (and they don't do v6 well).
+ *
+ * The values live in the table's uservalue (a Lua table) and nodes just
+ * hold a reference into it.
+ *
+ * A full v4 table has the common /24s twenty or so nodes down, and each of
+ * those is a cache miss, so v4 lookups go through a 16-8-8 stride table
+ * instead: each entry is either the reference of the best prefix for that
+ * range or another block of 256 entries for the next 8 bits. That's at most
+ * three reads. The trie is still what we keep, the stride table follows it
+ * (a change rewrites just the entries under that prefix).
+ *==============================================================================
+ */
+#define LPM_META		"lpm.table"
+
+struct node {
+	struct node		*child[2];
+	int				ref;				// LUA_NOREF if there isn't a prefix here
+	unsigned char	plen;
+	unsigned char	key[16];			// masked to plen
+};
+
+struct lpm {
+	struct node		*root[2];			// v4 and v6
+	int				count;
+
+	uint32_t		*top;				// v4 stride table, the first 16 bits
+	uint32_t		**blocks;			// blocks of 256 for the next 8 bits
+	int				nblocks;
+	int				maxblocks;
+	int				spare;				// first free block (linked through entry 0)
+	unsigned char	*plens;				// prefix length for each reference
+	int				nplens;
+};
+
+//
+// Stride table entries: 0 for nothing, a reference shifted up one or a
+// block number shifted up one with the bottom bit set
+//
+#define IS_BLOCK(e)		((e) & 1)
+#define BLOCK(t, e)		((t)->blocks[(e) >> 1])
+#define REF(e)			((int)((e) >> 1))
+
+static const int maxlen[2] = { 32, 128 };
+
+static inline int bit(const unsigned char *key, int i) {
+	return (key[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/*------------------------------------------------------------------------------
+ * How many leading bits (up to max) are the same in a and b
+ *------------------------------------------------------------------------------
+ */
+static int common(const unsigned char *a, const unsigned char *b, int max) {
+	int i = 0;
+
+	while (i + 8 <= max && a[i >> 3] == b[i >> 3]) i += 8;
+	while (i < max && bit(a, i) == bit(b, i)) i++;
+	return i;
+}
+
+/*------------------------------------------------------------------------------
+ * Does the first plen bits of addr match key
+ *------------------------------------------------------------------------------
+ */
+static inline int matches(const unsigned char *key, const unsigned char *addr, int plen) {
+	int bytes = plen >> 3;
+	int bits = plen & 7;
+
+	if (memcmp(key, addr, bytes)) return 0;
+	if (!bits) return 1;
+	return ((key[bytes] ^ addr[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+static void mask(unsigned char *key, int plen) {
+	int i = plen >> 3;
+
+	if (plen & 7) key[i++] &= 0xff << (8 - (plen & 7));
+	if (i < 16) memset(key + i, 0, 16 - i);
+}
+
+static struct node *node_new(const unsigned char *key, int plen, int ref) {
+	struct node *n = (struct node *)calloc(1, sizeof(struct node));
+
+	if (!n) return NULL;
+	memcpy(n->key, key, 16);
+	mask(n->key, plen);
+	n->plen = plen;
+	n->ref = ref;
+	return n;
+}
+
+static void node_free(struct node *n) {
+	if (!n) return;
+	node_free(n->child[0]);
+	node_free(n->child[1]);
+	free(n);
+}
+
+/*------------------------------------------------------------------------------
+ * The v4 stride table, an op either covers (a new prefix takes every entry
+ * where it's at least as specific as what's there) or swaps one reference
+ * for another (a prefix going away hands its entries to its parent)
+ *------------------------------------------------------------------------------
+ */
+static const int stride_off[3] = { 0, 16, 24 };
+static const int stride_bits[3] = { 16, 8, 8 };
+
+struct op {
+	uint32_t	old;					// swap this for new, or 0 to cover
+	uint32_t	new;
+	int			plen;
+};
+
+static int block_new(struct lpm *t, uint32_t fill) {
+	uint32_t	*b;
+	int			i, n;
+
+	if (t->spare) {
+		n = t->spare;
+		b = t->blocks[n];
+		t->spare = (int)b[0];
+	} else {
+		if (!t->nblocks) t->nblocks = 1;			// 0 isn't a block number
+		if (t->nblocks >= t->maxblocks) {
+			int			max = t->maxblocks ? t->maxblocks * 2 : 64;
+			uint32_t	**bl = realloc(t->blocks, sizeof(uint32_t *) * max);
+
+			if (!bl) return 0;
+			t->blocks = bl;
+			t->maxblocks = max;
+		}
+		if (!(b = malloc(sizeof(uint32_t) * 256))) return 0;
+		n = t->nblocks++;
+		t->blocks[n] = b;
+	}
+	for (i = 0; i < 256; i++) b[i] = fill;
+	return n;
+}
+
+static void block_free(struct lpm *t, int n) {
+	t->blocks[n][0] = (uint32_t)t->spare;
+	t->spare = n;
+}
+
+static inline int op_match(struct lpm *t, struct op *op, uint32_t e) {
+	if (op->old) return e == op->old;
+	return !e || t->plens[REF(e)] <= op->plen;
+}
+
+//
+// A block that's all the same reference isn't needed
+//
+static void collapse(struct lpm *t, uint32_t *slot) {
+	uint32_t	*b = BLOCK(t, *slot);
+	int			i;
+
+	uint32_t	e = b[0];
+
+	if (IS_BLOCK(e)) return;
+	for (i = 1; i < 256; i++) if (b[i] != e) return;
+	block_free(t, *slot >> 1);
+	*slot = e;
+}
+
+static void update(struct lpm *t, uint32_t *b, int lo, int hi, struct op *op) {
+	int i;
+
+	for (i = lo; i < hi; i++) {
+		if (IS_BLOCK(b[i])) {
+			update(t, BLOCK(t, b[i]), 0, 256, op);
+			collapse(t, &b[i]);
+		} else if (op_match(t, op, b[i])) {
+			b[i] = op->new;
+		}
+	}
+}
+
+static int stride_apply(struct lpm *t, uint32_t *b, int level, uint32_t addr, struct op *op) {
+	int			end = stride_off[level] + stride_bits[level];
+	int			idx = (addr >> (32 - end)) & ((1 << stride_bits[level]) - 1);
+	uint32_t	*slot = &b[idx];
+
+	if (op->plen <= end) {
+		int lo = idx & ~((1 << (end - op->plen)) - 1);
+
+		update(t, b, lo, lo + (1 << (end - op->plen)), op);
+		return 0;
+	}
+	if (!IS_BLOCK(*slot)) {
+		int n;
+
+		if (op->old) return 0;			// it was never down here
+		if (!(n = block_new(t, *slot))) return -1;
+		*slot = ((uint32_t)n << 1) | 1;
+	}
+	if (stride_apply(t, BLOCK(t, *slot), level + 1, addr, op) < 0) return -1;
+	collapse(t, slot);
+	return 0;
+}
+
+static int stride_change(struct lpm *t, const unsigned char *key, int plen, int old, int new) {
+	struct op	op = { old > 0 ? (uint32_t)old << 1 : 0, new > 0 ? (uint32_t)new << 1 : 0, plen };
+	uint32_t	addr = ((uint32_t)key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+
+	if (!t->top && !(t->top = calloc(1 << 16, sizeof(uint32_t)))) return -1;
+	return stride_apply(t, t->top, 0, addr, &op);
+}
+
+//
+// A new reference needs its prefix length remembered before it goes in
+//
+static int stride_plen(struct lpm *t, int ref, int plen) {
+	if (ref >= t->nplens) {
+		int				n = t->nplens ? t->nplens : 1024;
+		unsigned char	*p;
+
+		while (n <= ref) n *= 2;
+		if (!(p = realloc(t->plens, n))) return -1;
+		t->plens = p;
+		t->nplens = n;
+	}
+	t->plens[ref] = plen;
+	return 0;
+}
+
+static inline int stride_lookup(struct lpm *t, const unsigned char *addr) {
+	uint32_t e;
+
+	if (!t->top) return 0;
+	e = t->top[(addr[0] << 8) | addr[1]];
+	if (IS_BLOCK(e)) e = BLOCK(t, e)[addr[2]];
+	if (IS_BLOCK(e)) e = BLOCK(t, e)[addr[3]];
+	return REF(e);
+}
+
+/*------------------------------------------------------------------------------
+ * Turn "a.b.c.d/len" or "x::y/len" into a key, family (0 or 1) and length,
+ * without a length (or if we don't want one) it's the whole address. Gives
+ * BAD_ADDRESS or BAD_LENGTH if it can't.
+ *------------------------------------------------------------------------------
+ */
+#define BAD_ADDRESS		-1
+#define BAD_LENGTH		-2
+
+static int parse_string(const char *s, unsigned char *key, int *plen, int want_len) {
+	const char	*slash = strchr(s, '/');
+	char		buf[INET6_ADDRSTRLEN];
+	size_t		len = slash ? (size_t)(slash - s) : strlen(s);
+	int			fam;
+
+	if (len >= sizeof(buf)) return BAD_ADDRESS;
+	memcpy(buf, s, len);
+	buf[len] = 0;
+
+	memset(key, 0, 16);
+	if (inet_pton(AF_INET, buf, key) == 1) fam = 0;
+	else if (inet_pton(AF_INET6, buf, key) == 1) fam = 1;
+	else return BAD_ADDRESS;
+
+	*plen = maxlen[fam];
+	if (slash && want_len) {
+		char	*end;
+		long	n = strtol(slash + 1, &end, 10);
+
+		if (*end || end == slash + 1 || n < 0 || n > maxlen[fam]) return BAD_LENGTH;
+		*plen = (int)n;
+	}
+	mask(key, *plen);
+	return fam;
+}
+
+static int parse(lua_State *L, int idx, unsigned char *key, int *plen, int want_len) {
+	int fam = parse_string(luaL_checkstring(L, idx), key, plen, want_len);
+
+	if (fam == BAD_ADDRESS) return luaL_argerror(L, idx, "bad address");
+	if (fam == BAD_LENGTH) return luaL_argerror(L, idx, "bad prefix length");
+	return fam;
+}
+
+/*------------------------------------------------------------------------------
+ * Values are kept in the uservalue table
+ *------------------------------------------------------------------------------
+ */
+static int ref_value(lua_State *L, int t, int v) {
+	lua_getuservalue(L, t);
+	lua_pushvalue(L, v);
+	v = luaL_ref(L, -2);
+	lua_pop(L, 1);
+	return v;
+}
+
+static void unref_value(lua_State *L, int t, int ref) {
+	lua_getuservalue(L, t);
+	luaL_unref(L, -1, ref);
+	lua_pop(L, 1);
+}
+
+static void push_value(lua_State *L, int t, int ref) {
+	lua_getuservalue(L, t);
+	lua_rawgeti(L, -1, ref);
+	lua_remove(L, -2);
+}
+
+static int lpm_new(lua_State *L) {
+	struct lpm *t = (struct lpm *)lua_newuserdata(L, sizeof(struct lpm));
+
+	memset(t, 0, sizeof(*t));
+	luaL_setmetatable(L, LPM_META);
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+static int lpm_gc(lua_State *L) {
+	struct lpm *t = (struct lpm *)luaL_checkudata(L, 1, LPM_META);
+
+	int i;
+
+	node_free(t->root[0]);
+	node_free(t->root[1]);
+	t->root[0] = t->root[1] = NULL;
+	t->count = 0;
+
+	for (i = 1; i < t->nblocks; i++) free(t->blocks[i]);
+	free(t->blocks);
+	free(t->top);
+	free(t->plens);
+	t->blocks = NULL;
+	t->top = NULL;
+	t->plens = NULL;
+	t->nblocks = t->maxblocks = t->nplens = t->spare = 0;
+	return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Add (or replace the value of) a prefix: t:insert(prefix, value)
+ *------------------------------------------------------------------------------
+ */
+static int lpm_insert(lua_State *L) {
+	struct lpm		*t = (struct lpm *)luaL_checkudata(L, 1, LPM_META);
+	unsigned char	key[16];
+	int				plen;
+	int				fam = parse(L, 2, key, &plen, 1);
+	struct node		**pp = &t->root[fam];
+	struct node		*n, *m;
+	int				ref, c;
+	int				old = 0;
+
+	luaL_checkany(L, 3);
+	if (lua_isnil(L, 3)) return luaL_argerror(L, 3, "value can't be nil");
+	ref = ref_value(L, 1, 3);
+
+	while (1) {
+		n = *pp;
+		if (!n) {
+			if (!(*pp = node_new(key, plen, ref))) goto nomem;
+			break;
+		}
+
+		c = common(n->key, key, n->plen < plen ? n->plen : plen);
+		if (c < n->plen) {
+			// we branch off (or sit) part way along the bits leading to n
+			if (!(m = node_new(key, c, LUA_NOREF))) goto nomem;
+			m->child[bit(n->key, c)] = n;
+			if (c == plen) {
+				m->ref = ref;
+			} else if (!(m->child[bit(key, c)] = node_new(key, plen, ref))) {
+				free(m);
+				goto nomem;
+			}
+			*pp = m;
+			break;
+		}
+		if (n->plen == plen) {
+			if (n->ref != LUA_NOREF) {
+				old = n->ref;
+				unref_value(L, 1, n->ref);
+				t->count--;
+			}
+			n->ref = ref;
+			break;
+		}
+		pp = &n->child[bit(key, n->plen)];
+	}
+	t->count++;
+	if (fam == 0 && (stride_plen(t, ref, plen) < 0 || stride_change(t, key, plen, old, ref) < 0))
+		return luaL_error(L, "out of memory");
+	return 0;
+
+nomem:
+	unref_value(L, 1, ref);
+	return luaL_error(L, "out of memory");
+}
+
+/*------------------------------------------------------------------------------
+ * Take a prefix out: t:remove(prefix), returns the value it had. Nodes that
+ * are left with no prefix and fewer than two children aren't needed.
+ *------------------------------------------------------------------------------
+ */
+static int lpm_remove(lua_State *L) {
+	struct lpm		*t = (struct lpm *)luaL_checkudata(L, 1, LPM_META);
+	unsigned char	key[16];
+	int				plen;
+	int				fam = parse(L, 2, key, &plen, 1);
+	struct node		**path[130];
+	struct node		*n;
+	int				depth = 0;
+	int				parent = 0;
+
+	path[0] = &t->root[fam];
+	while ((n = *path[depth]) && n->plen < plen && matches(n->key, key, n->plen)) {
+		if (n->ref != LUA_NOREF) parent = n->ref;
+		path[++depth] = &n->child[bit(key, n->plen)];
+	}
+
+	if (!n || n->plen != plen || n->ref == LUA_NOREF || !matches(n->key, key, plen)) return 0;
+
+	// the stride entries go to the next shortest prefix covering us
+	if (fam == 0 && stride_change(t, key, plen, n->ref, parent) < 0) return luaL_error(L, "out of memory");
+
+	push_value(L, 1, n->ref);
+	unref_value(L, 1, n->ref);
+	n->ref = LUA_NOREF;
+	t->count--;
+
+	while (depth >= 0) {
+		n = *path[depth];
+		if (n->ref != LUA_NOREF || (n->child[0] && n->child[1])) break;
+		*path[depth] = n->child[0] ? n->child[0] : n->child[1];
+		free(n);
+		depth--;
+	}
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * The reference (0 for none) and prefix length of the longest prefix that
+ * covers an address
+ *------------------------------------------------------------------------------
+ */
+static int find_ref(struct lpm *t, int fam, const unsigned char *addr, int *plen) {
+	struct node		*n = t->root[fam];
+	struct node		*best = NULL;
+
+	if (fam == 0) {
+		int ref = stride_lookup(t, addr);
+
+		if (ref) *plen = t->plens[ref];
+		return ref;
+	}
+
+	while (n && matches(n->key, addr, n->plen)) {
+		if (n->ref != LUA_NOREF) best = n;
+		if (n->plen == maxlen[fam]) break;
+		n = n->child[bit(addr, n->plen)];
+	}
+	if (!best) return 0;
+	*plen = best->plen;
+	return best->ref;
+}
+
+/*------------------------------------------------------------------------------
+ * The longest prefix covering an address: t:lookup(addr) gives the value
+ * and the length of the prefix, or nothing
+ *------------------------------------------------------------------------------
+ */
+static int lpm_lookup(lua_State *L) {
+	struct lpm		*t = (struct lpm *)luaL_checkudata(L, 1, LPM_META);
+	unsigned char	addr[16];
+	int				plen;
+	int				fam = parse(L, 2, addr, &plen, 0);
+	int				ref = find_ref(t, fam, addr, &plen);
+
+	if (!ref) return 0;
+	push_value(L, 1, ref);
+	lua_pushinteger(L, plen);
+	return 2;
+}
+
+/*------------------------------------------------------------------------------
+ * Lots of lookups in one go, for when the call is most of the cost:
+ * t:lookup_many(addrs [, out]) sets out[i] to the value for addrs[i] (false
+ * if nothing covers it) and gives out and how many matched. A bad address
+ * is an error naming its index.
+ *
+ * Random addresses miss the cache at each level of the stride table, so v4
+ * addresses go through it a group at a time: each level is read for the
+ * whole group, prefetching the entries for the next one, and the misses
+ * overlap rather than coming one after another. v6 addresses walk the trie
+ * the same way, a node each in turn.
+ *------------------------------------------------------------------------------
+ */
+#define GROUP		16
+
+static void stride_group(struct lpm *t, unsigned char addr[][16], int *fam, uint32_t *e, int m) {
+	int j, level;
+
+	for (j = 0; j < m; j++) {
+		e[j] = 0;
+		if (fam[j] == 0) __builtin_prefetch(&t->top[(addr[j][0] << 8) | addr[j][1]]);
+	}
+	for (j = 0; j < m; j++) {
+		if (fam[j] != 0) continue;
+		e[j] = t->top[(addr[j][0] << 8) | addr[j][1]];
+		if (IS_BLOCK(e[j])) __builtin_prefetch(&BLOCK(t, e[j])[addr[j][2]]);
+	}
+	for (level = 2; level <= 3; level++) {
+		for (j = 0; j < m; j++) {
+			if (fam[j] != 0 || !IS_BLOCK(e[j])) continue;
+			e[j] = BLOCK(t, e[j])[addr[j][level]];
+			if (level == 2 && IS_BLOCK(e[j])) __builtin_prefetch(&BLOCK(t, e[j])[addr[j][3]]);
+		}
+	}
+}
+
+static void trie_group(struct lpm *t, unsigned char addr[][16], int *fam, int *refs, int m) {
+	struct node		*n[GROUP];
+	int				j, active = 0;
+
+	for (j = 0; j < m; j++) {
+		n[j] = NULL;
+		if (fam[j] != 1) continue;
+		refs[j] = 0;
+		n[j] = t->root[1];
+		if (n[j]) active++;
+	}
+	while (active) {
+		for (j = 0; j < m; j++) {
+			struct node *x = n[j];
+
+			if (!x) continue;
+			if (!matches(x->key, addr[j], x->plen)) {
+				x = NULL;
+			} else {
+				if (x->ref != LUA_NOREF) refs[j] = x->ref;
+				x = (x->plen == maxlen[1]) ? NULL : x->child[bit(addr[j], x->plen)];
+			}
+			if (x) __builtin_prefetch(x);
+			else active--;
+			n[j] = x;
+		}
+	}
+}
+
+static int lpm_lookup_many(lua_State *L) {
+	struct lpm		*t = (struct lpm *)luaL_checkudata(L, 1, LPM_META);
+	lua_Integer		n, i, found = 0;
+	unsigned char	addr[GROUP][16];
+	int				fam[GROUP];
+	uint32_t		e[GROUP];
+	int				refs[GROUP];
+	int				plen, ref, j, m;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = luaL_len(L, 2);
+	if (lua_isnoneornil(L, 3)) {
+		lua_settop(L, 2);
+		lua_createtable(L, (int)n, 0);
+	} else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_settop(L, 3);
+	}
+	lua_getuservalue(L, 1);						// 4: the values
+
+	for (i = 1; i <= n; i += m) {
+		m = (n - i + 1 < GROUP) ? (int)(n - i + 1) : GROUP;
+
+		for (j = 0; j < m; j++) {
+			const char *s;
+
+			lua_rawgeti(L, 2, i + j);
+			s = lua_tostring(L, -1);
+			fam[j] = s ? parse_string(s, addr[j], &plen, 0) : BAD_ADDRESS;
+			lua_pop(L, 1);
+			if (fam[j] < 0) return luaL_error(L, "bad address at %d", (int)(i + j));
+		}
+		if (t->top) stride_group(t, addr, fam, e, m);
+		trie_group(t, addr, fam, refs, m);
+
+		for (j = 0; j < m; j++) {
+			if (fam[j] == 0) ref = t->top ? REF(e[j]) : 0;
+			else ref = refs[j];
+
+			if (ref) {
+				lua_rawgeti(L, 4, ref);
+				found++;
+			} else {
+				lua_pushboolean(L, 0);
+			}
+			lua_rawseti(L, 3, i + j);
+		}
+	}
+	lua_pop(L, 1);
+	lua_pushinteger(L, found);
+	return 2;
+}
+
+/*------------------------------------------------------------------------------
+ * Exactly this prefix: t:get(prefix)
+ *------------------------------------------------------------------------------
+ */
+static int lpm_get(lua_State *L) {
+	struct lpm		*t = (struct lpm *)luaL_checkudata(L, 1, LPM_META);
+	unsigned char	key[16];
+	int				plen;
+	int				fam = parse(L, 2, key, &plen, 1);
+	struct node		*n = t->root[fam];
+
+	while (n && n->plen < plen && matches(n->key, key, n->plen))
+		n = n->child[bit(key, n->plen)];
+
+	if (!n || n->plen != plen || n->ref == LUA_NOREF || !matches(n->key, key, plen)) return 0;
+	push_value(L, 1, n->ref);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Everything at or inside a prefix: t:within(prefix) gives a list of the
+ * values
+ *------------------------------------------------------------------------------
+ */
+static void collect(lua_State *L, struct node *n, int *i) {
+	if (!n) return;
+	if (n->ref != LUA_NOREF) {
+		lua_rawgeti(L, -2, n->ref);
+		lua_rawseti(L, -2, ++*i);
+	}
+	collect(L, n->child[0], i);
+	collect(L, n->child[1], i);
+}
+
+static int lpm_within(lua_State *L) {
+	struct lpm		*t = (struct lpm *)luaL_checkudata(L, 1, LPM_META);
+	unsigned char	key[16];
+	int				plen;
+	int				fam = parse(L, 2, key, &plen, 1);
+	struct node		*n = t->root[fam];
+	int				i = 0;
+
+	while (n && n->plen < plen && matches(n->key, key, n->plen))
+		n = n->child[bit(key, n->plen)];
+
+	lua_getuservalue(L, 1);
+	lua_newtable(L);
+	if (n && n->plen >= plen && matches(n->key, key, plen)) collect(L, n, &i);
+	return 1;
+}
+
+static int lpm_count(lua_State *L) {
+	struct lpm *t = (struct lpm *)luaL_checkudata(L, 1, LPM_META);
+
+	lua_pushinteger(L, t->count);
+	return 1;
+}
+
+static const struct luaL_Reg lpm_methods[] = {
+	{"insert", lpm_insert},
+	{"remove", lpm_remove},
+	{"lookup", lpm_lookup},
+	{"lookup_many", lpm_lookup_many},
+	{"get", lpm_get},
+	{"within", lpm_within},
+	{"count", lpm_count},
+	{"__gc", lpm_gc},
+	{NULL, NULL}
+};
+
+/*==============================================================================
+ * These are the functions we export to Lua...
+ *==============================================================================
+ */
+static const struct luaL_Reg lib[] = {
+	{"new", lpm_new},
+	{NULL, NULL}
+};
+
+/*------------------------------------------------------------------------------
+ * Main Library Entry Point ... just intialise the metatable and functions
+ *------------------------------------------------------------------------------
+ */
+int luaopen_lpm(lua_State *L) {
+	luaL_newmetatable(L, LPM_META);
+	luaL_setfuncs(L, lpm_methods, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newlib(L, lib);
+	return 1;
+}
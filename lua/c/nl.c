@@ -1,266 +1,1274 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <netlink/netlink.h>
-#include <netlink/cache.h>
-#include <netlink/route/link.h>
-#include <netlink/socket.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/nexthop.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
-
 /*==============================================================================
- * There are a few important globals that are setup by the libary initialisation
- * function to ensure ease of use for the rest of the functions
+ * A small rtnetlink binding, we talk to the kernel directly rather than
+ * running /sbin/ip for every change.
+ *
+ * A single request is sent with NLM_F_ACK and we wait for the matching ack,
+ * so every call returns true on success or nil, message, errno (the same as
+ * luaposix) if the kernel said no. Batches (further down) send lots of
+ * requests at once for when one round trip each is too slow.
  *==============================================================================
  */
 
-struct nl_sock			*nls;				// netlink socket
-struct nl_cache_mngr	*cache_mngr;		// manager for our stuff
+static int		nl_fd = -1;				// our rtnetlink socket
+static __u32	nl_seq = 0;				// sequence number of the last request
+static int		nl_chunk_msgs = 64;		// most requests in one batch sendmsg
 
-void callback_link(struct nl_cache *cache, struct nl_object *object, int i, void *data);
+#define NL_BUFSIZE		8192
+#define NL_SOCKBUF		(1024 * 1024)
 
-struct int_cache {
-	lua_State			*L;
-	struct nl_cache		*cache;
-	int					cb_id;
-	change_func_t		cb;
-	const char			*name;
-} cache_list[] = { 
-	{ NULL, NULL, 0, callback_link, "route/link" }, 
-	{ NULL, NULL, 0, NULL, "route/route" },
-	{ NULL, NULL, 0, NULL, "route/address" },
-	{ NULL, NULL, 0, NULL },
+struct request {
+	struct nlmsghdr		n;
+	union {
+		struct ifaddrmsg	a;
+		struct ifinfomsg	i;
+		struct rtmsg		r;
+		struct nhmsg		nh;
+	};
+	char				buf[1024];
 };
-	
+
 /*------------------------------------------------------------------------------
- * Helper function for keeping track of our function callbacks
+ * Open the socket the first time we need it
  *------------------------------------------------------------------------------
  */
-static inline int store_function(lua_State *L) {
-    if(!lua_isfunction(L, -1)) return 0;
-    return(luaL_ref(L, LUA_REGISTRYINDEX));
+static int nl_open() {
+	struct sockaddr_nl	sa;
+	socklen_t			len;
+	int					size;
+	int					one = 1;
+
+	if (nl_fd >= 0) return 0;
+
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl_fd < 0) return -errno;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind(nl_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		int err = errno;
+		close(nl_fd);
+		nl_fd = -1;
+		return -err;
+	}
+
+	//
+	// Bigger buffers help the batches, we can only force them as root. Every
+	// failure in a batch queues an error (capped to just the header of the
+	// request) so we size batches to what we can receive without loss.
+	//
+	size = NL_SOCKBUF;
+	if (setsockopt(nl_fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(nl_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	if (setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(nl_fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+
+	len = sizeof(size);
+	if (getsockopt(nl_fd, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0 && size / 1024 > nl_chunk_msgs)
+		nl_chunk_msgs = size / 1024;
+	return 0;
 }
-static inline void get_function(lua_State *L, int id) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, id);
+
+/*------------------------------------------------------------------------------
+ * Push the standard failure return (nil, message, errno) and return the
+ * number of values
+ *------------------------------------------------------------------------------
+ */
+static int push_error(lua_State *L, int err) {
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(err));
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+/*------------------------------------------------------------------------------
+ * Add an attribute to the end of a message
+ *------------------------------------------------------------------------------
+ */
+static void addattr(lua_State *L, struct nlmsghdr *n, int type, const void *data, int alen) {
+	int				len = RTA_LENGTH(alen);
+	struct rtattr	*rta;
+
+	if (NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(len) > sizeof(struct request))
+		luaL_error(L, "netlink request too big");
+
+	rta = (struct rtattr *)(((char *)n) + NLMSG_ALIGN(n->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = len;
+	if (alen) memcpy(RTA_DATA(rta), data, alen);
+	n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(len);
 }
-static inline void free_function(lua_State *L, int id) {
-    luaL_unref(L, LUA_REGISTRYINDEX, id);
+
+static void addattr32(lua_State *L, struct nlmsghdr *n, int type, __u32 value) {
+	addattr(L, n, type, &value, sizeof(value));
 }
 
 /*------------------------------------------------------------------------------
- * Setup the basic netlink structures and cache manager
+ * Send a request and wait for the ack that goes with it, returns 0 or a
+ * negative errno
  *------------------------------------------------------------------------------
  */
-int netlink_init() {
-	int			rc;
+static int nl_talk(struct nlmsghdr *n) {
+	char				buf[NL_BUFSIZE];
+	struct sockaddr_nl	sa;
+	int					rc;
+
+	rc = nl_open();
+	if (rc < 0) return rc;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+
+	n->nlmsg_seq = ++nl_seq;
+	n->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
 
-	// Create the main netlink socket
-	nls = nl_socket_alloc();
-	if (!nls) {
-		fprintf(stderr, "unable to create netlink socket\n");
-		return -1;
+	do {
+		rc = sendto(nl_fd, n, n->nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa));
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) return -errno;
+
+	while (1) {
+		struct nlmsghdr	*h;
+		int				len;
+
+		len = recv(nl_fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_seq != n->nlmsg_seq) continue;		// something stale
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = (struct nlmsgerr *)NLMSG_DATA(h);
+				return e->error;
+			}
+		}
 	}
-	
-	// Create the cache manager
-	rc = nl_cache_mngr_alloc(nls, AF_UNSPEC, 0, &cache_mngr);
-	if (rc < 0) {
-		fprintf(stderr, "unable to create cache manager: rc=%d\n", rc);
-		return -1;
+}
+
+/*------------------------------------------------------------------------------
+ * Work out an interface index, we take either the index itself or a name
+ *------------------------------------------------------------------------------
+ */
+static int get_ifindex(lua_State *L, int arg) {
+	if (lua_type(L, arg) == LUA_TNUMBER) return (int)lua_tointeger(L, arg);
+	return (int)if_nametoindex(luaL_checkstring(L, arg));
+}
+
+/*------------------------------------------------------------------------------
+ * Parse an address with an optional prefix length ("10.0.0.1/24", "::1",
+ * "default"), returns 0 if it's not an address we understand
+ *------------------------------------------------------------------------------
+ */
+struct prefix {
+	int				family;
+	int				bytes;
+	int				len;
+	unsigned char	addr[16];
+};
+
+static int get_prefix(const char *str, struct prefix *p) {
+	char	tmp[64];
+	char	*slash;
+
+	memset(p, 0, sizeof(*p));
+	if (strcmp(str, "default") == 0) str = "0.0.0.0/0";
+	if (strlen(str) >= sizeof(tmp)) return 0;
+	strcpy(tmp, str);
+
+	slash = strchr(tmp, '/');
+	if (slash) *slash++ = 0;
+
+	if (strchr(tmp, ':')) {
+		p->family = AF_INET6;
+		p->bytes = 16;
+	} else {
+		p->family = AF_INET;
+		p->bytes = 4;
 	}
+	if (inet_pton(p->family, tmp, p->addr) != 1) return 0;
+
+	p->len = p->bytes * 8;
+	if (slash) {
+		char *end;
+		long len = strtol(slash, &end, 10);
+
+		if (*end || end == slash || len < 0 || len > p->len) return 0;
+		p->len = (int)len;
+	}
+	return 1;
+}
+
+static void check_prefix(lua_State *L, int arg, struct prefix *p) {
+	const char *str = luaL_checkstring(L, arg);
+
+	if (!get_prefix(str, p)) luaL_argerror(L, arg, "invalid address");
+}
+
+/*------------------------------------------------------------------------------
+ * Helpers for reading the options table
+ *------------------------------------------------------------------------------
+ */
+static const char *opt_string(lua_State *L, int arg, const char *name) {
+	const char *rc = NULL;
+
+	if (lua_type(L, arg) != LUA_TTABLE) return NULL;
+	lua_getfield(L, arg, name);
+	if (!lua_isnil(L, -1)) rc = luaL_checkstring(L, -1);
+	lua_pop(L, 1);
+	return rc;
+}
+
+static int opt_int(lua_State *L, int arg, const char *name, int def) {
+	int rc = def;
+
+	if (lua_type(L, arg) != LUA_TTABLE) return def;
+	lua_getfield(L, arg, name);
+	if (!lua_isnil(L, -1)) rc = (int)luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+	return rc;
+}
+
+/*------------------------------------------------------------------------------
+ * Request builders, these fill in a request from the Lua arguments (starting
+ * at arg) and return 0 or an errno for things we can tell up front (like a
+ * device that doesn't exist). They're shared by the single calls and the
+ * batches.
+ *------------------------------------------------------------------------------
+ */
+typedef int (*builder)(lua_State *L, int arg, struct request *req, int type, int flags);
+
+/*------------------------------------------------------------------------------
+ * Address add and delete: addr_add(dev, "10.0.0.1/24")
+ *------------------------------------------------------------------------------
+ */
+static int build_addr(lua_State *L, int arg, struct request *req, int type, int flags) {
+	struct prefix	p;
+	int				ifindex = get_ifindex(L, arg);
+
+	check_prefix(L, arg + 1, &p);
+	if (!ifindex) return ENODEV;
+
+	memset(req, 0, sizeof(*req));
+	req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	req->n.nlmsg_type = type;
+	req->n.nlmsg_flags = flags;
+	req->a.ifa_family = p.family;
+	req->a.ifa_prefixlen = p.len;
+	req->a.ifa_index = ifindex;
+	req->a.ifa_scope = RT_SCOPE_UNIVERSE;
+
+	addattr(L, &req->n, IFA_LOCAL, p.addr, p.bytes);
+	addattr(L, &req->n, IFA_ADDRESS, p.addr, p.bytes);
 	return 0;
 }
 
 /*------------------------------------------------------------------------------
- * Handle the callback for link ... build a suitable table and call the lua
- * callback
+ * Link settings: link_set(dev, { up = true, mtu = 1500, name = "wan" }),
+ * anything not given is left alone
  *------------------------------------------------------------------------------
  */
-void callback_link(struct nl_cache *cache, struct nl_object *object, int i, void *data) {
-	struct int_cache	*cp = (struct int_cache *)data;
-	lua_State			*L = cp->L;
-	struct rtnl_link *link = (struct rtnl_link *)object;
-	
-	printf("lua_State = %p\n", L);
+static int build_link(lua_State *L, int arg, struct request *req, int type, int flags) {
+	int				ifindex = get_ifindex(L, arg);
+	const char		*name;
+	int				mtu;
 
-	printf("Change called link cache=%p obj=%p i=%d data=%p\n", cache, object, i, data );
-	printf("Link object=%p\n", link);
+	luaL_checktype(L, arg + 1, LUA_TTABLE);
+	if (!ifindex) return ENODEV;
 
-	
+	memset(req, 0, sizeof(*req));
+	req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req->n.nlmsg_type = type;
+	req->n.nlmsg_flags = flags;
+	req->i.ifi_family = AF_UNSPEC;
+	req->i.ifi_index = ifindex;
 
-	// Execute the lua callback...
-	get_function(L, cp->cb_id);
-	if(!lua_isfunction(L, -1)) return; // TODO error?
+	lua_getfield(L, arg + 1, "up");
+	if (!lua_isnil(L, -1)) {
+		req->i.ifi_change |= IFF_UP;
+		if (lua_toboolean(L, -1)) req->i.ifi_flags |= IFF_UP;
+	}
+	lua_pop(L, 1);
 
+	mtu = opt_int(L, arg + 1, "mtu", -1);
+	if (mtu >= 0) addattr32(L, &req->n, IFLA_MTU, mtu);
 
-	lua_newtable(L);
-	lua_pushstring(L, "lee");
-	lua_setfield(L, -2, "fred");
-	lua_pushstring(L, "is joe");
-	lua_setfield(L, -2, "joe");
+	name = opt_string(L, arg + 1, "name");
+	if (name) {
+		if (strlen(name) >= IFNAMSIZ) return luaL_error(L, "interface name too long");
+		addattr(L, &req->n, IFLA_IFNAME, name, strlen(name) + 1);
+	}
+	return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Routes: route_add("10.0.0.0/8", { gateway = "1.2.3.4", dev = "eth0",
+ * table = 254, metric = 10, ["pref-src"] = "1.2.3.5", type = "unicast" })
+ * or with nhid = N to use a nexthop object instead of gateway and dev.
+ *
+ * For a delete only the things given are used to pick the route (so give
+ * protocol to only delete one of ours), replace adds or replaces the route
+ * with the same destination, table and metric.
+ *------------------------------------------------------------------------------
+ */
+static const char *route_types[] = { "unicast", "blackhole", "unreachable", "prohibit", NULL };
+static const int route_type_values[] = { RTN_UNICAST, RTN_BLACKHOLE, RTN_UNREACHABLE, RTN_PROHIBIT };
+
+static int build_route(lua_State *L, int arg, struct request *req, int type, int flags) {
+	struct prefix	dst, gw, src;
+	const char		*s;
+	int				opts = arg + 1;
+	int				table, metric, nhid;
+
+	check_prefix(L, arg, &dst);
+
+	memset(req, 0, sizeof(*req));
+	req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req->n.nlmsg_type = type;
+	req->n.nlmsg_flags = flags;
+	req->r.rtm_family = dst.family;
+	req->r.rtm_dst_len = dst.len;
+	req->r.rtm_protocol = opt_int(L, opts, "protocol", (type == RTM_NEWROUTE) ? RTPROT_STATIC : 0);
+	req->r.rtm_scope = (type == RTM_NEWROUTE) ? RT_SCOPE_LINK : RT_SCOPE_NOWHERE;
+	req->r.rtm_type = RTN_UNICAST;
+
+	if (dst.len) addattr(L, &req->n, RTA_DST, dst.addr, dst.bytes);
+
+	s = opt_string(L, opts, "gateway");
+	if (s) {
+		if (!get_prefix(s, &gw) || gw.family != dst.family) return luaL_error(L, "invalid gateway: %s", s);
+		addattr(L, &req->n, RTA_GATEWAY, gw.addr, gw.bytes);
+		if (type == RTM_NEWROUTE) req->r.rtm_scope = RT_SCOPE_UNIVERSE;
+	}
+
+	s = opt_string(L, opts, "pref-src");
+	if (s) {
+		if (!get_prefix(s, &src) || src.family != dst.family) return luaL_error(L, "invalid pref-src: %s", s);
+		addattr(L, &req->n, RTA_PREFSRC, src.addr, src.bytes);
+	}
+
+	if (lua_type(L, opts) == LUA_TTABLE) {
+		lua_getfield(L, opts, "dev");
+		if (!lua_isnil(L, -1)) {
+			int ifindex = get_ifindex(L, -1);
+			if (!ifindex) return ENODEV;
+			addattr32(L, &req->n, RTA_OIF, ifindex);
+		}
+		lua_pop(L, 1);
+	}
+
+	nhid = opt_int(L, opts, "nhid", 0);
+	if (nhid) {
+		addattr32(L, &req->n, RTA_NH_ID, nhid);
+		if (type == RTM_NEWROUTE) req->r.rtm_scope = RT_SCOPE_UNIVERSE;
+	}
+
+	metric = opt_int(L, opts, "metric", -1);
+	if (metric >= 0) addattr32(L, &req->n, RTA_PRIORITY, metric);
+
+	table = opt_int(L, opts, "table", RT_TABLE_MAIN);
+	if (table < 256) {
+		req->r.rtm_table = table;
+	} else {
+		req->r.rtm_table = RT_TABLE_UNSPEC;
+		addattr32(L, &req->n, RTA_TABLE, table);
+	}
+
+	s = opt_string(L, opts, "type");
+	if (s) {
+		int i;
+
+		for (i = 0; route_types[i]; i++) if (strcmp(s, route_types[i]) == 0) break;
+		if (!route_types[i]) return luaL_error(L, "invalid route type: %s", s);
+		req->r.rtm_type = route_type_values[i];
+		if (req->r.rtm_type != RTN_UNICAST && type == RTM_NEWROUTE) req->r.rtm_scope = RT_SCOPE_UNIVERSE;
+	}
+	return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Nexthop objects: nexthop_replace(id, { gateway = "1.2.3.4", dev = "eth0" })
+ * or { group = { id, id, ... } } or { blackhole = true }, routes then use
+ * them by id so changing where one goes is a single request. For a delete
+ * only the id is needed.
+ *------------------------------------------------------------------------------
+ */
+static int build_nexthop(lua_State *L, int arg, struct request *req, int type, int flags) {
+	int				id = (int)luaL_checkinteger(L, arg);
+	int				opts = arg + 1;
+	struct prefix	gw;
+	const char		*s;
+
+	memset(req, 0, sizeof(*req));
+	req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct nhmsg));
+	req->n.nlmsg_type = type;
+	req->n.nlmsg_flags = flags;
+	req->nh.nh_family = AF_UNSPEC;
+	req->nh.nh_protocol = opt_int(L, opts, "protocol", (type == RTM_NEWNEXTHOP) ? RTPROT_STATIC : 0);
+
+	addattr32(L, &req->n, NHA_ID, id);
+	if (type != RTM_NEWNEXTHOP) return 0;
+
+	if (lua_type(L, opts) != LUA_TTABLE) return luaL_argerror(L, opts, "options expected");
+
+	lua_getfield(L, opts, "group");
+	if (!lua_isnil(L, -1)) {
+		struct nexthop_grp	grp[64];
+		int					i, n = (int)luaL_len(L, -1);
+
+		if (n < 1 || n > 64) return luaL_error(L, "nexthop groups need 1 to 64 members");
+		memset(grp, 0, sizeof(grp));
+		for (i = 0; i < n; i++) {
+			lua_rawgeti(L, -1, i + 1);
+			grp[i].id = (__u32)luaL_checkinteger(L, -1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		addattr(L, &req->n, NHA_GROUP, grp, n * sizeof(struct nexthop_grp));
+		return 0;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, opts, "blackhole");
+	if (lua_toboolean(L, -1)) {
+		lua_pop(L, 1);
+		addattr(L, &req->n, NHA_BLACKHOLE, NULL, 0);
+		return 0;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, opts, "dev");
+	if (!lua_isnil(L, -1)) {
+		int ifindex = get_ifindex(L, -1);
+		if (!ifindex) return ENODEV;
+		addattr32(L, &req->n, NHA_OIF, ifindex);
+	}
+	lua_pop(L, 1);
+
+	s = opt_string(L, opts, "gateway");
+	if (s) {
+		if (!get_prefix(s, &gw)) return luaL_error(L, "invalid gateway: %s", s);
+		req->nh.nh_family = gw.family;
+		addattr(L, &req->n, NHA_GATEWAY, gw.addr, gw.bytes);
+	} else {
+		req->nh.nh_family = AF_INET;
+	}
+	return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * The single calls, build the request, send it and wait for the ack
+ *------------------------------------------------------------------------------
+ */
+static int single(lua_State *L, builder build, int type, int flags) {
+	struct request	req;
+	int				rc;
+
+	rc = build(L, 1, &req, type, flags);
+	if (rc) return push_error(L, rc);
+
+	rc = nl_talk(&req.n);
+	if (rc < 0) return push_error(L, -rc);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int addr_add(lua_State *L) {
+	return single(L, build_addr, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL);
+}
+static int addr_del(lua_State *L) {
+	return single(L, build_addr, RTM_DELADDR, 0);
+}
+static int link_set(lua_State *L) {
+	return single(L, build_link, RTM_NEWLINK, 0);
+}
+static int route_add(lua_State *L) {
+	return single(L, build_route, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL);
+}
+static int route_replace(lua_State *L) {
+	return single(L, build_route, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE);
+}
+static int route_del(lua_State *L) {
+	return single(L, build_route, RTM_DELROUTE, 0);
+}
+static int nexthop_add(lua_State *L) {
+	return single(L, build_nexthop, RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_EXCL);
+}
+static int nexthop_replace(lua_State *L) {
+	return single(L, build_nexthop, RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_REPLACE);
+}
+static int nexthop_del(lua_State *L) {
+	return single(L, build_nexthop, RTM_DELNEXTHOP, 0);
+}
+
+/*==============================================================================
+ * Batches: requests are added to a buffer (each gets an index, starting at
+ * one) and then sent together, as many to a sendmsg as we can.
+ *
+ * Only the last request in each sendmsg asks for an ack, the kernel always
+ * tells us about failures and deals with the requests in order, so once
+ * that ack is back we know the outcome of everything before it. Failures
+ * are matched back to their request by sequence number.
+ *==============================================================================
+ */
+#define BATCH_META		"nl.batch"
+#define CHUNK_BYTES		65536
+
+struct batch {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+	int		count;
+};
+
+static int batch_new(lua_State *L) {
+	struct batch *b = (struct batch *)lua_newuserdata(L, sizeof(struct batch));
 
-//	lua_pushstring(L, "hello");
-	lua_call(L, 1, 0);
+	memset(b, 0, sizeof(*b));
+	luaL_setmetatable(L, BATCH_META);
+	return 1;
 }
 
+static int batch_gc(lua_State *L) {
+	struct batch *b = (struct batch *)luaL_checkudata(L, 1, BATCH_META);
+
+	free(b->buf);
+	b->buf = NULL;
+	b->len = b->size = b->count = 0;
+	return 0;
+}
 
 /*------------------------------------------------------------------------------
- * Add a cache, setup the callback, call the callback for each initial entry
+ * Add a request, returns its index or nil, message, errno if we can tell
+ * straight away that it won't work (it isn't added in that case)
  *------------------------------------------------------------------------------
  */
-static int add_cache(lua_State *L) {
-	if(!lua_isstring(L, 1)) return luaL_error(L, "expected string as first argument");
-	if(!lua_isfunction(L, 2)) return luaL_error(L, "expected function as second argument");
+static int batch_add(lua_State *L, builder build, int type, int flags) {
+	struct batch	*b = (struct batch *)luaL_checkudata(L, 1, BATCH_META);
+	struct request	req;
+	size_t			len;
+	int				rc;
+
+	rc = build(L, 2, &req, type, flags);
+	if (rc) return push_error(L, rc);
+
+	len = NLMSG_ALIGN(req.n.nlmsg_len);
+	if (b->len + len > b->size) {
+		size_t	size = b->size ? b->size * 2 : CHUNK_BYTES;
+		char	*buf = realloc(b->buf, size);
+
+		if (!buf) return luaL_error(L, "out of memory");
+		b->buf = buf;
+		b->size = size;
+	}
+	memcpy(b->buf + b->len, &req, len);
+	b->len += len;
+	lua_pushinteger(L, ++b->count);
+	return 1;
+}
+
+static int batch_addr_add(lua_State *L) {
+	return batch_add(L, build_addr, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL);
+}
+static int batch_addr_del(lua_State *L) {
+	return batch_add(L, build_addr, RTM_DELADDR, 0);
+}
+static int batch_link_set(lua_State *L) {
+	return batch_add(L, build_link, RTM_NEWLINK, 0);
+}
+static int batch_route_add(lua_State *L) {
+	return batch_add(L, build_route, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL);
+}
+static int batch_route_replace(lua_State *L) {
+	return batch_add(L, build_route, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE);
+}
+static int batch_nexthop_add(lua_State *L) {
+	return batch_add(L, build_nexthop, RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_EXCL);
+}
+static int batch_nexthop_replace(lua_State *L) {
+	return batch_add(L, build_nexthop, RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_REPLACE);
+}
+static int batch_nexthop_del(lua_State *L) {
+	return batch_add(L, build_nexthop, RTM_DELNEXTHOP, 0);
+}
+static int batch_route_del(lua_State *L) {
+	return batch_add(L, build_route, RTM_DELROUTE, 0);
+}
+
+static int batch_count(lua_State *L) {
+	struct batch *b = (struct batch *)luaL_checkudata(L, 1, BATCH_META);
 
+	lua_pushinteger(L, b->count);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Send one chunk (requests first to first+n-1 in the buffer at off..end) and
+ * read back the failures into the table at the top of the stack, returns 0
+ * or a negative errno if we lost track
+ *------------------------------------------------------------------------------
+ */
+static int batch_chunk(lua_State *L, char *start, size_t len, int first, __u32 seq, __u32 last, int *failed) {
+	char				buf[NL_BUFSIZE];
+	struct sockaddr_nl	sa;
+	struct iovec		iov = { start, len };
+	struct msghdr		msg;
 	int					rc;
-	const char			*type = lua_tolstring(L, 1, NULL);
-	struct int_cache	*cp = cache_list;
-	struct nl_object	*obj;
-
-	// See if we can find the cache info...
-	while(cp->name) {
-		if(strcmp(cp->name, type) == 0) {
-			printf("Found a match for %s\n", cp->name);
-			break;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &sa;
+	msg.msg_namelen = sizeof(sa);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	do {
+		rc = sendmsg(nl_fd, &msg, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) return -errno;
+
+	while (1) {
+		struct nlmsghdr	*h;
+		int				n;
+
+		n = recv(nl_fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, n); h = NLMSG_NEXT(h, n)) {
+			__u32 i = h->nlmsg_seq - seq;
+
+			if (h->nlmsg_type != NLMSG_ERROR || i > last - seq) continue;		// not one of ours
+			if (((struct nlmsgerr *)NLMSG_DATA(h))->error) {
+				lua_pushinteger(L, -((struct nlmsgerr *)NLMSG_DATA(h))->error);
+				lua_rawseti(L, -2, first + i);
+				(*failed)++;
+			}
+			if (h->nlmsg_seq == last) return 0;
 		}
-		cp++;
 	}
-	if(!cp->name) return luaL_error(L, "unknown cache type: %s", type);
+}
+
+/*------------------------------------------------------------------------------
+ * Send everything, returns a table of index = errno for the requests that
+ * failed and the number of them. If we lose track part way (no buffer space,
+ * or the socket fails) everything we can't vouch for is reported with that
+ * error. The batch is empty afterwards and can be reused.
+ *------------------------------------------------------------------------------
+ */
+static int batch_send(lua_State *L) {
+	struct batch	*b = (struct batch *)luaL_checkudata(L, 1, BATCH_META);
+	size_t			off = 0;
+	int				index = 1;
+	int				first = 1;
+	int				failed = 0;
+	int				rc;
+
+	lua_newtable(L);
+	rc = nl_open();
 
-	// Update the cache list and store the lua callback function...
-	lua_pushvalue(L, 2);
-	cp->L = L;
-	cp->cb_id = store_function(L);
-	rc = nl_cache_mngr_add(cache_mngr, cp->name, cp->cb, (void *)cp, &cp->cache);
+	while (rc == 0 && off < b->len) {
+		size_t			start = off;
+		__u32			seq = nl_seq + 1;
+		struct nlmsghdr	*h = NULL;
+
+		first = index;
+		while (off < b->len && index - first < nl_chunk_msgs) {
+			struct nlmsghdr *next = (struct nlmsghdr *)(b->buf + off);
+
+			if (h && off - start + next->nlmsg_len > CHUNK_BYTES) break;
+			h = next;
+			h->nlmsg_seq = ++nl_seq;
+			h->nlmsg_flags = (h->nlmsg_flags | NLM_F_REQUEST) & ~NLM_F_ACK;
+			off += NLMSG_ALIGN(h->nlmsg_len);
+			index++;
+		}
+		h->nlmsg_flags |= NLM_F_ACK;
 
-	// Now run through the initial list and call the callback for each
-	obj = nl_cache_get_first(cp->cache);
-	while(obj) {
-		printf("Obj found\n");
-		cp->cb(cp->cache, obj, 1, (void *)cp);
-		obj = nl_cache_get_next(obj);
+		rc = batch_chunk(L, b->buf + start, off - start, first, seq, nl_seq, &failed);
 	}
+	if (rc < 0) {
+		int i;
 
+		for (i = first; i <= b->count; i++) {
+			lua_rawgeti(L, -1, i);
+			if (lua_isnil(L, -1)) {
+				lua_pushinteger(L, -rc);
+				lua_rawseti(L, -3, i);
+				failed++;
+			}
+			lua_pop(L, 1);
+		}
+	}
 
-	
+	b->len = 0;
+	b->count = 0;
+	lua_pushinteger(L, failed);
+	return 2;
+}
 
+static const struct luaL_Reg batch_methods[] = {
+	{"addr_add", batch_addr_add},
+	{"addr_del", batch_addr_del},
+	{"link_set", batch_link_set},
+	{"route_add", batch_route_add},
+	{"route_replace", batch_route_replace},
+	{"route_del", batch_route_del},
+	{"nexthop_add", batch_nexthop_add},
+	{"nexthop_replace", batch_nexthop_replace},
+	{"nexthop_del", batch_nexthop_del},
+	{"count", batch_count},
+	{"send", batch_send},
+	{"__gc", batch_gc},
+	{NULL, NULL}
+};
 
+/*==============================================================================
+ * Reading the kernel state: a dump gives us everything there is now and a
+ * monitor socket tells us about changes as they happen, both turn the
+ * messages into the same tables (an "event" and "action" plus the fields)
+ * so whoever uses them doesn't need to care which it was.
+ *==============================================================================
+ */
+#define RX_BUFSIZE		65536
+
+static char		rx_buf[RX_BUFSIZE];
+
+static void parse_rtattr(struct rtattr *tb[], int max, struct rtattr *rta, int len) {
+	memset(tb, 0, sizeof(struct rtattr *) * (max + 1));
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type <= max) tb[rta->rta_type] = rta;
+	}
+}
 
-	// Register the cache...
-//	rc = nl_cache_mngr_add(cache_mngr, type, cb, (void *)L, &cache);
-//	printf("c=%d\n", c);	
+static void set_int(lua_State *L, const char *name, lua_Integer value) {
+	lua_pushinteger(L, value);
+	lua_setfield(L, -2, name);
+}
 
-	// Execure the function
-//	get_function(L, id);
-//	if(!lua_isfunction(L, -1)) return luaL_error(L, "function call problems");
-//	lua_pushstring(L, "hello");
-//	lua_call(L, 1, 0);
+static void set_string(lua_State *L, const char *name, const char *value) {
+	lua_pushstring(L, value);
+	lua_setfield(L, -2, name);
+}
 
-	// Return 0
-	lua_pushnumber(L, 0);	
-	return 1;
+static void set_bool(lua_State *L, const char *name, int value) {
+	lua_pushboolean(L, value);
+	lua_setfield(L, -2, name);
 }
 
+static void set_u32(lua_State *L, const char *name, struct rtattr *rta) {
+	if (rta) set_int(L, name, *(__u32 *)RTA_DATA(rta));
+}
 
-//	c = nl_cache_mngr_add(cache_mgr, "route/link", change_func, (void *)45, &link_cache);
+/*------------------------------------------------------------------------------
+ * An address (with a prefix length if len >= 0) or a mac address
+ *------------------------------------------------------------------------------
+ */
+static void set_addr(lua_State *L, const char *name, int family, struct rtattr *rta, int len) {
+	char	buf[INET6_ADDRSTRLEN + 8];
 
+	if (!rta || !inet_ntop(family, RTA_DATA(rta), buf, INET6_ADDRSTRLEN)) return;
+	if (len >= 0) sprintf(buf + strlen(buf), "/%d", len);
+	set_string(L, name, buf);
+}
 
+static void set_mac(lua_State *L, const char *name, struct rtattr *rta) {
+	char			buf[64];
+	char			*b = buf;
+	unsigned char	*p;
+	int				i, n;
 
+	if (!rta) return;
+	p = RTA_DATA(rta);
+	n = RTA_PAYLOAD(rta);
+	if (n > 20) n = 20;
+	buf[0] = 0;
+	for (i = 0; i < n; i++) b += sprintf(b, i ? ":%02x" : "%02x", p[i]);
+	set_string(L, name, buf);
+}
 
-void change_func(struct nl_cache *cache, struct nl_object *object, int i, void *data) {
-	struct rtnl_link *link = (struct rtnl_link *)object;
+static const char *operstates[] = { "unknown", "notpresent", "down", "lowerlayerdown",
+										"testing", "dormant", "up" };
 
-	printf("Change called cache=%p obj=%p i=%d data=%p\n", cache, object, i, data );
+static const char *rtn_types[] = { "unspec", "unicast", "local", "broadcast", "anycast",
+										"multicast", "blackhole", "unreachable", "prohibit",
+										"throw", "nat", "xresolve" };
 
-	// We probably want to ignore lo, and the dummy entries...
-	//
-	// lo
-	// gre0
-	// gretap0
-	// tunl0
-	//
+static const char *nud_state(int state) {
+	switch (state) {
+	case NUD_INCOMPLETE:	return "incomplete";
+	case NUD_REACHABLE:		return "reachable";
+	case NUD_STALE:			return "stale";
+	case NUD_DELAY:			return "delay";
+	case NUD_PROBE:			return "probe";
+	case NUD_FAILED:		return "failed";
+	case NUD_NOARP:			return "noarp";
+	case NUD_PERMANENT:		return "permanent";
+	default:				return "none";
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * Links: ifindex, name, flags, up, running, operstate, mtu, mac, master,
+ * kind and stats
+ *------------------------------------------------------------------------------
+ */
+static void push_link(lua_State *L, struct nlmsghdr *h) {
+	struct ifinfomsg	*ifi = NLMSG_DATA(h);
+	struct rtattr		*tb[IFLA_MAX + 1];
+
+	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(h));
+
+	set_int(L, "ifindex", ifi->ifi_index);
+	set_int(L, "flags", ifi->ifi_flags);
+	set_bool(L, "up", (ifi->ifi_flags & IFF_UP) != 0);
+	set_bool(L, "running", (ifi->ifi_flags & IFF_RUNNING) != 0);
+	if (tb[IFLA_IFNAME]) set_string(L, "name", RTA_DATA(tb[IFLA_IFNAME]));
+	set_u32(L, "mtu", tb[IFLA_MTU]);
+	set_u32(L, "master", tb[IFLA_MASTER]);
+	set_mac(L, "mac", tb[IFLA_ADDRESS]);
+	if (tb[IFLA_OPERSTATE]) {
+		unsigned char state = *(unsigned char *)RTA_DATA(tb[IFLA_OPERSTATE]);
+		set_string(L, "operstate", state < sizeof(operstates) / sizeof(operstates[0]) ? operstates[state] : "unknown");
+	}
+	if (tb[IFLA_LINKINFO]) {
+		struct rtattr *info[IFLA_INFO_MAX + 1];
+
+		parse_rtattr(info, IFLA_INFO_MAX, RTA_DATA(tb[IFLA_LINKINFO]), RTA_PAYLOAD(tb[IFLA_LINKINFO]));
+		if (info[IFLA_INFO_KIND]) set_string(L, "kind", RTA_DATA(info[IFLA_INFO_KIND]));
+	}
+	if (tb[IFLA_STATS64] && RTA_PAYLOAD(tb[IFLA_STATS64]) >= sizeof(struct rtnl_link_stats64)) {
+		struct rtnl_link_stats64 st;
+
+		memcpy(&st, RTA_DATA(tb[IFLA_STATS64]), sizeof(st));
+		lua_createtable(L, 0, 8);
+		set_int(L, "rx-bytes", st.rx_bytes);
+		set_int(L, "rx-packets", st.rx_packets);
+		set_int(L, "rx-errors", st.rx_errors);
+		set_int(L, "rx-dropped", st.rx_dropped);
+		set_int(L, "tx-bytes", st.tx_bytes);
+		set_int(L, "tx-packets", st.tx_packets);
+		set_int(L, "tx-errors", st.tx_errors);
+		set_int(L, "tx-dropped", st.tx_dropped);
+		lua_setfield(L, -2, "stats");
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * Addresses: ifindex, family, address (with prefix), peer, scope, flags
+ *------------------------------------------------------------------------------
+ */
+static void push_addr(lua_State *L, struct nlmsghdr *h) {
+	struct ifaddrmsg	*ifa = NLMSG_DATA(h);
+	struct rtattr		*tb[IFA_MAX + 1];
+	struct rtattr		*local;
+
+	parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(h));
+	local = tb[IFA_LOCAL] ? tb[IFA_LOCAL] : tb[IFA_ADDRESS];
 
-	if (i == 1) {
-		printf("NEW\n");
-	} else if (i == 2) {
-		printf("DEL\n");
-	} else if (i == 5) {
-		printf("CHANGE\n");
+	set_int(L, "ifindex", ifa->ifa_index);
+	set_string(L, "family", ifa->ifa_family == AF_INET6 ? "ipv6" : "ip");
+	set_addr(L, "address", ifa->ifa_family, local, ifa->ifa_prefixlen);
+	if (tb[IFA_LOCAL] && tb[IFA_ADDRESS] &&
+				memcmp(RTA_DATA(tb[IFA_LOCAL]), RTA_DATA(tb[IFA_ADDRESS]), RTA_PAYLOAD(tb[IFA_LOCAL])))
+		set_addr(L, "peer", ifa->ifa_family, tb[IFA_ADDRESS], -1);
+	if (tb[IFA_LABEL]) set_string(L, "label", RTA_DATA(tb[IFA_LABEL]));
+	set_int(L, "scope", ifa->ifa_scope);
+	set_int(L, "flags", tb[IFA_FLAGS] ? *(__u32 *)RTA_DATA(tb[IFA_FLAGS]) : ifa->ifa_flags);
+}
+
+/*------------------------------------------------------------------------------
+ * Routes: family, dst (with prefix), gateway, oif, table, metric, protocol,
+ * scope, type, pref-src and nhid
+ *------------------------------------------------------------------------------
+ */
+static void push_route(lua_State *L, struct nlmsghdr *h) {
+	struct rtmsg		*r = NLMSG_DATA(h);
+	struct rtattr		*tb[RTA_MAX + 1];
+	char				any[16] = { 0 };
+
+	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), RTM_PAYLOAD(h));
+
+	set_string(L, "family", r->rtm_family == AF_INET6 ? "ipv6" : "ip");
+	if (tb[RTA_DST]) {
+		set_addr(L, "dst", r->rtm_family, tb[RTA_DST], r->rtm_dst_len);
 	} else {
-		printf("UNKNOWN\n");
+		char buf[INET6_ADDRSTRLEN + 8];
+
+		inet_ntop(r->rtm_family, any, buf, INET6_ADDRSTRLEN);
+		sprintf(buf + strlen(buf), "/%d", r->rtm_dst_len);
+		set_string(L, "dst", buf);
 	}
-	
-	printf("Name is [%s]\n", rtnl_link_get_name(link));
-	printf("Type is [%s]\n", rtnl_link_get_type(link));
-	printf("ArpType is [%d]\n", rtnl_link_get_arptype(link));
+	set_addr(L, "gateway", r->rtm_family, tb[RTA_GATEWAY], -1);
+	set_addr(L, "pref-src", r->rtm_family, tb[RTA_PREFSRC], -1);
+	set_u32(L, "oif", tb[RTA_OIF]);
+	set_u32(L, "metric", tb[RTA_PRIORITY]);
+	set_u32(L, "nhid", tb[RTA_NH_ID]);
+	set_int(L, "table", tb[RTA_TABLE] ? *(__u32 *)RTA_DATA(tb[RTA_TABLE]) : r->rtm_table);
+	set_int(L, "protocol", r->rtm_protocol);
+	set_int(L, "scope", r->rtm_scope);
+	set_string(L, "type", r->rtm_type < sizeof(rtn_types) / sizeof(rtn_types[0]) ? rtn_types[r->rtm_type] : "unknown");
+}
 
-	//
-	// Here we would callback lua so we can update our internal
-	// state
-	//
-	// on links ... add or remove as needed, rerun the config match
-	//              we don't need to do anything with routes as any changes
-	//              will force the routes to update and cause a config match there
-	//
+/*------------------------------------------------------------------------------
+ * Neighbours: ifindex, family, address, mac and state
+ *------------------------------------------------------------------------------
+ */
+static void push_neigh(lua_State *L, struct nlmsghdr *h) {
+	struct ndmsg		*nd = NLMSG_DATA(h);
+	struct rtattr		*tb[NDA_MAX + 1];
+
+	parse_rtattr(tb, NDA_MAX, (struct rtattr *)(((char *)nd) + NLMSG_ALIGN(sizeof(*nd))),
+										h->nlmsg_len - NLMSG_LENGTH(sizeof(*nd)));
+
+	set_int(L, "ifindex", nd->ndm_ifindex);
+	set_string(L, "family", nd->ndm_family == AF_INET6 ? "ipv6" : "ip");
+	set_addr(L, "address", nd->ndm_family, tb[NDA_DST], -1);
+	set_mac(L, "mac", tb[NDA_LLADDR]);
+	set_string(L, "state", nud_state(nd->ndm_state));
+}
+
+/*------------------------------------------------------------------------------
+ * Nexthop objects: id, protocol, gateway, oif, group (a list of ids) and
+ * blackhole
+ *------------------------------------------------------------------------------
+ */
+static void push_nexthop(lua_State *L, struct nlmsghdr *h) {
+	struct nhmsg		*nh = NLMSG_DATA(h);
+	struct rtattr		*tb[NHA_MAX + 1];
+
+	parse_rtattr(tb, NHA_MAX, (struct rtattr *)(((char *)nh) + NLMSG_ALIGN(sizeof(*nh))),
+										h->nlmsg_len - NLMSG_LENGTH(sizeof(*nh)));
+
+	set_u32(L, "id", tb[NHA_ID]);
+	set_int(L, "protocol", nh->nh_protocol);
+	set_addr(L, "gateway", nh->nh_family, tb[NHA_GATEWAY], -1);
+	set_u32(L, "oif", tb[NHA_OIF]);
+	if (tb[NHA_BLACKHOLE]) set_bool(L, "blackhole", 1);
+	if (tb[NHA_GROUP]) {
+		struct nexthop_grp	*grp = RTA_DATA(tb[NHA_GROUP]);
+		int					i, n = RTA_PAYLOAD(tb[NHA_GROUP]) / sizeof(*grp);
+
+		lua_createtable(L, n, 0);
+		for (i = 0; i < n; i++) {
+			lua_pushinteger(L, grp[i].id);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, "group");
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * Turn a message into a table and add it to the list at the top of the
+ * stack, anything we don't know about is skipped
+ *------------------------------------------------------------------------------
+ */
+static void push_event(lua_State *L, struct nlmsghdr *h) {
+	void		(*fn)(lua_State *, struct nlmsghdr *);
+	const char	*event;
+	int			del = 0;
+
+	switch (h->nlmsg_type) {
+	case RTM_DELLINK:	del = 1;	/* fall through */
+	case RTM_NEWLINK:	fn = push_link; event = "link"; break;
+	case RTM_DELADDR:	del = 1;	/* fall through */
+	case RTM_NEWADDR:	fn = push_addr; event = "addr"; break;
+	case RTM_DELROUTE:	del = 1;	/* fall through */
+	case RTM_NEWROUTE:	fn = push_route; event = "route"; break;
+	case RTM_DELNEIGH:	del = 1;	/* fall through */
+	case RTM_NEWNEIGH:	fn = push_neigh; event = "neigh"; break;
+	case RTM_DELNEXTHOP:	del = 1;	/* fall through */
+	case RTM_NEWNEXTHOP:	fn = push_nexthop; event = "nexthop"; break;
+	default:			return;
+	}
+
+	lua_createtable(L, 0, 12);
+	set_string(L, "event", event);
+	set_string(L, "action", del ? "del" : "new");
+	fn(L, h);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+}
+
+/*------------------------------------------------------------------------------
+ * Dump everything of one kind ("link", "addr", "route", "neigh" or
+ * "nexthop"), returns a list of events
+ *------------------------------------------------------------------------------
+ */
+static int dump(lua_State *L) {
+	static const char	*kinds[] = { "link", "addr", "route", "neigh", "nexthop", NULL };
+	static const int	types[] = { RTM_GETLINK, RTM_GETADDR, RTM_GETROUTE, RTM_GETNEIGH, RTM_GETNEXTHOP };
+	struct {
+		struct nlmsghdr		n;
+		union {
+			struct rtgenmsg		g;
+			struct nhmsg		nh;			// the nexthop dump wants a whole header
+		};
+	} req;
+	struct sockaddr_nl	sa;
+	int					kind = luaL_checkoption(L, 1, NULL, kinds);
+	int					rc;
+
+	rc = nl_open();
+	if (rc < 0) return push_error(L, -rc);
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(types[kind] == RTM_GETNEXTHOP ? sizeof(struct nhmsg) : sizeof(struct rtgenmsg));
+	req.n.nlmsg_type = types[kind];
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.n.nlmsg_seq = ++nl_seq;
+	req.g.rtgen_family = AF_UNSPEC;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	do {
+		rc = sendto(nl_fd, &req, req.n.nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa));
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) return push_error(L, errno);
+
+	lua_newtable(L);
+	while (1) {
+		struct nlmsghdr	*h;
+		int				len;
+
+		len = recv(nl_fd, rx_buf, sizeof(rx_buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			return push_error(L, errno);
+		}
+		for (h = (struct nlmsghdr *)rx_buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_seq != req.n.nlmsg_seq) continue;				// something stale
+			if (h->nlmsg_type == NLMSG_DONE) return 1;
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = (struct nlmsgerr *)NLMSG_DATA(h);
+				if (e->error) return push_error(L, -e->error);
+				continue;
+			}
+			push_event(L, h);
+		}
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * Walk the routing tables (all of them, both families unless one is given)
+ * without building the whole lot in memory: routes() returns an iterator
+ * that hands back one route table at a time, reading from the kernel as it
+ * goes. It has its own socket so other requests can carry on in between.
+ *------------------------------------------------------------------------------
+ */
+#define ROUTES_META		"nl.routes"
+
+struct routes {
+	int		fd;
+	__u32	seq;
+	int		len;
+	int		off;
+	char	buf[RX_BUFSIZE];
+};
+
+static void routes_close(struct routes *r) {
+	if (r->fd >= 0) close(r->fd);
+	r->fd = -1;
 }
 
+static int routes_gc(lua_State *L) {
+	routes_close((struct routes *)luaL_checkudata(L, 1, ROUTES_META));
+	return 0;
+}
 
+static int routes_next(lua_State *L) {
+	struct routes *r = (struct routes *)luaL_checkudata(L, lua_upvalueindex(1), ROUTES_META);
 
-int main(int argc, char *argv[]) {
-	struct nl_sock		*nls;
-	int					c;
-	struct nl_cache		*link_cache;
+	while (r->fd >= 0) {
+		while (r->off < r->len) {
+			struct nlmsghdr	*h = (struct nlmsghdr *)(r->buf + r->off);
+			int				left = r->len - r->off;
 
-	printf("Hello world!\n");
+			if (!NLMSG_OK(h, left)) break;
+			r->off += NLMSG_ALIGN(h->nlmsg_len);
 
+			if (h->nlmsg_seq != r->seq) continue;
+			if (h->nlmsg_type == NLMSG_DONE) {
+				routes_close(r);
+				return 0;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				int err = -((struct nlmsgerr *)NLMSG_DATA(h))->error;
 
-	nls = nl_socket_alloc();
-	printf("nls=%p\n", nls);
+				if (!err) continue;
+				routes_close(r);
+				return luaL_error(L, "route dump failed: %s", strerror(err));
+			}
+			if (h->nlmsg_type != RTM_NEWROUTE) continue;
 
+			lua_createtable(L, 0, 10);
+			push_route(L, h);
+			return 1;
+		}
 
-//	c = rtnl_link_alloc_cache(nls, AF_UNSPEC, &link_cache);
-//	printf("c=%d\n", c);
+		r->off = 0;
+		r->len = recv(r->fd, r->buf, sizeof(r->buf), 0);
+		if (r->len < 0) {
+			int err = errno;
 
-	struct nl_cache_mngr	*cache_mgr;
+			r->len = 0;
+			if (err == EINTR) continue;
+			routes_close(r);
+			return luaL_error(L, "route dump failed: %s", strerror(err));
+		}
+	}
+	return 0;
+}
 
-	c = nl_cache_mngr_alloc(nls, AF_UNSPEC, 0, &cache_mgr);
-	printf("c=%d\n", c);	
+static int routes(lua_State *L) {
+	static const char	*families[] = { "all", "ip", "ipv6", NULL };
+	static const int	family_values[] = { AF_UNSPEC, AF_INET, AF_INET6 };
+	struct {
+		struct nlmsghdr		n;
+		struct rtmsg		r;
+	} req;
+	struct sockaddr_nl	sa;
+	struct routes		*r;
+	int					family = family_values[luaL_checkoption(L, 1, "all", families)];
 
-//	struct nl_cache		*route_cache;
+	r = (struct routes *)lua_newuserdata(L, sizeof(struct routes));
+	r->fd = -1;
+	r->len = r->off = 0;
+	luaL_setmetatable(L, ROUTES_META);
 
-	c = nl_cache_mngr_add(cache_mgr, "route/link", change_func, (void *)45, &link_cache);
-	printf("c=%d\n", c);	
-	printf("cache = %p\n", link_cache);
+	r->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (r->fd < 0) return push_error(L, errno);
 
-	printf("Items=%d\n", nl_cache_nitems(link_cache));
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind(r->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		int err = errno;
+		routes_close(r);
+		return push_error(L, err);
+	}
 
-	// Run our callback for the initial set...
-	struct nl_object *obj;
-	
-	obj = nl_cache_get_first(link_cache);
-	while(obj) {
-		printf("Obj found\n");
-		change_func(link_cache, obj, 1, (void *)1234);
-		obj = nl_cache_get_next(obj);
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.n.nlmsg_type = RTM_GETROUTE;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.n.nlmsg_seq = r->seq = ++nl_seq;
+	req.r.rtm_family = family;
+
+	if (sendto(r->fd, &req, req.n.nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		int err = errno;
+		routes_close(r);
+		return push_error(L, err);
 	}
+	lua_pushcclosure(L, routes_next, 1);
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Open a (non-blocking) socket that gets told about changes to the things
+ * listed ("link", "addr", "route", "neigh", "nexthop"), returns the fd for
+ * the event loop. The nexthop group is past the ones that fit in nl_groups
+ * so that one is joined with a setsockopt once we're bound.
+ *------------------------------------------------------------------------------
+ */
+static int monitor(lua_State *L) {
+	struct sockaddr_nl	sa;
+	int					size = NL_SOCKBUF;
+	int					nexthop = 0;
+	int					fd, i;
 
+	luaL_checktype(L, 1, LUA_TTABLE);
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
 
+	for (i = 1; i <= lua_rawlen(L, 1); i++) {
+		const char *kind;
 
-	while(1) {
-		c = nl_cache_mngr_poll(cache_mgr, 1000);
-		printf("poll c=%d\n", c);
+		lua_rawgeti(L, 1, i);
+		kind = luaL_checkstring(L, -1);
+		if (strcmp(kind, "link") == 0) sa.nl_groups |= RTMGRP_LINK;
+		else if (strcmp(kind, "addr") == 0) sa.nl_groups |= RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+		else if (strcmp(kind, "route") == 0) sa.nl_groups |= RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+		else if (strcmp(kind, "neigh") == 0) sa.nl_groups |= RTMGRP_NEIGH;
+		else if (strcmp(kind, "nexthop") == 0) nexthop = RTNLGRP_NEXTHOP;
+		else return luaL_error(L, "unknown netlink group: %s", kind);
+		lua_pop(L, 1);
 	}
 
-	exit(0);
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if (fd < 0) return push_error(L, errno);
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+			(nexthop && setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &nexthop, sizeof(nexthop)) < 0)) {
+		int err = errno;
+		close(fd);
+		return push_error(L, err);
+	}
+	lua_pushinteger(L, fd);
+	return 1;
 }
 
-/*
- * Dummy function
+/*------------------------------------------------------------------------------
+ * Read whatever is waiting on a monitor socket, returns a list of events.
+ * If the kernel had to drop some (we didn't keep up) the list has overrun
+ * set and the caller needs to dump to catch up.
+ *------------------------------------------------------------------------------
  */
-static int dummy(lua_State *L) {
-	printf("DUMMY\n");
-	return 0;
+static int monitor_read(lua_State *L) {
+	int		fd = (int)luaL_checkinteger(L, 1);
+
+	lua_newtable(L);
+	while (1) {
+		struct nlmsghdr	*h;
+		int				len;
+
+		len = recv(fd, rx_buf, sizeof(rx_buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == ENOBUFS) {
+				set_bool(L, "overrun", 1);
+				continue;
+			}
+			return push_error(L, errno);
+		}
+		if (len == 0) break;
+		for (h = (struct nlmsghdr *)rx_buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) push_event(L, h);
+	}
+	return 1;
+}
+
+/*------------------------------------------------------------------------------
+ * Interface name to index (nil if there isn't one)
+ *------------------------------------------------------------------------------
+ */
+static int ifindex(lua_State *L) {
+	int i = (int)if_nametoindex(luaL_checkstring(L, 1));
+
+	if (!i) return push_error(L, ENODEV);
+	lua_pushinteger(L, i);
+	return 1;
+}
+
+static int nl_strerror(lua_State *L) {
+	lua_pushstring(L, strerror((int)luaL_checkinteger(L, 1)));
+	return 1;
 }
 
 /*==============================================================================
@@ -268,20 +1276,42 @@ static int dummy(lua_State *L) {
  *==============================================================================
  */
 static const struct luaL_Reg lib[] = {
-    {"dummy", dummy},
-	{"add_cache", add_cache},
-    {NULL, NULL}
+	{"addr_add", addr_add},
+	{"addr_del", addr_del},
+	{"link_set", link_set},
+	{"route_add", route_add},
+	{"route_replace", route_replace},
+	{"route_del", route_del},
+	{"nexthop_add", nexthop_add},
+	{"nexthop_replace", nexthop_replace},
+	{"nexthop_del", nexthop_del},
+	{"batch", batch_new},
+	{"dump", dump},
+	{"routes", routes},
+	{"monitor", monitor},
+	{"monitor_read", monitor_read},
+	{"ifindex", ifindex},
+	{"strerror", nl_strerror},
+	{NULL, NULL}
 };
 
 /*------------------------------------------------------------------------------
- * Main Library Entry Point ... just intialise all the functions
+ * Main Library Entry Point ... just intialise all the functions and the
+ * metatables, the socket is opened when we first need it
  *------------------------------------------------------------------------------
  */
-int luaopen_lee(lua_State *L) {
-//    luaL_openlib(L, "lee", lib, 0);
-	luaL_newlib(L, lib);
+int luaopen_nl(lua_State *L) {
+	luaL_newmetatable(L, BATCH_META);
+	luaL_setfuncs(L, batch_methods, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
 
-	netlink_init();
-    return 1;
-}
+	luaL_newmetatable(L, ROUTES_META);
+	lua_pushcfunction(L, routes_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
 
+	luaL_newlib(L, lib);
+	return 1;
+}
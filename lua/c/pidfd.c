@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+/*==============================================================================
+ * Process file handles, so a child going away is just another event for the
+ * loop: the handle becomes readable once the process has exited, and then
+ * a waitpid() on it won't block.
+ *
+ * libc doesn't always have a wrapper for pidfd_open() so we make the system
+ * call ourselves. The handle is always close-on-exec.
+ *
+ * Errors come back as nil, message, errno (the same as luaposix).
+ *==============================================================================
+ */
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open		434
+#endif
+
+static int push_error(lua_State *L, int err) {
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(err));
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+/*------------------------------------------------------------------------------
+ * A handle for one of our children: open(pid)
+ *------------------------------------------------------------------------------
+ */
+static int pidfd_open(lua_State *L) {
+	pid_t	pid = (pid_t)luaL_checkinteger(L, 1);
+	int		fd = (int)syscall(__NR_pidfd_open, pid, 0);
+
+	if (fd < 0) return push_error(L, errno);
+	lua_pushinteger(L, fd);
+	return 1;
+}
+
+/*==============================================================================
+ * These are the functions we export to Lua...
+ *==============================================================================
+ */
+static const struct luaL_Reg lib[] = {
+	{"open", pidfd_open},
+	{NULL, NULL}
+};
+
+/*------------------------------------------------------------------------------
+ * Main Library Entry Point ... just the functions
+ *------------------------------------------------------------------------------
+ */
+int luaopen_pidfd(lua_State *L) {
+	luaL_newlib(L, lib);
+	return 1;
+}
@@ -19,23 +19,64 @@
 
 
 --
--- Stop address ... just remove the address from the interface
+-- Stop address ... just remove the address from the interface, we use the
+-- device we added it to since the interface may have been renamed since
 --
-local function stop_address(path, ci)
-	local dev = core.interface.lookupbyname(ci.interface)
+local function stop_address(path, ci, live)
+	local dev = live._dev or core.interface.lookupbyname(ci.interface)
 
 	lib.ip.addr.del(ci.address, dev)
+	live._dev = nil
 end
 
 --
--- Start address ... just add the address to the interface
+-- Start address ... just add the address to the interface, if the kernel
+-- won't have it the error ends up on this item
 --
-local function start_address(path, ci)
+local function start_address(path, ci, live)
 	local dev = core.interface.lookupbyname(ci.interface)
+	local ok, err = lib.ip.addr.add(ci.address, dev)
 
-	lib.ip.addr.add(ci.address, dev)
+	if not ok then error("unable to add " .. ci.address .. " to " .. dev .. ": " .. err, 0) end
+	live._dev = dev
 end
 
+--
+-- Adopt address ... after a restart the kernel may well have it already,
+-- in which case we just take note of the device
+--
+local function adopt_address(path, ci, live)
+	local dev = core.interface.lookupbyname(ci.interface)
+	local link = core.interface.link(dev)
+
+	if not link or not lib.netlink.get("addr", link.ifindex .. " " .. ci.address) then return false end
+	live._dev = dev
+	return true
+end
+
+--
+-- Update address ... a changed address or a move to a different device
+-- needs a restart, so anything left (comment, interface renamed) needs
+-- nothing doing to the system
+--
+local function update_address(path, ci, changed, live)
+end
+
+--
+-- The kernel telling us an address has come or gone, we show which
+-- interface it's actually on
+--
+local function addr_event(ev)
+	if ev.family ~= "ip" then return end
+
+	local uniq = string.format("%s@%s", ev.address, core.interface.lookupbyindex(ev.ifindex))
+	local live = CONFIG["/ip/address"].live[uniq]
+
+	if live then live["actual-interface"] = (ev.action == "new" and live.interface) or nil end
+end
+
+lib.netlink.on("addr", addr_event)
+
 --
 --
 --
@@ -43,10 +84,13 @@ lib.cf.register("/ip/address", {
 	["fields"] = {
 		["address"] = { 
 			default="",
+			restart = true,
 		},
 		["interface"] = { 	
 			readonly = true, 
-			default = ""
+			default = "",
+			restart = core.interface.device_changed("interface"),
+			index = true,
 		 },
 		["disabled"] = { 
 			default = false,
@@ -62,6 +106,9 @@ lib.cf.register("/ip/address", {
 		["actual-interface"] = {
 			default = "",
 		},
+		["comment"] = {
+			default = "",
+		},
 		["uniq"] = {
 			uniq = function(_, ci) return string.format("%s@%s", ci.address, ci.interface) end,
 		},
@@ -81,6 +128,8 @@ lib.cf.register("/ip/address", {
 		["ci-post-process"] = nil,
 		["stop"] = stop_address,
 		["start"] = start_address,
+		["adopt"] = adopt_address,
+		["update"] = update_address,
 		["can-delete"] = true,
 		["can-disable"] = true,
 		["field-order"] = { "address", "network", "interface", "actual-interface" }
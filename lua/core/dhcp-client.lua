@@ -22,10 +22,7 @@
 -- Stop dhcp ... kill the process if it's running, that will cause the
 -- address to be removed (if we have a valid lease)
 --
-local function stop_dhcp(path, ci)
-	local base = CONFIG[path]
-	local uniq = ci._uniq
-	local live = base.live[uniq]
+local function stop_dhcp(path, ci, live)
 	local dev = core.interface.lookupbyname(ci.interface)
 
 	if live._pid then
@@ -39,10 +36,7 @@ end
 -- Start dhcp ... start the executable and save the pid into the live
 -- structure
 --
-local function start_dhcp(path, ci)
-	local base = CONFIG[path]
-	local uniq = ci._uniq
-	local live = base.live[uniq]
+local function start_dhcp(path, ci, live)
 	local dev = core.interface.lookupbyname(ci.interface)
 	local args = { 	"--interface", dev,
 					"--script", "/opentik/scripts/dhcp-lease.lua",
@@ -51,10 +45,18 @@ local function start_dhcp(path, ci)
 	local pid = lib.run.background("/sbin/udhcpc", args)
 	print("PID is "..pid)
 	live._pid = pid
+	live._dev = dev
 
 	print(lib.cf.dump(CONFIG[path]))
 end
 
+--
+-- Update dhcp ... the other fields are only used when we get a lease so
+-- there is nothing to do to the running client
+--
+local function update_dhcp(path, ci, changed, live)
+end
+
 --
 -- DHCP Event ... called when we get an address, we update the live
 -- structure, and then add the ipaddress etc.
@@ -152,6 +154,7 @@ lib.cf.register("/ip/dhcp-client", {
 		["interface"] = { 	
 			default = "",
 			uniq = true,
+			restart = core.interface.device_changed("interface"),
 		 },
 		["use-peer-dns"] = { 
 			default = true,
@@ -174,6 +177,7 @@ lib.cf.register("/ip/dhcp-client", {
 		["ci-post-process"] = nil,
 		["stop"] = stop_dhcp,
 		["start"] = start_dhcp,
+		["update"] = update_dhcp,
 		["can-delete"] = true,
 		["can-disable"] = true,
 		["field-order"] = { "interface", "add-default-route", "use-peer-dns", "use-peer-ntp",
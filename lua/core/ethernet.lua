@@ -26,21 +26,44 @@ _ = core.interface
 --
 -- Start the interface
 --
-local function ether_start(path, ci)
+local function ether_start(path, ci, live)
 	local dev = core.interface.lookupbyname(ci.name)
 
 	lib.ip.link.set(dev, "mtu", ci.mtu, "up")
+	core.interface.sync_live(ci, live)
 end
 
 --
--- Stop the interface
+-- Adopt the interface if it's already up with the right mtu
+--
+local function ether_adopt(path, ci, live)
+	local link = core.interface.link(core.interface.lookupbyname(ci.name))
+
+	if not link or not link.up or link.mtu ~= tonumber(ci.mtu) then return false end
+	core.interface.sync_live(ci, live)
+	return true
+end
+
+--
+-- Stop the interface, we use the system name from the config we were started
+-- with since the name may have changed by now
 --
 local function ether_stop(path, ci)
-	local dev = core.interface.lookupbyname(ci.name)
+	local dev = ci._system_name
 
 	lib.ip.link.set(dev, "down")
 end
 
+--
+-- Update the interface in place, only the mtu needs anything doing, a new
+-- name or comment is purely our business
+--
+local function ether_update(path, ci, changed)
+	local dev = ci._system_name
+
+	if changed.mtu then lib.ip.link.set(dev, "mtu", ci.mtu) end
+end
+
 --
 --
 --
@@ -63,7 +86,6 @@ lib.cf.register("/interface/ethernet", {
 			prep = false,
 		},
 		["mtu"] = { 
-			restart = true, 
 			default = 1500,
 		},
 		["type"] = { 
@@ -71,6 +93,9 @@ lib.cf.register("/interface/ethernet", {
 			default = "ether",
 			prep = false,
 		},
+		["comment"] = {
+			default = "",
+		},
 	},
 	
 	["flags"] = {
@@ -83,7 +108,11 @@ lib.cf.register("/interface/ethernet", {
 		["duplicate"] = "/interface",
 		["ci-post-process"] = core.interface.ci_postprocess,
 		["start"] = ether_start,
+		["adopt"] = ether_adopt,
 		["stop"] = ether_stop,
+		["update"] = ether_update,
+		["can-add"] = false,			-- they come with the system
+		["find-by"] = "default-name",	-- so export finds them by this
 		["can-delete"] = false,			-- can't delete ether interfaces
 		["can-disable"] = true,			-- can disable them though
 		["field-order"] = { "name", "default-name", "disabled", "mtu", "type" }
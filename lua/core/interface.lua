@@ -17,18 +17,80 @@
 ------------------------------------------------------------------------------
 
 --
--- Maintain the lookup for system interface in the /interface (_if_lookup) section
--- so that we can map from interface events back to the correct item in the cf.
+-- We map system interfaces back to the items in the cf in two steps: the
+-- system name (from the config) gives us the item, and the kernel tells us
+-- the ifindex for the name (see link_event), everything after that is by
+-- ifindex.
 --
+local byname = {}			-- system name -> { path, uniq }
+local byindex = {}			-- ifindex -> { path, uniq }
+local links = {}			-- ifindex -> the latest link event from the kernel
+local indexof = {}			-- system name -> ifindex
+
+--
+-- Copy the kernel state of a link into the live item (if there is one yet,
+-- the start function catches up otherwise)
+--
+local function live_of(map)
+	return map and CONFIG[map.path].live[map.uniq]
+end
+
+local function apply_link(live, ev)
+	if not live then return end
+
+	if ev then
+		live._ifindex = ev.ifindex
+		live._running = ev.running or nil
+		live._operstate = ev.operstate
+		live._actual_mtu = ev.mtu
+		live._mac = ev.mac
+		live._stats = ev.stats
+	else
+		live._ifindex, live._running, live._operstate = nil, nil, nil
+		live._actual_mtu, live._mac, live._stats = nil, nil, nil
+	end
+end
+
 local function ci_postprocess(path, ci, going)
-	local uniq = ci._uniq
-	local base = CONFIG["/interface"]
-	local map = (not going and { ["path"] = path, ["uniq"] = uniq }) or nil
+	local name = ci._system_name
+	local map = (not going and { ["path"] = path, ["uniq"] = ci._uniq }) or nil
+	local ifindex = indexof[name]
 
-	base._if_lookup = base._if_lookup or {}
-	base._if_lookup[ci._system_name] = map
+	byname[name] = map
+	if ifindex then byindex[ifindex] = map end
 end
 
+local function link_event(ev)
+	local old = links[ev.ifindex]
+
+	if old and old.name ~= ev.name then indexof[old.name] = nil end
+	local map = byindex[ev.ifindex]
+
+	if ev.action == "del" then
+		apply_link(live_of(map), nil)
+		links[ev.ifindex] = nil
+		indexof[ev.name] = nil
+		byindex[ev.ifindex] = nil
+	else
+		links[ev.ifindex] = ev
+		indexof[ev.name] = ev.ifindex
+		map = byname[ev.name] or map		-- renamed under us
+		byindex[ev.ifindex] = map
+		apply_link(live_of(map), ev)
+	end
+	if map and live_of(map) then lib.cf.changed(map.path, map.uniq) end
+end
+
+lib.netlink.on("link", link_event)
+
+--
+-- For a start function to bring its live item up to date
+--
+local function sync_live(ci, live)
+	local ifindex = indexof[ci._system_name]
+
+	if ifindex then apply_link(live, links[ifindex]) end
+end
 
 --
 -- This is a helper function that anyone can use to lookup the system
@@ -40,12 +102,41 @@ local function lookupbyname(name)
 	return map._system_name
 end
 
+--
+-- And back from the kernel's ifindex (or the system name) to our name
+--
+local function lookupbyindex(ifindex)
+	local map = byindex[ifindex]
+	if not map then return "unknown" end
+	return map.uniq
+end
+
+--
+-- What the kernel last told us about a system interface
+--
+local function link(dev)
+	local ifindex = indexof[dev]
+	return ifindex and links[ifindex]
+end
+
 local function lookupbydev(dev)
-	local map = CONFIG["/interface"]._if_lookup[dev]
+	local ifindex = indexof[dev]
+	local map = (ifindex and byindex[ifindex]) or byname[dev]
 	if not map then return "unknown" end
 	return map.uniq
 end
 
+--
+-- A restart check for fields that reference an interface by name, we only
+-- need a restart if the item would now end up on a different device (the
+-- start function keeps the device it used in live._dev)
+--
+local function device_changed(field)
+	return function(_, _, ci, live)
+		return lookupbyname(ci[field]) ~= live._dev
+	end
+end
+
 --
 --
 --
@@ -75,6 +166,9 @@ lib.cf.register("/interface", {
 			readonly = true, 
 			default = "",
 		},
+		["comment"] = {
+			default = "",
+		},
 	},
 	
 	["flags"] = {
@@ -85,6 +179,8 @@ lib.cf.register("/interface", {
 	},
 
 	["options"] = {
+		["can-add"] = false,			-- they come with the system
+		["find-by"] = "default-name",	-- so export finds them by this
 		["can-delete"] = false,			-- can't delete ether interfaces
 		["can-disable"] = true,			-- can disable them though
 		["field-order"] = { "name", "default-name", "disabled", "mtu", "type" }
@@ -94,6 +190,10 @@ lib.cf.register("/interface", {
 return {
 	ci_postprocess = ci_postprocess,
 	lookupbyname = lookupbyname,
+	lookupbyindex = lookupbyindex,
 	lookupbydev = lookupbydev,
+	link = link,
+	sync_live = sync_live,
+	device_changed = device_changed,
 }
 
@@ -30,160 +30,932 @@ end
 
 
 --
--- Stop route ... 
+-- Each dst-address@routing-mark has a heap of candidate routes (ours from
+-- the config and anything else the kernel has) ordered by distance, the
+-- top one is the active one. A change only touches its own destination and
+-- we only ever tell the kernel about the difference, so a table of a
+-- million routes costs no more to change than one of ten.
 --
-local function stop_route(path, ci)
---	local dev = core.interface.lookupbyname(ci.interface)
+-- Ours go in with a protocol of our own and metric 0, so we can tell them
+-- apart from everyone else's (even other static ones) in the kernel events
+-- and so a replace swaps one of ours for another in place.
+--
+-- The active route for each destination also goes in a longest prefix
+-- match table (c.lpm) per routing-mark, that's what we resolve gateways
+-- against and what /ip route check looks in.
+--
+-- Routes with the same gateway share a hop, which is resolved once and
+-- goes in the kernel as a nexthop object (a group for an ECMP gateway) that
+-- our routes point at. When a gateway moves that's one replace for the
+-- object rather than one for every route through it.
+--
+local ROUTE_TYPES = { ["unicast"] = true, ["prohibit"] = true, ["blackhole"] = true, ["unreachable"] = true }
+local TABLE_NAMES = { [253] = "default", [254] = "main", [255] = "local" }
+local TABLE_IDS = { ["default"] = 253, ["main"] = 254, ["local"] = 255 }
+local RTPROT_KERNEL = 2
+local RTPROT_OPENTIK = 73		-- not one iproute2 knows about
+local RT_SCOPE_LINK = 253
+local MAX_CASCADE = 32
+local EEXIST = 17
+local NHID_BASE = 0x4f540000	-- where our kernel nexthop ids start
+
+local dests = {}			-- dst@mark -> { heap, selected, installed }
+local externals = {}		-- lib.netlink key -> candidate
+local shared_nh = setmetatable({}, { __mode = "v" })	-- gateway%interface -> nh
+local tables = {}			-- routing-mark -> c.lpm of the active routes
+local hops = {}				-- hop key -> shared next hop
+local gateways = nil		-- c.lpm of gateway address -> set of hops using it
+local nexthops = true		-- install ours through kernel nexthop objects
+local nhid = NHID_BASE
+local cascade = 0
+local seq = 0
+
+local reselect, refresh
 
---	lib.ip.addr.del(ci.address, dev)
+--
+-- Lower distance wins, on a tie the system's route beats ours and then the
+-- one that came first
+--
+local function better(a, b)
+	if a.distance ~= b.distance then return a.distance < b.distance end
+	if a.ours ~= b.ours then return not a.ours end
+	return a.seq < b.seq
 end
 
 --
--- Start route...
+-- A destination is its own heap of candidates, which saves a table for
+-- each one of a full table's worth
 --
-local function start_route(path, ci)
---	local dev = core.interface.lookupbyname(ci.interface)
+local function dest(key, dst, mark)
+	local d = dests[key]
+
+	if not d then
+		d = lib.heap.new(better)
+		d.dst, d.mark = dst, mark
+		dests[key] = d
+	end
+	return d
+end
 
---	lib.ip.addr.add(ci.address, dev)
+local function lpm(mark)
+	local t = tables[mark]
+
+	if not t then
+		t = c.lpm.new()
+		tables[mark] = t
+	end
+	return t
+end
+
+local function is_ip(s)
+	return s:match("^[%d.]+$") or s:find(":", 1, true)
+end
+
+--
+-- Where a candidate sends things: its next hop (if there is one) and the
+-- interface, ours get theirs from the hop they share with everyone else
+-- using the same gateway. The signature is just so we can see if it's
+-- changed.
+--
+local function nexthop(cand)
+	return (cand.hop and cand.hop.nh) or cand.nh
 end
 
+local function nh_sig(nh)
+	return nh and ((nh.gateway or "") .. "%" .. nh.interface)
+end
 
+--
+-- What the kernel has for one of ours, with nexthop objects the route only
+-- changes if it moves to a different hop
+--
+local function route_sig(cand)
+	if not cand then return nil end
+	if cand.hop and nexthops then return cand.hop.key end
+	return nh_sig(nexthop(cand)) or ""
+end
 
 --
--- Pull out the set of routes from the system routing table and turn them
--- into a set on entries that have a similar format to our live data
+-- Resolve a gateway through the main table: the route covering it has to
+-- be within our target-scope, and if that route has a gateway itself we go
+-- there (recursive) otherwise the gateway is directly reachable. Routes we
+-- install always have their resolved next hop so one lookup is enough.
 --
-local function system_routes()
-	--
-	-- Pull out the basic routes list from iproute2
-	--
-	local st, routes = lib.run.execute("/sbin/ip", { "-4", "route", "show", "table", "all" })
+local function resolve(hop)
+	local r = tables["main"] and tables["main"]:lookup(hop.gw)
+	local nh = r and nexthop(r)
 
-	--
-	-- Add the "unicase" keyword to ones starting with an address
-	--
-	for i,r in ipairs(routes) do
-		local entry = {}
+	if not nh or r.scope > hop.scope then return nil end
+	if nh.gateway then
+		return { gateway = nh.gateway, interface = nh.interface, recursive = true }, r
+	end
+	return { gateway = hop.gw, interface = nh.interface }, r
+end
 
-		--
-		-- Process the entry and split it into key/value pairs
-		--
-		r:gsub("default", "0.0.0.0/0"):gsub("^([%d%./]+)%s", "unicast %1 ")
-			:gsub("%s([%d%./]+)%s", " dst-address %1 ",1):gsub("^", "type ")
-			:gsub(" src ", " pref-src "):gsub(" table ", " routing-mark ")
-				:gsub("([^%s]+)%s+([^%s]+)", function(k,v) entry[k] = v end)
+local function hop_status(hop)
+	local nh = hop.nh
 
-		routes[i] = nil
-		if entry.type == "unicast" or entry.type == "prohibit" 
-		or entry.type == "blackhole" or entry.type == "unreachable" then
-			-- ensure we have a valid netmask, sort out the table, and see if its connected
-			entry["dst-address"] = entry["dst-address"] .. ((not entry["dst-address"]:match("/") and "/32") or "")
-			if entry.proto == "kernel" then
-				entry._connected = true
-				entry.distance = 0
-			else
-				entry.distance = 256
+	if not nh then return hop.gw .. " unreachable" end
+	if nh.recursive then return hop.gw .. " recursive via " .. nh.gateway .. " " .. nh.interface end
+	return hop.gw .. " reachable via " .. nh.interface
+end
+
+--
+-- A route can't be resolved through its own destination, and one with an
+-- ECMP gateway is fine as long as one of them is
+--
+local function usable(hop, dst)
+	if hop.members then
+		for _,m in ipairs(hop.members) do
+			if usable(m, dst) then return true end
+		end
+		return false
+	end
+	return hop.nh ~= nil and hop.via ~= dst
+end
+
+local function gateway_status(cand)
+	local hop = cand.hop
+
+	if hop.via and hop.via == cand.dst then return hop.gw .. " unreachable" end
+	return hop.status
+end
+
+--
+-- Kernel nexthop objects, one per hop that an installed route of ours is
+-- using and created when the first one goes in. A group holds on to the
+-- objects for the members that resolve. Taking an object away takes the
+-- routes using it too, so we only let go once nothing is.
+--
+local hold, drop
+
+local function nexthop_opts(hop)
+	if hop.members then
+		local ids = {}
+
+		for _,m in ipairs(hop.members) do
+			if hop.held[m] then ids[#ids+1] = m.id end
+		end
+		return { ["group"] = ids, ["protocol"] = RTPROT_OPENTIK }
+	end
+	return {
+		["gateway"] = hop.nh.gateway,
+		["dev"] = core.interface.lookupbyname(hop.nh.interface),
+		["protocol"] = RTPROT_OPENTIK,
+	}
+end
+
+--
+-- Pick up the group members that now resolve and let go of those that don't
+--
+local function regroup(hop)
+	local gone = {}
+
+	for _,m in ipairs(hop.members) do
+		if m.nh and not hop.held[m] then
+			if hold(m) then hop.held[m] = true end
+		elseif not m.nh and hop.held[m] then
+			hop.held[m] = nil
+			gone[#gone+1] = m
+		end
+	end
+	return gone
+end
+
+hold = function(hop)
+	if hop.refs == 0 then
+		if hop.members then
+			regroup(hop)
+			if not next(hop.held) then return nil, "no usable gateway in " .. hop.key end
+		end
+		while not hop.id do
+			local ok, err, errno
+
+			nhid = nhid + 1
+			hop.id = nhid
+			ok, err, errno = lib.ip.nexthop.add(hop.id, nexthop_opts(hop))
+			if not ok then
+				hop.id = nil
+				if errno ~= EEXIST then
+					if hop.members then
+						for m in pairs(hop.held) do hop.held[m] = nil drop(m) end
+					end
+					return nil, "unable to add nexthop " .. hop.key .. ": " .. err
+				end
 			end
+		end
+	end
+	hop.refs = hop.refs + 1
+	return true
+end
 
-			-- clean out the bits we don't need
-			entry.proto = nil
-			entry.scope = nil
-			entry.metric = nil
+--
+-- Forget a hop once nothing is using it, one that took over a kernel
+-- object at startup (see claim_hop) might not have been held since
+--
+local function forget(hop)
+	if hop.refs > 0 or next(hop.cands) or next(hop.groups) then return end
 
-			-- map in our interface names
-			if entry["dev"] then entry["dev"] = core.interface.lookupbydev(entry["dev"]) end
+	if hop.id then
+		lib.ip.nexthop.del(hop.id)
+		hop.id = nil
+	end
+	hops[hop.key] = nil
+	if hop.parent then hop.parent.children[hop] = nil end
+	if hop.gw then
+		local set = gateways:get(hop.gw)
+		set[hop] = nil
+		if not next(set) then gateways:remove(hop.gw) end
+	end
+	for _,m in ipairs(hop.members or {}) do
+		m.groups[hop] = nil
+		forget(m)
+	end
+end
 
-			-- set the flags for the special cases
-			if entry.type == "prohibit" or entry.type == "blackhole" or entry.type == "unreachable" then
-				entry["_"..entry.type] = true
-			elseif entry.via then
-				entry["gateway-status"] = entry["via"] .. " reachable via " .. entry["dev"]
-				entry["gateway"] = entry.via
-			else
-				entry["gateway-status"] = entry["dev"] .. " reachable"
-				entry["gateway"] = entry["dev"]
+drop = function(hop)
+	hop.refs = hop.refs - 1
+	if hop.refs > 0 then return end
+
+	local id = hop.id
+
+	hop.id = nil
+	if id then lib.ip.nexthop.del(id) end
+	if hop.members then
+		for m in pairs(hop.held) do hop.held[m] = nil drop(m) end
+	end
+	forget(hop)
+end
+
+--
+-- One of ours going in or coming out of the kernel
+--
+local function acquire(cand)
+	if not nexthops or not cand.hop or cand.held then return true end
+
+	local ok, err = hold(cand.hop)
+	if ok then cand.held = cand.hop end
+	return ok, err
+end
+
+local function release(cand)
+	local hop = cand and cand.held
+
+	if hop then
+		cand.held = nil
+		drop(hop)
+	end
+end
+
+--
+-- What we ask the kernel for to install or remove one of ours
+--
+local function kernel_route(cand)
+	local ci = cand.ci
+	local opts = {
+		["table"] = TABLE_IDS[cand.mark] or tonumber(cand.mark),
+		["protocol"] = RTPROT_OPENTIK,
+	}
+
+	if ci.type ~= "unicast" then
+		opts.type = ci.type
+	elseif cand.held then
+		opts.nhid = cand.held.id
+	elseif cand.hop then
+		opts.gateway = cand.hop.nh.gateway
+		opts.dev = core.interface.lookupbyname(cand.hop.nh.interface)
+	end
+	if ci["pref-src"] ~= "" then opts["pref-src"] = ci["pref-src"] end
+	return cand.dst, opts
+end
+
+local function kernel_del(cand)
+	return cand.dst, { ["table"] = TABLE_IDS[cand.mark] or tonumber(cand.mark), ["protocol"] = RTPROT_OPENTIK }
+end
+
+--
+-- After a restart the kernel still has our routes and nexthop objects from
+-- last time. While the config is being reconciled (see lib.cf.reconcile)
+-- we keep what we found by dst@mark and id, a route that wins its
+-- destination takes over the kernel's one if it matches what we'd install
+-- rather than replacing it. Whatever is left once we're done goes.
+--
+-- Our routes come with the netlink dump if that happens while we're
+-- reconciling, otherwise we ask for them. The kernel isn't touched for
+-- any destination until the reconcile is done (deferred has them) so a
+-- destination only changes if what finally wins there differs.
+--
+local leftover = nil		-- dst@mark -> kernel route of ours
+local leftover_nh = nil		-- id -> kernel nexthop object of ours
+local deferred = nil		-- dst@mark -> true, waiting for the reconcile
+
+local function remember(ev)
+	local key = ev.dst .. "@" .. (TABLE_NAMES[ev.table] or tostring(ev.table))
+
+	leftover = leftover or {}
+	if leftover[key] then table.insert(leftover, ev) else leftover[key] = ev end
+end
+
+local function kernel_state()
+	if leftover_nh then return end
+
+	leftover_nh, deferred = {}, {}
+	if not leftover then
+		leftover = {}
+		for _,ev in ipairs(assert(c.nl.dump("route"))) do
+			if ev.protocol == RTPROT_OPENTIK then remember(ev) end
+		end
+	end
+	for _,ev in ipairs(c.nl.dump("nexthop") or {}) do
+		if ev.protocol == RTPROT_OPENTIK then
+			leftover_nh[ev.id] = ev
+			nhid = math.max(nhid, ev.id)
+		end
+	end
+end
+
+--
+-- Take over a kernel nexthop object for a hop if it goes where the hop
+-- does, a group needs its members to take over the objects it's made of
+--
+local function claim_hop(hop, id)
+	if hop.id then return hop.id == id end
+
+	local nh = leftover_nh[id]
+	if not nh or not hop.nh then return false end
+	if hop.members then
+		local i = 0
+
+		if not nh.group then return false end
+		for _,m in ipairs(hop.members) do
+			if m.nh then
+				i = i + 1
+				if not nh.group[i] or not claim_hop(m, nh.group[i]) then return false end
 			end
-			entry.via = nil
-			entry.dev = nil
+		end
+		if i ~= #nh.group then return false end
+	elseif nh.gateway ~= hop.nh.gateway or not nh.oif or core.interface.lookupbyindex(nh.oif) ~= hop.nh.interface then
+		return false
+	end
+	leftover_nh[id] = nil
+	hop.id = id
+	return true
+end
+
+local function claim(cand)
+	local ev = leftover and leftover[cand.key]
+	if not ev then return false end
+
+	local ci = cand.ci
+	local hop = cand.hop
+	local src = (ci["pref-src"] ~= "" and ci["pref-src"]) or nil
+
+	-- we'll be replacing it if it doesn't match, so either way it's done with
+	leftover[cand.key] = nil
+	if ev.type ~= ci.type or (ev.metric or 0) ~= 0 or ev["pref-src"] ~= src then return false end
+	if not hop then return not ev.nhid and not ev.gateway end
+	if nexthops then return ev.nhid ~= nil and claim_hop(hop, ev.nhid) end
+	return not ev.nhid and ev.gateway == hop.nh.gateway and ev.oif ~= nil and
+										core.interface.lookupbyindex(ev.oif) == hop.nh.interface
+end
 
-			-- TODO: routing mark name lookup
-			-- TODO: proper interface name lookup (for gateway-status)
+--
+-- A hop has changed, so a route using it might now be in or out of the
+-- running for its destination
+--
+local function retry(cand)
+	if cand.failed then return end
+
+	local d = dest(cand.key, cand.dst, cand.mark)
+	local ok = usable(cand.hop, cand.dst)
+
+	cand.live["gateway-status"] = gateway_status(cand)
+	if ok ~= lib.heap.contains(d, cand) then
+		if ok then lib.heap.push(d, cand) else lib.heap.remove(d, cand) end
+		reselect(cand.key)
+	elseif d.installed == cand and not cand.held then
+		reselect(cand.key)
+	end
+end
+
+--
+-- Where a hop goes has changed: with a kernel object that's one request
+-- however many routes use it. Then the groups it's in, the routes using it
+-- and any hop that resolves through one of those routes.
+--
+local function changed(hop)
+	if cascade >= MAX_CASCADE then
+		print("Route resolution loop at " .. hop.key .. ", giving up")
+		return
+	end
+	cascade = cascade + 1
+
+	local gone = {}
+	if hop.id and hop.members then
+		gone = regroup(hop)
+		if next(hop.held) then lib.ip.nexthop.replace(hop.id, nexthop_opts(hop)) end
+	elseif hop.id and hop.nh then
+		local ok, err = lib.ip.nexthop.replace(hop.id, nexthop_opts(hop))
+		if not ok then print("unable to change nexthop " .. hop.key .. ": " .. err) end
+	end
+	for _,m in ipairs(gone) do drop(m) end
+
+	local list = {}
+	for g in pairs(hop.groups) do list[#list+1] = g end
+	for _,g in ipairs(list) do refresh(g) end
+
+	list = {}
+	for cand in pairs(hop.cands) do list[#list+1] = cand end
+	for _,cand in ipairs(list) do retry(cand) end
+
+	list = {}
+	for child in pairs(hop.children) do list[#list+1] = child end
+	for _,child in ipairs(list) do refresh(child) end
+
+	cascade = cascade - 1
+end
+
+--
+-- Work out where a hop goes now, a group goes wherever its members do
+--
+refresh = function(hop)
+	local nh, r, sig
 
-			-- store with a uniq key
-			local key = string.format("%s@%s", entry["dst-address"], entry["routing-mark"] or "main")
-			routes[key] = entry
+	if hop.members then
+		local status, sigs = {}, {}
+
+		for _,m in ipairs(hop.members) do
+			nh = nh or m.nh
+			status[#status+1] = m.status
+			sigs[#sigs+1] = nh_sig(m.nh) or "-"
+		end
+		hop.status = table.concat(status, ",")
+		sig = table.concat(sigs, ",")
+		if sig == hop.sig then return end
+		hop.nh, hop.sig = nh, sig
+		return changed(hop)
+	end
+	if not hop.gw then return end
+
+	nh, r = resolve(hop)
+
+	local parent = r and r.hop
+	if parent ~= hop.parent then
+		if hop.parent then hop.parent.children[hop] = nil end
+		if parent then parent.children[hop] = true end
+		hop.parent = parent
+	end
+
+	local via = r and r.dst
+	sig = nh_sig(nh)
+	if sig == hop.sig and via == hop.via then return end
+	hop.nh, hop.sig, hop.via = nh, sig, via
+	hop.status = hop_status(hop)
+	changed(hop)
+end
+
+--
+-- Find (or make) the hop for a gateway, which is an address, an interface
+-- or a comma separated list of them for ECMP. Routes with the same gateway
+-- and target-scope share one.
+--
+local function single_hop(gw, scope)
+	local key = (is_ip(gw) and (gw .. "@" .. scope)) or ("%" .. gw)
+	local hop = hops[key]
+
+	if hop then return hop end
+	hop = { key = key, scope = scope, refs = 0, cands = {}, groups = {}, children = {} }
+	hops[key] = hop
+	if is_ip(gw) then
+		hop.gw = gw
+		gateways = gateways or c.lpm.new()
+
+		local set = gateways:get(gw)
+		if not set then
+			set = {}
+			gateways:insert(gw, set)
+		end
+		set[hop] = true
+		hop.status = hop_status(hop)
+		refresh(hop)
+	else
+		hop.nh = { interface = gw }
+		hop.status = gw .. " reachable"
+	end
+	return hop
+end
+
+local function find_hop(gateway, scope)
+	if not gateway:find(",", 1, true) then return single_hop(gateway, scope) end
+
+	local members, keys, seen = {}, {}, {}
+	for gw in gateway:gmatch("[^,%s]+") do
+		local m = single_hop(gw, scope)
+
+		if not seen[m] then
+			seen[m] = true
+			members[#members+1] = m
+			keys[#keys+1] = m.key
 		end
 	end
-	return routes
+	if #members == 1 then return members[1] end
+
+	table.sort(keys)
+	local key = table.concat(keys, ",")
+	local hop = hops[key]
+
+	if hop then return hop end
+	hop = { key = key, members = members, held = {}, refs = 0, cands = {}, groups = {}, children = {} }
+	hops[key] = hop
+	for _,m in ipairs(members) do m.groups[hop] = true end
+	refresh(hop)
+	return hop
 end
 
+--
+-- Something about the active route for a main table prefix has changed, so
+-- any gateway inside it might resolve differently now
+--
+local function prefix_changed(dst)
+	if not gateways then return end
 
+	local list = {}
+	for _,set in ipairs(gateways:within(dst)) do
+		for hop in pairs(set) do list[#list+1] = hop end
+	end
+	for _,hop in ipairs(list) do refresh(hop) end
+end
 
 --
--- Build a list of routes that we think should be deployed based on dst-address/routing-mark/type and
--- the distance ... so we only pick the one with the smallest distance in each case.
+-- Work out the best candidate for a destination, move the active flag to
+-- it and sort out the kernel if what of ours should be there has changed.
+-- One of ours that the kernel won't take is out of the running until it's
+-- restarted, and we go round again for the next best.
 --
-local function route_list()
-	local base = CONFIG["/ip/route"]
-	local live = base.live
-	local system = system_routes()
+reselect = function(key)
+	local d = dests[key]
+	if not d then return end
 
-	-- Rework our list building a table for each uniq dst/mark/type combination with the lowest
-	-- distance only stored, we remove all the external stuff as we process.
-	local dests = {}
-	for uniq,rt in pairs(live) do
-		if rt._external then
-			live[uniq] = nil
-		else
-			local dest = string.format("%s@%s", rt["dst-address"], rt["routing-mark"])
-			local sysdist = (system[dest] and system[dest].distance) or 256
-			local prevdist = (dests[dest] and dests[dest].distance) or 256
-			rt.active = nil
-			if base.cf[uniq] then rt.static = true end
-
-			if rt["distance"] < sysdist and rt["distance"] < prevdist then
-				dests[dest] = rt
+	local moved = false
+
+	while true do
+		local best = lib.heap.top(d)
+
+		if best ~= d.selected then
+			if d.selected and d.selected.live then d.selected.live.active = nil end
+			if best then
+				if best.live then best.live.active = true end
+				lpm(d.mark):insert(d.dst, best)
+			else
+				lpm(d.mark):remove(d.dst)
 			end
+			d.selected = best
+			moved = true
 		end
+		if deferred then
+			deferred[key] = true
+			break
+		end
+
+		local want = (best and best.ours and best) or nil
+		local sig = route_sig(want)
+		local was, wassig = d.installed, d.sig
+		if want == was and sig == wassig then break end
+
+		-- record what we're after before we ask, since asking might suspend
+		-- us and someone else change this destination in the meantime
+		d.installed, d.sig = want, sig
+		if not want then
+			lib.ip.route.del(kernel_del(was))
+			release(was)
+			break
+		end
+
+		local adopted = not was and claim(want)
+		local ok, err = acquire(want)
+		if ok and not adopted then
+			local dst, opts = kernel_route(want)
+
+			ok, err = lib.ip.route.replace(dst, opts)
+			if not ok then err = "unable to add route to " .. dst .. ": " .. err end
+		end
+		if ok then
+			want.live._error = nil
+			if was ~= want then release(was) end
+			break
+		end
+		if was ~= want then release(want) end
+		want.failed = err
+		want.live._error = want.failed
+		lib.heap.remove(d, want)
+		if d.installed == want then d.installed, d.sig = was, wassig end
 	end
 
-	-- At this point we should have the list of all the active routes, we can run through
-	-- our system routes ensuring our stuff is properly installed.
+	if lib.heap.size(d) == 0 and not d.installed then dests[key] = nil end
+	if moved and d.mark == "main" then prefix_changed(d.dst) end
+end
 
-	for dest,rt in pairs(dests) do
-		local sysdest = system[dest]
+--
+-- Stop route ... take it out of the running for its destination and let
+-- go of its gateway
+--
+local function stop_route(path, ci, live)
+	local cand = live._cand
+	if not cand then return end
 
-		print("Looking at "..dest)
+	live._cand = nil
+	live.active = nil
 
-		if not sysdest then
-			print("need to add to system")
-		elseif sysdest.type ~= rt.type or sysdest.gateway ~= rt.gateway then
-			print("need to change del/add")
-			-- TODO: copy status over
-			rt["gateway-status"] = sysdest["gateway-status"]
+	local d = dests[cand.key]
+	if d and lib.heap.contains(d, cand) then
+		lib.heap.remove(d, cand)
+		reselect(cand.key)
+	end
+	if cand.hop then
+		cand.hop.cands[cand] = nil
+		forget(cand.hop)
+	end
+end
+
+--
+-- Start route ... put it in the running for its destination, a gateway
+-- that we can't resolve keeps it out until we can. If it wins and the
+-- kernel won't have it the error ends up on this item.
+--
+local function start_route(path, ci, live)
+	local mark = ci["routing-mark"]
+	local cand
+
+	seq = seq + 1
+	cand = {
+		key = string.format("%s@%s", ci["dst-address"], mark),
+		dst = ci["dst-address"], mark = mark,
+		distance = ci.distance, scope = tonumber(ci.scope), type = ci.type,
+		ours = true, ci = ci, live = live, seq = seq,
+	}
+	live._cand = cand
+	live.static = true
+
+	if ci.type == "unicast" and ci.gateway ~= "" then
+		cand.hop = find_hop(ci.gateway, tonumber(ci["target-scope"]))
+		cand.hop.cands[cand] = true
+		live["gateway-status"] = gateway_status(cand)
+	end
+
+	if not cand.hop or usable(cand.hop, cand.dst) then lib.heap.push(dest(cand.key, cand.dst, cand.mark), cand) end
+	reselect(cand.key)
+	if cand.failed then
+		live._cand = nil
+		if cand.hop then
+			cand.hop.cands[cand] = nil
+			forget(cand.hop)
+		end
+		error(cand.failed, 0)
+	end
+end
+
+--
+-- Adopt route ... this is just a start, but with what the kernel had from
+-- last time to hand so a route that's already there is left alone
+--
+local function adopt_route(path, ci, live)
+	kernel_state()
+	start_route(path, ci, live)
+	return true
+end
+
+--
+-- Once the config is up, anything of ours that nothing claimed goes (the
+-- routes first, taking a nexthop object out takes its routes with it)
+--
+local function reconciled_routes(path)
+	kernel_state()
+
+	local keys = deferred
+	deferred = nil
+	for key in pairs(keys) do reselect(key) end
+
+	local b = lib.ip.batch()
+	local routes, objects = 0, 0
+
+	for _,ev in pairs(leftover) do
+		b:route_del(ev.dst, { ["table"] = ev.table, ["protocol"] = RTPROT_OPENTIK, ["metric"] = ev.metric,
+								["dev"] = (ev.family == "ipv6" and ev.oif) or nil })
+		routes = routes + 1
+	end
+	for id in pairs(leftover_nh) do
+		b:nexthop_del(id)
+		objects = objects + 1
+	end
+	if routes + objects > 0 then
+		b:send()
+		print(string.format("Removed %d routes and %d nexthops left from before", routes, objects))
+	end
+	leftover, leftover_nh = nil, nil
+end
+
+--
+-- The kernel's routes are kept as just their candidate (there can be a
+-- million of them) with only what isn't the same for most routes: the
+-- routing-mark is the destination's, the type is only kept if it isn't
+-- unicast and the next hop is shared between all the routes going the
+-- same way. They aren't in the config at all, print asks for them (see
+-- options dynamic) and gets something that looks like our live data made
+-- as it goes.
+--
+local function external_entry(cand)
+	local d = dests[cand.key]
+	local entry = {
+		["type"] = cand.type or "unicast",
+		["dst-address"] = cand.dst,
+		["pref-src"] = cand.src,
+		["scope"] = cand.scope,
+		["distance"] = cand.distance,
+		["active"] = (d and d.selected == cand) or nil,
+		["_external"] = true,
+		["_dynamic"] = true,
+		["_connected"] = (cand.distance == 0) or nil,
+	}
+
+	if d.mark ~= "main" then entry["routing-mark"] = d.mark end
+	if cand.type then
+		entry["_"..cand.type] = true
+	elseif cand.nh then
+		local nh = cand.nh
+
+		if nh.gateway then
+			entry["gateway-status"] = nh.gateway .. " reachable via " .. nh.interface
+			entry["gateway"] = nh.gateway
 		else
-			print("route seems to be there ok")
-			-- TODO: copy status over
-			rt["gateway-status"] = sysdest["gateway-status"]
+			entry["gateway-status"] = nh.interface .. " reachable"
+			entry["gateway"] = nh.interface
 		end
-		rt.active = true		-- mark route active
-		system[dest] = nil		-- remove from system list
-		-- TODO: status?
-	end	
+	end
+	return entry
+end
+
+local function external_items()
+	local list = {}
+	local i = 0
+
+	for _,cand in pairs(externals) do list[#list+1] = cand end
+	return function()
+		while true do
+			i = i + 1
+
+			local cand = list[i]
+			if not cand then return nil end
+			list[i] = false
+			if externals[cand.id] == cand then return cand.id, external_entry(cand) end
+		end
+	end
+end
+
+local function external_nh(gateway, dev)
+	local key = (gateway or "") .. "%" .. dev
+	local nh = shared_nh[key]
+
+	if not nh then
+		nh = { gateway = gateway, interface = dev }
+		shared_nh[key] = nh
+	end
+	return nh
+end
+
+local function external_del(id)
+	local cand = externals[id]
+	if not cand then return end
+
+	externals[id] = nil
+	lib.heap.remove(dests[cand.key], cand)
+	reselect(cand.key)
+	return true
+end
+
+--
+-- The kernel telling us about a route, anything that isn't ours becomes a
+-- candidate for its destination. One of ours arriving means we've replaced
+-- whatever the kernel had there.
+--
+local function route_event(ev)
+	local id = lib.netlink.key(ev)
+
+	local gone = external_del(id)
+	if ev.protocol == RTPROT_OPENTIK and ev.action == "new" and lib.cf.reconciling() and not leftover_nh then
+		remember(ev)
+	end
+	if ev.action ~= "new" or not ROUTE_TYPES[ev.type] or ev.protocol == RTPROT_OPENTIK then
+		if gone then lib.cf.changed("/ip/route", id) end
+		return
+	end
+
+	local mark = (ev.table == 254 and "main") or TABLE_NAMES[ev.table] or tostring(ev.table)
+	local cand
+
+	seq = seq + 1
+	cand = {
+		id = id, key = ev.dst .. "@" .. mark, dst = ev.dst,
+		distance = (ev.protocol == RTPROT_KERNEL and 0) or 256,
+		scope = (ev.scope == RT_SCOPE_LINK and 10) or 30,
+		seq = seq,
+	}
+	if ev["pref-src"] then cand.src = ev["pref-src"] end
+	if ev.type ~= "unicast" then
+		cand.type = ev.type
+	elseif ev.oif then
+		local dev = core.interface.lookupbyindex(ev.oif)
+		if dev then cand.nh = external_nh(ev.gateway, dev) end
+	end
+	externals[id] = cand
+	lib.heap.push(dest(cand.key, cand.dst, mark), cand)
+	reselect(cand.key)
+	if lib.cf.watched() then lib.cf.changed("/ip/route", id, external_entry(cand)) end
+end
+
+lib.netlink.on("route", route_event)
 
-	-- Now we can add any remaining system routes as external live ones
-	for _,rt in pairs(system) do
-		rt._external = true
-		rt._dynamic = true
-		rt.active = true
-		lib.cf.live("/ip/route", nil, rt)
+--
+-- Which route an address would take, and where it would go
+--
+local function result(r, addr)
+	if not r then return { status = "no route" } end
+	local nh = nexthop(r)
+	if not nh then return { status = (r.type and r.type ~= "unicast" and r.type) or "unreachable", route = r.dst } end
+	return { status = "ok", interface = nh.interface, nexthop = nh.gateway or addr, route = r.dst }
+end
+
+local function check(addr, mark)
+	local t = tables[mark or "main"]
+
+	return result(t and t:lookup(addr), addr)
+end
+
+--
+-- The same for a list of addresses, with all the lookups done in one call
+-- (see c.lpm lookup_many), giving a list of the results in the same order
+--
+local function check_many(addrs, mark)
+	local t = tables[mark or "main"]
+	local out = {}
+
+	if t then t:lookup_many(addrs, out) end
+	for i = 1, #addrs do out[i] = result(out[i], addrs[i]) end
+	return out
+end
+
+--
+-- /ip route check <address> [routing-mark=<mark>]
+--
+local function check_command(path, args)
+	local addr = args[1] or args["dst-ip"]
+	local lines = {}
+
+	if not addr then
+		lines = { "need an address to check" }
+	else
+		local ok, rc = pcall(check, addr, args["routing-mark"])
+
+		if not ok then
+			lines = { "bad address: " .. addr }
+		else
+			for _,field in ipairs({ "status", "interface", "nexthop", "route" }) do
+				if rc[field] then lines[#lines+1] = string.format("%10s: %s", field, rc[field]) end
+			end
+		end
 	end
 
-	-- Install any that are missing
+	local i = 0
+	return function() i = i + 1 return lines[i] end
+end
+
+--
+-- How many destinations (and how many of ours installed for them), external
+-- routes, gateways and hops we're tracking and how many of the hops are in
+-- the kernel
+--
+local function stats()
+	local n, i, x, h, k = 0, 0, 0, 0, 0
+
+	for _,d in pairs(dests) do
+		n = n + 1
+		if d.installed then i = i + 1 end
+	end
+	for _ in pairs(externals) do x = x + 1 end
+	for _,hop in pairs(hops) do
+		h = h + 1
+		if hop.id then k = k + 1 end
+	end
+	return { dests = n, installed = i, externals = x, gateways = gateways and gateways:count() or 0,
+				hops = h, nexthops = k }
+end
 
-	-- QUESTION: do we reconcile against live data somehow?	
-	
-	print(lib.cf.dump(CONFIG["/ip/route"].live))
+--
+-- Nexthop objects need a 5.3 kernel, without them (nexthops = false) our
+-- routes go in with their own gateway. This has to be set before any
+-- routes are started.
+--
+local function configure(options)
+	if options.nexthops ~= nil then nexthops = options.nexthops end
 end
 
 
@@ -193,9 +965,10 @@ lib.cf.register("/ip/route", {
 		["dst-address"] = { default = "0.0.0.0/0" },
 		["routing-mark"] = { default = "main" },
 		["scope"] = { default = 30 },
+		["target-scope"] = { default = 10 },
 		["type"] = { default = "unicast" },
 		["pref-src"] = { default = "" },
-		["gateway"] = { default = "" },
+		["gateway"] = { default = "", index = true },
 		["distance"] = { default = 1 },
 		["disabled"] = { default = false },
 	},
@@ -216,13 +989,22 @@ lib.cf.register("/ip/route", {
 		["ci-post-process"] = nil,
 		["stop"] = stop_route,
 		["start"] = start_route,
+		["adopt"] = adopt_route,
+		["reconciled"] = reconciled_routes,
+		["dynamic"] = external_items,
 		["can-delete"] = true,
 		["can-disable"] = true,
-		["field-order"] = { "dst-address", "gateway", "routing-mark", "scope", "type", "pref-src",
-							"distance" },
+		["field-order"] = { "dst-address", "gateway", "routing-mark", "scope", "target-scope", "type",
+							"pref-src", "distance" },
+		["commands"] = {
+			["check"] = check_command,
+		},
 	},
 })
 
 return {
-	route_list = route_list,
+	check = check,
+	check_many = check_many,
+	stats = stats,
+	configure = configure,
 }
@@ -0,0 +1,690 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- The RouterOS API. This uses the same length prefixed words as the cli
+-- (see lib.cli.size_encode), a sentence is a number of words ending with
+-- an empty one. The first word of a request is the command, the rest are
+-- attributes (=name=value), API attributes (.tag=x) and queries (?...):
+--
+--		/login =name=admin =password=secret
+--		/ip/route/print =.proplist=.id,dst-address ?gateway=1.2.3.4
+--		/ip/address/listen .tag=7
+--		/cancel =tag=7
+--
+-- Replies are !re (a row), !trap (an error), !done (the end of a command)
+-- and !fatal (we're closing the connection), each one carries the .tag of
+-- the command it's for so a client can have lots of commands going at once.
+--
+-- Items are identified by their uniq, which we give as .id.
+--
+
+--
+-- Where we listen: a unix socket and a TCP port (port false for none), and
+-- who can log in, a table of name = password. There's no user database yet
+-- so until users is given every login is refused. TCP is only on localhost
+-- unless you say otherwise and the unix socket is only for its owner.
+--
+local socket_path = "/tmp/opentik.api"
+local address = "127.0.0.1"
+local port = 8728
+local backlog = 64
+local users = nil
+
+local function configure(options)
+	socket_path = options.path or socket_path
+	address = options.address or address
+	if options.port ~= nil then port = options.port end
+	backlog = options.backlog or backlog
+	users = options.users or users
+end
+
+--
+-- Encode a sentence, the words and the empty word at the end go out as
+-- one chunk
+--
+local function sentence(words)
+	local buf = {}
+
+	for i, w in ipairs(words) do
+		buf[2*i-1] = c.frame.size(#w)
+		buf[2*i] = w
+	end
+	buf[#buf+1] = "\0"
+	return table.concat(buf)
+end
+
+local function send(fdt, words)
+	local out = fdt.outbuf
+
+	out[#out+1] = sentence(words)
+	lib.event.want(fdt.fd, "OUT", true)
+end
+
+--
+-- The !done (with a =ret= if there is one) or a !trap and !done for a
+-- command, tag is its .tag word (or nil)
+--
+local function done(fdt, tag, ret)
+	local words = { "!done" }
+
+	if ret then words[#words+1] = "=ret=" .. ret end
+	words[#words+1] = tag
+	send(fdt, words)
+end
+
+local function trap(fdt, tag, message, category)
+	local words = { "!trap" }
+
+	if category then words[#words+1] = "=category=" .. category end
+	words[#words+1] = "=message=" .. message
+	words[#words+1] = tag
+	send(fdt, words)
+	done(fdt, tag)
+end
+
+--
+-- A command (or the stream it started) that raised an error, the session
+-- carries on
+--
+local function failed(fdt, tag, err)
+	trap(fdt, tag, "failure: " .. tostring(err))
+end
+
+--
+-- Values are given the API way, booleans are true and false
+--
+local function api_value(v)
+	if v == true then return "true" end
+	if v == false then return "false" end
+	return tostring(v)
+end
+
+--
+-- A field's value as print shows it
+--
+local function get(base, uniq, live, name)
+	if name == ".id" then return uniq end
+
+	local field = base.fields[name]
+	if field and type(field.prep) == "function" then return field.prep(name, live) end
+	return live[name]
+end
+
+--
+-- Queries are done with a stack, each ?name=value (or ?name, ?-name,
+-- ?<name=value and ?>name=value) pushes whether the item matches and ?#
+-- works on what's there: ! negates the top, & and | combine the top two,
+-- . pushes a copy of the top and a digit pushes a copy of that entry. The
+-- item is given if everything left on the stack is true.
+--
+local function compare(v, op, value)
+	if v == nil then return false end
+	if type(v) == "boolean" then
+		if value == "yes" then value = "true" elseif value == "no" then value = "false" end
+	end
+	v = api_value(v)
+	if op == "=" then return v == value end
+
+	local a, b = tonumber(v), tonumber(value)
+	if not (a and b) then a, b = v, value end
+	if op == "<" then return a < b end
+	return a > b
+end
+
+local function compile_query(words)
+	if #words == 0 then return nil end
+
+	local steps = {}
+
+	for _, w in ipairs(words) do
+		local ops = w:match("^%?#(.*)$")
+		if ops then
+			for op in ops:gmatch(".") do table.insert(steps, { op = op }) end
+		else
+			local op, name, value = w:match("^%?([<>=]?)([^=]+)=(.*)$")
+			if op then
+				table.insert(steps, { name = name, cmp = (op == "" and "=") or op, value = value })
+			elseif w:sub(2, 2) == "-" then
+				table.insert(steps, { name = w:sub(3), absent = true })
+			else
+				table.insert(steps, { name = w:sub(2), present = true })
+			end
+		end
+	end
+
+	return function(base, uniq, live)
+		local stack = {}
+		local n = 0
+
+		for _, s in ipairs(steps) do
+			if s.name then
+				local v = get(base, uniq, live, s.name)
+
+				n = n + 1
+				if s.present then stack[n] = v ~= nil
+				elseif s.absent then stack[n] = v == nil
+				else stack[n] = compare(v, s.cmp, s.value) end
+			elseif s.op == "!" then
+				stack[n] = not stack[n]
+			elseif s.op == "&" or s.op == "|" then
+				local a, b = stack[n-1], stack[n]
+
+				n = n - 1
+				if s.op == "&" then stack[n] = a and b else stack[n] = a or b end
+			elseif s.op == "." then
+				stack[n+1] = stack[n]
+				n = n + 1
+			elseif s.op:match("%d") then
+				stack[n+1] = stack[tonumber(s.op) + 1]
+				n = n + 1
+			end
+		end
+		for i = 1, n do
+			if not stack[i] then return false end
+		end
+		return true
+	end
+end
+
+
+--
+-- Build the !re for an item, with just the .proplist fields if we were
+-- given them (otherwise .id and all of the fields). Items that don't
+-- match the query give nil.
+--
+local function row_builder(path, args, query, tag)
+	local base = CONFIG[path]
+	local names
+
+	if args[".proplist"] then
+		names = lib.util.split(args[".proplist"], ",")
+	else
+		names = lib.cf.fields(path)
+		table.insert(names, 1, ".id")
+	end
+
+	return function(uniq, live)
+		if query and not query(base, uniq, live) then return nil end
+
+		local words = { "!re" }
+		for _, name in ipairs(names) do
+			local v = get(base, uniq, live, name)
+			if v ~= nil then words[#words+1] = "=" .. name .. "=" .. api_value(v) end
+		end
+		words[#words+1] = tag
+		return sentence(words)
+	end
+end
+
+--
+-- Each command that's still going (a print being streamed or a listen) is
+-- kept in fdt.active by its tag so it can be cancelled, the streams are
+-- also in fdt.streams in the order they started. As with the cli we only
+-- pull more from a stream once the socket has taken what's queued, and
+-- each stream gets a chunk in turn so a big print doesn't hold up the
+-- commands that come after it.
+--
+local CHUNK_SIZE = 16384
+
+local function forget(fdt, entry)
+	fdt.active[entry.key] = nil
+	for i, s in ipairs(fdt.streams) do
+		if s == entry then table.remove(fdt.streams, i) break end
+	end
+end
+
+local function stream_fill(fdt, entry)
+	local out = fdt.outbuf
+	local size = 0
+
+	while size < CHUNK_SIZE do
+		local ok, s = pcall(entry.lines)
+		if not ok then
+			forget(fdt, entry)
+			if entry.close then entry.close() end
+			failed(fdt, entry.tag, s)
+			return
+		end
+		if not s then
+			forget(fdt, entry)
+			done(fdt, entry.tag)
+			return
+		end
+		out[#out+1] = s
+		size = size + #s
+	end
+	lib.event.want(fdt.fd, "OUT", true)
+end
+
+local function streams_fill(fdt)
+	for _, entry in ipairs({ table.unpack(fdt.streams) }) do stream_fill(fdt, entry) end
+end
+
+local function start(fdt, key, entry)
+	entry.key = key
+	fdt.active[key] = entry
+	if entry.lines then
+		table.insert(fdt.streams, entry)
+		stream_fill(fdt, entry)
+	end
+end
+
+--
+-- Listeners are kept by path, a change hook (only put in place when the
+-- first listen comes along) sends each change to everyone listening to its
+-- path once it has been applied: the item as it is now or just its .id and
+-- .dead if it's gone. A client that isn't reading its changes doesn't get to
+-- hold any amount of our memory, it's dropped once it's too far behind.
+--
+local listeners = {}
+local hooked = false
+local LISTEN_MAX = 65536
+
+local api_fatal
+
+local function listen_changes(changes)
+	for _, ch in ipairs(changes) do
+		for entry, _ in pairs(listeners[ch.path] or {}) do
+			local fdt = entry.fdt
+			local s
+
+			if ch.live then
+				s = entry.row(ch.uniq, ch.live)
+			else
+				s = sentence({ "!re", "=.id=" .. ch.uniq, "=.dead=true", entry.tag })
+			end
+			if s and not fdt.closed then
+				if #fdt.outbuf >= LISTEN_MAX then
+					api_fatal(fdt, "too many changes waiting")
+				else
+					fdt.outbuf[#fdt.outbuf+1] = s
+					lib.event.want(fdt.fd, "OUT", true)
+				end
+			end
+		end
+	end
+end
+
+local function unlisten(entry)
+	local ls = listeners[entry.listen]
+
+	ls[entry] = nil
+	if not next(ls) then listeners[entry.listen] = nil end
+end
+
+--
+-- Stop a command that's still going, it gets its !trap and !done unless
+-- the session is going away
+--
+local function cancel(fdt, entry, quiet)
+	forget(fdt, entry)
+	if entry.close then entry.close() end
+	if entry.listen then unlisten(entry) end
+	if not quiet then trap(fdt, entry.tag, "interrupted", 2) end
+end
+
+--
+-- Values come in as strings, a field with a boolean or numeric default
+-- takes that type
+--
+local function field_values(path, args)
+	local fields = CONFIG[path].fields
+	local items = {}
+
+	for name, value in pairs(args) do
+		if name:sub(1, 1) ~= "." then
+			local field = fields[name]
+			if not field then return nil, "unknown parameter " .. name end
+
+			local t = type(field.default)
+			if t == "boolean" then
+				if value == "true" or value == "yes" then value = true
+				elseif value == "false" or value == "no" then value = false
+				else return nil, "bad value for " .. name end
+			elseif t == "number" then
+				value = tonumber(value)
+				if not value then return nil, "bad value for " .. name end
+			end
+			items[name] = value
+		end
+	end
+	return items
+end
+
+--
+-- Config changes are a transaction of their own, anything that goes wrong
+-- puts the config back as it was (a commit that fails has done that itself)
+--
+local function change(fdt, tag, fn)
+	lib.cf.begin()
+	local ok, rc = pcall(fn)
+	if not ok or not rc then
+		lib.cf.abort()
+		trap(fdt, tag, "failure: " .. ((ok and "invalid change") or tostring(rc)))
+		return
+	end
+	local done, err = pcall(lib.cf.commit)
+	if not done then
+		trap(fdt, tag, "failure: " .. tostring(err))
+		return
+	end
+	return rc
+end
+
+--
+-- The commands each path has, they're given the session, the path, the
+-- attributes by name, the compiled query (or nil) and the tag word
+--
+local commands = {}
+
+commands["print"] = function(fdt, path, args, query, tag)
+	if args["count-only"] then
+		local n = 0
+		for _ in lib.cf.items(path, function(uniq, live)
+			return (not query or query(CONFIG[path], uniq, live)) or nil
+		end) do n = n + 1 end
+		done(fdt, tag, tostring(n))
+		return
+	end
+	return { lines = lib.cf.items(path, row_builder(path, args, query, tag)) }
+end
+
+commands["listen"] = function(fdt, path, args, query, tag)
+	if not hooked then
+		lib.cf.on_change(listen_changes)
+		hooked = true
+	end
+
+	local entry = { fdt = fdt, tag = tag, listen = path, row = row_builder(path, args, query, tag) }
+
+	if not listeners[path] then listeners[path] = {} end
+	listeners[path][entry] = true
+	return entry
+end
+
+commands["add"] = function(fdt, path, args, query, tag)
+	local items, err = field_values(path, args)
+	if not items then trap(fdt, tag, err) return end
+
+	local uniq = change(fdt, tag, function() return lib.cf.set(path, nil, items) end)
+	if uniq then done(fdt, tag, uniq) end
+end
+
+commands["set"] = function(fdt, path, args, query, tag)
+	local id = args[".id"]
+	local items, err = field_values(path, args)
+
+	if not items then trap(fdt, tag, err) return end
+	if not (id and CONFIG[path].cf[id]) then trap(fdt, tag, "no such item") return end
+	if change(fdt, tag, function() return lib.cf.set(path, id, items) end) then done(fdt, tag) end
+end
+
+commands["remove"] = function(fdt, path, args, query, tag)
+	local ids = lib.util.split(args[".id"] or "", ",")
+
+	for _, id in ipairs(ids) do
+		if not CONFIG[path].cf[id] then trap(fdt, tag, "no such item") return end
+	end
+	if change(fdt, tag, function()
+		for _, id in ipairs(ids) do lib.cf.set(path, id, nil) end
+		return true
+	end) then done(fdt, tag) end
+end
+
+--
+-- A section's own commands (options "commands") give lines, each one comes
+-- back as a =ret=
+--
+local function own_command(fn, path, args, tag)
+	local lines, close = fn(path, args)
+
+	return { lines = function()
+		local line = lines()
+		if line then return sentence({ "!re", "=ret=" .. line, tag }) end
+	end, close = close, tag = tag }
+end
+
+--
+-- Commands that aren't about a path
+--
+local function login(fdt, args, tag)
+	local name = args.name
+
+	if not name then
+		trap(fdt, tag, "only =name= and =password= login is supported")
+	elseif not users or users[name] ~= (args.password or "") then
+		trap(fdt, tag, "invalid user name or password (6)")
+	else
+		fdt.user = name
+		done(fdt, tag)
+	end
+end
+
+local function cancel_command(fdt, args, tag)
+	local which = args.tag
+
+	if which then
+		local entry = fdt.active[which]
+		if not entry then trap(fdt, tag, "unknown command tag") return end
+		cancel(fdt, entry)
+	else
+		for _, entry in pairs(fdt.active) do cancel(fdt, entry) end
+	end
+	done(fdt, tag)
+end
+
+--
+-- Split up a sentence and run it. The command is the path and the command
+-- name in one word (/ip/route/print), attributes are collected by name,
+-- queries in order. A command that raises an error gets a !trap rather
+-- than taking the session (and us) down with it.
+--
+local function api_command(fdt, words)
+	local args = {}
+	local queries = {}
+	local tagv, tag
+
+	for i = 2, #words do
+		local w = words[i]
+		local b = w:byte(1)
+
+		if b == 61 then							-- =name=value
+			local name, value = w:match("^=([^=]+)=?(.*)$")
+			if name then args[name] = value end
+		elseif b == 63 then						-- ?query
+			queries[#queries+1] = w
+		elseif b == 46 then						-- .tag=x
+			tagv = w:match("^%.tag=(.*)$") or tagv
+		end
+	end
+	tag = tagv and "=.tag=" .. tagv
+
+	local cmd = words[1]
+	if cmd == "/login" then return login(fdt, args, tag) end
+	if cmd == "/quit" then return api_fatal(fdt, "session terminated on request") end
+	if not fdt.user then return trap(fdt, tag, "not logged in") end
+	if cmd == "/cancel" then return cancel_command(fdt, args, tag) end
+
+	local key = tagv or {}
+	if fdt.active[key] then return trap(fdt, tag, "tag already in use") end
+
+	local path, name = cmd:match("^(/.+)/([^/]+)$")
+	local base = path and CONFIG[path]
+	local own = base and base.options.commands and base.options.commands[name]
+
+	if not (own or (base and commands[name])) then return trap(fdt, tag, "no such command prefix") end
+
+	local ok, entry = pcall(function()
+		if own then return own_command(own, path, args, tag) end
+		return commands[name](fdt, path, args, compile_query(queries), tag)
+	end)
+	if not ok then return failed(fdt, tag, entry) end
+	if entry then
+		entry.tag = tag
+		start(fdt, key, entry)
+	end
+end
+
+--
+-- Close the session, whatever it has going is stopped first
+--
+local function api_close(fdt)
+	fdt.closed = true
+	for _, entry in pairs(fdt.active) do cancel(fdt, entry, true) end
+	lib.event.remove_fd(fdt.fd)
+	posix.unistd.close(fdt.fd)
+end
+
+--
+-- A !fatal is the last thing the client gets, we close once it's gone
+--
+api_fatal = function(fdt, message)
+	for _, entry in pairs(fdt.active) do cancel(fdt, entry, true) end
+	fdt.outbuf[#fdt.outbuf+1] = sentence({ "!fatal", message })
+	fdt.quitting = true
+	lib.event.want(fdt.fd, "OUT", true)
+	lib.event.want(fdt.fd, "IN", false)
+end
+
+--
+-- Take the sentences that have come in, a client can send as many as it
+-- likes without waiting (with different tags they all run at once). We
+-- stop reading while there's too much waiting to go out or too many
+-- streams going.
+--
+local MAX_QUEUED = 256
+local MAX_STREAMS = 64
+
+local function api_input(fdt)
+	local words = fdt.words
+
+	while not fdt.quitting and #fdt.outbuf < MAX_QUEUED and #fdt.streams < MAX_STREAMS do
+		local word, err = fdt.reader:next()
+		if not word then
+			if err then
+				print("api: "..err)
+				api_close(fdt)
+				return
+			end
+			break
+		end
+		if word ~= "" then
+			words[#words+1] = word
+		elseif #words > 0 then
+			fdt.words = {}
+			api_command(fdt, words)
+			words = fdt.words
+		end
+	end
+	lib.event.want(fdt.fd, "IN", not fdt.quitting and #fdt.outbuf < MAX_QUEUED and #fdt.streams < MAX_STREAMS)
+end
+
+local function io_callback(fdt)
+	local fd = fdt.fd
+
+	if fdt.revents.OUT or fdt.revents.ERR or fdt.revents.HUP then
+		if #fdt.outbuf == 0 then streams_fill(fdt) end
+
+		local ok, err = c.frame.flush(fd, fdt.outbuf)
+		if ok == nil then
+			print("api: error writing: "..err)
+			api_close(fdt)
+			return
+		end
+		if ok and fdt.quitting then
+			api_close(fdt)
+			return
+		end
+		if ok and #fdt.streams == 0 then lib.event.want(fd, "OUT", false) end
+		api_input(fdt)
+		if fdt.closed then return end
+	end
+
+	if fdt.revents.IN and not fdt.quitting then
+		local size, err, errno = fdt.reader:fill(fd)
+		if not size then
+			if errno == posix.errno.EAGAIN then return end
+			print("api: error reading")
+			api_close(fdt)
+			return
+		end
+		if size == 0 then
+			api_close(fdt)
+			return
+		end
+		api_input(fdt)
+	end
+end
+
+--
+-- New connections, on TCP we don't want small replies held back waiting
+-- for more to send (Nagle)
+--
+local function api_accept(fdt)
+	for _ = 1, 64 do
+		local newfd = posix.sys.socket.accept(fdt.fd)
+		if not newfd then return end
+
+		local flags = posix.fcntl.fcntl(newfd, posix.fcntl.F_GETFL)
+		posix.fcntl.fcntl(newfd, posix.fcntl.F_SETFL, flags | posix.fcntl.O_NONBLOCK)
+		if fdt.tcp then
+			posix.sys.socket.setsockopt(newfd, posix.sys.socket.IPPROTO_TCP, posix.sys.socket.TCP_NODELAY, 1)
+		end
+		lib.event.add_fd(newfd, io_callback, {
+			reader = c.frame.reader(), outbuf = {}, words = {}, active = {}, streams = {},
+		})
+	end
+end
+
+local function listen_on(family, sa, tcp)
+	local fd = posix.sys.socket.socket(family, posix.sys.socket.SOCK_STREAM, 0)
+	local rc
+
+	local flags = posix.fcntl.fcntl(fd, posix.fcntl.F_GETFL)
+	posix.fcntl.fcntl(fd, posix.fcntl.F_SETFL, flags | posix.fcntl.O_NONBLOCK)
+	if tcp then
+		posix.sys.socket.setsockopt(fd, posix.sys.socket.SOL_SOCKET, posix.sys.socket.SO_REUSEADDR, 1)
+	end
+
+	rc = posix.sys.socket.bind(fd, sa)
+	assert(rc == 0, "unable to bind api socket")
+	if not tcp then posix.sys.stat.chmod(sa.path, posix.sys.stat.S_IRUSR | posix.sys.stat.S_IWUSR) end
+	rc = posix.sys.socket.listen(fd, backlog)
+	assert(rc == 0, "unable to listen on api socket")
+
+	lib.event.add_fd(fd, api_accept, { tcp = tcp })
+end
+
+--
+-- Start listening on the unix socket and the TCP port
+--
+local function init()
+	posix.unistd.unlink(socket_path)
+	listen_on(posix.sys.socket.AF_UNIX, { family = posix.sys.socket.AF_UNIX, path = socket_path })
+
+	if port then
+		listen_on(posix.sys.socket.AF_INET, { family = posix.sys.socket.AF_INET, addr = address, port = port }, true)
+	end
+end
+
+return {
+	init = init,
+	configure = configure,
+	sentence = sentence,
+}
@@ -65,25 +65,98 @@ local function build_uniq_name(path, prefix)
 end
 
 --
--- The defaults metatable is used to gather default values for given fields by looking
--- within the fields, we keep the path and ci as local variables so we can use them if
--- we are doing function lookups
+-- Each path has its schema compiled once when it's registered, everything
+-- the engine needs on a per-item basis is then shared by all the items:
 --
-function set_defaults_metatable(path, ci)
-	setmetatable(ci, { __index=function(t, k)
-		--
-		-- We only return defaults for defined fields
-		--
-		if not CONFIG[path].fields[k] then return nil end
-
-		local default = CONFIG[path].fields[k].default
-		if type(default) == "function" then
-			return default(path, ci)
+-- item		- metatable for config items, supplies the defaults
+-- live		- metatable for live items, these look in their config item
+--		  (held in _ci) and fall back to the defaults
+-- defaults	- plain default values by field
+-- uniq		- function(ci) building the uniq value
+-- flags	- the flags by display position, in priority order
+-- indexes	- the fields with index=true
+--
+-- So an item costs one table, there is no per-item closure or metatable.
+--
+local function compile_schema(path, config)
+	local schema = {}
+	local defaults = {}
+	local dynamic = {}
+	local uniqs = {}
+	local item_index
+
+	schema.indexes = {}
+	for name, field in pairs(config.fields) do
+		if field.index then table.insert(schema.indexes, name) end
+		if type(field.default) == "function" then
+			dynamic[name] = field.default
 		else
-			return default
+			defaults[name] = field.default
+		end
+		if field.uniq then table.insert(uniqs, { field = name, fn = type(field.uniq) == "function" and field.uniq }) end
+	end
+	table.sort(uniqs, function(a, b) return a.field < b.field end)
+
+	--
+	-- We only return defaults for defined fields, if none of the defaults
+	-- need calling then the lookup can stay in C
+	--
+	if next(dynamic) then
+		item_index = function(ci, k)
+			local v = defaults[k]
+			if v ~= nil then return v end
+
+			local fn = dynamic[k]
+			if fn then return fn(path, ci) end
 		end
+	else
+		item_index = defaults
 	end
-	})
+	schema.defaults = defaults
+	schema.item = { __index = item_index }
+
+	local index_is_table = type(item_index) == "table"
+
+	schema.live = { __index = function(live, k)
+		local ci = rawget(live, "_ci")
+		if ci then return ci[k] end
+		if index_is_table then return item_index[k] end
+		return item_index(live, k)
+	end }
+
+	--
+	-- The first uniq field with a value wins, a uniq function is only called
+	-- if its field doesn't have one
+	--
+	schema.uniq = function(ci)
+		for _,u in ipairs(uniqs) do
+			local v = ci[u.field]
+			if v then return v end
+			if u.fn then return u.fn(path, ci) end
+		end
+	end
+
+	--
+	-- Flags share a display position, later ones in the list take priority
+	--
+	local flags = { header = {}, width = 0 }
+	for i, f in ipairs(config.flags or {}) do
+		if not flags[f.pos] then flags[f.pos] = {} end
+		table.insert(flags[f.pos], f)
+		if f.pos > flags.width then flags.width = f.pos end
+		table.insert(flags.header, string.format("%s - %s", f.flag, f.name))
+	end
+	flags.header = table.concat(flags.header, ", ")
+	schema.flags = flags
+
+	return schema
+end
+
+--
+-- The defaults metatable is used to gather default values for given fields
+--
+function set_defaults_metatable(path, ci)
+	setmetatable(ci, CONFIG[path].schema.item)
 end
 
 --
@@ -112,39 +185,32 @@ local function dependency_list(path, ci)
 	end
 end
 
---
--- Dependency change tells a dependant that the parent has changed (or gone)
--- so it should update the relevant field(s) to reflect the change
---
--- TODO: may want to support a function here for special cases
---
-local function dependency_change(path, uniq, field, dpath, dolduniq, dnewuniq)
-	dnewuniq = dnewuniq or "unknown"
-
-	print(string.format("DEPEND CHANGE FOR %s %s -> %s", dpath, dolduniq, dnewuniq))	
-	print(string.format("IMPACTING %s %s %s", path, uniq, field))
-	CONFIG[path].cf[uniq][field] = dnewuniq
-end
-
 
 --
--- Dump a table for debugging
+-- Dump a table for debugging, the pieces are gathered into a buffer and
+-- joined once at the end (concatenating as we go is quadratic)
 --
-local function cf_dump(t, indent)
-	indent = indent or 0
+local function dump_into(buf, t, indent)
 	local space = string.rep(" ", indent)
-	local rc = ""
 
 	if type(t) == "table" then
-		rc = rc .. "{\n"
+		buf[#buf+1] = "{\n"
 		for k,v in pairs(t) do
-			rc = rc .. space .. "   " .. k .. " = " .. cf_dump(v, indent+3) .. "\n"
+			buf[#buf+1] = space .. "   " .. k .. " = "
+			dump_into(buf, v, indent+3)
+			buf[#buf+1] = "\n"
 		end
-		rc = rc .. space .. "}"
+		buf[#buf+1] = space .. "}"
 	else
-		rc = tostring(t)
+		buf[#buf+1] = tostring(t)
 	end
-	return rc
+end
+
+local function cf_dump(t, indent)
+	local buf = {}
+
+	dump_into(buf, t, indent or 0)
+	return table.concat(buf)
 end
 
 
@@ -163,6 +229,18 @@ local function copy_of(i)
 	end
 end
 
+--
+-- Config items are never changed once they are in the config, a change builds
+-- a new item, so a shallow copy is all we need to start from. That makes a
+-- set O(fields in the item), which is what lets a snapshot just keep the old
+-- item rather than copying anything.
+--
+local function shallow_copy(i)
+	local rc = {}
+	for k,v in pairs(i) do rc[k] = v end
+	return rc
+end
+
 --
 -- Generate a random key that isn't already in the table, optionally
 -- with a specific prefix
@@ -184,188 +262,1128 @@ local function random_key(t, prefix)
 	return k
 end
 
+--
+-- Every change to the config happens inside a transaction, a lone lib.cf.set
+-- simply wraps itself in one. Within a transaction the config is changed
+-- straight away but the backends are left alone, we just keep track of each
+-- item that has been touched (and what it was started with) so that commit
+-- can work out the final state of everything once and then stop and start
+-- each backend at most once, in dependency order.
+--
+-- Each path is snapshotted the first time the transaction writes to it so
+-- that abort can put the config back exactly as it was, a small change only
+-- pays for the paths it touches.
+--
+local txn = nil
+local SNAPSHOT_MAPS = { "cf", "live", "requires" }
+
+local function snapshot_path(snap, path)
+	if snap.paths[path] then return end
+
+	local base = CONFIG[path]
+	local layers = {}
+
+	for _,m in ipairs(SNAPSHOT_MAPS) do layers[m] = lib.pmap.snapshot(base[m]) end
+	snap.paths[path] = layers
+end
+
+--
+-- Record that an item has been touched by the transaction, the first time we
+-- see it we keep the config it had (and so what the backend was started with),
+-- its live table and its dependencies so commit can stop it properly.
+--
+local function touch(path, uniq)
+	local items = txn.items[path]
+	if not items then items = {} txn.items[path] = items end
+
+	local entry = items[uniq]
+	if not entry then
+		local base = CONFIG[path]
+
+		snapshot_path(txn.snap, path)
+		if base.options.duplicate then snapshot_path(txn.snap, base.options.duplicate) end
+
+		local live = base.live[uniq]
+
+		entry = { orig = base.cf[uniq], live = live, requires = base.requires[uniq] }
+		entry.ci = live and live._backed and entry.orig
+		items[uniq] = entry
+	end
+	return entry
+end
+
+--
+-- The dependency graph is kept as two hash indexes so that adding or removing
+-- a single edge never needs to walk the other dependents of the parent:
+--
+-- dependents[puniq][cpath][cuniq][cfield] = true 	(on the parent path)
+-- requires[cuniq][cfield] = { path=, uniq= }		(on the child path)
 --
 -- Add a dependent to the dependency list
 --
 local function add_dependent(ppath, puniq, cpath, cuniq, cfield)
 	local pbase = CONFIG[ppath].dependents
+	local node = pbase[puniq]
+
+	if not node then node = {} pbase[puniq] = node end
+	if not node[cpath] then node[cpath] = {} end
+	if not node[cpath][cuniq] then node[cpath][cuniq] = {} end
+	node[cpath][cuniq][cfield] = true
+end
+
+--
+-- Remove a dependent from the dependecy list, tidying up any tables that are
+-- left empty so the parent doesn't accumulate dead entries
+--
+local function remove_dependent(ppath, puniq, cpath, cuniq, cfield)
+	local pbase = CONFIG[ppath].dependents
+	local node = pbase[puniq]
+	local byuniq = node and node[cpath]
+	local fields = byuniq and byuniq[cuniq]
+
+	if not fields then return end
+	fields[cfield] = nil
+	if next(fields) then return end
+	byuniq[cuniq] = nil
+	if next(byuniq) then return end
+	node[cpath] = nil
+	if next(node) then return end
+	pbase[puniq] = nil
+end
+
+--
+-- Whether an item's new dependencies are the ones it already has
+--
+local function same_dependencies(old, new)
+	old = old or {}
+	for field,dep in pairs(new) do
+		local o = old[field]
+		if not o or o.path ~= dep.path or o.uniq ~= dep.uniq or o.needrunning ~= dep.needrunning then return false end
+	end
+	for field,_ in pairs(old) do
+		if not new[field] then return false end
+	end
+	return true
+end
+
+--
+-- Iterate over everything that depends on the given item, returning
+-- path, uniq and field for each edge
+--
+local function each_dependent(path, uniq)
+	local node = CONFIG[path].dependents[uniq] or {}
+	local cpath, byuniq, cuniq, fields, cfield
+
+	return function()
+		while true do
+			if fields then
+				cfield = next(fields, cfield)
+				if cfield then return cpath, cuniq, cfield end
+				fields = nil
+			elseif byuniq then
+				cuniq, fields = next(byuniq, cuniq)
+				if not cuniq then byuniq = nil end
+			else
+				cpath, byuniq = next(node, cpath)
+				if not cpath then return nil end
+				cuniq = nil
+			end
+		end
+	end
+end
+
+--
+-- Iterate over everything the given item depends on, returning
+-- field, path and uniq for each one
+--
+local function each_dependency(path, uniq)
+	local requires = CONFIG[path].requires[uniq] or {}
+	local field, dep
+
+	return function()
+		field, dep = next(requires, field)
+		if field then return field, dep.path, dep.uniq end
+	end
+end
+
+--
+-- Secondary indexes are kept for any field with index=true, they cover the
+-- live items (so config and dynamic entries) and are keyed on the value the
+-- item shows for the field:
+--
+-- index[field][value][uniq] = true
+--
+-- Like dependents these are derived, so they aren't part of a snapshot and
+-- restore puts back just the entries that have changed. Live fields that are
+-- changed in place aren't seen, dynamic items should be re-set with
+-- lib.cf.live.
+--
+local function index_add(path, uniq, live)
+	local base = CONFIG[path]
+
+	for _,field in ipairs(base.schema.indexes) do
+		local value = live[field]
+
+		if value ~= nil then
+			local byvalue = base.index[field]
+			local uniqs = byvalue[value]
+
+			if not uniqs then uniqs = {} byvalue[value] = uniqs end
+			uniqs[uniq] = true
+		end
+	end
+end
+
+local function index_remove(path, uniq, live)
+	local base = CONFIG[path]
+
+	for _,field in ipairs(base.schema.indexes) do
+		local value = live[field]
+		local byvalue = base.index[field]
+		local uniqs = value ~= nil and byvalue[value]
+
+		if uniqs then
+			uniqs[uniq] = nil
+			if not next(uniqs) then byvalue[value] = nil end
+		end
+	end
+end
+
+--
+-- Copy an item into the path named by options.duplicate (if there is one),
+-- keeping its indexes up to date
+--
+local function mirror(path, uniq)
+	local dpath = CONFIG[path].options.duplicate
+	if not dpath then return end
+
+	local base, dup = CONFIG[path], CONFIG[dpath]
+
+	if dup.live[uniq] then index_remove(dpath, uniq, dup.live[uniq]) end
+	dup.cf[uniq] = base.cf[uniq]
+	dup.live[uniq] = base.live[uniq]
+	if dup.live[uniq] then index_add(dpath, uniq, dup.live[uniq]) end
+end
+
+--
+-- Iterate over the live items where field == value, returning uniq and
+-- the live item. Indexed fields just walk the index, anything else is a
+-- scan. As with pairs, don't add or remove items while iterating.
+--
+local function each_where(path, field, value)
+	local base = CONFIG[path]
+	local byvalue = base.index[field]
+	local live = base.live
+
+	if byvalue then
+		local uniqs = byvalue[value] or {}
+		local uniq
+
+		return function()
+			uniq = next(uniqs, uniq)
+			if uniq then return uniq, live[uniq] end
+		end
+	end
+
+	local iter, state, uniq = pairs(live)
+	local item
+
+	return function()
+		repeat
+			uniq, item = iter(state, uniq)
+		until uniq == nil or item[field] == value
+		if uniq then return uniq, item end
+	end
+end
+
+--
+-- Return the first (uniq, live) where field == value
+--
+local function find(path, field, value)
+	return each_where(path, field, value)()
+end
+
+--
+-- Dependency change tells the dependants that the parent has changed (or gone)
+-- so they should update the relevant field(s) to reflect the change
+--
+-- If the parent has been renamed then the dependant is re-set with the new
+-- value (which may well give it a new uniq), if it's gone then the field is
+-- set to "unknown" which leaves the dependant invalid.
+--
+-- TODO: may want to support a function here for special cases
+--
+local cf_set
+
+local function dependency_change(dpath, dolduniq, dnewuniq)
+	local list = {}
+
+	--
+	-- Take a copy of the edges first, re-setting a dependant changes the
+	-- graph underneath us
+	--
+	for path, uniq, field in each_dependent(dpath, dolduniq) do
+		table.insert(list, { path = path, uniq = uniq, field = field })
+	end
+
+	for _,dep in ipairs(list) do
+		local base = CONFIG[dep.path]
+		local requires = copy_of(base.requires[dep.uniq] or {})
+
+		touch(dep.path, dep.uniq)
+		remove_dependent(dpath, dolduniq, dep.path, dep.uniq, dep.field)
+
+		print(string.format("DEPEND CHANGE FOR %s %s -> %s", dpath, dolduniq, dnewuniq or "unknown"))
+		print(string.format("IMPACTING %s %s %s", dep.path, dep.uniq, dep.field))
+
+		if requires[dep.field] then requires[dep.field].uniq = dnewuniq or "unknown" end
+		base.requires[dep.uniq] = requires
+
+		if dnewuniq then
+			cf_set(dep.path, dep.uniq, { [dep.field] = dnewuniq })
+		else
+			local ci = shallow_copy(base.cf[dep.uniq])
+
+			set_defaults_metatable(dep.path, ci)
+			ci[dep.field] = "unknown"
+			touch(dep.path, dep.uniq).changed = true
+			index_remove(dep.path, dep.uniq, base.live[dep.uniq])
+			base.cf[dep.uniq] = ci
+			base.live[dep.uniq]._ci = ci
+			index_add(dep.path, dep.uniq, base.live[dep.uniq])
+			mirror(dep.path, dep.uniq)
+		end
+	end
+end
+
+--
+-- Call the _build_uniq function for a given item
+--
+local function build_uniq(path, ci)
+	local base = CONFIG[path]
+	--
+	-- See if we have a field with uniq set.
+	--
+	-- If set to true, then we use the field
+	-- If it's a function, then we call the function
+	--
+	local uniq = base.schema.uniq(ci)
+	if uniq then return uniq end
+
+	--
+	-- Without a uniq field an item keeps the key it was given when it was
+	-- created (so it survives updates and a journal replay)
+	--
+	if ci._uniq then return ci._uniq end
+
+	print("NO UNIQ FOUND for "..path)
+	return random_key(base.live)
+end
 
-	if not pbase[puniq] then pbase[puniq] = {} end
-	table.insert(pbase[puniq], { path = cpath, uniq = cuniq, field = cfield })
+--
+-- See if an item exists
+--
+local function exists(path, uniq)
+	return CONFIG[path].live[uniq] and true
 end
 
---
--- Remove a dependent from the dependecy list
---
-local function remove_dependent(ppath, puniq, cpath, cuniq, cfield)
-	local pbase = CONFIG[ppath].dependents[puniq] or {}
-	local i = 1
-	while pbase[i] do
-		if pbase[i].path == cpath and pbase[i].uniq == cuniq and pbase[i].field == cfield then
-			table.remove(pbase, i)
-		else
-			i = i + 1
+--
+-- Remove keys where the value is the same as the default, we don't check
+-- anything starting with a '_'.
+--
+local function prune_defaults(path, ci)
+	local defaults = CONFIG[path].schema.defaults
+
+	for field,value in pairs(ci) do
+		if value == defaults[field] and field:sub(1,1) ~= "_" then ci[field] = nil end
+	end
+end
+
+--
+-- Work out which fields differ between the config a backend was started with
+-- and the new config, and whether any of them need the backend restarting.
+--
+-- A field with restart=true always needs a restart, restart can also be a
+-- function(path, oldci, ci, live) for fields where it depends on the values.
+-- If we don't have an update function then any change is a restart.
+--
+local function changed_fields(path, oldci, ci, live)
+	local base = CONFIG[path]
+	local changed = {}
+	local restart = not base.options.update
+
+	for k,v in pairs(oldci) do
+		if k ~= "_uniq" and ci[k] ~= v then changed[k] = true end
+	end
+	for k,v in pairs(ci) do
+		if k ~= "_uniq" and oldci[k] ~= v then changed[k] = true end
+	end
+	if not next(changed) then return nil end
+
+	for k,_ in pairs(changed) do
+		local field = base.fields[k]
+		local r = field and field.restart
+
+		if type(r) == "function" then r = r(path, oldci, ci, live) end
+		if r then restart = true end
+	end
+	return changed, restart
+end
+
+--
+-- Backend actions are queued as jobs (see lib.job). Each item's live table
+-- keeps the last job queued for it so that whatever we queue next for the
+-- item (or for anything that depends on it) waits its turn.
+--
+local function backend_job(live, after, name, fn)
+	local last = live._job
+
+	if last and not last.done then table.insert(after, last) end
+
+	local job
+	job = lib.job.add(function()
+		local ok, err = pcall(fn)
+
+		if live._job == job then live._job = nil end
+		if not ok then error(err, 0) end
+	end, after, name)
+	live._job = job
+	return job
+end
+
+--
+-- States:
+--
+-- invalid = one or mode dependencies are not dependable
+-- disabled = we are configured to be disabled (removes invalid)
+-- running = an extra flag for relevant state
+--
+-- dependable = not disabled and then either (not invalid) or (running)
+--
+-- if it's not disabled and not invalid then the back-end should be up, this
+-- will be set by this routine (backed) so we can compare history
+--
+-- When a transaction commits we start with the items it touched and only
+-- go on to the items that depend on one of them if it changes its state
+-- (or is bouncing), so an edit that doesn't change anything for the
+-- dependents costs nothing however many there are. An item that's reached
+-- again because something else it depends on has changed is worked out
+-- again, so each item ends up with the state its dependencies finally
+-- have. Anything with a change that needs a restart (or that depends on
+-- something being restarted) is bounced, other changes to running items
+-- are handed to options.update so they can be done in place. Once we know
+-- what's changing it's put in dependency order: all the stops are run
+-- first (dependents first) followed by the starts and updates.
+--
+-- Everything here uses worklists rather than recursion so a long chain of
+-- dependencies can't run us out of stack, and a dependency loop is reported
+-- (and the items in it left invalid) rather than followed forever.
+--
+local STATS = { commits = 0, visited = 0, evaluated = 0, loops = 0 }
+local adopting = false
+
+local function txn_apply(t)
+	local state = {}
+	local visited = 0
+	local queue = {}
+	local evaluated = {}
+	local order = {}
+
+	local function get_state(path, uniq)
+		return state[path] and state[path][uniq]
+	end
+
+	local function get_or_add(path, uniq, entry)
+		local s = get_state(path, uniq)
+		if s then return s end
+		if not state[path] then state[path] = {} end
+
+		s = { path = path, uniq = uniq, entry = entry }
+		state[path][uniq] = s
+		visited = visited + 1
+		return s
+	end
+
+	local function enqueue(s)
+		if s.queued then return end
+		s.queued = true
+		queue[#queue+1] = s
+	end
+
+	local touched = {}
+	for path, items in pairs(t.items) do
+		for uniq, entry in pairs(items) do table.insert(touched, get_or_add(path, uniq, entry)) end
+	end
+
+	--
+	-- Anything that was in a loop before this transaction was left invalid,
+	-- so a new loop has to go through something we touched, and everything
+	-- in it is something that item depends on. So we look among the touched
+	-- items and what they depend on (usually not much) and sort those
+	-- (Kahn's algorithm), whatever can't be sorted is in a loop or hangs off
+	-- one and is left invalid.
+	--
+	local up = {}
+	for _,s in ipairs(touched) do up[#up+1] = s s.up = true end
+	for _,s in ipairs(up) do
+		s.ups = 0
+		s.downs = {}
+	end
+	local i = 1
+	while up[i] do
+		local s = up[i]
+
+		for _,dep in pairs(CONFIG[s.path].requires[s.uniq] or {}) do
+			local p = get_or_add(dep.path, dep.uniq, nil)
+
+			if not p.up then
+				p.up = true
+				p.ups = 0
+				p.downs = {}
+				up[#up+1] = p
+			end
+			s.ups = s.ups + 1
+			table.insert(p.downs, s)
+		end
+		i = i + 1
+	end
+
+	local ready, sorted = {}, 0
+	for _,s in ipairs(up) do
+		if s.ups == 0 then table.insert(ready, s) end
+	end
+	while #ready > 0 do
+		local s = table.remove(ready)
+
+		sorted = sorted + 1
+		for _,c in ipairs(s.downs) do
+			c.ups = c.ups - 1
+			if c.ups == 0 then table.insert(ready, c) end
+		end
+	end
+	if sorted < #up then
+		local stuck = {}
+
+		for _,s in ipairs(up) do
+			if s.ups > 0 then
+				s.loop = true
+				enqueue(s)
+				table.insert(stuck, s.path .. " " .. s.uniq)
+			end
+		end
+		print("Dependency loop, leaving invalid: " .. table.concat(stuck, ", "))
+		STATS.loops = STATS.loops + 1
+	end
+
+	--
+	-- Work out the state of each item on the worklist, items we haven't
+	-- needed to look at keep the state they already had
+	--
+	local function dependable(path, uniq)
+		local s = get_state(path, uniq)
+		if s and s.done then return s.want end
+
+		local live = CONFIG[path].live[uniq]
+		return live and live._dependable
+	end
+
+	local function evaluate(s)
+		local base = CONFIG[s.path]
+		local ci = base.cf[s.uniq]
+
+		if not s.done then
+			s.done = true
+			s.live = (s.entry and s.entry.live) or base.live[s.uniq]
+			s.backed = s.live and s.live._backed
+			table.insert(evaluated, s)
+		end
+
+		if ci then
+			local requires = base.requires[s.uniq] or {}
+			local invalid = s.loop
+			local changed, bounce
+
+			if s.backed and s.entry and s.entry.changed then
+				changed, bounce = changed_fields(s.path, s.entry.ci, ci, s.live)
+			end
+
+			for _,dep in pairs(requires) do
+				local d = get_state(dep.path, dep.uniq)
+
+				if not s.live.disabled and not dependable(dep.path, dep.uniq) then invalid = true end
+				if d and d.bounce then bounce = true end
+			end
+			s.invalid = invalid
+			s.want = not s.live.disabled and not invalid
+			s.bounce = s.backed and s.want and bounce
+			s.update = s.backed and s.want and not bounce and changed
+		end
+	end
+
+	for _,s in ipairs(touched) do enqueue(s) end
+
+	i = 1
+	while queue[i] do
+		local s = queue[i]
+
+		queue[i] = false
+		i = i + 1
+		s.queued = false
+		evaluate(s)
+
+		--
+		-- Our dependents only need looking at if they will see a change, or
+		-- if what they saw last time round has changed
+		--
+		local was = s.live and s.live._dependable
+		local seen = (s.want and 1 or 0) + (s.bounce and 2 or 0)
+		local change = s.bounce or (not s.want) ~= (not was)
+
+		if s.seen ~= seen and (change or s.seen) then
+			for dpath, byuniq in pairs(CONFIG[s.path].dependents[s.uniq] or {}) do
+				for duniq,_ in pairs(byuniq) do enqueue(get_or_add(dpath, duniq, nil)) end
+			end
+		end
+		s.seen = seen
+	end
+
+	--
+	-- Put what we looked at into dependency order (Kahn's algorithm). We
+	-- link each item to the dependencies it had when we first touched it as
+	-- well as the ones it has now so the stops happen in the right order,
+	-- if that makes a loop we try again with just the current ones.
+	--
+	local function sort(with_orig)
+		local ready = {}
+
+		order = {}
+
+		local function link(s, requires)
+			for _,dep in pairs(requires) do
+				local p = get_state(dep.path, dep.uniq)
+				if p and p.done then
+					s.parents = s.parents + 1
+					table.insert(p.children, s)
+				end
+			end
+		end
+
+		for _,s in ipairs(evaluated) do s.parents = 0 s.children = {} end
+		for _,s in ipairs(evaluated) do
+			local requires = CONFIG[s.path].requires[s.uniq]
+
+			if requires then link(s, requires) end
+			if with_orig and s.entry and s.entry.requires and s.entry.requires ~= requires then
+				link(s, s.entry.requires)
+			end
+		end
+
+		for _,s in ipairs(evaluated) do
+			if s.parents == 0 then table.insert(ready, s) end
+		end
+		while #ready > 0 do
+			local s = table.remove(ready)
+
+			table.insert(order, s)
+			for _,c in ipairs(s.children) do
+				c.parents = c.parents - 1
+				if c.parents == 0 then table.insert(ready, c) end
+			end
+		end
+	end
+
+	sort(true)
+	if #order < #evaluated then sort(false) end
+
+	--
+	-- Anything still left is in a loop (and so invalid), it goes on the end
+	--
+	if #order < #evaluated then
+		for _,s in ipairs(evaluated) do
+			if s.parents > 0 then table.insert(order, s) end
+		end
+	end
+
+	STATS.commits = STATS.commits + 1
+	STATS.visited = STATS.visited + visited
+	STATS.evaluated = STATS.evaluated + #order
+	STATS.last = { visited = visited, evaluated = #order }
+
+	--
+	-- Stop anything that needs to go (or be restarted), dependents first and
+	-- with the config the backend was started with
+	--
+	local stops = {}
+
+	local function stop(path, uniq, entry, live, after)
+		local base = CONFIG[path]
+		local ci = (entry and entry.ci) or base.cf[uniq]
+		local fn = base.options.stop
+
+		live._backed = false
+		table.insert(stops, backend_job(live, after, "stop " .. path .. " " .. uniq, function()
+			print("Would stop backend for "..path.." "..uniq)
+			if fn then fn(path, ci, live) end
+		end))
+	end
+
+	for _,g in ipairs(t.gone) do
+		if g.entry.live and g.entry.live._backed then stop(g.path, g.uniq, g.entry, g.entry.live, {}) end
+	end
+	for i = #order, 1, -1 do
+		local s = order[i]
+
+		if s.backed and (not s.want or s.bounce) then
+			local after = {}
+
+			for _,c in ipairs(s.children) do
+				local job = c.live and c.live._job
+				if job and not job.done then table.insert(after, job) end
+			end
+			stop(s.path, s.uniq, s.entry, s.live, after)
+		end
+	end
+
+	--
+	-- Now start everything that should be running, update anything that can
+	-- be changed in place, and update the flags. These all wait for the stops
+	-- and for anything queued for the items they depend on.
+	--
+	local barrier = next(stops) and lib.job.add(nil, stops, "stops")
+
+	for _,s in ipairs(order) do
+		local base = CONFIG[s.path]
+		local ci = base.cf[s.uniq]
+		local live = s.live
+		local fn
+
+		--
+		-- The jobs this item's backend has to wait for
+		--
+		local function after()
+			local list = { barrier }
+
+			for _,dep in pairs(base.requires[s.uniq] or {}) do
+				local plive = CONFIG[dep.path].live[dep.uniq]
+				local job = plive and plive._job
+				if job and not job.done then table.insert(list, job) end
+			end
+			return list
+		end
+
+		if s.want and (not s.backed or s.bounce) then
+			local start = base.options.start
+			local adopt = adopting and not s.bounce and base.options.adopt
+
+			live._backed = true
+
+			--
+			-- With nothing to wait for we can ask straight away, an item
+			-- that's taken over as it is then doesn't need a job at all
+			--
+			local taken = false
+
+			if adopt and not (live._job and not live._job.done) and not next(after()) then
+				local ok, adopted = pcall(adopt, s.path, ci, live)
+
+				adopt = nil
+				if ok and adopted then
+					print("Adopted backend for "..s.path.." "..s.uniq)
+					live._error = nil
+					taken = true
+				end
+			end
+			if not taken then
+				fn = function()
+					if adopt and adopt(s.path, ci, live) then
+						print("Adopted backend for "..s.path.." "..s.uniq)
+						live._error = nil
+						return
+					end
+					print("Would start backend for "..s.path.." "..s.uniq)
+					if start then
+						local ok, err = pcall(start, s.path, ci, live)
+						if not ok then
+							live._backed = false
+							live._error = err
+							error(err, 0)
+						end
+					end
+					live._error = nil
+				end
+			end
+		elseif s.update then
+			local update, changed = base.options.update, s.update
+
+			fn = function()
+				print("Would update backend for "..s.path.." "..s.uniq)
+				update(s.path, ci, changed, live)
+			end
+		end
+		if fn then backend_job(live, after(), s.path .. " " .. s.uniq, fn) end
+		if ci then
+			live._invalid = s.invalid
+			live._dependable = s.want or nil
 		end
 	end
+	lib.job.settle()
+	return order
 end
 
 --
--- See if all the dependencies are dependable
+-- Snapshots cover the config, live and requires maps of every path, these
+-- are all persistent maps (see lib.pmap) so taking one is O(1) per path and
+-- shares everything with the current config.
+--
+-- Restore isn't O(1) though, it's O(keys changed since the snapshot): the
+-- dependents and secondary indexes are derived and not versioned, so the
+-- edges and index entries of every changed key are rebuilt, and each live
+-- table that's kept has its _ci pointed back at the restored config.
 --
-local function all_dependable(path, ci)
-	local rc = true
+-- What a snapshot doesn't pin is anything changed inside a live table, the
+-- maps only hold references: backend state (_backed, _invalid, _error,
+-- _job), status the backends keep there (_running and friends from netlink)
+-- and the fields of dynamic items all stay as they are now. That's why an
+-- abort only restores config, the backends are the caller's problem.
+--
+local function cf_snapshot()
+	local snap = { paths = {} }
 
-	for _,dep in pairs(dependency_list(path, ci)) do
-		local base = CONFIG[dep.path]
-		local live = base and base.live[dep.uniq]
+	for path,_ in pairs(CONFIG) do snapshot_path(snap, path) end
+	return snap
+end
 
-		if not live or not live._dependable then rc = false end
+local function cf_release(snap)
+	if snap.released then return end
+	for path, layers in pairs(snap.paths) do
+		for _,m in ipairs(SNAPSHOT_MAPS) do lib.pmap.release(CONFIG[path][m], layers[m]) end
 	end
-	return rc
+	snap.released = true
 end
 
 --
--- Call the _build_uniq function for a given item
+-- Put the config back to how it was when the snapshot was taken. This only
+-- restores the config, it's up to the caller to sort out any backends.
 --
-local function build_uniq(path, ci)
-	local base = CONFIG[path]
+local function cf_restore(snap)
+	assert(not snap.released, "restore of a released snapshot")
+
+	local touched = {}
+
 	--
-	-- See if we have a field with uniq set.
+	-- Take out the dependency edges for anything whose requires differ
 	--
-	-- If set to true, then we use the field
-	-- If it's a function, then we call the function
+	for path, layers in pairs(snap.paths) do
+		local base = CONFIG[path]
+
+		touched[path] = lib.pmap.changed(base.requires, layers.requires)
+		for uniq,_ in pairs(touched[path]) do
+			for field,dep in pairs(base.requires[uniq] or {}) do
+				remove_dependent(dep.path, dep.uniq, path, uniq, field)
+			end
+		end
+	end
+
+	for path, layers in pairs(snap.paths) do
+		local base = CONFIG[path]
+		local indexed = next(base.schema.indexes)
+		local relink = lib.pmap.changed(base.cf, layers.cf)
+
+		for k,_ in pairs(lib.pmap.changed(base.live, layers.live)) do relink[k] = true end
+		if indexed then
+			for uniq,_ in pairs(relink) do
+				local live = base.live[uniq]
+				if live then index_remove(path, uniq, live) end
+			end
+		end
+
+		for _,m in ipairs(SNAPSHOT_MAPS) do lib.pmap.restore(base[m], layers[m]) end
+
+		--
+		-- Live tables are shared with the snapshot, so make sure they are
+		-- looking at the restored config, then put back the index entries
+		--
+		for uniq,_ in pairs(relink) do
+			local live = base.live[uniq]
+
+			if live then
+				if getmetatable(live) == base.schema.live then live._ci = base.cf[uniq] end
+				if indexed then index_add(path, uniq, live) end
+			end
+		end
+	end
+
+	--
+	-- And put back the edges from the restored requires
 	--
-	local uniq = nil
-	for k,field in pairs(base.fields) do
-		if field.uniq then
-			-- If we have a value set, then use it regardless
-			if ci[k] then return ci[k] end
-			-- If uniq=<function> then call it
-			if type(field.uniq) == "function" then return field.uniq(path, ci) end
+	for path, uniqs in pairs(touched) do
+		for uniq,_ in pairs(uniqs) do
+			for field,dep in pairs(CONFIG[path].requires[uniq] or {}) do
+				if exists(dep.path, dep.uniq) then
+					add_dependent(dep.path, dep.uniq, path, uniq, field)
+				end
+			end
 		end
 	end
-	print("NO UNIQ FOUND for "..path)
-	return random_key(base.live)
 end
 
 --
--- See if an item exists
+-- Start a transaction, these can be nested in which case only the outermost
+-- commit does anything
 --
-local function exists(path, uniq)
-	return CONFIG[path].live[uniq] and true
+local function txn_begin()
+	if txn then
+		txn.depth = txn.depth + 1
+		return
+	end
+	txn = { depth = 1, items = {}, gone = {}, snap = { paths = {} } }
 end
 
 --
--- Remove keys where the value is the same as the default, we don't check
--- anything starting with a '_'.
+-- Put back the config a transaction started with and let any post-processing
+-- catch up with the restored items
 --
-local function prune_defaults(path, ci)
-	for field,value in pairs(ci) do
-		if field:sub(1,1) ~= "_" then 
-			print("Prun check f="..field.." v="..tostring(value))
-			if value == CONFIG[path].fields[field].default then ci[field] = nil end
+local function rollback(t)
+	cf_restore(t.snap)
+	cf_release(t.snap)
+
+	for path, items in pairs(t.items) do
+		local postprocess = CONFIG[path].options["ci-post-process"]
+
+		if postprocess then
+			for _,entry in pairs(items) do
+				if entry.orig then postprocess(path, entry.orig) end
+			end
 		end
 	end
 end
 
 --
--- States:
+-- Commit the transaction, this is where the backends get started and stopped
 --
--- invalid = one or mode dependencies are not dependable
--- disabled = we are configured to be disabled (removes invalid)
--- running = an extra flag for relevant state
+-- Anything registered with lib.cf.on_commit (the journal) is given the list
+-- of config changes before any backends are touched, each one is either
+-- { op="put", path=, ci= } or { op="del", path=, uniq= }. A hook that
+-- errors aborts the transaction (nothing has been started or stopped yet)
+-- and the error is passed on.
 --
--- dependable = not disabled and then either (not invalid) or (running)
+local commit_hooks = {}
+
 --
--- if it's not disabled and not invalid then the back-end should be up, this
--- will be set by this routine (backed) so we can compare history
+-- Anything registered with lib.cf.on_change (the API's listen) is told about
+-- items whose live state may have moved on: once a commit has been applied,
+-- and whenever a backend changes a live item itself. Each change is
+-- { path=, uniq=, live= } with no live if the item has gone. Sections with
+-- dynamic items report those themselves, giving the live they'd print, but
+-- can check watched() first to save building it for nobody.
 --
-local function state_change(path, uniq, going, goinvalid)
-	local base = CONFIG[path]
-	local live = base.live[uniq]
-	local invalid = going or goinvalid or nil
+local change_hooks = {}
 
+local function on_change(fn)
+	table.insert(change_hooks, fn)
+end
 
-	local backed = live._backed
+local function watched()
+	return next(change_hooks) ~= nil
+end
 
-	if not live.disabled then
-		--
-		-- Check our dependencies are valid
-		--
-		if not all_dependable(path, base.cf[uniq]) then invalid = true end
-	end
+local function tell(changes)
+	for _,hook in ipairs(change_hooks) do hook(changes) end
+end
 
-	--
-	-- If we weren't backed, but now need to be then we need to start the backend
-	--
-	if not backed and not live.disabled and not invalid then
-		-- START
-		print("Would start backend for "..path.." "..uniq)
-		if base.options.start then
-			base.options.start(path, base.cf[uniq])
+local function changed(path, uniq, live)
+	if not next(change_hooks) then return end
+	tell({ { path = path, uniq = uniq, live = live or CONFIG[path].live[uniq] } })
+end
+
+local function txn_changes(t)
+	local changes = {}
+
+	for path, items in pairs(t.items) do
+		local base = CONFIG[path]
+
+		for uniq, entry in pairs(items) do
+			local ci = base.cf[uniq]
+			local olduniq = entry.orig and entry.orig._uniq
+
+			--
+			-- Anything just as it was loaded (or unloaded) came from the
+			-- journal in the first place, so it's not news
+			--
+			if entry.loaded == nil or entry.loaded ~= (ci or false) then
+				if olduniq and olduniq ~= uniq and not base.cf[olduniq] then
+					table.insert(changes, { op = "del", path = path, uniq = olduniq })
+				end
+				if ci and ci ~= entry.orig then
+					table.insert(changes, { op = "put", path = path, ci = ci })
+				elseif not ci and entry.orig then
+					table.insert(changes, { op = "del", path = path, uniq = uniq })
+				end
+			end
 		end
-		live._backed = true
 	end
+	return changes
+end
 
-	--
-	-- What is our new dependable state?
-	--
-	local dependable = not live.disabled and not invalid
-	-- TODO include optional running state
+local function txn_commit()
+	assert(txn, "commit called outside of a transaction")
 
-	-- Ensure our invalid flag is correct
-	live._invalid = invalid
+	txn.depth = txn.depth - 1
+	if txn.depth > 0 then return end
 
-	--
-	-- If we have changed state then tell our depedents
-	--
-	if dependable ~= live._dependable then
-		live._dependable = dependable or nil
+	local t = txn
+	txn = nil
 
-		for _,dep in ipairs(base.dependents[uniq] or {}) do
-			if going then dependency_change(dep.path, dep.uniq, dep.field, path, uniq, nil) end
-		print("DEPENTABLE CHANGE for "..path.."/"..uniq.." notifiying "..dep.path.."/"..dep.uniq)
-			state_change(dep.path, dep.uniq)
+	local changes = (next(commit_hooks) or next(change_hooks)) and txn_changes(t)
+	if changes and next(changes) then
+		local ok, err = pcall(function()
+			for _,hook in ipairs(commit_hooks) do hook(changes) end
+		end)
+		if not ok then
+			rollback(t)
+			error(err, 0)
 		end
 	end
+	cf_release(t.snap)
+
+	local order = txn_apply(t)
 
 	--
-	-- If we were backed, but now we are not, then we need to stop
+	-- Now the flags are right, tell the listeners about what was changed and
+	-- anything else whose state we looked at
 	--
-	if backed and (live.disabled or invalid) then
-		-- STOP
-		print("Would stop backend for "..path.." "..uniq)
-		if base.options.stop then
-			base.options.stop(path, base.cf[uniq])
+	if next(change_hooks) then
+		local told, out = {}, {}
+
+		local function add(path, uniq)
+			local k = path .. " " .. uniq
+			if told[k] then return end
+			told[k] = true
+			out[#out+1] = { path = path, uniq = uniq, live = CONFIG[path].live[uniq] }
 		end
-		live._backed = false
+		for _,ch in ipairs(changes) do add(ch.path, ch.uniq or ch.ci._uniq) end
+		for _,s in ipairs(order) do add(s.path, s.uniq) end
+		if next(out) then tell(out) end
 	end
 end
 
+local function on_commit(fn)
+	table.insert(commit_hooks, fn)
+end
+
+--
+-- Counters for the dependency work done at commit: items visited (touched
+-- or depending on something touched), items evaluated and loops found, with
+-- the figures for the most recent commit in last
+--
+local function cf_stats()
+	local rc = {}
+
+	for k,v in pairs(STATS) do rc[k] = v end
+	rc.last = rc.last and { visited = rc.last.visited, evaluated = rc.last.evaluated }
+	return rc
+end
+
+--
+-- Abort the transaction (regardless of nesting), we restore the snapshot
+-- taken at the start and then let any post-processing catch up with the
+-- restored items. Nothing was started or stopped so there is nothing else
+-- to put back.
+--
+local function txn_abort()
+	assert(txn, "abort called outside of a transaction")
+
+	local t = txn
+	txn = nil
+	rollback(t)
+end
+
+--
+-- Bring up the config at startup without redoing what the system already
+-- has (we've been restarted, the kernel hasn't). fn loads the config (a
+-- journal replay, say) and it's all committed in one go. Anything that
+-- would be started gets offered to its path's adopt option first, which
+-- returns true if the system already matches the item (it's then backed
+-- without its start being run). Once that's all settled each path's
+-- reconciled option can clear away whatever of ours nothing claimed.
+--
+-- Adopt is only a look at the system so it mustn't suspend: an item with
+-- nothing to wait for is asked there and then, and only gets a job if it
+-- needs starting. An adopt that fails just means a start.
+--
+local reconciling = false
 
+local function cf_reconcile(fn)
+	reconciling = true
+	txn_begin()
+
+	local ok, err = pcall(fn)
+	if not ok then
+		reconciling = false
+		if txn then txn_abort() end		-- fn may have aborted it already
+		error(err, 0)
+	end
+
+	adopting = true
+	ok, err = pcall(txn_commit)
+	adopting = false
+	if ok then
+		ok, err = pcall(function()
+			lib.job.drain()
+			for path, base in pairs(CONFIG) do
+				if base.options.reconciled then base.options.reconciled(path) end
+			end
+		end)
+	end
+	reconciling = false
+	if not ok then error(err, 0) end
+end
+
+--
+-- Whether we're in the middle of a reconcile, for a backend that wants to
+-- pick up what the system has as it comes past
+--
+local function reconciling_now()
+	return reconciling
+end
 
 --
--- Set specific configuration fields. 
+-- Set specific configuration fields.
 --
 -- Since changes could chage the dependencies we remove them before the change
--- then add them back afterwards.
+-- then add them back afterwards (unless they are just the same).
 --
 -- Before we do anything we should check the new dependencies to ensure they are
 -- valid, otherwise we can reject the change.
 --
+-- If we aren't in a transaction then we run as a transaction of our own, so
+-- the backends are sorted out before we return. If anything goes wrong part
+-- way through then that transaction is aborted (otherwise everything after
+-- would join a transaction that never commits).
 --
---
-local function cf_set(path, olduniq, items)
+cf_set = function(path, olduniq, items)
+	if not txn then
+		txn_begin()
+		local ok, rc = pcall(cf_set, path, olduniq, items)
+		if not ok then
+			txn_abort()
+			error(rc, 0)
+		end
+		txn_commit()
+		return rc
+	end
+
 	local base = CONFIG[path]
 	local oldci = olduniq and base.cf[olduniq]
 	local newuniq = nil
 	local ci = nil
+	local dependencies
 
 	-- If we have some items then we need to build a representation of how
 	-- the new cf will look, we copy the old one first if provided, then
 	-- create the new uniq value and check all the dependencies are valid
 	if items then
-		ci = (oldci and copy_of(oldci)) or {}
+		ci = (oldci and shallow_copy(oldci)) or {}
 		set_defaults_metatable(path, ci)
 
 		for field,value in pairs(items) do ci[field] = value end
@@ -375,7 +1393,8 @@ local function cf_set(path, olduniq, items)
 		-- at this point (dependable checks will be later)
 		newuniq = build_uniq(path, ci)
 		ci._uniq = newuniq
-		for _,dep in pairs(dependency_list(path, ci)) do
+		dependencies = dependency_list(path, ci)
+		for _,dep in pairs(dependencies) do
 			if not exists(dep.path, dep.uniq) then
 				print("Dependency not present: "..dep.path.." "..dep.uniq)
 				return false
@@ -384,27 +1403,39 @@ local function cf_set(path, olduniq, items)
 	end
 
 	--
-	-- Regardless of what we are doing we need to remove any existing registered
-	-- dependencies since they might change (we will add them back later if needed)
+	-- Unless the item keeps its uniq and the same dependencies we need to
+	-- remove the existing registrations (we will add them back later if
+	-- needed). Leaving them alone keeps a plain change out of the requires
+	-- map, so a snapshot has less to put back.
 	--
+	local keep = oldci and ci and olduniq == newuniq and same_dependencies(base.requires[olduniq], dependencies)
+
 	if oldci then
+		local entry = touch(path, olduniq)
+
+		index_remove(path, olduniq, base.live[olduniq])
+
 		--
 		-- Remove our dependency registrations
 		--
-		for field,dep in pairs(dependency_list(path, oldci)) do 
-			remove_dependent(dep.path, dep.uniq, path, olduniq, field) 
+		if not keep then
+			for field,dep in pairs(base.requires[olduniq] or {}) do
+				remove_dependent(dep.path, dep.uniq, path, olduniq, field)
+			end
+			base.requires[olduniq] = nil
 		end
 
 		--
-		-- We need to shut down to make whatever changes are needed, if we are
-		-- being removed then we handle it differently
+		-- Remove the old config ... it will be replaced below if needed
 		--
-		-- TODO: make the shut down optional if only minor fields are changing
+		base.cf[olduniq] = nil
+
 		--
-		if ci then
-			state_change(path, olduniq, false, true)
-		else
-			state_change(path, olduniq, true)
+		-- If we are being removed then our dependants need to know, the live
+		-- data is kept in the transaction so the backend can be stopped
+		--
+		if not ci then
+			dependency_change(path, olduniq, nil)
 
 			--
 			-- Allow post-processing to handle the remove
@@ -413,23 +1444,15 @@ local function cf_set(path, olduniq, items)
 				base.options["ci-post-process"](path, oldci, true)
 			end
 
-			base.cf[olduniq] = nil
+			entry.changed = true
 			base.live[olduniq] = nil
 			base.dependents[olduniq] = nil
 		end
 
-		--
-		-- Remove the old config ... it will be replaced below if needed
-		-- TODO: duplicate of above, remove from there?
-		base.cf[olduniq] = nil
-
 		--
 		-- Update our mirror if needed
 		--
-		if base.options.duplicate then
-			CONFIG[base.options.duplicate].cf[olduniq] = base.cf[olduniq]
-			CONFIG[base.options.duplicate].live[olduniq] = base.live[olduniq]
-		end
+		mirror(path, olduniq)
 	end
 
 
@@ -437,38 +1460,45 @@ local function cf_set(path, olduniq, items)
 	-- Now we can put in the new
 	--
 	if ci then
-		local dependencies = dependency_list(path, ci)
+		local renamed = oldci and olduniq ~= newuniq
+		local entry
 
 		--
-		-- Ensure we move stuff across, caters for change of uniq, including updating any
-		-- dependents
+		-- Keep the transaction entry with the item if the uniq changes, if
+		-- we land on an entry for something removed earlier then that still
+		-- needs stopping
 		--
-		base.cf[newuniq] = ci
-		base.live[newuniq] = base.live[olduniq] or {}
-		base.dependents[newuniq] = base.dependents[olduniq] or {}
-		setmetatable(base.live[newuniq], { __index = ci })
-
-		if olduniq and olduniq ~= newuniq then
-			base.live[olduniq] = nil
-			base.dependents[olduniq] = nil
+		if renamed then
+			local items = txn.items[path]
 
-			for _,dep in ipairs(base.dependents[newuniq] or {}) do
-				dependency_change(dep.path, dep.uniq, dep.field, path, olduniq, newuniq)
+			entry = items[olduniq]
+			items[olduniq] = nil
+			if items[newuniq] then
+				table.insert(txn.gone, { path = path, uniq = newuniq, entry = items[newuniq] })
 			end
+			items[newuniq] = entry
+		else
+			entry = touch(path, newuniq)
 		end
+		entry.changed = true
 
 		--
-		-- Call the function to handle the field changes, if the item is not backed this doesn't do
-		-- anything (since it will all happen at start). If the item is backed then these are minor
-		-- changes that can be done on the fly.
+		-- Ensure we move stuff across, caters for change of uniq, including updating any
+		-- dependents
 		--
-		-- TODO: include check for _backed
-		if oldci then
-			local changed = {}
-			for k,v in pairs(oldci or {}) do changed[k] = (oldci[k] ~= ci[k]) or nil end
-			for k,v in pairs(ci or {}) do changed[k] = (ci[k] ~= oldci[k]) or nil end
-			print("CHANGED: ")
-			print(lib.cf.dump(changed))
+		local live = base.live[olduniq] or entry.live or {}
+
+		entry.live = live
+		live._ci = ci
+		base.cf[newuniq] = ci
+		if base.live[newuniq] ~= live then base.live[newuniq] = live end
+		setmetatable(live, base.schema.live)
+		index_add(path, newuniq, live)
+
+		if renamed then
+			base.live[olduniq] = nil
+
+			dependency_change(path, olduniq, newuniq)
 		end
 
 		--
@@ -479,28 +1509,95 @@ local function cf_set(path, olduniq, items)
 		end
 
 		--
-		-- Install our dependencies
-		--
-		for field,dep in pairs(dependencies) do 
-			add_dependent(dep.path, dep.uniq, path, newuniq, field) 
-		end
-
-		--
-		-- Honor the options.duplicte setting before calling state_change
+		-- Install our dependencies (items without any don't keep an empty table)
 		--
-		if base.options.duplicate then
-			CONFIG[base.options.duplicate].cf[newuniq] = base.cf[newuniq]
-			CONFIG[base.options.duplicate].live[newuniq] = base.live[newuniq]
+		if not keep then
+			for field,dep in pairs(dependencies) do
+				add_dependent(dep.path, dep.uniq, path, newuniq, field)
+			end
+			base.requires[newuniq] = next(dependencies) and dependencies or nil
 		end
 
 		--
-		-- Call state change to action any changes
+		-- Honor the options.duplicte setting (a rename leaves nothing behind)
 		--
-		state_change(path, newuniq)
-	end	
+		if renamed then mirror(path, olduniq) end
+		mirror(path, newuniq)
+	end
 	return newuniq
 end
 
+--
+-- Load an item straight into the config, this is used to replay a journal so
+-- the item has already been through cf_set once: it has its _uniq and the
+-- defaults pruned, and we don't check dependencies (the parent may well come
+-- later) or tell any dependants, they will have their own records.
+--
+-- This has to be inside a transaction, the backends get sorted out when it
+-- commits. What's loaded isn't passed to the commit hooks (unless it's been
+-- changed again since), the journal has it already.
+--
+local function cf_load(path, ci)
+	assert(txn, "load called outside of a transaction")
+
+	local base = CONFIG[path]
+	local uniq = ci._uniq
+	local entry = touch(path, uniq)
+	local was = base.live[uniq]
+	local live = was or entry.live or {}
+
+	if was then index_remove(path, uniq, was) end
+	for field,dep in pairs(base.requires[uniq] or {}) do
+		remove_dependent(dep.path, dep.uniq, path, uniq, field)
+	end
+
+	set_defaults_metatable(path, ci)
+	entry.changed = true
+	entry.loaded = ci
+	entry.live = live
+	live._ci = ci
+	base.cf[uniq] = ci
+	if live ~= was then base.live[uniq] = live end
+	setmetatable(live, base.schema.live)
+	index_add(path, uniq, live)
+
+	local dependencies = dependency_list(path, ci)
+	for field,dep in pairs(dependencies) do
+		add_dependent(dep.path, dep.uniq, path, uniq, field)
+	end
+	base.requires[uniq] = next(dependencies) and dependencies or nil
+
+	if base.options["ci-post-process"] then
+		base.options["ci-post-process"](path, ci)
+	end
+	mirror(path, uniq)
+end
+
+local function cf_unload(path, uniq)
+	assert(txn, "unload called outside of a transaction")
+
+	local base = CONFIG[path]
+	local oldci = base.cf[uniq]
+	if not oldci then return end
+
+	local entry = touch(path, uniq)
+
+	index_remove(path, uniq, base.live[uniq])
+	for field,dep in pairs(base.requires[uniq] or {}) do
+		remove_dependent(dep.path, dep.uniq, path, uniq, field)
+	end
+	base.requires[uniq] = nil
+	base.cf[uniq] = nil
+	base.live[uniq] = nil
+	entry.changed = true
+	entry.loaded = false
+
+	if base.options["ci-post-process"] then
+		base.options["ci-post-process"](path, oldci, true)
+	end
+	mirror(path, uniq)
+end
+
 --
 -- Support the addition of dynamic entries into the live data set, we will create
 -- a uniq value if one isn't provided.
@@ -510,9 +1607,13 @@ end
 local function live_set(path, uniq, ci)
 	-- TODO: validation!
 	--
+	local live = CONFIG[path].live
+
 	if not ci then
 		-- TODO: uniq not set?
-		CONFIG[path].live[uniq] = nil
+		if live[uniq] then index_remove(path, uniq, live[uniq]) end
+		live[uniq] = nil
+		changed(path, uniq)
 		return
 	end
 
@@ -524,7 +1625,10 @@ local function live_set(path, uniq, ci)
 	
 	-- Support defaults
 	set_defaults_metatable(path, ci)
-	CONFIG[path].live[uniq] = ci
+	if live[uniq] then index_remove(path, uniq, live[uniq]) end
+	live[uniq] = ci
+	index_add(path, uniq, ci)
+	changed(path, uniq)
 end
 
 
@@ -536,11 +1640,15 @@ end
 local function cf_register(path, config)
 	CONFIG[path] = config;
 
-	config.cf = {}
-	config.live = {}
+	config.cf = lib.pmap.new()
+	config.live = lib.pmap.new()
 	config.dependents = {}
+	config.index = {}
+	config.requires = lib.pmap.new()
 	config.options = config.options or {}
 	config.events = config.events or {}
+	config.schema = compile_schema(path, config)
+	for _,field in ipairs(config.schema.indexes) do config.index[field] = {} end
 
 	-- TODO: some sanity checks to ensure things won't break later
 	--
@@ -576,64 +1684,265 @@ end
 	
 
 --
--- Basic printing function
+-- Printing and exporting are generators that hand back one line at a time,
+-- so however big the table is we only ever hold a line of it. They walk a
+-- snapshot of the path, which means the config can change while a slow
+-- reader is part way through (pairs on a live pmap doesn't like new keys).
 --
-local function cf_print(path)
-	local base = CONFIG[path]
+-- Each returns the line iterator and a close function, the snapshot is let
+-- go of when we run out of lines or the caller closes us early. Anything
+-- given as more (see dynamic_items) follows what's in the map.
+--
+local function snapshot_lines(map, header, line, more)
+	local layer = lib.pmap.snapshot(map)
+	local nextitem = pairs(lib.pmap.view(layer))
+	local done = false
+
+	local function close()
+		if done then return end
+		done = true
+		lib.pmap.release(map, layer)
+	end
 
+	return function()
+		if header then
+			local rc = header
+			header = nil
+			return rc
+		end
+		while not done do
+			local uniq, item = nextitem()
+			if uniq == nil then close() break end
 
-	local function build_flags(live)
-		local rc = {}
+			local rc = line(uniq, item)
+			if rc then return rc end
+		end
+		while more do
+			local uniq, item = more()
+			if uniq == nil then more = nil break end
 
-		for i, f in pairs(base.flags) do
-			rc[f.pos] = (live[f.field] and f.flag) or rc[f.pos] or " "
+			local rc = line(uniq, item)
+			if rc then return rc end
 		end
-		return table.concat(rc)
+	end, function()
+		close()
+		more = nil
+	end
+end
+
+--
+-- A path can have items that aren't kept in the config at all (the
+-- kernel's routes, there can be millions of them): options.dynamic gives
+-- an iterator of uniq and a live table made for the occasion, which gets
+-- the defaults like any other.
+--
+local function dynamic_items(path)
+	local base = CONFIG[path]
+	if not base.options.dynamic then return nil end
+
+	local items = base.options.dynamic(path)
+
+	return function()
+		local uniq, item = items()
+		if uniq ~= nil then set_defaults_metatable(path, item) end
+		return uniq, item
+	end
+end
+
+--
+-- Values are shown the RouterOS way, yes/no for booleans and quoted if
+-- they wouldn't survive as a single word
+--
+local function format_value(v)
+	if v == true then return "yes" end
+	if v == false then return "no" end
+
+	v = tostring(v)
+	if v == "" or v:find('[%s"\\;$?]') then
+		return '"' .. (v:gsub('[\\"$?]', "\\%0")) .. '"'
 	end
+	return v
+end
+
+--
+-- Print rows: a number, the flags and then the fields in field order, we
+-- show what the backend sees (the live data) rather than the config
+--
+local function cf_rows(path)
+	local base = CONFIG[path]
+	local flags = base.schema.flags
+	local shown = {}
+	local rc = {}
+	local fl = {}
+	local n = -1
 
 	--
-	-- Flags header
+	-- Work out what we're showing once rather than for every row, the
+	-- buffers get reused for each row too
 	--
-	io.write("Flags: ")
-	for i, f in pairs(base.flags) do
-		if i > 1 then io.write(", ") end
-		io.write(string.format("%s - %s", f.flag, f.name))
+	for fname, field in each_field(base) do
+		if field.prep ~= false then table.insert(shown, { name = fname, prep = field.prep }) end
+	end
+
+	local function build_flags(live)
+		for pos = 1, flags.width do
+			fl[pos] = " "
+			for _, f in ipairs(flags[pos] or {}) do
+				if live[f.field] then fl[pos] = f.flag end
+			end
+		end
+		return table.concat(fl, "", 1, flags.width)
 	end
-	io.write("\n")
 
+	return snapshot_lines(base.live, "Flags: " .. flags.header, function(uniq, live)
+		local count = 0
+
+		n = n + 1
+		for _, f in ipairs(shown) do
+			local v
+
+			if f.prep then v = f.prep(f.name, live) else v = live[f.name] end
+			if v then
+				count = count + 1
+				rc[count] = f.name .. "=" .. format_value(v)
+			end
+		end
+		return string.format("%2d %s %s", n, build_flags(live), table.concat(rc, " ", 1, count))
+	end, dynamic_items(path))
+end
 
-	for uniq, live in pairs(base.live) do
-		print("Got: "..uniq)
+--
+-- All of the field names for a path: the field order first and then the
+-- rest in name order
+--
+local function cf_fields(path)
+	local base = CONFIG[path]
+	local order = {}
+	local seen = {}
+	local extra = {}
 
-		print("Flags: [" .. build_flags(live) .. "]")
+	for fname, _ in each_field(base) do
+		order[#order+1] = fname
+		seen[fname] = true
+	end
+	for fname, _ in pairs(base.fields) do
+		if not seen[fname] then extra[#extra+1] = fname end
+	end
+	table.sort(extra)
+	table.move(extra, 1, #extra, #order+1, order)
+	return order
+end
 
-		for fname, field in each_field(base) do
-			local v = live[fname]
-			local prep = field.prep
+--
+-- Walk a snapshot of the live items (and any dynamic ones) giving whatever
+-- fn makes of each one (items it gives nil for are skipped), for callers
+-- that want their own output format. Gives the iterator and a close
+-- function as rows does.
+--
+local function cf_items(path, fn)
+	return snapshot_lines(CONFIG[path].live, nil, fn, dynamic_items(path))
+end
 
-			if prep == false then v = nil
-			elseif type(prep) == "function" then v = prep(fname, live)
+--
+-- Export lines: the section header and then an add for each configured item
+-- with just the fields that differ from the defaults (the config items only
+-- hold those). The field order only covers what print shows so anything
+-- else follows it in name order. Without a path we export every section in
+-- turn, except for the ones that are just mirrors of another.
+--
+-- A section whose items come with the system (options can-add is false, the
+-- ethernet interfaces) can't have them added back, so each one is a set on
+-- the item found by its find-by field: set [ find default-name=ether1 ]
+-- mtu=1400. Anything that just repeats that field (a name that's still the
+-- default-name) is left out, and an item with nothing else is too.
+--
+local function cf_export(path)
+	if path then
+		local base = CONFIG[path]
+		local header = path:gsub("(.)/", "%1 ")
+		local order = cf_fields(path)
+		local find = base.options["can-add"] == false and base.options["find-by"]
+
+		return snapshot_lines(base.cf, header, function(uniq, ci)
+			local rc = { "add" }
+			local key = find and ci[find]
+
+			if find then rc[1] = "set [ find " .. find .. "=" .. format_value(key) .. " ]" end
+			for _, fname in ipairs(order) do
+				local v = rawget(ci, fname)
+				if v ~= nil and not (find and (fname == find or v == key)) then
+					rc[#rc+1] = fname .. "=" .. format_value(v)
+				end
 			end
-				
-			if v then
-				print(string.format("  %s=%s", fname, live[fname]))
+			if find and #rc == 1 then return nil end
+			return table.concat(rc, " ")
+		end)
+	end
+
+	local paths = {}
+	local mirrors = {}
+	local i = 0
+	local lines, close
+
+	for p, base in pairs(CONFIG) do
+		if base.options.duplicate then mirrors[base.options.duplicate] = true end
+	end
+	for p, _ in pairs(CONFIG) do
+		if not mirrors[p] then table.insert(paths, p) end
+	end
+	table.sort(paths)
+
+	return function()
+		while true do
+			if lines then
+				local rc = lines()
+				if rc then return rc end
+				lines = nil
 			end
+			i = i + 1
+			if not paths[i] then return nil end
+			lines, close = cf_export(paths[i])
 		end
+	end, function()
+		if lines then close() lines = nil end
+		i = #paths
 	end
 end
 
+--
+-- Basic printing function
+--
+local function cf_print(path)
+	for line in cf_rows(path) do io.write(line, "\n") end
+end
+
 return {
 	set = cf_set,
 	live = live_set,
 	register = cf_register,
 	dump = cf_dump,
 	print = cf_print,
+	rows = cf_rows,
+	export = cf_export,
+	fields = cf_fields,
+	items = cf_items,
+	dependents = each_dependent,
+	dependencies = each_dependency,
+	find = find,
+	each_where = each_where,
+	begin = txn_begin,
+	commit = txn_commit,
+	abort = txn_abort,
+	load = cf_load,
+	unload = cf_unload,
+	on_commit = on_commit,
+	on_change = on_change,
+	changed = changed,
+	watched = watched,
+	reconcile = cf_reconcile,
+	reconciling = reconciling_now,
+	stats = cf_stats,
+	snapshot = cf_snapshot,
+	restore = cf_restore,
+	release = cf_release,
 }
-
-
-
-
-
-
-
-
@@ -57,15 +57,157 @@ local function size_encode(len)
 end
 
 --
--- Send a reply over the cli socket. The length will need to be
--- encoded and then the output queued
+-- Send a reply over the cli socket. The length and the data are queued as
+-- they are, they go out together (with whatever else is queued) in one
+-- writev
 --
 local function send(fdt, data)
-	local enclen = size_encode(data:len())
-	table.insert(fdt.outbuf, enclen .. data)
-	fdt.events.OUT = true	
+	local out = fdt.outbuf
+
+	out[#out+1] = c.frame.size(#data)
+	out[#out+1] = data
+	lib.event.want(fdt.fd, "OUT", true)
 end
 
+--
+-- A command that fails gets the error as its reply, rather than taking the
+-- daemon down with it
+--
+local function failed(fdt, err)
+	send(fdt, "failure: " .. tostring(err) .. "\n")
+	send(fdt, "")
+end
+
+--
+-- Long output (print and export) is streamed: we only pull the next chunk
+-- of lines from the generator once the socket has taken everything we've
+-- queued, so a slow reader holds us back rather than us buffering the whole
+-- table. Each chunk goes out as a normal reply and an empty reply marks the
+-- end of the output. If the generator fails part way the error is the last
+-- line.
+--
+local CHUNK_SIZE = 16384
+
+local function stream(fdt, lines, close)
+	fdt.stream = { lines = lines, close = close }
+	lib.event.want(fdt.fd, "OUT", true)
+end
+
+local function stream_fill(fdt)
+	local s = fdt.stream
+	local buf = {}
+	local size = 0
+
+	while size < CHUNK_SIZE do
+		local ok, line = pcall(s.lines)
+		if not ok then
+			if s.close then s.close() end
+			line = "failure: " .. tostring(line)
+			fdt.stream = nil
+		end
+		if not line then
+			fdt.stream = nil
+			break
+		end
+		buf[#buf+1] = line
+		buf[#buf+1] = "\n"
+		size = size + #line + 1
+		if not fdt.stream then break end
+	end
+	if size > 0 then send(fdt, table.concat(buf)) end
+	if not fdt.stream then send(fdt, "") end
+end
+
+--
+-- Stop a stream part way through, we need to let go of whatever it's
+-- holding (a snapshot of the config)
+--
+local function stream_close(fdt)
+	if fdt.stream.close then fdt.stream.close() end
+	fdt.stream = nil
+end
+
+local function cli_close(fdt)
+	fdt.closed = true
+	if fdt.stream then stream_close(fdt) end
+	lib.event.remove_fd(fdt.fd)
+	posix.unistd.close(fdt.fd)
+end
+
+--
+-- The commands we understand, the words before the command are the path
+-- (either "/ip route print" or "/ip/route print"), export with no path
+-- exports everything. A section can have commands of its own (options
+-- "commands"), they're given the path and the words after the command
+-- (name=value ones by name, the rest in order) and return the lines to
+-- send back.
+--
+local commands = {
+	["print"] = function(fdt, path) stream(fdt, lib.cf.rows(path)) end,
+	["export"] = function(fdt, path) stream(fdt, lib.cf.export(path)) end,
+}
+
+local function cli_args(words, first)
+	local args = {}
+
+	for i = first, #words do
+		local k, v = words[i]:match("^([^=]+)=(.*)$")
+		if k then args[k] = v else table.insert(args, words[i]) end
+	end
+	return args
+end
+
+local function cli_command(fdt, data)
+	local words = lib.util.split(data, "%s")
+	local path = nil
+
+	for i, cmd in ipairs(words) do
+		local own = path and CONFIG[path] and CONFIG[path].options.commands
+		local fn = own and own[cmd]
+
+		if fn then
+			local ok, lines, close = pcall(fn, path, cli_args(words, i + 1))
+			if ok then stream(fdt, lines, close) else failed(fdt, lines) end
+			return
+		end
+		if commands[cmd] and (path and CONFIG[path] or (not path and cmd == "export")) and i == #words then
+			local ok, err = pcall(commands[cmd], fdt, path)
+			if not ok then failed(fdt, err) end
+			return
+		end
+		path = "/" .. table.concat(lib.util.split(table.concat(words, "/", 1, i), "/"), "/")
+	end
+	send(fdt, "bad command: " .. data .. "\n")
+	send(fdt, "")
+end
+
+
+--
+-- Run the commands that have come in, a client can send several without
+-- waiting for the replies. They're taken in order and the replies come
+-- back in order, so while one is streaming its output the rest wait (and
+-- we stop reading until it's finished). A reply that fits in one chunk is
+-- queued straight away to go out with the others. We stop taking commands
+-- while there's too much waiting to go out.
+--
+local MAX_QUEUED = 256
+
+local function cli_input(fdt)
+	while not fdt.stream and #fdt.outbuf < MAX_QUEUED do
+		local data, err = fdt.reader:next()
+		if not data then
+			if err then
+				print("cli: "..err)
+				cli_close(fdt)
+				return
+			end
+			break
+		end
+		cli_command(fdt, data)
+		if fdt.stream then stream_fill(fdt) end
+	end
+	lib.event.want(fdt.fd, "IN", not fdt.stream and #fdt.outbuf < MAX_QUEUED)
+end
 
 --
 -- Called when we have data to read or write, we buffer up as needed,
@@ -74,105 +216,75 @@ end
 local function io_callback(fdt)
 	local fd = fdt.fd
 
-	print("Got cli callback " .. fd)
-
 	--
-	-- For output we just send each chunk of data in turn
+	-- For output we write everything queued in one go, topping up from
+	-- the stream when we've run out. The socket is non-blocking so a full
+	-- socket just means we try again later. Once a stream has finished
+	-- any commands waiting behind it can go.
 	--
-	if fdt.revents.OUT then
-		local data = fdt.outbuf[1]
-		local size = posix.unistd.write(fd, data)
-		if not size then
-			print("error writing")
-			posix.unistd.close(fd)
-			lib.event.remove_fd(fd)
+	if fdt.revents.OUT or fdt.revents.ERR or fdt.revents.HUP then
+		if #fdt.outbuf == 0 and fdt.stream then stream_fill(fdt) end
+
+		local done, err = c.frame.flush(fd, fdt.outbuf)
+		if done == nil then
+			print("error writing: "..err)
+			cli_close(fdt)
 			return
 		end
-		data = data:sub(size+1)
-		if data:len() == 0 then
-			table.remove(fdt.outbuf, 1)
-			if #fdt.outbuf == 0 then fdt.events.OUT = nil end
-		else
-			fdt.outbuf[1] = data
+		if done and not fdt.stream then lib.event.want(fd, "OUT", false) end
+		if not fdt.stream then
+			cli_input(fdt)
+			if fdt.closed then return end
 		end
 	end
 
 	--
-	-- Input is more complex because we might get partial data
+	-- Input is read in as big pieces as we can get, there may be any number
+	-- of commands in it (and part of the next)
 	--
 	if fdt.revents.IN then
-
-		if fdt.want > 0 then
-			local data = posix.unistd.read(fd, fdt.want)
-			if not data then
-				print("error reading")
-				posix.unistd.close(fd)
-				lib.event.remove_fd(fd)
-				return
-			end
-			local size = data:len()
-			if size == 0 then
-				print("end of stream")
-				posix.unistd.close(fd)
-				lib.event.remove_fd(fd)
-				return
-			end
-			fdt.want = fdt.want - size
-			table.insert(fdt.inbuf, data)
-			if fdt.want > 0 then return end
-		end
-
-		--
-		-- We have what we want so far...
-		--
-		data = table.concat(fdt.inbuf)
-
-		--
-		-- If it's just the first byte, then decode and work out
-		-- how many bytes we need for size
-		--
-		if not fdt.template then
-			local byte
-			fdt.want, byte, fdt.template = size_decode(data)
-			if fdt.want > 0 then
-				-- Put first byte back
-				fdt.inbuf = { string.pack(">I1", byte ) }
-				return
-			end
+		local size, err, errno = fdt.reader:fill(fd)
+		if not size then
+			if errno == posix.errno.EAGAIN then return end
+			print("error reading")
+			cli_close(fdt)
+			return
 		end
-
-		--
-		-- We will have the right number of size bytes so we can unpack
-		-- to find out how big the actual data will be
-		--
-		if not fdt.clisize then
-			fdt.clisize = string.unpack(fdt.template, data)
-			print("Got size: " .. fdt.clisize)
-			fdt.inbuf = {}
-			fdt.want = fdt.clisize
+		if size == 0 then
+			print("end of stream")
+			cli_close(fdt)
 			return
 		end
-
-		--
-		-- Here we actually have the cli data, so setup for another read
-		-- and call the cli function
-		--
-		fdt.template = nil
-		fdt.clisize = nil
-		fdt.inbuf = {}
-		fdt.want = 1
-		print("Got data "..data)
+		cli_input(fdt)
 	end
 end
 
 --
 -- The cli accept function, this creates the new socket and adds to our
--- poll to ensure we can send/receive as needed
+-- poll to ensure we can send/receive as needed. We take whatever is
+-- waiting (up to a point) each time round.
 --
 local function cli_accept(fdt)
-	local fd = fdt.fd
-	local newfd = posix.sys.socket.accept(fd)
-	lib.event.add_fd(newfd, io_callback, { want = 1, inbuf = {}, outbuf = {} })
+	for _ = 1, 64 do
+		local newfd = posix.sys.socket.accept(fdt.fd)
+		if not newfd then return end
+
+		local flags = posix.fcntl.fcntl(newfd, posix.fcntl.F_GETFL)
+		posix.fcntl.fcntl(newfd, posix.fcntl.F_SETFL, flags | posix.fcntl.O_NONBLOCK)
+		lib.event.add_fd(newfd, io_callback, { reader = c.frame.reader(), outbuf = {} })
+	end
+end
+
+--
+-- Where the socket goes and how many connections can be waiting to be
+-- accepted (a script firing off lots of cli sessions needs more than a few)
+--
+local socket_path = "/tmp/opentik.cli"
+local backlog = 64
+
+local function configure(options)
+	socket_path = options.path or socket_path
+	backlog = options.backlog or backlog
 end
 
 --
@@ -197,19 +309,20 @@ local function init()
 	--
 	-- Bind and listen
 	--
-	posix.unistd.unlink("/tmp/opentik.cli")
-	rc = posix.sys.socket.bind(cli, { family = posix.sys.socket.AF_UNIX, path = "/tmp/opentik.cli" })
+	posix.unistd.unlink(socket_path)
+	rc = posix.sys.socket.bind(cli, { family = posix.sys.socket.AF_UNIX, path = socket_path })
 	assert(rc == 0, "unable to bind cli socket")
 
-	rc = posix.sys.socket.listen(cli, 5)
+	rc = posix.sys.socket.listen(cli, backlog)
 	assert(rc == 0, "unable to listen on cli socket")
 
 	lib.event.add_fd(cli, cli_accept)
 end
 
-
 return {
 	init = init,
+	configure = configure,
+	stream = stream,
 	size_encode = size_encode,
 	size_decode = size_decode,
 }
@@ -20,11 +20,13 @@ local SOCK_NAME = "/tmp/opentik.sock"
 
 --
 -- We have a series of things that can create events, these are typically
--- file handle based (libnl or our event stream) or perhaps signals, or a
--- timer system.
+-- file handle based (libnl or our event stream) or perhaps signals, or
+-- timers.
 --
--- We use poll() to react to incoming events and then call the relevant
--- callback.
+-- The handles stay registered with an epoll set (c.ev) so each time round
+-- we only hear about, and only call the callbacks of, the ones that are
+-- ready. A forked child gets a set of its own the first time it uses it,
+-- otherwise it would be changing its parent's.
 --
 
 local function stdin_read(fd)
@@ -37,19 +39,32 @@ local fds = {
 
 }
 
+local loop, loop_pid
+local ready = {}
+
+local function mask(events)
+	return (events.IN and c.ev.IN or 0) | (events.OUT and c.ev.OUT or 0)
+end
+
+local function the_loop()
+	local pid = posix.unistd.getpid()
+
+	if loop_pid ~= pid then
+		if loop then loop:close() end
+		loop, loop_pid = assert(c.ev.new()), pid
+		for fd, fdt in pairs(fds) do assert(loop:add(fd, mask(fdt.events))) end
+	end
+	return loop
+end
 
 --
--- The callback used when we receive an external event, we need to look it
--- up in the config and call the relevant function
+-- Look up an external event in the config and call the relevant function
 --
-local function event_recv(fdt)
-	local fd = fdt.fd
-	local raw = posix.sys.socket.recv(fd, 1024)
-	print("RAW="..raw)
-	local event = lib.util.unserialise(raw)
-
-	print("Path = "..event.path)
-	print("Got packet "..#raw.." event="..event.event)
+local function dispatch(event)
+	if type(event) ~= "table" or type(event.path) ~= "string" then
+		print("Got an event with no path")
+		return
+	end
 
 	local base = CONFIG[event.path]
 	if not base then
@@ -58,31 +73,41 @@ local function event_recv(fdt)
 	end
 	local func = base.events[event.event]
 	if not func then
-		print("Got unconfigured event: "..event.path.." "..event.event)
+		print("Got unconfigured event: "..event.path.." "..tostring(event.event))
 		return
 	end
 	func(event)
 end
 
 --
--- Initialise the key stuff for the event system
+-- External events arrive on a datagram socket (c.bus), we take everything
+-- that's waiting at once (up to a limit, so we don't starve everything else)
 --
-local function init()
+local RECV_MAX = 1024
+
+local function event_recv(fdt)
+	local events, bad = c.bus.recv(fdt.fd, RECV_MAX)
 
-	--
-	-- The AF_UNIX socket for receiving external events
-	--
-	local rc
-	local evs = posix.sys.socket.socket(posix.sys.socket.AF_UNIX, posix.sys.socket.SOCK_DGRAM, 0)
-	
-	posix.unistd.unlink(SOCK_NAME)
-	rc = posix.sys.socket.bind(evs, { family = posix.sys.socket.AF_UNIX, path = SOCK_NAME })
-	assert(rc == 0, "unable to bind event socket")
-	fds[evs] = { fd = evs, events = { IN = true }, callback = event_recv }
+	if not events then print("event socket: "..bad) return end
+	if bad > 0 then print("Dropped "..bad.." bad events") end
+	for _,event in ipairs(events) do dispatch(event) end
 end
 
 --
--- Register an additional filehandle to listen on
+-- Initialise the key stuff for the event system, the socket for receiving
+-- external events can be somewhere else (for testing)
+--
+local function init(path)
+	if path then SOCK_NAME = path end
+
+	local evs = assert(c.bus.listen(SOCK_NAME))
+	fds[evs] = { fd = evs, events = { IN = true }, revents = {}, callback = event_recv }
+	assert(the_loop():add(evs, c.ev.IN))
+end
+
+--
+-- Register an additional filehandle to listen on, fields can set the events
+-- we want (IN by default) and anything else the callback wants to find
 --
 local function add_fd(fd, callback, fields)
 	local table = { fd = fd, events = { IN = true }, revents = {}, callback = callback }
@@ -90,42 +115,155 @@ local function add_fd(fd, callback, fields)
 		table[k] = v
 	end
 	fds[fd] = table
+	assert(the_loop():add(fd, mask(table.events)))
 end
 local function remove_fd(fd)
+	if not fds[fd] then return end
 	fds[fd] = nil
+	the_loop():del(fd)
+end
+
+--
+-- Turn an event (IN or OUT) on or off for a registered handle, the kernel
+-- only needs telling when it changes
+--
+local function want(fd, event, on)
+	local fdt = fds[fd]
+
+	on = on or nil
+	if not fdt or fdt.events[event] == on then return end
+	fdt.events[event] = on
+	assert(the_loop():mod(fd, mask(fdt.events)))
+end
+
+--
+-- Timers, on a wheel of 10ms ticks (lib.wheel) against the monotonic clock.
+-- Everything due in the same tick goes off in the same pass and the poll
+-- only waits until the next tick where something is due, so any number of
+-- timers cost nothing until they go off.
+--
+local TICK = 10
+local MAX_WAIT = 5000
+
+local function now()
+	local t = posix.time.clock_gettime(posix.time.CLOCK_MONOTONIC)
+	return t.tv_sec * 1000 + t.tv_nsec // 1000000
+end
+
+local timers = lib.wheel.new(now() // TICK)
+
+local function ticks(ms)
+	return math.max(1, (ms + TICK - 1) // TICK)
 end
 
 --
--- Send an event
+-- Call fn(timer) in ms milliseconds time, or every ms milliseconds for
+-- every(). A periodic timer keeps to its schedule rather than drifting by
+-- however late each one runs, if we fall behind the ones we missed are
+-- dropped.
 --
+local function after(ms, fn)
+	local t = now()
+	local timer = { due = math.max(t // TICK + 1, (t + ms + TICK - 1) // TICK), fn = fn }
+
+	lib.wheel.add(timers, timer)
+	return timer
+end
+
+local function every(ms, fn)
+	local timer = after(ms, fn)
+
+	timer.every = ticks(ms)
+	return timer
+end
+
+local function cancel(timer)
+	lib.wheel.remove(timers, timer)
+end
+
+local current
+
+local function fire(timer)
+	if timer.every then
+		timer.due = timer.due + timer.every
+		if timer.due <= current then timer.due = current + timer.every end
+		lib.wheel.add(timers, timer)
+	end
+	timer.fn(timer)
+end
+
+local function run_timers()
+	current = now() // TICK
+	lib.wheel.advance(timers, current, fire)
+end
+
+--
+-- How long the poll can wait before the next timer is due
+--
+local function wait_time()
+	local tick = lib.wheel.next_tick(timers)
+
+	if not tick then return MAX_WAIT end
+	return math.min(MAX_WAIT, math.max(0, tick * TICK - now()))
+end
+
+--
+-- Send an event, we keep the socket connected for the next one. If the
+-- other end has gone (restarted, probably) we connect again and have one
+-- more go.
+--
+local sender
+
 local function send(ev)
-	local evs = posix.sys.socket.socket(posix.sys.socket.AF_UNIX, posix.sys.socket.SOCK_DGRAM, 0)
-	posix.sys.socket.sendto(evs, lib.util.serialise(ev), { family = posix.sys.socket.AF_UNIX, path = SOCK_NAME })
-	posix.unistd.close(evs)
+	local ok, err, errno
+
+	for _ = 1, 2 do
+		if not sender then
+			sender, err, errno = c.bus.connect(SOCK_NAME)
+			if not sender then return nil, err, errno end
+		end
+		ok, err, errno = c.bus.send(sender, ev)
+		if ok or errno == posix.errno.EMSGSIZE then break end
+		posix.unistd.close(sender)
+		sender = nil
+	end
+	return ok, err, errno
 end
 
 
 --
--- The main poll
+-- The main poll, if there are backend jobs that could run we don't wait
+-- for events and we give the jobs a turn each time round, otherwise we
+-- wait until the next timer is due
 --
+local IN, OUT, ERR, HUP = c.ev.IN, c.ev.OUT, c.ev.ERR, c.ev.HUP
+
 local function poll()
-	local rc = posix.poll.poll(fds, 5000)
+	local n, err = the_loop():wait(lib.job.busy() and 0 or wait_time(), ready)
 
 	-- error
-	if rc < 0 then print("poll rc="..rc) return end
+	if not n then print("poll error: "..err) n = 0 end
 
-	-- timeout
-	if rc == 0 then return end
+	-- call the callback for each handle that's ready (a closed pipe only
+	-- shows as a hangup, the callback finds out when it reads), an earlier
+	-- callback may have removed it
+	for i = 1, n do
+		local fd, ev = ready[2*i-1], ready[2*i]
+		local fdt = fds[fd]
 
-	-- now find any handles ready for processing
-	for i,fd in pairs(fds) do
-		if fd.revents.IN or fd.revents.OUT then
-			print("Got read on "..i)
-			fd.callback(fd)
+		if fdt then
+			local rev = fdt.revents
+			rev.IN = (ev & IN ~= 0) or nil
+			rev.OUT = (ev & OUT ~= 0) or nil
+			rev.ERR = (ev & ERR ~= 0) or nil
+			rev.HUP = (ev & HUP ~= 0) or nil
+			fdt.callback(fdt)
 		end
 	end
-end
 
+	run_timers()
+	lib.job.poll()
+end
 
 
 return {
@@ -134,6 +272,11 @@ return {
 	send = send,
 	add_fd = add_fd,
 	remove_fd = remove_fd,
+	want = want,
+	after = after,
+	every = every,
+	cancel = cancel,
+	now = now,
 }
 
 
@@ -0,0 +1,117 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Binary heaps ordered by a less(a, b) function, the smallest item is at
+-- the top. Items are tables and each remembers where it is in its heap
+-- (item[heap]) so taking one out, or putting it back in order after it has
+-- changed, is O(log n) rather than a search.
+--
+-- An item can be in more than one heap at a time, but only once in each.
+--
+-- The ordering lives in a metatable shared by every heap with the same less
+-- so a heap costs nothing beyond its items and size, there can be one per
+-- route destination.
+--
+local orders = setmetatable({}, { __mode = "k" })
+
+local function new(less)
+	local mt = orders[less]
+	if not mt then
+		mt = { __index = { less = less } }
+		orders[less] = mt
+	end
+	return setmetatable({ n = 0 }, mt)
+end
+
+local function swap(h, i, j)
+	local a, b = h[i], h[j]
+
+	h[i], h[j] = b, a
+	a[h], b[h] = j, i
+end
+
+local function up(h, i)
+	while i > 1 do
+		local parent = i // 2
+		if not h.less(h[i], h[parent]) then break end
+		swap(h, i, parent)
+		i = parent
+	end
+	return i
+end
+
+local function down(h, i)
+	while true do
+		local l, r, min = i * 2, i * 2 + 1, i
+
+		if l <= h.n and h.less(h[l], h[min]) then min = l end
+		if r <= h.n and h.less(h[r], h[min]) then min = r end
+		if min == i then return end
+		swap(h, i, min)
+		i = min
+	end
+end
+
+local function push(h, item)
+	assert(not item[h], "item already in heap")
+	h.n = h.n + 1
+	h[h.n] = item
+	item[h] = h.n
+	up(h, h.n)
+end
+
+local function remove(h, item)
+	local i = item[h]
+	if not i then return end
+
+	swap(h, i, h.n)
+	h[h.n] = nil
+	item[h] = nil
+	h.n = h.n - 1
+	if i <= h.n then down(h, up(h, i)) end
+end
+
+--
+-- Put an item back in order after whatever less looks at has changed
+--
+local function fix(h, item)
+	down(h, up(h, item[h]))
+end
+
+local function top(h)
+	return h[1]
+end
+
+local function size(h)
+	return h.n
+end
+
+local function contains(h, item)
+	return item[h] ~= nil
+end
+
+return {
+	new = new,
+	push = push,
+	remove = remove,
+	fix = fix,
+	top = top,
+	size = size,
+	contains = contains,
+}
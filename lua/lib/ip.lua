@@ -17,21 +17,352 @@
 ------------------------------------------------------------------------------
 
 --
--- This module provides a simple interface into the iproute2 command set
+-- This module provides a simple interface for changing addresses, links
+-- and routes. We talk rtnetlink directly (c.nl) rather than running
+-- /sbin/ip, so a change costs a message and an ack instead of a fork and
+-- exec. Everything returns true, or nil, message and errno on failure.
 --
+
+--
+-- A batch collects requests and sends them together (see c/nl.c), each
+-- request can have a function that is called with the outcome of that
+-- request once the batch is sent, so a failure ends up with whatever asked
+-- for the change.
+--
+local function batch()
+	local b = c.nl.batch()
+	local callbacks = {}
+	local rc = {}
+
+	local function add(op, fn, ...)
+		local i, err, errno = b[op](b, ...)
+
+		if not i then
+			if fn then fn(nil, err, errno) end
+			return nil, err, errno
+		end
+		callbacks[i] = fn or false
+		return i
+	end
+
+	function rc:addr_add(ip, dev, fn) return add("addr_add", fn, dev, ip) end
+	function rc:addr_del(ip, dev, fn) return add("addr_del", fn, dev, ip) end
+	function rc:link_set(dev, opts, fn) return add("link_set", fn, dev, opts) end
+	function rc:route_add(dst, opts, fn) return add("route_add", fn, dst, opts or {}) end
+	function rc:route_replace(dst, opts, fn) return add("route_replace", fn, dst, opts or {}) end
+	function rc:route_del(dst, opts, fn) return add("route_del", fn, dst, opts or {}) end
+	function rc:nexthop_add(id, opts, fn) return add("nexthop_add", fn, id, opts or {}) end
+	function rc:nexthop_replace(id, opts, fn) return add("nexthop_replace", fn, id, opts or {}) end
+	function rc:nexthop_del(id, opts, fn) return add("nexthop_del", fn, id, opts or {}) end
+	function rc:count() return b:count() end
+
+	--
+	-- Returns the number of failures and a table of index = errno for them
+	--
+	function rc:send()
+		local failed, n = b:send()
+		local fns = callbacks
+
+		callbacks = {}
+		for i = 1, #fns do
+			local fn = fns[i]
+			if fn then
+				local errno = failed[i]
+				if errno then fn(nil, c.nl.strerror(errno), errno) else fn(true) end
+			end
+		end
+		return n, failed
+	end
+	return rc
+end
+
+--
+-- Changes made from a backend job join a shared batch and the job waits
+-- for its outcome, the batch goes once the jobs that can run this pass
+-- have had their turn. Outside of a job we just do it there and then.
+--
+local shared = nil
+
+local function flush()
+	local b = shared
+
+	shared = nil
+	b:send()
+end
+
+local function wait(op, a, b)
+	local job = lib.job.self()
+	local rc
+
+	if not shared then
+		shared = batch()
+		lib.job.defer(flush)
+	end
+	shared[op](shared, a, b, function(...)
+		rc = table.pack(...)
+		lib.job.wake(job)
+	end)
+	if not rc then lib.job.suspend() end
+	return table.unpack(rc, 1, rc.n)
+end
+
 local function addr_add(ip, dev)
-	local st = lib.run.execute("/sbin/ip", {"addr", "add", ip, "dev", dev }, nil, nil)
-	return (st == 0)
+	if not lib.job.self() then return c.nl.addr_add(dev, ip) end
+	return wait("addr_add", ip, dev)
 end
 
 local function addr_del(ip, dev)
-	local st = lib.run.execute("/sbin/ip", {"addr", "del", ip, "dev", dev }, nil, nil)
-	return (st == 0)
+	if not lib.job.self() then return c.nl.addr_del(dev, ip) end
+	return wait("addr_del", ip, dev)
 end
 
+--
+-- Takes the same arguments as "ip link set", e.g. link_set(dev, "mtu", 1500, "up")
+--
 local function link_set(dev, ...)
-	local st = lib.run.execute("/sbin/ip", {"link", "set", "dev", dev, ...})
-	return (st == 0)
+	local args = { ... }
+	local opts = {}
+	local i = 1
+
+	while i <= #args do
+		local arg = args[i]
+
+		if arg == "up" or arg == "down" then
+			opts.up = (arg == "up")
+		elseif arg == "mtu" or arg == "name" then
+			i = i + 1
+			opts[arg] = (arg == "mtu" and tonumber(args[i])) or args[i]
+		else
+			error("unsupported link option: " .. tostring(arg))
+		end
+		i = i + 1
+	end
+	if not lib.job.self() then return c.nl.link_set(dev, opts) end
+	return wait("link_set", dev, opts)
+end
+
+--
+-- Routes take a table of options: gateway, dev, table, metric, pref-src
+-- and type (unicast, blackhole, unreachable or prohibit)
+--
+local function route_add(dst, opts)
+	if not lib.job.self() then return c.nl.route_add(dst, opts or {}) end
+	return wait("route_add", dst, opts)
+end
+
+local function route_replace(dst, opts)
+	if not lib.job.self() then return c.nl.route_replace(dst, opts or {}) end
+	return wait("route_replace", dst, opts)
+end
+
+local function route_del(dst, opts)
+	if not lib.job.self() then return c.nl.route_del(dst, opts or {}) end
+	return wait("route_del", dst, opts)
+end
+
+--
+-- Nexthop objects are numbered by the caller and take gateway and dev, or
+-- group (a list of ids) or blackhole, routes then refer to them with nhid
+--
+local function nexthop_add(id, opts)
+	if not lib.job.self() then return c.nl.nexthop_add(id, opts or {}) end
+	return wait("nexthop_add", id, opts)
+end
+
+local function nexthop_replace(id, opts)
+	if not lib.job.self() then return c.nl.nexthop_replace(id, opts or {}) end
+	return wait("nexthop_replace", id, opts)
+end
+
+local function nexthop_del(id)
+	if not lib.job.self() then return c.nl.nexthop_del(id) end
+	return wait("nexthop_del", id, {})
+end
+
+
+--
+-- For things we don't have netlink for (tc, the more involved rules) we
+-- keep a single "ip -force -batch -" (and "tc -force -batch -") running and
+-- feed it commands, one per line, rather than starting a process each time.
+--
+-- It says nothing when a command works and "Command failed -:N" (after the
+-- reason) when line N doesn't, so each command is followed by a line it will
+-- always reject (a sentinel) and once we hear about that we know how the
+-- command went. Commands from jobs are written together once the pass is
+-- over, as with the netlink batch.
+--
+-- Some bad arguments make it exit rather than carry on, in that case the
+-- first command we hadn't heard about is the one that did it and anything
+-- after it never ran, so those go to a new process.
+--
+local BATCH = {
+	["ip"] = { "/sbin/ip", { "-force", "-batch", "-" } },
+	["tc"] = { "/sbin/tc", { "-force", "-batch", "-" } },
+}
+local SENTINEL = "opentik-sentinel\n"
+
+local coprocs = {}
+local coproc, coproc_send
+
+local function coproc_write(cp)
+	local data = table.concat(cp.out)
+
+	cp.out = {}
+	while #data > 0 do
+		local n, err, errno = posix.unistd.write(cp.wfd, data)
+
+		if not n then
+			if errno ~= posix.errno.EAGAIN then break end		-- we'll see it exit
+			cp.out[1] = data
+			if not cp.writing then
+				cp.writing = true
+				lib.event.add_fd(cp.wfd, function() coproc_write(cp) end, { events = { OUT = true } })
+			end
+			return
+		end
+		data = data:sub(n + 1)
+	end
+	if cp.writing then
+		cp.writing = nil
+		lib.event.remove_fd(cp.wfd)
+	end
+end
+
+local function coproc_flush(cp)
+	cp.queued = nil
+	if not cp.writing then coproc_write(cp) end
+end
+
+local function coproc_exited(cp)
+	lib.event.remove_fd(cp.rfd)
+	if cp.writing then lib.event.remove_fd(cp.wfd) end
+	posix.unistd.close(cp.rfd)
+	posix.unistd.close(cp.wfd)
+	posix.sys.wait.wait(cp.pid)
+	if coprocs[cp.name] == cp then coprocs[cp.name] = nil end
+
+	local lines = {}
+	for n in pairs(cp.pending) do table.insert(lines, n) end
+	table.sort(lines)
+	if not lines[1] then return end
+
+	local first = cp.pending[lines[1]]
+	local reason = (cp.text[1] and table.concat(cp.text, "; ")) or (cp.name .. " batch process exited")
+
+	first.fn(nil, reason)
+	if not lines[2] then return end
+
+	local np = coproc(cp.name)
+	for i = 2, #lines do
+		local p = cp.pending[lines[i]]
+		coproc_send(np, p.line, p.fn)
+	end
+	coproc_flush(np)
+end
+
+local function coproc_line(cp, line)
+	local n = tonumber(line:match("^Command failed %-:(%d+)$"))
+
+	if not n then
+		if line ~= "" then table.insert(cp.text, line) end
+		return
+	end
+
+	local p = cp.pending[n] or cp.pending[n - 1]
+	if p then
+		cp.pending[p.n] = nil
+		if p.n == n then p.fn(nil, table.concat(cp.text, "; ")) else p.fn(true) end
+	end
+	cp.text = {}
+end
+
+local function coproc_read(cp)
+	local data, err, errno = posix.unistd.read(cp.rfd, 4096)
+
+	if not data and errno == posix.errno.EAGAIN then return end
+	if not data or #data == 0 then return coproc_exited(cp) end
+
+	data = cp.partial .. data
+	for line in data:gmatch("(.-)\n") do coproc_line(cp, line) end
+	cp.partial = data:match("[^\n]*$")
+end
+
+function coproc(name)
+	local cp = coprocs[name]
+
+	if not cp then
+		local pid, wfd, rfd = lib.run.coprocess(BATCH[name][1], BATCH[name][2])
+
+		cp = { name = name, pid = pid, wfd = wfd, rfd = rfd, lines = 0,
+					pending = {}, out = {}, text = {}, partial = "" }
+		lib.event.add_fd(rfd, function() coproc_read(cp) end)
+		coprocs[name] = cp
+	end
+	return cp
+end
+
+--
+-- Queue a command (and its sentinel), fn gets the outcome
+--
+function coproc_send(cp, line, fn)
+	local n = cp.lines + 1
+
+	cp.lines = n + 1
+	cp.pending[n] = { n = n, line = line, fn = fn }
+	table.insert(cp.out, line)
+	table.insert(cp.out, SENTINEL)
+end
+
+--
+-- Arguments with spaces get quoted, there's no escaping so we can't pass
+-- quotes or newlines at all (or a #, it starts a comment even in quotes)
+--
+local function batch_line(args)
+	local words = {}
+
+	for _,arg in ipairs(args) do
+		arg = tostring(arg)
+		assert(not arg:find("[\"\n#]"), "can't pass quote, newline or # in a batch command")
+		if arg == "" or arg:find("%s") then arg = '"' .. arg .. '"' end
+		table.insert(words, arg)
+	end
+	return table.concat(words, " ") .. "\n"
+end
+
+local function coproc_run(name, args)
+	local cp = coproc(name)
+	local job = lib.job.self()
+	local rc
+
+	coproc_send(cp, batch_line(args), function(...)
+		rc = table.pack(...)
+		if job then lib.job.wake(job) end
+	end)
+
+	if job then
+		if not cp.queued then
+			cp.queued = true
+			lib.job.defer(function() if cp.queued then coproc_flush(cp) end end)
+		end
+		while not rc do lib.job.suspend() end
+	else
+		coproc_flush(cp)
+		while not rc do lib.event.poll() end
+	end
+	return table.unpack(rc, 1, rc.n)
+end
+
+--
+-- lib.ip.command({ "rule", "add", "from", "10.0.0.0/8", "table", "100" })
+-- and lib.ip.tc({ "qdisc", "add", "dev", "eth0", "root", "fq" }) return
+-- true or nil and the reason
+--
+local function command(args)
+	return coproc_run("ip", args)
+end
+
+local function tc(args)
+	return coproc_run("tc", args)
 end
 
 
@@ -41,11 +372,19 @@ return {
 		["del"] = addr_del,
 	},
 	["route"] = {
+		["add"] = route_add,
+		["replace"] = route_replace,
+		["del"] = route_del,
+	},
+	["nexthop"] = {
+		["add"] = nexthop_add,
+		["replace"] = nexthop_replace,
+		["del"] = nexthop_del,
 	},
 	["link"] = {
 		["set"] = link_set,
 	},
+	["batch"] = batch,
+	["command"] = command,
+	["tc"] = tc,
 }
-
-
-
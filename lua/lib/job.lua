@@ -0,0 +1,260 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Jobs are the backend actions (starting, stopping and updating things)
+-- that a config change causes. Rather than running them there and then we
+-- queue them up and the event loop works through them, each in its own
+-- coroutine so a job that has to wait for something (a command to finish)
+-- can suspend itself and let the others get on.
+--
+-- A job can be told to wait for other jobs to finish first, we limit how
+-- many jobs can be in progress at once and how much we do on each pass of
+-- the event loop so the cli stays responsive during a big change.
+--
+-- Until the event loop takes over (background mode) anything queued is run
+-- straight through at the end of the change, so startup and scripts see the
+-- backends sorted out when lib.cf.set returns.
+--
+
+local limit = 16			-- jobs in progress at once
+local budget = 64			-- jobs started or resumed per pass
+local slice = 0.02			-- and seconds spent per pass
+local background = false
+
+local ready = { first = 1, last = 0 }		-- waiting to start
+local woken = { first = 1, last = 0 }		-- suspended and now runnable
+local deferred = {}							-- run at the end of this pass
+local running = 0							-- started but not finished
+local pending = 0							-- queued but not finished
+local current = nil
+
+local function push(q, job)
+	q.last = q.last + 1
+	q[q.last] = job
+end
+
+local function pop(q)
+	if q.first > q.last then return nil end
+
+	local job = q[q.first]
+	q[q.first] = nil
+	q.first = q.first + 1
+	return job
+end
+
+--
+-- A job has finished (one way or another), anything waiting for it and
+-- nothing else can now go on the ready queue
+--
+local function finish(job, ok, err)
+	job.done = true
+	pending = pending - 1
+	if job.fn then running = running - 1 end
+	if not ok then
+		job.failed = err
+		print("Job failed: " .. (job.name or "?") .. ": " .. tostring(err))
+	end
+	for _,d in ipairs(job.dependents) do
+		d.waiting = d.waiting - 1
+		if d.waiting == 0 then push(ready, d) end
+	end
+	job.dependents = nil
+end
+
+--
+-- Add a job, after is a list of jobs that need to finish first (any that
+-- already have are ignored). A job without a function is just a marker
+-- for others to wait on.
+--
+local function add(fn, after, name)
+	local job = { fn = fn, name = name, waiting = 0, dependents = {} }
+
+	pending = pending + 1
+	for _,dep in ipairs(after or {}) do
+		if not dep.done then
+			table.insert(dep.dependents, job)
+			job.waiting = job.waiting + 1
+		end
+	end
+	if job.waiting == 0 then push(ready, job) end
+	return job
+end
+
+--
+-- Jobs are run on a pool of worker coroutines, a worker hands back DONE
+-- when its job has finished and is then free for the next one. Anything
+-- else it yields means the job has suspended itself.
+--
+local DONE = {}
+local workers = {}
+
+local function worker(fn)
+	while true do
+		fn()
+		fn = coroutine.yield(DONE)
+	end
+end
+
+local function resume(job, fn)
+	local outer = current
+
+	current = job
+	local ok, rc = coroutine.resume(job.co, fn)
+	current = outer
+
+	if not ok then
+		finish(job, false, rc)
+	elseif rc == DONE then
+		table.insert(workers, job.co)
+		job.co = nil
+		finish(job, true)
+	end
+end
+
+--
+-- Suspend the current job until something wakes it up
+--
+local function suspend()
+	local job = assert(current, "suspend called outside of a job")
+
+	job.sleeping = true
+	coroutine.yield()
+end
+
+local function wake(job)
+	if not job.sleeping then return end
+	job.sleeping = nil
+	push(woken, job)
+end
+
+--
+-- Suspend the current job for ms milliseconds
+--
+local function sleep(ms)
+	local job = assert(current, "sleep called outside of a job")
+
+	lib.event.after(ms, function() wake(job) end)
+	suspend()
+end
+
+local function self()
+	return current
+end
+
+--
+-- Run something once the jobs that can run this pass have had their turn,
+-- so it can deal with whatever they left for it in one go (lib.ip uses this
+-- to send one netlink batch for all of them)
+--
+local function defer(fn)
+	table.insert(deferred, fn)
+end
+
+local function now()
+	local t = posix.time.clock_gettime(posix.time.CLOCK_MONOTONIC)
+	return t.tv_sec + t.tv_nsec / 1e9
+end
+
+--
+-- Do a bounded amount of work, woken jobs carry on first and then we start
+-- new ones while we are under the limit. Returns true if we did anything.
+--
+local function poll()
+	local n = 0
+	local stop = now() + slice
+	local last = woken.last			-- anything woken while we run waits for the next pass
+
+	while n < budget do
+		local job = woken.first <= last and pop(woken)
+		local fn = nil
+
+		if not job then
+			if running >= limit then break end
+			job = pop(ready)
+			if not job then break end
+			if job.fn then
+				job.co = table.remove(workers) or coroutine.create(worker)
+				fn = job.fn
+				running = running + 1
+			end
+		end
+		if job.fn then resume(job, fn) else finish(job, true) end
+
+		n = n + 1
+		if now() > stop then break end
+	end
+
+	if deferred[1] then
+		local fns = deferred
+
+		deferred = {}
+		for _,fn in ipairs(fns) do fn() end
+		n = n + #fns
+	end
+	return n > 0
+end
+
+--
+-- Is there something we could run right now (so the event loop shouldn't
+-- sleep)?
+--
+local function busy()
+	return woken.first <= woken.last or deferred[1] ~= nil or (running < limit and ready.first <= ready.last)
+end
+
+--
+-- Run until everything queued has finished, pumping the event loop if all
+-- that's left is waiting on something. A job that changes the config will
+-- get here too, but its jobs are picked up by whoever is running it.
+--
+local function drain()
+	if current then return end
+	while pending > 0 do
+		if not poll() then lib.event.poll() end
+	end
+end
+
+--
+-- Called at the end of a change, in the foreground everything is run
+-- through before we return
+--
+local function settle()
+	if not background then drain() end
+end
+
+local function configure(options)
+	limit = options.limit or limit
+	budget = options.budget or budget
+	slice = options.slice or slice
+	if options.background ~= nil then background = options.background end
+end
+
+return {
+	add = add,
+	suspend = suspend,
+	sleep = sleep,
+	wake = wake,
+	self = self,
+	defer = defer,
+	poll = poll,
+	busy = busy,
+	drain = drain,
+	settle = settle,
+	configure = configure,
+}
@@ -0,0 +1,566 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- The config journal ... every committed transaction is appended to a
+-- journal file as a single frame, so either all of it makes it to disk or
+-- none of it does. When the journal gets big we start a new one and fork a
+-- child to write out the whole config as a snapshot, once that's safely in
+-- place the old journals can go.
+--
+-- dir/snapshot		- the config as of the start of journal N
+-- dir/journal.N	- the frames committed since
+--
+-- Both files start with a header (magic and N) followed by frames:
+--
+-- frame	= <len:u32> <checksum:u32> <payload>
+-- payload	= <count:u32> <record>*
+-- record	= "P" <path:s2> <nfields:u16> (<field:s2> <value>)*
+--		| "D" <path:s2> <uniq:s2>
+-- value	= <type:u8> <data>
+--
+-- At boot we replay the snapshot and then the journals straight into the
+-- config inside a single transaction, so the backends are only sorted out
+-- once everything is loaded. A torn frame at the end of the last journal
+-- (we crashed while writing it) is cut off.
+--
+
+local MAGIC = "OTJ1"
+local HEADER = "<c4I4"
+local HEADER_SIZE = string.packsize(HEADER)
+local FRAME = "<I4I4"
+local FRAME_SIZE = string.packsize(FRAME)
+
+--
+-- Records per frame when writing a snapshot
+--
+local SNAPSHOT_FRAME = 1000
+
+local T_STRING, T_INTEGER, T_FLOAT, T_TRUE, T_FALSE = 1, 2, 3, 4, 5
+
+--
+-- Our state
+--
+local journal = nil
+
+--
+-- A simple checksum (a Fletcher style pair of sums over 8 byte words, left to
+-- wrap), this is only there to spot a frame that didn't make it to disk
+-- properly
+--
+local function checksum(s)
+	local a, b = 1, 0
+	local n = #s
+	local full = n - n % 32
+	local pos = 1
+
+	while pos <= full do
+		local w, x, y, z = string.unpack("<i8i8i8i8", s, pos)
+		a = a + w b = b + a
+		a = a + x b = b + a
+		a = a + y b = b + a
+		a = a + z b = b + a
+		pos = pos + 32
+	end
+	for i = pos, n do
+		a = a + s:byte(i) b = b + a
+	end
+	return (a ~ (a >> 32) ~ (b << 16) ~ (b >> 16)) & 0xffffffff
+end
+
+--
+-- Encoding and decoding of the individual values and records
+--
+local function encode_value(v)
+	local t = type(v)
+
+	if t == "string" then return string.pack("<Bs4", T_STRING, v)
+	elseif math.type(v) == "integer" then return string.pack("<Bi8", T_INTEGER, v)
+	elseif t == "number" then return string.pack("<Bn", T_FLOAT, v)
+	elseif v == true then return string.pack("<B", T_TRUE)
+	elseif v == false then return string.pack("<B", T_FALSE)
+	end
+	error("unable to journal a value of type "..t)
+end
+
+--
+-- The type byte comes with the field name, so this just has the value
+--
+local function decode_value(t, s, pos)
+	if t == T_STRING then return string.unpack("<s4", s, pos)
+	elseif t == T_INTEGER then return string.unpack("<i8", s, pos)
+	elseif t == T_FLOAT then return string.unpack("<n", s, pos)
+	elseif t == T_TRUE then return true, pos
+	elseif t == T_FALSE then return false, pos
+	end
+	error("bad value type in journal: "..t)
+end
+
+local function encode_put(out, path, ci)
+	local fields = {}
+
+	for k,v in pairs(ci) do
+		table.insert(fields, string.pack("<s2", k))
+		table.insert(fields, encode_value(v))
+	end
+	table.insert(out, string.pack("<c1s2I2", "P", path, #fields // 2))
+	table.insert(out, table.concat(fields))
+end
+
+local function encode_del(out, path, uniq)
+	table.insert(out, string.pack("<c1s2s2", "D", path, uniq))
+end
+
+local function frame(records, count)
+	local payload = string.pack("<I4", count) .. table.concat(records)
+	return string.pack(FRAME, #payload, checksum(payload)) .. payload
+end
+
+--
+-- Apply each of the records in a frame to the config, keeping a note of
+-- what was put if we're given somewhere to keep it
+--
+local function replay_payload(payload, seen)
+	local count, pos = string.unpack("<I4", payload)
+
+	for _ = 1, count do
+		local op, path
+		op, path, pos = string.unpack("<c1s2", payload, pos)
+
+		if not CONFIG[path] then error("journal refers to unknown path: "..path) end
+
+		if op == "P" then
+			local n, ci = nil, {}
+
+			n, pos = string.unpack("<I2", payload, pos)
+			for _ = 1, n do
+				local k, t
+				k, t, pos = string.unpack("<s2B", payload, pos)
+				ci[k], pos = decode_value(t, payload, pos)
+			end
+			lib.cf.load(path, ci)
+			if seen then
+				seen[path] = seen[path] or {}
+				seen[path][ci._uniq] = true
+			end
+		elseif op == "D" then
+			local uniq
+			uniq, pos = string.unpack("<s2", payload, pos)
+			lib.cf.unload(path, uniq)
+		else
+			error("bad record in journal: "..op)
+		end
+	end
+end
+
+--
+-- Read the header from a file, returning the sequence number
+--
+local function read_header(file)
+	local header = file:read(HEADER_SIZE)
+	if not header or #header < HEADER_SIZE then return nil end
+
+	local magic, seq = string.unpack(HEADER, header)
+	if magic ~= MAGIC then return nil end
+	return seq
+end
+
+--
+-- Replay all the good frames in a file, returning the offset of the end of
+-- the last good one and whether we got to the end cleanly
+--
+local function replay_file(name, seen)
+	local file = io.open(name, "rb")
+	if not file then return nil end
+
+	local good = HEADER_SIZE
+	local seq = read_header(file)
+
+	if not seq then
+		file:close()
+		return 0, false
+	end
+
+	while true do
+		local hdr = file:read(FRAME_SIZE)
+		if not hdr then break end
+		if #hdr < FRAME_SIZE then file:close() return good, false end
+
+		local len, sum = string.unpack(FRAME, hdr)
+		local payload = file:read(len)
+		if not payload or #payload < len or checksum(payload) ~= sum then
+			file:close()
+			return good, false
+		end
+		replay_payload(payload, seen)
+		good = good + FRAME_SIZE + len
+	end
+	file:close()
+	return good, true
+end
+
+--
+-- We don't have a truncate, so cutting off a torn tail means copying the
+-- good part to a new file and renaming it over the old one
+--
+local function fsync_dir(dir)
+	local fd = posix.fcntl.open(dir, posix.fcntl.O_RDONLY)
+	if fd then
+		posix.unistd.fsync(fd)
+		posix.unistd.close(fd)
+	end
+end
+
+--
+-- Replace a file with data, the old one stays unless all of the new one
+-- makes it to disk
+--
+local function write_file(dir, name, data)
+	local tmp = dir .. "/" .. name .. ".tmp"
+	local file = assert(io.open(tmp, "wb"))
+	local ok, err = file:write(data)
+
+	if ok then ok, err = file:flush() end
+	if ok then ok, err = posix.unistd.fsync(posix.stdio.fileno(file)) end
+	file:close()
+	if not ok then
+		os.remove(tmp)
+		error(err, 0)
+	end
+	assert(os.rename(tmp, dir .. "/" .. name))
+	fsync_dir(dir)
+end
+
+local function truncate(dir, name, len)
+	local file = assert(io.open(dir .. "/" .. name, "rb"))
+	local data = file:read(len)
+
+	file:close()
+	write_file(dir, name, data)
+end
+
+local function journal_name(seq)
+	return string.format("journal.%d", seq)
+end
+
+--
+-- Write the whole config as a snapshot that will be followed by journal
+-- seq, this is run in a forked child so we get a consistent copy of the
+-- config without stopping the parent.
+--
+-- Items that are just a mirror of another path's (options.duplicate) don't
+-- need writing since loading the original fills them in.
+--
+local function mirrored(path, uniq)
+	for _, base in pairs(CONFIG) do
+		if base.options.duplicate == path and base.cf[uniq] then return true end
+	end
+	return false
+end
+
+local function write_snapshot(dir, seq)
+	local tmp = dir .. "/snapshot.tmp"
+	local file = assert(io.open(tmp, "wb"))
+
+	assert(file:write(string.pack(HEADER, MAGIC, seq)))
+	for path, base in pairs(CONFIG) do
+		local records, count = {}, 0
+
+		for uniq, ci in pairs(base.cf) do
+			if not mirrored(path, uniq) then
+				encode_put(records, path, ci)
+				count = count + 1
+				if count == SNAPSHOT_FRAME then
+					assert(file:write(frame(records, count)))
+					records, count = {}, 0
+				end
+			end
+		end
+		if count > 0 then assert(file:write(frame(records, count))) end
+	end
+	assert(file:flush())
+	assert(posix.unistd.fsync(posix.stdio.fileno(file)))
+	file:close()
+	assert(os.rename(tmp, dir .. "/snapshot"))
+	fsync_dir(dir)
+end
+
+--
+-- Start a new journal file
+--
+local function start_journal(seq)
+	local name = journal.dir .. "/" .. journal_name(seq)
+	local file = assert(io.open(name, "wb"))
+
+	assert(file:write(string.pack(HEADER, MAGIC, seq)))
+	assert(file:flush())
+	posix.unistd.fsync(posix.stdio.fileno(file))
+	fsync_dir(journal.dir)
+	if journal.file then journal.file:close() end
+	journal.file = file
+	journal.seq = seq
+	journal.size = HEADER_SIZE
+end
+
+--
+-- A compaction child has finished (lib.run.reap sees to that from the event
+-- loop), if it worked then the journals before the one it started at aren't
+-- needed any more
+--
+local function compacted(c, how, status)
+	journal.compacting = nil
+	if how == "exited" and status == 0 then
+		for seq = c.from, c.seq - 1 do
+			os.remove(journal.dir .. "/" .. journal_name(seq))
+		end
+		journal.first = c.seq
+	else
+		print("journal compaction failed: "..tostring(how).." "..tostring(status))
+	end
+end
+
+--
+-- Move on to a new journal and write a snapshot from a child process
+--
+local function compact()
+	if journal.compacting then return end
+
+	local seq = journal.seq + 1
+
+	start_journal(seq)
+
+	local pid = posix.unistd.fork()
+	if pid == 0 then
+		local ok, err = pcall(write_snapshot, journal.dir, seq)
+		if not ok then io.stderr:write("snapshot failed: "..tostring(err).."\n") end
+		posix.unistd._exit((ok and 0) or 1)
+	end
+
+	local c = { pid = pid, from = journal.first, seq = seq }
+	c.wait = lib.run.reap(pid, function(status, how) compacted(c, how, status) end)
+	journal.compacting = c
+end
+
+--
+-- Make sure everything written so far is on disk
+--
+local function sync()
+	if journal and journal.dirty then
+		local ok, err = posix.unistd.fsync(posix.stdio.fileno(journal.file))
+		if not ok then return nil, err end
+		journal.dirty = false
+	end
+	return true
+end
+
+--
+-- A frame that didn't all make it out is cut off again, so the next one
+-- doesn't end up behind something replay would stop at. If even that fails
+-- the journal is broken: the torn frame is at the end where a replay will
+-- cut it off, and it has to stay there.
+--
+local function rewind()
+	local name = journal_name(journal.seq)
+
+	truncate(journal.dir, name, journal.size)
+
+	local file = assert(io.open(journal.dir .. "/" .. name, "ab"))
+	journal.file:close()
+	journal.file = file
+	journal.dirty = false
+end
+
+--
+-- Called by lib.cf with the changes from each commit, before any of it is
+-- applied. If we can't get it to disk we fail, and lib.cf puts the config
+-- back so what's running never gets ahead of the journal.
+--
+-- A compaction that won't start doesn't lose anything, so it's only
+-- reported.
+--
+local function commit(changes)
+	if not journal or journal.replaying then return end
+	if journal.broken then error("journal is broken: " .. journal.broken, 0) end
+
+	local records = {}
+
+	for _,c in ipairs(changes) do
+		if c.op == "put" then
+			encode_put(records, c.path, c.ci)
+		else
+			encode_del(records, c.path, c.uniq)
+		end
+	end
+
+	local data = frame(records, #changes)
+	local ok, err = journal.file:write(data)
+
+	if ok then ok, err = journal.file:flush() end
+	if ok then
+		journal.dirty = true
+		if journal.sync then ok, err = sync() end
+	end
+	if not ok then
+		err = "unable to write journal: " .. tostring(err)
+		if not pcall(rewind) then journal.broken = err end
+		error(err, 0)
+	end
+	journal.size = journal.size + #data
+
+	if journal.size > journal.limit then
+		ok, err = pcall(compact)
+		if not ok then print("journal compaction failed: "..tostring(err)) end
+	end
+end
+
+--
+-- Open the journal in the given directory, replaying anything that's there
+-- into the config and then recording all future commits.
+--
+-- options.sync		- fsync each commit (default true), otherwise call
+--			  lib.journal.sync() when it matters
+-- options.limit	- journal size that triggers a compaction (default 4MB)
+--
+-- Returns true if there was any config to replay, false for a new journal.
+-- Inside a transaction (lib.cf.reconcile, say) the replay joins it, what's
+-- loaded isn't journaled again when it commits.
+--
+local function open(dir, options)
+	options = options or {}
+	assert(not journal, "journal already open")
+
+	posix.sys.stat.mkdir(dir)
+	os.remove(dir .. "/snapshot.tmp")			-- a compaction that never finished
+	journal = {
+		dir = dir,
+		sync = options.sync ~= false,
+		limit = options.limit or 4 * 1024 * 1024,
+		replaying = true,
+	}
+
+	--
+	-- The snapshot tells us where the journals start, without one we start
+	-- at the lowest journal we can find
+	--
+	local first = nil
+	local snapshot = io.open(dir .. "/snapshot", "rb")
+	local found = snapshot ~= nil
+
+	if snapshot then
+		first = read_header(snapshot)
+		snapshot:close()
+		assert(first, "bad snapshot header in "..dir)
+	else
+		for name in posix.dirent.files(dir) do
+			local seq = tonumber(name:match("^journal%.(%d+)$"))
+			if seq and (not first or seq < first) then first = seq end
+		end
+	end
+	first = first or 0
+	journal.first = first
+
+	lib.cf.begin()
+	local ok, err = pcall(function()
+		--
+		-- The snapshot is the whole config, so anything that isn't in it
+		-- (other than mirrors, they go with the original) has to go
+		--
+		if snapshot then
+			local seen = {}
+			local _, clean = replay_file(dir .. "/snapshot", seen)
+			assert(clean, "snapshot is corrupt in "..dir)
+
+			for path, base in pairs(CONFIG) do
+				local gone = {}
+
+				for uniq,_ in pairs(base.cf) do
+					if not (seen[path] and seen[path][uniq]) then table.insert(gone, uniq) end
+				end
+				for _,uniq in ipairs(gone) do
+					if base.cf[uniq] and not mirrored(path, uniq) then lib.cf.unload(path, uniq) end
+				end
+			end
+		end
+
+		local seq = first
+		while true do
+			local name = journal_name(seq)
+			local good, clean = replay_file(dir .. "/" .. name)
+
+			if not good then break end
+			if not clean then
+				--
+				-- Only the last journal can have a torn tail (it's the one
+				-- we were writing), anywhere else it's left alone for
+				-- someone to look at
+				--
+				if posix.sys.stat.stat(dir .. "/" .. journal_name(seq + 1)) then
+					error("journal "..name.." is corrupt but isn't the last one")
+				end
+				print("journal: discarding torn frame at "..good.." in "..name)
+				if good < HEADER_SIZE then
+					os.remove(dir .. "/" .. name)
+					break
+				end
+				truncate(dir, name, good)
+			end
+			journal.seq = seq
+			journal.size = good
+			found = found or good > HEADER_SIZE
+			seq = seq + 1
+		end
+	end)
+	if not ok then
+		lib.cf.abort()
+		journal = nil
+		error(err, 0)
+	end
+	lib.cf.commit()
+	journal.replaying = nil
+
+	--
+	-- Carry on with the last journal, or start the first one
+	--
+	if journal.seq then
+		journal.file = assert(io.open(dir .. "/" .. journal_name(journal.seq), "ab"))
+	else
+		start_journal(first)
+	end
+	return found
+end
+
+--
+-- Stop journaling, waiting for any compaction to finish
+--
+local function close()
+	if not journal then return end
+
+	sync()
+	if journal.compacting then journal.compacting.wait() end
+	journal.file:close()
+	journal = nil
+end
+
+lib.cf.on_commit(commit)
+
+return {
+	open = open,
+	close = close,
+	sync = sync,
+	compact = function() if journal then compact() end end,
+}
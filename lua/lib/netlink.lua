@@ -0,0 +1,175 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Keeping up with the kernel: modules register for the kinds of thing they
+-- care about (link, addr, route, neigh or nexthop) and get called with an event
+-- table (see c/nl.c) for everything there is at init and then for each
+-- change as the kernel tells us about it through the event loop.
+--
+-- We only listen for the kinds someone has registered for, and we keep the
+-- last event for each thing so that if the kernel has to drop messages
+-- (we didn't keep up) we can dump again and work out what went away.
+-- There can be millions of routes so for those we only keep the fact that
+-- we've seen one (the route code has its own compact record), one that's
+-- gone away is given to the handlers as just its key.
+--
+local ORDER = { "link", "addr", "route", "neigh", "nexthop" }		-- links first so they can be mapped
+
+--
+-- What identifies a thing to the kernel, a v4 route is replaced by another
+-- with the same table, destination and metric, v6 ones can differ by device
+--
+local KEYS = {
+	["link"] = function(ev) return ev.ifindex end,
+	["addr"] = function(ev) return ev.ifindex .. " " .. ev.address end,
+	["route"] = function(ev)
+		local dev = (ev.family == "ipv6" and ev.oif) or 0
+		return ev.table .. " " .. ev.dst .. " " .. (ev.metric or 0) .. " " .. ev.type .. " " .. dev
+	end,
+	["neigh"] = function(ev) return ev.ifindex .. " " .. ev.address end,
+	["nexthop"] = function(ev) return ev.id end,
+}
+
+local KEEP = { ["link"] = true, ["addr"] = true, ["neigh"] = true, ["nexthop"] = true }
+
+local handlers = {}
+local known = {}
+local fd = nil
+
+local function on(kind, fn)
+	assert(KEYS[kind], "unknown netlink event: " .. tostring(kind))
+	handlers[kind] = handlers[kind] or {}
+	table.insert(handlers[kind], fn)
+end
+
+--
+-- The key is worked out once per event and kept on it for the handlers
+--
+local function key(ev)
+	if not ev.key then ev.key = KEYS[ev.event](ev) end
+	return ev.key
+end
+
+local function dispatch(ev)
+	local kind = ev.event
+	local k = key(ev)
+
+	if not handlers[kind] then return end
+	if ev.action == "del" then
+		known[kind][k] = nil
+	else
+		known[kind][k] = (KEEP[kind] and ev) or true
+	end
+	for _,fn in ipairs(handlers[kind]) do fn(ev) end
+end
+
+--
+-- Everything of one kind the kernel has, routes are read a piece at a time
+-- rather than the whole dump at once
+--
+local function each_event(kind)
+	if kind == "route" then
+		local routes = assert(c.nl.routes())
+
+		return function()
+			local ev = routes()
+			if ev then ev.event, ev.action = "route", "new" end
+			return ev
+		end
+	end
+
+	local events = assert(c.nl.dump(kind))
+	local i = 0
+
+	return function()
+		i = i + 1
+		return events[i]
+	end
+end
+
+--
+-- Dump everything of one kind, anything we knew about that isn't there
+-- any more gets a del
+--
+local function sync(kind)
+	local seen = {}
+
+	for ev in each_event(kind) do
+		seen[key(ev)] = true
+		dispatch(ev)
+	end
+	for k, ev in pairs(known[kind]) do
+		if not seen[k] then
+			local gone = { event = kind, key = k }
+			if ev ~= true then
+				for f,v in pairs(ev) do gone[f] = v end
+			end
+			gone.action = "del"
+			dispatch(gone)
+		end
+	end
+end
+
+local function read()
+	local events = assert(c.nl.monitor_read(fd))
+
+	for _,ev in ipairs(events) do dispatch(ev) end
+	if events.overrun then
+		print("Netlink overrun, resyncing")
+		for _,kind in ipairs(ORDER) do
+			if handlers[kind] then sync(kind) end
+		end
+	end
+end
+
+--
+-- Start listening (before the dump, so we can't miss anything in between)
+-- and then bring everyone up to date
+--
+local function init()
+	local kinds = {}
+
+	for _,kind in ipairs(ORDER) do
+		if handlers[kind] then
+			table.insert(kinds, kind)
+			known[kind] = {}
+		end
+	end
+	if not kinds[1] then return end
+
+	fd = assert(c.nl.monitor(kinds))
+	for _,kind in ipairs(kinds) do sync(kind) end
+	lib.event.add_fd(fd, read)
+end
+
+--
+-- The last event we had for something (so what the kernel has for it now),
+-- not kept for routes
+--
+local function get(kind, k)
+	local ev = known[kind] and known[kind][k]
+	return ev ~= true and ev or nil
+end
+
+return {
+	on = on,
+	init = init,
+	key = key,
+	get = get,
+}
@@ -0,0 +1,257 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Persistent maps ... these look like normal tables (index, assign, pairs)
+-- but the data is held in a chain of layers. Writes always go to the top
+-- layer, taking a snapshot just freezes the current top and starts a new
+-- empty one on top of it, so a snapshot is O(1) and shares everything that
+-- hasn't changed since.
+--
+-- Restoring a snapshot is also O(1), we just start a new top layer on top
+-- of the snapshot's layer.
+--
+-- Once nothing can see the layer underneath the top any more we fold the
+-- top back down into it, so without any snapshots there is just one layer
+-- and a lookup is a single table access.
+--
+-- As with normal tables, don't add new keys while iterating.
+--
+
+--
+-- Deleted keys need to hide anything in the layers below
+--
+local TOMBSTONE = {}
+
+--
+-- Layers know how many snapshots are holding them (pins) and how many
+-- layers are built on them (children), we can only fold into a layer
+-- that nothing else is looking at.
+--
+local function layer_new(parent)
+	if parent then parent.children = parent.children + 1 end
+	return { data = {}, parent = parent, pins = 0, children = 0 }
+end
+
+local function lookup(layer, k)
+	repeat
+		local v = layer.data[k]
+		if v ~= nil then
+			if v == TOMBSTONE then return nil end
+			return v
+		end
+		layer = layer.parent
+	until not layer
+	return nil
+end
+
+--
+-- Iterate through the view from a given layer, keys in upper layers hide
+-- the same keys further down
+--
+local function iterate(top)
+	local layer = top
+	local k, v
+
+	local function shadowed(key)
+		local l = top
+		while l ~= layer do
+			if l.data[key] ~= nil then return true end
+			l = l.parent
+		end
+		return false
+	end
+
+	return function()
+		while layer do
+			k, v = next(layer.data, k)
+			if k == nil then
+				layer = layer.parent
+			elseif v ~= TOMBSTONE and not shadowed(k) then
+				return k, v
+			end
+		end
+	end
+end
+
+local function state_of(map)
+	return getmetatable(map).state
+end
+
+local function set_top(state, layer)
+	state.top.top = nil
+	layer.top = true
+	state.top = layer
+end
+
+--
+-- A layer that isn't pinned, has nothing built on it and isn't the top of
+-- its map can't be seen by anyone, so it lets go of its parent
+--
+local function prune(layer)
+	while layer and layer.pins == 0 and layer.children == 0 and not layer.top do
+		local parent = layer.parent
+
+		if parent then parent.children = parent.children - 1 end
+		layer.parent = nil
+		layer = parent
+	end
+end
+
+--
+-- Fold the top layer down into its parent for as long as the parent is only
+-- visible through the top
+--
+local function compact(map)
+	local state = state_of(map)
+	local top = state.top
+	local parent = top.parent
+
+	while parent and parent.pins == 0 and parent.children == 1 do
+		local bottom = not parent.parent
+
+		for k,v in pairs(top.data) do
+			if v == TOMBSTONE and bottom then v = nil end
+			parent.data[k] = v
+		end
+		parent.children = 0
+		top.parent = nil
+		set_top(state, parent)
+		top = parent
+		parent = top.parent
+	end
+end
+
+--
+-- Create a new map
+--
+local function new()
+	local state = { top = layer_new() }
+	local mt = { state = state }
+
+	state.top.top = true
+
+	mt.__index = function(_, k)
+		local top = state.top
+
+		if not top.parent then return top.data[k] end
+		return lookup(top, k)
+	end
+	mt.__newindex = function(_, k, v)
+		local top = state.top
+
+		if v == nil and top.parent then v = TOMBSTONE end
+		top.data[k] = v
+	end
+	mt.__pairs = function()
+		return iterate(state.top), nil, nil
+	end
+	return setmetatable({}, mt)
+end
+
+--
+-- Take a snapshot, the returned layer is pinned until it's released. If
+-- nothing has been written since the last snapshot we just share it.
+--
+local function snapshot(map)
+	local state = state_of(map)
+	local top = state.top
+	local layer = top
+
+	if top.parent and not next(top.data) then
+		layer = top.parent
+	else
+		set_top(state, layer_new(top))
+	end
+	layer.pins = layer.pins + 1
+	return layer
+end
+
+--
+-- Let go of a snapshot, we don't compact here so this is safe to call from
+-- a __gc handler (compact gets called at the next snapshot or release)
+--
+local function unpin(layer)
+	layer.pins = layer.pins - 1
+	prune(layer)
+end
+
+local function release(map, layer)
+	unpin(layer)
+	compact(map)
+end
+
+--
+-- Make the map look like it did when the snapshot was taken
+--
+local function restore(map, layer)
+	local state = state_of(map)
+	local old = state.top
+
+	set_top(state, layer_new(layer))
+	prune(old)
+end
+
+--
+-- Return a set of the keys that may differ between the map now and the
+-- given snapshot, that's anything written on either side since the two
+-- views last had a layer in common
+--
+local function changed(map, layer)
+	local rc = {}
+	local seen = {}
+	local l = layer
+
+	while l do seen[l] = true l = l.parent end
+
+	l = state_of(map).top
+	while l and not seen[l] do
+		for k,_ in pairs(l.data) do rc[k] = true end
+		l = l.parent
+	end
+
+	local common = l
+	l = layer
+	while l and l ~= common do
+		for k,_ in pairs(l.data) do rc[k] = true end
+		l = l.parent
+	end
+	return rc
+end
+
+--
+-- A read only map showing the view from a snapshot
+--
+local function view(layer)
+	return setmetatable({}, {
+		__index = function(_, k) return lookup(layer, k) end,
+		__newindex = function() error("snapshot views are read only", 2) end,
+		__pairs = function() return iterate(layer), nil, nil end,
+	})
+end
+
+return {
+	new = new,
+	snapshot = snapshot,
+	release = release,
+	unpin = unpin,
+	restore = restore,
+	compact = compact,
+	changed = changed,
+	view = view,
+}
@@ -71,6 +71,188 @@ local function execute(cmd, args, stdin, env)
 end
 
 
+--
+-- Call fn(status, reason) once a child of ours has exited, having reaped it.
+-- The child's pidfd (see c.pidfd) is just another handle for the event loop
+-- so nothing spins while we wait. If the kernel can't give us one we look
+-- again every REAP_POLL ms instead.
+--
+-- What comes back waits for the child there and then, for when we can't
+-- leave it to the loop (shutting down, say). fn is still only called once.
+--
+local REAP_POLL = 10
+
+local function reap(pid, fn)
+	local fd = c.pidfd.open(pid)
+	local timer
+	local gone = false
+
+	local function wait(flags)
+		if gone then return end
+
+		local rpid, reason, status = posix.sys.wait.wait(pid, flags)
+
+		if rpid ~= pid then return end
+		gone = true
+		if fd then
+			lib.event.remove_fd(fd)
+			posix.unistd.close(fd)
+		else
+			lib.event.cancel(timer)
+		end
+		fn(status, reason)
+	end
+
+	local function check()
+		wait(posix.sys.wait.WNOHANG)
+	end
+
+	if fd then
+		lib.event.add_fd(fd, check)
+	else
+		timer = lib.event.every(REAP_POLL, check)
+	end
+	return function() wait(0) end
+end
+
+--
+-- The same as execute but for use inside a job (see lib.job), rather than
+-- blocking the whole daemon we suspend the job while the command runs and
+-- pick up its output and its exit through the event loop. Outside of a job
+-- this is just execute.
+--
+-- The parent closes the write end of the output pipe straight after the
+-- fork (there's no chance to yield in between) so a command started by
+-- another job can't inherit it and stop us seeing the end.
+--
+local function nonblock(fd)
+	local flags = posix.fcntl.fcntl(fd, posix.fcntl.F_GETFL)
+	posix.fcntl.fcntl(fd, posix.fcntl.F_SETFL, flags | posix.fcntl.O_NONBLOCK)
+end
+
+local function await(cmd, args, stdin, env)
+	local job = lib.job.self()
+	if not job then return execute(cmd, args, stdin, env) end
+
+	-- Some debug
+	print("["..cmd.." "..(table.concat(args or {}, " ")).."]")
+
+	local outr, outw = posix.unistd.pipe()
+	local inr, inw
+
+	if stdin then inr, inw = posix.unistd.pipe() end
+
+	local pid = posix.unistd.fork()
+	if pid == 0 then
+		-- child
+		posix.unistd.close(outr)
+		posix.unistd.dup2(outw, 1)
+		posix.unistd.dup2(outw, 2)
+		if stdin then
+			posix.unistd.close(inw)
+			posix.unistd.dup2(inr, 0)
+		end
+
+		-- set environment if specified
+		for k, v in pairs(env or {}) do posix.stdlib.setenv(k, v) end
+
+		posix.unistd.exec(cmd, args or {})
+		print("unable to exec")
+		posix.unistd._exit(1)
+	end
+	posix.unistd.close(outw)
+
+	local status
+	reap(pid, function(st)
+		status = st
+		lib.job.wake(job)
+	end)
+
+	--
+	-- Input is expected to be small (it fits in the pipe) so we just write
+	-- it and close
+	--
+	if stdin then
+		posix.unistd.close(inr)
+		for _,line in ipairs(stdin) do
+			posix.unistd.write(inw, line .. "\n")
+		end
+		posix.unistd.close(inw)
+	end
+
+	--
+	-- Collect the output until the other end closes and the child has gone
+	--
+	local chunks = {}
+	local eof = false
+
+	nonblock(outr)
+	lib.event.add_fd(outr, function()
+		local data, err, errno = posix.unistd.read(outr, 4096)
+
+		if data and #data > 0 then
+			table.insert(chunks, data)
+			return
+		end
+		if not data and errno == posix.errno.EAGAIN then return end
+		lib.event.remove_fd(outr)
+		posix.unistd.close(outr)
+		eof = true
+		lib.job.wake(job)
+	end)
+	while not (eof and status) do lib.job.suspend() end
+
+	local output = {}
+	local data = table.concat(chunks)
+
+	if data:sub(-1) ~= "\n" then data = data .. "\n" end
+	for line in data:gmatch("(.-)\n") do table.insert(output, line) end
+	if #output == 1 and output[1] == "" then output = {} end
+
+	-- Some debug
+	for _,o in ipairs(output) do print("> "..o) end
+
+	return status, output
+end
+
+--
+-- Start a long running child that we feed commands to, we get back the
+-- pid, a (non-blocking) fd for its stdin and one for its stderr. Its stdout
+-- goes nowhere. Our ends are close-on-exec so other children don't keep
+-- them open, and we ignore SIGPIPE so a child that dies under us is seen as
+-- a failed write rather than taking us with it.
+--
+local function coprocess(cmd, args)
+	print("[coprocess "..cmd.." "..(table.concat(args or {}, " ")).."]")
+
+	local inr, inw = posix.unistd.pipe()
+	local errr, errw = posix.unistd.pipe()
+
+	posix.signal.signal(posix.signal.SIGPIPE, posix.signal.SIG_IGN)
+
+	local pid = posix.unistd.fork()
+	if pid == 0 then
+		-- child
+		posix.signal.signal(posix.signal.SIGPIPE, posix.signal.SIG_DFL)
+		posix.unistd.close(inw)
+		posix.unistd.close(errr)
+		posix.unistd.dup2(inr, 0)
+		posix.unistd.dup2(errw, 2)
+		posix.unistd.dup2(posix.fcntl.open("/dev/null", posix.fcntl.O_WRONLY), 1)
+		posix.unistd.exec(cmd, args or {})
+		print("unable to exec")
+		posix.unistd._exit(1)
+	end
+	posix.unistd.close(inr)
+	posix.unistd.close(errw)
+
+	for _,fd in ipairs({ inw, errr }) do
+		nonblock(fd)
+		posix.fcntl.fcntl(fd, posix.fcntl.F_SETFD, 1)		-- FD_CLOEXEC
+	end
+	return pid, inw, errr
+end
+
 --
 -- Run a binary in the background and return its pid so we can kill it later
 --
@@ -120,6 +302,9 @@ end
 
 return {
 	execute = execute,
+	await = await,
+	reap = reap,
+	coprocess = coprocess,
 	background = background,
 }
 
@@ -16,34 +16,6 @@
 --  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 ------------------------------------------------------------------------------
 
---
--- Serialise a variable (most use for a table)
---
-function serialise(t)
-	local rc
-
-	if type(t) == "table" then
-		rc = "{"
-		for k,v in pairs(t) do
-			rc = rc .. ("["..serialise(k).."]="..serialise(v)..",")
-		end
-		return rc .. "}"
-	elseif type(t) == "string" then
-		return string.format('%q', t)
-	else
-		return tostring(t)
-	end
-end
-
-
---
--- Unserialise (just means executing the code)
---
-function unserialise(v)
-	return load("return "..v)()
-end
-
-
 --
 -- Split a string into a table
 --
@@ -59,8 +31,6 @@ end
 
 
 return {
-	serialise = serialise,
-	unserialise = unserialise,
 	split = split,
 }
 
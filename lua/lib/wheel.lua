@@ -0,0 +1,180 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+
+--
+-- Hierarchical timing wheels, time is in whole ticks and each item (a
+-- table) is due at a tick. Level 0 has a slot for each of the next 64
+-- ticks, level 1 a slot for each of the next 64 blocks of 64 ticks and so
+-- on. An item goes in the lowest level that can tell it apart from now and
+-- moves down a level each time its slot comes round, so adding, removing
+-- and each tick going by are all O(1) however many items there are.
+--
+-- Slots are sets of items and each item remembers its slot (item[wheel]),
+-- like the heaps do, so an item can be in more than one wheel.
+--
+-- Ticks where nothing is due (or needs moving down) are skipped, so a
+-- wheel full of items far in the future costs nothing until they're close.
+-- The next tick where there's something to do is worked out once and kept
+-- (w.next) until it goes by, adding only ever brings it forward and
+-- removing leaves it where it is (we just look and find nothing).
+--
+
+local BITS = 6
+local SIZE = 1 << BITS
+local MASK = SIZE - 1
+local LEVELS = 5
+
+local function new(now)
+	local w = { now = now or 0, n = 0, levels = {} }
+
+	for l = 0, LEVELS - 1 do
+		local slots = {}
+		for s = 0, MASK do slots[s] = {} end
+		w.levels[l] = slots
+	end
+	return w
+end
+
+--
+-- Which slot does an item go in, anything already due goes in the first
+-- tick we'll look at and anything past the top level goes as far out as we
+-- can (we put it back when it comes round)
+--
+local function place(w, item, first)
+	local now = w.now
+	local due = math.max(item.due, first)
+
+	for l = 0, LEVELS - 1 do
+		local shift = l * BITS
+		if (due >> shift) - (now >> shift) < SIZE or l == LEVELS - 1 then
+			if (due >> shift) - (now >> shift) >= SIZE then due = ((now >> shift) + MASK) << shift end
+			local slot = w.levels[l][(due >> shift) & MASK]
+			slot[item] = true
+			item[w] = slot
+			due = (due >> shift) << shift
+			if w.next and due < w.next then w.next = due end
+			return
+		end
+	end
+end
+
+--
+-- Add an item due at item.due (or move it if it's already in)
+--
+local function add(w, item)
+	local slot = item[w]
+
+	if slot then slot[item] = nil else w.n = w.n + 1 end
+	place(w, item, w.now + 1)
+end
+
+local function remove(w, item)
+	local slot = item[w]
+	if not slot then return end
+
+	slot[item] = nil
+	item[w] = nil
+	w.n = w.n - 1
+	if w.n == 0 then w.next = nil end
+end
+
+--
+-- The next tick where something is due, or a slot needs moving down a
+-- level, nil if the wheel is empty
+--
+local function next_tick(w)
+	if w.n == 0 then return nil end
+	if w.next then return w.next end
+
+	local best
+	for l = 0, LEVELS - 1 do
+		local shift = l * BITS
+		local block = w.now >> shift
+		local slots = w.levels[l]
+
+		for i = 1, MASK do
+			if next(slots[(block + i) & MASK]) then
+				local tick = (block + i) << shift
+				if not best or tick < best then best = tick end
+				break
+			end
+		end
+		-- nothing in the levels above can come before their next block
+		if best and best <= ((w.now >> (shift + BITS)) + 1) << (shift + BITS) then break end
+	end
+	w.next = best
+	return best
+end
+
+--
+-- Move the wheel on to tick, calling fire(item) for everything that comes
+-- due on the way (in order of tick). An item that fire adds back in for
+-- later is fine.
+--
+local function advance(w, tick, fire)
+	while w.n > 0 do
+		local t = next_tick(w)
+		if t > tick then break end
+
+		w.now = t
+		w.next = nil
+		for l = LEVELS - 1, 1, -1 do
+			local shift = l * BITS
+			if t & ((1 << shift) - 1) == 0 then
+				local slot = w.levels[l][(t >> shift) & MASK]
+				for item in pairs(slot) do
+					slot[item] = nil
+					place(w, item, t)
+				end
+			end
+		end
+
+		local slot = w.levels[0][t & MASK]
+		local due = {}
+		for item in pairs(slot) do
+			slot[item] = nil
+			if item.due > t then
+				place(w, item, t + 1)
+			else
+				item[w] = nil
+				w.n = w.n - 1
+				due[#due+1] = item
+			end
+		end
+		for _,item in ipairs(due) do fire(item) end
+	end
+	if tick > w.now then w.now = tick end
+end
+
+local function size(w)
+	return w.n
+end
+
+local function contains(w, item)
+	return item[w] ~= nil
+end
+
+return {
+	new = new,
+	add = add,
+	remove = remove,
+	next_tick = next_tick,
+	advance = advance,
+	size = size,
+	contains = contains,
+}
@@ -0,0 +1,202 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+--
+-- The API server: no one gets in until there are users and then only with
+-- the right password, the unix socket is only for us, and a listen gives
+-- each change once it's been applied (so with the state the backend left)
+-- and .dead once an item has gone. A command that fails, or whose output
+-- fails part way, gets a !trap and the session carries on.
+--
+-- Each case is a forked client that checks what it gets back, its error
+-- comes back through a pipe while we run the event loop for the server.
+--
+-- Run from the lua directory: ../support/bin/lua test/api.lua
+--
+local test = dofile("test/harness.lua")
+
+local S = posix.sys.socket
+local SOCK = "/tmp/opentik-test-api.sock"
+
+lib.cf.register("/test", {
+	["fields"] = {
+		["name"] = { default = "", uniq = true },
+		["mtu"] = { default = 1500 },
+		["state"] = { default = "", prep = function(_, live) return live._state end },
+	},
+	["options"] = {
+		["start"] = function(path, ci, live) live._state = "up " .. ci.mtu end,
+		["ci-post-process"] = function(path, ci) if ci.name == "bad" then error({}) end end,
+		["commands"] = {
+			["boom"] = function() error("boom") end,
+			["fizzle"] = function()
+				local n = 0
+				return function()
+					n = n + 1
+					if n > 1 then error("fizzled") end
+					return "one"
+				end
+			end,
+		},
+	},
+})
+lib.cf.set("/test", nil, { name = "one" })
+
+lib.api.configure({ path = SOCK, port = false })
+lib.api.init()
+
+local function connect()
+	local fd = S.socket(S.AF_UNIX, S.SOCK_STREAM, 0)
+	assert(S.connect(fd, { family = S.AF_UNIX, path = SOCK }) == 0)
+
+	local reader = c.frame.reader()
+	local api = {}
+
+	function api.send(...)
+		posix.unistd.write(fd, lib.api.sentence({ ... }))
+	end
+
+	function api.recv()
+		local words = {}
+
+		while true do
+			local w = reader:next()
+			if not w then assert(reader:fill(fd) > 0, "connection closed")
+			elseif w == "" then return table.concat(words, " ")
+			else words[#words+1] = w end
+		end
+	end
+
+	function api.cmd(...)
+		local out = {}
+
+		api.send(...)
+		repeat
+			local s = api.recv()
+			out[#out+1] = s
+		until s:match("^!done") or s:match("^!fatal")
+		return table.concat(out, "\n")
+	end
+
+	return api
+end
+
+--
+-- Run fn(api) in a client while we serve it
+--
+local function client(fn)
+	local r, w = posix.unistd.pipe()
+	local pid = posix.unistd.fork()
+
+	if pid == 0 then
+		posix.unistd.close(r)
+		local ok, err = pcall(fn, connect())
+		if not ok then posix.unistd.write(w, tostring(err)) end
+		posix.unistd._exit((ok and 0) or 1)
+	end
+	posix.unistd.close(w)
+
+	local deadline = test.now() + 10
+	local done
+	repeat
+		lib.event.after(10, function() end)
+		lib.event.poll()
+		done = posix.sys.wait.wait(pid, posix.sys.wait.WNOHANG) == pid
+	until done or test.now() > deadline
+
+	local err = posix.unistd.read(r, 4096)
+	posix.unistd.close(r)
+	assert(done, "client didn't finish")
+	assert(err == "", err)
+end
+
+local function login(api, password)
+	return api.cmd("/login", "=name=admin", "=password=" .. password)
+end
+
+test.case("the unix socket is only for us", function()
+	local st = assert(posix.sys.stat.stat(SOCK))
+	assert(st.st_mode & 0x3f == 0, string.format("mode %o", st.st_mode))
+end)
+
+test.case("no users means no logins", function()
+	client(function(api)
+		assert(login(api, ""):match("^!trap"), "logged in without users")
+		assert(api.cmd("/test/print"):match("^!trap =message=not logged in"))
+	end)
+end)
+
+lib.api.configure({ users = { ["admin"] = "secret" } })
+
+test.case("only the right password gets in", function()
+	client(function(api)
+		assert(login(api, "wrong"):match("^!trap"), "logged in with the wrong password")
+		assert(api.cmd("/test/print"):match("^!trap =message=not logged in"))
+		assert(login(api, "secret") == "!done")
+		assert(api.cmd("/test/print", "=.proplist=name") == "!re =name=one\n!done")
+	end)
+end)
+
+test.case("listen gives changes once they're applied", function()
+	client(function(api)
+		login(api, "secret")
+		api.send("/test/listen", "=.proplist=.id,mtu,state", ".tag=L")
+
+		local got = api.cmd("/test/add", "=name=two", "=mtu=9000", ".tag=a")
+		assert(got:find("!re =.id=two =mtu=9000 =state=up 9000 =.tag=L", 1, true), got)
+
+		api.send("/test/remove", "=.id=two", ".tag=r")
+		got = { api.recv(), api.recv() }
+		table.sort(got)
+		assert(got[1] == "!done =.tag=r" and got[2] == "!re =.id=two =.dead=true =.tag=L", table.concat(got, " | "))
+
+		api.send("/cancel", "=tag=L", ".tag=c")
+		got = { api.recv(), api.recv(), api.recv() }
+		table.sort(got)
+		assert(got[1] == "!done =.tag=L" and got[2] == "!done =.tag=c", table.concat(got, " | "))
+	end)
+end)
+
+test.case("changes made outside the API are heard too", function()
+	lib.event.after(300, function() lib.cf.set("/test", "one", { mtu = 1400 }) end)
+	client(function(api)
+		login(api, "secret")
+		api.send("/test/listen", "=.proplist=.id,mtu,state", ".tag=L")
+
+		local got = api.recv()
+		assert(got == "!re =.id=one =mtu=1400 =state=up 1400 =.tag=L", got)
+	end)
+end)
+
+test.case("a command that fails gets a trap and the session carries on", function()
+	client(function(api)
+		login(api, "secret")
+
+		local got = api.cmd("/test/boom", ".tag=b")
+		assert(got:match("^!trap =message=failure: .*boom =.tag=b\n!done =.tag=b$"), got)
+
+		got = api.cmd("/test/fizzle", ".tag=f")
+		assert(got:match("^!re =ret=one =.tag=f\n!trap =message=failure: .*fizzled =.tag=f\n!done =.tag=f$"), got)
+
+		got = api.cmd("/test/add", "=name=bad", ".tag=a")
+		assert(got:match("^!trap =message=failure: table: "), got)
+
+		assert(api.cmd("/test/print", "=.proplist=name") == "!re =name=one\n!done")
+	end)
+end)
+
+test.done()
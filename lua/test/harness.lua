@@ -0,0 +1,56 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+--
+-- Correctness tests, kept next to the benchmarks and run the same way (from
+-- the lua directory: ../support/bin/lua test/txn.lua). Each one is a list
+-- of cases, a case is a function that raises an error (assert) if what it
+-- checks isn't so:
+--
+--	local test = dofile("test/harness.lua")
+--	test.case("what it checks", function() ... end)
+--	test.done()
+--
+-- done() exits non-zero if any case failed, so a shell loop over test/*.lua
+-- can tell.
+--
+local bench = dofile("bench/harness.lua")
+local output = bench.output
+
+local failed = 0
+
+local function case(name, fn)
+	local ok, err = pcall(fn)
+
+	if ok then
+		output("ok   " .. name)
+	else
+		failed = failed + 1
+		output("FAIL " .. name .. ": " .. tostring(err))
+	end
+end
+
+local function done()
+	os.exit((failed == 0 and 0) or 1)
+end
+
+return {
+	output = output,
+	now = bench.now,
+	case = case,
+	done = done,
+}
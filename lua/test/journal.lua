@@ -0,0 +1,181 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+--
+-- The journal: a torn frame at the end of the last journal (we crashed
+-- while writing it) is cut off at boot and the journal carries on from
+-- there, a bad frame anywhere else stops the boot, compaction is reaped by
+-- the event loop and a commit that can't be journaled isn't applied.
+--
+-- Run from the lua directory: ../support/bin/lua test/journal.lua [dir]
+--
+local test = dofile("test/harness.lua")
+
+local DIR = (arg and arg[1]) or "/tmp/opentik-journal-test"
+
+local started = 0
+
+lib.cf.register("/test", {
+	["fields"] = {
+		["name"] = { default = "", uniq = true },
+		["value"] = { default = 0 },
+	},
+	["options"] = {
+		["start"] = function() started = started + 1 end,
+	},
+})
+
+local function names()
+	local rc = {}
+	for uniq in pairs(CONFIG["/test"].cf) do rc[#rc+1] = uniq end
+	table.sort(rc)
+	return table.concat(rc, ",")
+end
+
+local function size(name)
+	local st = posix.sys.stat.stat(DIR .. "/" .. name)
+	return st and st.st_size
+end
+
+local function contents(name)
+	local file = assert(io.open(DIR .. "/" .. name, "rb"))
+	local data = file:read("a")
+	file:close()
+	return data
+end
+
+local function append(name, data)
+	local file = assert(io.open(DIR .. "/" .. name, "ab"))
+	file:write(data)
+	file:close()
+end
+
+--
+-- Forget the config and boot from the journal again
+--
+local function reboot()
+	lib.journal.close()
+	lib.cf.begin()
+	for uniq in pairs(CONFIG["/test"].cf) do lib.cf.unload("/test", uniq) end
+	lib.cf.commit()
+	lib.journal.open(DIR)
+end
+
+os.execute("rm -rf " .. DIR)
+lib.journal.open(DIR)
+
+test.case("what was committed comes back", function()
+	lib.cf.set("/test", nil, { name = "a" })
+	lib.cf.set("/test", nil, { name = "b", value = 2 })
+	lib.cf.set("/test", "a", nil)
+	reboot()
+	assert(names() == "b" and CONFIG["/test"].cf["b"].value == 2, names())
+end)
+
+test.case("a torn frame at the end is cut off", function()
+	local good = size("journal.0")
+
+	lib.journal.close()
+	append("journal.0", string.pack("<I4I4", 1000, 0) .. "half a frame")
+	reboot()
+	assert(names() == "b", names())
+	assert(size("journal.0") == good, "torn frame still there")
+
+	lib.cf.set("/test", nil, { name = "c" })
+	reboot()
+	assert(names() == "b,c", "a commit after the cut didn't replay: " .. names())
+end)
+
+test.case("a last frame with a bad checksum is dropped", function()
+	local good = size("journal.0")
+
+	lib.cf.set("/test", nil, { name = "d" })
+	lib.journal.close()
+
+	local file = assert(io.open(DIR .. "/journal.0", "r+b"))
+	file:seek("set", good + 4)
+	file:write("\0\0\0\0")
+	file:close()
+	reboot()
+	assert(names() == "b,c", names())
+	assert(size("journal.0") == good)
+end)
+
+test.case("a bad frame in a journal that isn't the last stops the boot", function()
+	lib.journal.close()
+	append("journal.0", "junk")
+	append("journal.1", string.pack("<c4I4", "OTJ1", 1))
+
+	local before = contents("journal.0")
+	assert(not pcall(lib.journal.open, DIR), "booted past a bad frame")
+	assert(contents("journal.0") == before, "journal.0 was changed")
+	os.remove(DIR .. "/journal.1")
+	lib.journal.open(DIR)
+	assert(names() == "b,c", names())
+end)
+
+test.case("a bad header in a journal that isn't the last stops the boot", function()
+	lib.journal.close()
+	append("journal.1", "OT")
+	append("journal.2", string.pack("<c4I4", "OTJ1", 2))
+
+	local before = contents("journal.0")
+	assert(not pcall(lib.journal.open, DIR), "booted past a bad header")
+	assert(size("journal.1") == 2, "journal.1 was changed")
+	assert(contents("journal.0") == before, "journal.0 was changed")
+	os.remove(DIR .. "/journal.1")
+	os.remove(DIR .. "/journal.2")
+	lib.journal.open(DIR)
+	assert(names() == "b,c", names())
+end)
+
+test.case("compaction is reaped by the event loop", function()
+	reboot()
+	lib.journal.close()
+	lib.journal.open(DIR, { limit = 1 })
+	lib.cf.set("/test", nil, { name = "e" })
+
+	local deadline = test.now() + 5
+	while size("journal.0") and test.now() < deadline do
+		lib.event.after(10, function() end)
+		lib.event.poll()
+	end
+	assert(not size("journal.0"), "old journal still there")
+	assert(size("snapshot"), "no snapshot")
+
+	local _, how = posix.sys.wait.wait(-1, posix.sys.wait.WNOHANG)
+	assert(how ~= "exited" and how ~= "killed", "the child was left for us to reap")
+
+	reboot()
+	assert(names() == "b,c,e", names())
+end)
+
+test.case("a commit the journal won't take isn't applied", function()
+	local before = started
+
+	lib.cf.on_commit(function() error("no room", 0) end)
+	local ok, err = pcall(lib.cf.set, "/test", nil, { name = "f" })
+	assert(not ok and err == "no room", err)
+	assert(names() == "b,c,e", names())
+	assert(started == before, "started something that wasn't journaled")
+
+	ok = pcall(lib.cf.set, "/test", "b", { value = 3 })
+	assert(not ok and CONFIG["/test"].cf["b"].value == 2)
+end)
+
+lib.journal.close()
+test.done()
@@ -0,0 +1,116 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+--
+-- Netlink batches: every request gets its own outcome, a failure is matched
+-- back to the request that caused it (even once the batch is split over a
+-- number of sendmsg calls) and doesn't stop the ones after it, and jobs
+-- sharing a batch each get their own result.
+--
+-- This changes the routing table so it needs root and should be run in
+-- its own namespace:
+--
+-- Run from the lua directory: unshare -n sh -c 'ip link set lo up; ../support/bin/lua test/netlink.lua'
+--
+local test = dofile("test/harness.lua")
+
+local E = posix.errno
+
+local function route(i)
+	return string.format("10.%d.%d.0/24", (i >> 8) & 255, i & 255)
+end
+
+local function recorder(outcomes, i)
+	return function(ok, err, errno) outcomes[i] = ok or errno end
+end
+
+test.case("failures map to their request", function()
+	local b = lib.ip.batch()
+	local got = {}
+
+	assert(b:route_add(route(1), { dev = "lo" }, recorder(got, 1)) == 1)
+	assert(b:route_add(route(1), { dev = "lo" }, recorder(got, 2)) == 2)
+	assert(b:route_del(route(2), { dev = "lo" }, recorder(got, 3)) == 3)
+	assert(b:route_add(route(3), { dev = "lo" }, recorder(got, 4)) == 4)
+
+	local n, failed = b:send()
+	assert(n == 2, "failed count " .. n)
+	assert(failed[1] == nil and failed[4] == nil, "good request reported as failed")
+	assert(failed[2] == E.EEXIST, "duplicate add gave " .. tostring(failed[2]))
+	assert(failed[3] == E.ESRCH, "missing del gave " .. tostring(failed[3]))
+	assert(got[1] == true and got[4] == true, "good request not told")
+	assert(got[2] == E.EEXIST and got[3] == E.ESRCH, "failed request not told")
+end)
+
+test.case("bad request fails when added", function()
+	local b = lib.ip.batch()
+	local got = {}
+
+	local i, err, errno = b:route_add(route(5), { dev = "nosuchdev0" }, recorder(got, 1))
+	assert(i == nil and errno == E.ENODEV, "bad device added: " .. tostring(err))
+	assert(got[1] == E.ENODEV, "bad request not told")
+	assert(b:count() == 0, "bad request in the batch")
+	assert(b:route_add(route(5), { dev = "lo" }, recorder(got, 2)) == 1)
+
+	local n = b:send()
+	assert(n == 0 and got[2] == true, "batch after a bad request failed")
+end)
+
+test.case("failures map across chunks", function()
+	local COUNT = 2000
+	local b = lib.ip.batch()
+	local got, expect = {}, {}
+
+	-- every seventh one deletes a route that isn't there
+	for i = 1, COUNT do
+		if i % 7 == 0 then
+			b:route_del(route(1000 + i), { dev = "lo" }, recorder(got, i))
+			expect[i] = E.ESRCH
+		else
+			b:route_add(route(1000 + i), { dev = "lo" }, recorder(got, i))
+		end
+	end
+	local n, failed = b:send()
+	assert(n == COUNT // 7, "failed count " .. n)
+	for i = 1, COUNT do
+		assert(failed[i] == expect[i], "request " .. i .. " gave " .. tostring(failed[i]))
+		assert(got[i] == (expect[i] or true), "request " .. i .. " told " .. tostring(got[i]))
+	end
+
+	-- and the same batch can go again, now it's the adds that fail
+	for i = 1, COUNT do
+		if i % 7 ~= 0 then b:route_add(route(1000 + i), { dev = "lo" }) end
+	end
+	n, failed = b:send()
+	assert(n == COUNT - COUNT // 7, "second send failed count " .. n)
+	assert(failed[1] == E.EEXIST, "reused batch gave " .. tostring(failed[1]))
+end)
+
+test.case("jobs in a shared batch get their own result", function()
+	local got = {}
+
+	lib.job.add(function() got.good = table.pack(lib.ip.route.add(route(6), { dev = "lo" })) end)
+	lib.job.add(function() got.dup = table.pack(lib.ip.route.add(route(1), { dev = "lo" })) end)
+	lib.job.add(function() got.del = table.pack(lib.ip.route.del(route(6), { dev = "lo" })) end)
+	lib.job.drain()
+
+	assert(got.good[1] == true, "good job failed: " .. tostring(got.good[2]))
+	assert(got.dup[1] == nil and got.dup[3] == E.EEXIST, "duplicate job gave " .. tostring(got.dup[3]))
+	assert(got.del[1] == true, "del after add in the same batch failed: " .. tostring(got.del[2]))
+end)
+
+test.done()
@@ -0,0 +1,121 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+--
+-- Snapshots: restore puts back the config, the live items, the indexes and
+-- the dependency edges as they were when the snapshot was taken, however
+-- the items changed since (or came and went).
+--
+-- Run from the lua directory: ../support/bin/lua test/restore.lua
+--
+local test = dofile("test/harness.lua")
+
+lib.cf.register("/parent", {
+	["fields"] = { ["name"] = { default = "", uniq = true } },
+	["options"] = {},
+})
+lib.cf.register("/child", {
+	["fields"] = {
+		["name"] = { default = "", uniq = true },
+		["parent"] = { default = "" },
+		["colour"] = { default = "", index = true },
+		["comment"] = { default = "" },
+	},
+	["dependencies"] = { ["parent"] = { path = "/parent" } },
+	["options"] = {},
+})
+
+local function dependents(parent)
+	local n = 0
+	for _ in lib.cf.dependents("/parent", parent) do n = n + 1 end
+	return n
+end
+
+local function coloured(colour)
+	local n = 0
+	for _ in lib.cf.each_where("/child", "colour", colour) do n = n + 1 end
+	return n
+end
+
+lib.cf.set("/parent", nil, { name = "a" })
+lib.cf.set("/parent", nil, { name = "b" })
+lib.cf.set("/child", nil, { name = "x", parent = "a", colour = "red" })
+lib.cf.set("/child", nil, { name = "y", parent = "a", colour = "blue" })
+
+test.case("changed fields and live items come back", function()
+	local snap = lib.cf.snapshot()
+
+	lib.cf.set("/child", "x", { comment = "hi" })
+	lib.cf.restore(snap)
+	lib.cf.release(snap)
+	assert(CONFIG["/child"].cf["x"].comment == "")
+	assert(CONFIG["/child"].live["x"].comment == "")
+	assert(CONFIG["/child"].live["x"]._ci == CONFIG["/child"].cf["x"], "live doesn't point at the restored config")
+end)
+
+test.case("dependency edges come back", function()
+	local snap = lib.cf.snapshot()
+
+	lib.cf.set("/child", "x", { parent = "b" })
+	assert(dependents("a") == 1 and dependents("b") == 1)
+	lib.cf.restore(snap)
+	lib.cf.release(snap)
+	assert(dependents("a") == 2 and dependents("b") == 0)
+end)
+
+test.case("indexes come back", function()
+	local snap = lib.cf.snapshot()
+
+	lib.cf.set("/child", "x", { colour = "blue" })
+	lib.cf.set("/child", nil, { name = "z", parent = "b", colour = "red" })
+	assert(coloured("red") == 1 and coloured("blue") == 2)
+	lib.cf.restore(snap)
+	lib.cf.release(snap)
+	assert(coloured("red") == 1 and coloured("blue") == 1)
+	assert(lib.cf.find("/child", "colour", "red") == "x")
+end)
+
+test.case("deleted and added items are undone", function()
+	local snap = lib.cf.snapshot()
+
+	lib.cf.set("/child", "y", nil)
+	lib.cf.set("/child", nil, { name = "w", parent = "b" })
+	lib.cf.restore(snap)
+	lib.cf.release(snap)
+	assert(CONFIG["/child"].cf["y"] and CONFIG["/child"].live["y"])
+	assert(CONFIG["/child"].cf["w"] == nil and CONFIG["/child"].live["w"] == nil)
+	assert(dependents("a") == 2 and dependents("b") == 0)
+end)
+
+test.case("a rename is undone", function()
+	local snap = lib.cf.snapshot()
+
+	lib.cf.set("/child", "x", { name = "renamed" })
+	lib.cf.restore(snap)
+	lib.cf.release(snap)
+	assert(CONFIG["/child"].cf["x"] and not CONFIG["/child"].cf["renamed"])
+	assert(lib.cf.find("/child", "name", "x") == "x")
+end)
+
+test.case("a released snapshot can't be restored", function()
+	local snap = lib.cf.snapshot()
+
+	lib.cf.release(snap)
+	assert(not pcall(lib.cf.restore, snap))
+end)
+
+test.done()
@@ -0,0 +1,112 @@
+--------------------------------------------------------------------------------
+--  This file is part of OpenTik
+--  Copyright (C) 2014,15 Lee Essen <lee.essen@nowonline.co.uk>
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+--
+-- Transactions: an abort puts the config back and leaves the backends
+-- alone, a lone set that fails is its own aborted transaction, and only
+-- the outermost commit applies anything.
+--
+-- Run from the lua directory: ../support/bin/lua test/txn.lua
+--
+local test = dofile("test/harness.lua")
+
+local calls = {}
+
+lib.cf.register("/test", {
+	["fields"] = {
+		["name"] = { default = "", uniq = true },
+		["value"] = { default = 0 },
+		["bad"] = { default = false },
+	},
+	["options"] = {
+		["start"] = function(path, ci) table.insert(calls, "start " .. ci.name) end,
+		["stop"] = function(path, ci) table.insert(calls, "stop " .. ci.name) end,
+		["ci-post-process"] = function(path, ci) if ci.bad then error("bad item", 0) end end,
+	},
+})
+
+local function settle()
+	lib.job.drain()
+	local rc = table.concat(calls, ",")
+	calls = {}
+	return rc
+end
+
+local function item(name)
+	return CONFIG["/test"].cf[name]
+end
+
+test.case("a lone set that fails leaves nothing behind", function()
+	local ok, err = pcall(lib.cf.set, "/test", nil, { name = "x", bad = true })
+
+	assert(not ok and err == "bad item", err)
+	assert(item("x") == nil)
+	lib.cf.set("/test", nil, { name = "y" })
+	assert(settle() == "start y", "the next set wasn't its own transaction")
+end)
+
+test.case("abort undoes adds, changes and deletes", function()
+	lib.cf.set("/test", nil, { name = "keep", value = 1 })
+	lib.cf.set("/test", nil, { name = "gone", value = 2 })
+	settle()
+
+	lib.cf.begin()
+	lib.cf.set("/test", nil, { name = "new" })
+	lib.cf.set("/test", "keep", { value = 10 })
+	lib.cf.set("/test", "gone", nil)
+	lib.cf.abort()
+
+	assert(item("new") == nil)
+	assert(item("keep").value == 1)
+	assert(item("gone") and item("gone").value == 2)
+	assert(CONFIG["/test"].live["keep"].value == 1, "live not restored")
+	assert(settle() == "", "an abort touched the backends")
+end)
+
+test.case("abort undoes a rename", function()
+	lib.cf.begin()
+	lib.cf.set("/test", "keep", { name = "renamed" })
+	assert(item("renamed") and not item("keep"))
+	lib.cf.abort()
+
+	assert(item("keep") and not item("renamed"))
+	assert(lib.cf.find("/test", "name", "keep") == "keep")
+end)
+
+test.case("an abort at any depth aborts the lot", function()
+	lib.cf.begin()
+	lib.cf.set("/test", nil, { name = "outer" })
+	lib.cf.begin()
+	lib.cf.set("/test", nil, { name = "inner" })
+	lib.cf.abort()
+
+	assert(item("outer") == nil and item("inner") == nil)
+	lib.cf.set("/test", nil, { name = "after" })
+	assert(settle() == "start after", "still inside a transaction after the abort")
+end)
+
+test.case("only the outermost commit applies", function()
+	lib.cf.begin()
+	lib.cf.begin()
+	lib.cf.set("/test", nil, { name = "nested" })
+	lib.cf.commit()
+	assert(settle() == "", "applied at an inner commit")
+	lib.cf.commit()
+	assert(settle() == "start nested")
+end)
+
+test.done()